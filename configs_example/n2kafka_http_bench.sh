@@ -0,0 +1,91 @@
+#!/bin/bash
+
+# Load every http/http2 listener of a n2kafka config, one after another, and
+# print requests per second and n2kafka CPU usage of each one.
+#
+# Usage: n2kafka_http_bench.sh [config] [host]
+#   config: n2kafka config (default n2kafka_config_http_bench.json)
+#   host:   n2kafka host (default localhost)
+#
+# Environment:
+#   DURATION:    seconds per listener (default 60)
+#   THREADS:     load generator threads (default 16)
+#   CONNECTIONS: concurrent connections (default 512)
+#   N2KAFKA_SSH: ssh destination to read n2kafka CPU usage from, if it is not
+#                running in this machine
+#   N2KAFKA_PID: n2kafka pid (default: pidof n2kafka)
+#
+# Needs jq, wrk for http listeners and h2load for http2 listeners.
+
+CONFIG=${1:-$(dirname "$0")/n2kafka_config_http_bench.json}
+HOST=${2:-localhost}
+DURATION=${DURATION:-60}
+THREADS=${THREADS:-16}
+CONNECTIONS=${CONNECTIONS:-512}
+BODY='{"timestamp":1452608400,"client_mac":"00:11:22:33:44:55"}'
+
+# Run command $@ where n2kafka is running
+function n2kafka_host_run {
+  if [[ -n "$N2KAFKA_SSH" ]]; then
+    ssh -n "$N2KAFKA_SSH" "$@"
+  else
+    "$@"
+  fi
+}
+
+# n2kafka used CPU time, in clock ticks
+function n2kafka_cpu_ticks {
+  # utime and stime are 14th and 15th fields. 2nd one can't contain spaces
+  # because process is called n2kafka
+  n2kafka_host_run cat "/proc/$N2KAFKA_PID/stat" | awk '{print $14 + $15}'
+}
+
+for cmd in jq awk; do
+  if ! command -v $cmd > /dev/null; then
+    echo "$cmd not found" >&2
+    exit 1
+  fi
+done
+
+if [[ -z "$N2KAFKA_PID" ]]; then
+  N2KAFKA_PID=$(n2kafka_host_run pidof -s n2kafka)
+fi
+if [[ -z "$N2KAFKA_PID" ]]; then
+  echo "n2kafka is not running (set N2KAFKA_PID or N2KAFKA_SSH)" >&2
+  exit 1
+fi
+CLK_TCK=$(n2kafka_host_run getconf CLK_TCK)
+
+TMPDIR=$(mktemp -d)
+trap 'rm -rf "$TMPDIR"' EXIT
+printf 'wrk.method = "POST"\nwrk.body   = %s\n' "'$BODY'" > "$TMPDIR/post.lua"
+printf '%s' "$BODY" > "$TMPDIR/body.json"
+
+printf "%-6s %-6s %-22s %14s %10s\n" PROTO PORT MODE REQ/S CPU%
+jq -r '.listeners[] | select(.proto == "http" or .proto == "http2") |
+       "\(.proto) \(.port) \(.mode // "-")\(if .num_daemons then
+       "/\(.num_daemons)daemons" else "" end)"' "$CONFIG" |
+while read -r proto port mode; do
+  start_ticks=$(n2kafka_cpu_ticks)
+  start_ns=$(date +%s%N)
+
+  if [[ "$proto" == "http" ]]; then
+    rps=$(wrk -t "$THREADS" -c "$CONNECTIONS" -d "${DURATION}s" \
+            -s "$TMPDIR/post.lua" "http://$HOST:$port/" < /dev/null |
+          awk '/^Requests\/sec:/ {print $2}')
+  else
+    rps=$(h2load -t "$THREADS" -c "$CONNECTIONS" -m 10 -D "$DURATION" \
+            -d "$TMPDIR/body.json" "http://$HOST:$port/" < /dev/null |
+          awk '/^finished in/ {print $4}')
+  fi
+
+  end_ticks=$(n2kafka_cpu_ticks)
+  end_ns=$(date +%s%N)
+  # 100% is a fully used CPU
+  cpu=$(awk -v t=$((end_ticks - start_ticks)) -v hz="$CLK_TCK" \
+            -v ns=$((end_ns - start_ns)) \
+            'BEGIN {printf "%.1f", 100 * t / hz / (ns / 1e9)}')
+
+  printf "%-6s %-6s %-22s %14s %10s\n" "$proto" "$port" "$mode" \
+    "${rps:-failed}" "$cpu"
+done
@@ -206,7 +206,7 @@ static int parse_per_listener_opaque_config(struct meraki_opaque *opaque,json_t
 		topic_name = default_topic_name();
 	}
 
-	opaque->rkt = new_rkt_global_config(topic_name,
+	opaque->rkt = kafka_topic_get(topic_name,
 		rb_client_mac_partitioner,err,sizeof(err));
 
 	if(NULL == opaque->rkt) {
@@ -283,7 +283,7 @@ int meraki_opaque_reload(json_t *config,void *vopaque) {
 		topic_name = global_config.topic;
 	}
 
-	rkt_aux = new_rkt_global_config(topic_name,
+	rkt_aux = kafka_topic_get(topic_name,
 		rb_client_mac_partitioner,err,sizeof(err));
 
 	if(NULL == rkt_aux) {
@@ -297,7 +297,7 @@ int meraki_opaque_reload(json_t *config,void *vopaque) {
 	pthread_rwlock_unlock(&opaque->decoder_info.per_listener_enrichment_rwlock);
 
 	if(rkt_aux) {
-		rd_kafka_topic_destroy(rkt_aux);
+		kafka_topic_release(rkt_aux);
 	}
 
 rkt_err:
@@ -317,7 +317,7 @@ void meraki_opaque_destructor(void *_opaque) {
 	meraki_decoder_info_destructor(&opaque->decoder_info);
 
 	if (opaque->rkt) {
-		rd_kafka_topic_destroy(opaque->rkt);
+		kafka_topic_release(opaque->rkt);
 	}
 
 	free(opaque);
@@ -642,5 +642,4 @@ void meraki_decode(char *buffer,size_t buf_size,
 		send_array_to_kafka(meraki_opaque->rkt,notifications);
 		free(notifications);
 	}
-	free(buffer);
 }
@@ -167,7 +167,7 @@ static int parse_per_listener_opaque_config(struct mse_opaque *opaque,
 		topic_name = default_topic_name();
 	}
 
-	opaque->rkt = new_rkt_global_config(topic_name,
+	opaque->rkt = kafka_topic_get(topic_name,
 		rb_client_mac_partitioner,err,sizeof(err));
 
 	if(NULL == opaque->rkt) {
@@ -304,7 +304,7 @@ int mse_opaque_reload(json_t *config, void *_opaque) {
 		topic_name = global_config.topic;
 	}
 
-	rkt_aux = new_rkt_global_config(topic_name,
+	rkt_aux = kafka_topic_get(topic_name,
 		rb_client_mac_partitioner,err,sizeof(err));
 
 	if(NULL == rkt_aux) {
@@ -322,7 +322,7 @@ int mse_opaque_reload(json_t *config, void *_opaque) {
 rkt_err:
 enrichment_err:
 	if(rkt_aux) {
-		rd_kafka_topic_destroy(rkt_aux);
+		kafka_topic_release(rkt_aux);
 	}
 
 	if(enrichment_aux) {
@@ -341,7 +341,7 @@ void mse_opaque_done(void *_opaque) {
 #endif
 	mse_decoder_info_destroy(&opaque->decoder_info);
 	if (opaque->rkt) {
-		rd_kafka_topic_destroy(opaque->rkt);
+		kafka_topic_release(opaque->rkt);
 	}
 	free(opaque);
 }
@@ -720,7 +720,6 @@ void mse_decode(char *buffer, size_t buf_size,
 	time_t now = time(NULL);
 	struct mse_array *notifications = process_mse_buffer(buffer, buf_size,
 					client, &mse_opaque->decoder_info, now);
-	free(buffer);
 
 	if (NULL == notifications)
 		return;
@@ -732,7 +731,8 @@ void mse_decode(char *buffer, size_t buf_size,
 				notifications->data[i].string,
 			    notifications->data[i].string_size,
 			    RD_KAFKA_MSG_F_FREE,
-			    (void *)(intptr_t)notifications->data[i].client_mac);
+			    kafka_msg_opaque_from_value(
+					notifications->data[i].client_mac));
 		}
 	}
 }
@@ -28,6 +28,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <jansson.h>
 #include <errno.h>
 
@@ -74,17 +75,54 @@ int rb_http2k_database_get_topic_client(struct rb_database *db,
 	assert(topic_handler);
 	assert(client_enrichment);
 
+	*topic_handler = NULL;
+	*client_enrichment = NULL;
+
 	pthread_rwlock_rdlock(&db->rwlock);
-	*topic_handler = topics_db_get_topic(db->topics_db, topic);
+	*client_enrichment = sensors_db_get(db->sensors_db, sensor_uuid);
 
-	if(*topic_handler) {
-		*client_enrichment = sensors_db_get(db->sensors_db, sensor_uuid);
+	if(*client_enrichment) {
+		*topic_handler = topics_db_get_topic(db->topics_db, topic);
 	}
 	pthread_rwlock_unlock(&db->rwlock);
 
 	return NULL != *topic_handler && NULL != *client_enrichment;
 }
 
+void rb_http2k_handlers_done(struct rb_http2k_handlers *handlers) {
+	if (handlers->topic) {
+		topic_decref(handlers->topic);
+		handlers->topic = NULL;
+	}
+
+	if (handlers->sensor) {
+		sensor_db_entry_decref(handlers->sensor);
+		handlers->sensor = NULL;
+	}
+}
+
+int rb_http2k_handlers_take(const keyval_list_t *msg_vars,
+		struct topic_s **topic_handler,
+		sensor_db_entry_t **sensor_info) {
+	const char *value = valueof(msg_vars, RB_HTTP2K_HANDLERS_KEY);
+	if (NULL == value) {
+		return 0;
+	}
+
+	/* Listener owns the struct, it's only const in parameters list */
+	struct rb_http2k_handlers *handlers =
+		(struct rb_http2k_handlers *)(uintptr_t)value;
+	if (NULL == handlers->topic || NULL == handlers->sensor) {
+		return 0;
+	}
+
+	*topic_handler = handlers->topic;
+	*sensor_info = handlers->sensor;
+	handlers->topic = NULL;
+	handlers->sensor = NULL;
+	return 1;
+}
+
 int rb_http2k_validate_uuid(struct rb_database *db, const char *sensor_uuid) {
 	pthread_rwlock_rdlock(&db->rwlock);
 	const int ret = sensors_db_exists(db->sensors_db, sensor_uuid);
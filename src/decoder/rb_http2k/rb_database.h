@@ -25,6 +25,7 @@
 #include "rb_http2k_organizations_database.h"
 
 #include "util/rb_timer.h"
+#include "util/pair.h"
 
 #include <pthread.h>
 #include <jansson.h>
@@ -50,7 +51,8 @@ int init_rb_database(struct rb_database *db);
 void free_valid_rb_database(struct rb_database *db);
 
 /**
-	Get sensor enrichment and topic of an specific database.
+	Get sensor enrichment and topic of an specific database. Topic is
+	only searched if sensor is found.
 
 	@param db Database to extract sensor and topic handler from
 	@param topic Topic to search for
@@ -65,5 +67,32 @@ int rb_http2k_database_get_topic_client(struct rb_database *db,
 	const char *topic, const char *sensor_uuid,
 	struct topic_s **topic_handler, sensor_db_entry_t **sensor_info);
 
+/// Topic and sensor handlers of a request, looked up by the listener
+struct rb_http2k_handlers {
+	/// Topic handler. Need to be freed with topic_decref
+	struct topic_s *topic;
+	/// Sensor information. Need to be freed with sensor_db_entry_decref
+	sensor_db_entry_t *sensor;
+};
+
+/// Decoder parameter that points to request struct rb_http2k_handlers
+#define RB_HTTP2K_HANDLERS_KEY "rb_http2k_handlers"
+
+/** Release handlers not taken by a decoder session
+  @param handlers Handlers. NULL ones are ignored
+  */
+void rb_http2k_handlers_done(struct rb_http2k_handlers *handlers);
+
+/** Take handlers from decoder parameters if listener has looked them up, so
+  there is no need to look up them again.
+  @param msg_vars Decoder parameters
+  @param topic_handler Returned topic handler
+  @param sensor_info Returned sensor information
+  @return 1 if handlers were taken (and now belong to the caller), 0
+  otherwise
+  */
+int rb_http2k_handlers_take(const keyval_list_t *msg_vars,
+	struct topic_s **topic_handler, sensor_db_entry_t **sensor_info);
+
 int rb_http2k_validate_uuid(struct rb_database *db,const char *uuid);
 int rb_http2k_validate_topic(struct rb_database *db,const char *topic);
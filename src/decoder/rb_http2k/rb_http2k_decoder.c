@@ -261,30 +261,21 @@ static int parse_topic_list_config(json_t *config, struct topics_db *new_topics_
 			continue;
 		}
 
-		rd_kafka_topic_conf_t *my_rkt_conf = rd_kafka_topic_conf_dup(
-                                global_config.kafka_topic_conf);
-		if(NULL == my_rkt_conf) {
-			rdlog(LOG_ERR,"Couldn't topic_conf_dup in topic %s",topic_name);
-			continue;
-		}
-
+		partitioner_cb partitioner = NULL;
 		if (NULL != partition_algo) {
-			partitioner_cb partitioner = partitioner_of_name(partition_algo);
-			if (NULL != partitioner) {
-				rd_kafka_topic_conf_set_partitioner_cb(my_rkt_conf, partitioner);
-			} else {
+			partitioner = partitioner_of_name(partition_algo);
+			if (NULL == partitioner) {
 				rdlog(LOG_ERR,
 					"Can't found partitioner algorithm %s for topic %s",
 					partition_algo,topic_name);
 			}
 		}
 
-		rkt = rd_kafka_topic_new(global_config.rk, topic_name, my_rkt_conf);
+		/* Reloads get the same handler from registry */
+		char buf[BUFSIZ];
+		rkt = kafka_topic_get(topic_name, partitioner, buf, sizeof(buf));
 		if (NULL == rkt) {
-			char buf[BUFSIZ];
-			strerror_r(errno, buf, sizeof(buf));
 			rdlog(LOG_ERR, "Can't create topic %s: %s", topic_name, buf);
-			rd_kafka_topic_conf_destroy(my_rkt_conf);
 			continue;
 		}
 
@@ -485,7 +476,7 @@ static int create_organization_monitor_topic(json_t *monitor_topics_array,
 			continue;
 		}
 
-		rkt_array->rkt[rkt_array->count] = new_rkt_global_config(
+		rkt_array->rkt[rkt_array->count] = kafka_topic_get(
 			topic_name, NULL,
 			err, sizeof(err));
 		if (NULL == rkt_array->rkt[rkt_array->count]) {
@@ -896,8 +887,8 @@ static void produce_or_free(struct rb_opaque *opaque, struct topic_s *topic,
 
 	rd_kafka_topic_t *rkt = topics_db_get_rdkafka_topic(topic);
 
-	const int produce_ret = rd_kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA,
-	                        RD_KAFKA_MSG_F_FREE, msgs, len);
+	const int produce_ret = kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA,
+	                        RD_KAFKA_MSG_F_FREE, msgs, (size_t)len);
 
 	if (produce_ret != len) {
 		int i;
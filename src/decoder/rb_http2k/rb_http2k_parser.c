@@ -448,17 +448,20 @@ struct rb_session *new_rb_session(struct rb_config *rb_config,
 	struct topic_s *topic_handler = NULL;
 	sensor_db_entry_t *sensor = NULL;
 
-	rb_http2k_database_get_topic_client(&rb_config->database, topic,
-		sensor_uuid, &topic_handler, &sensor);
+	if (!rb_http2k_handlers_take(msg_vars, &topic_handler, &sensor)) {
+		/* Listener has not looked them up */
+		rb_http2k_database_get_topic_client(&rb_config->database,
+			topic, sensor_uuid, &topic_handler, &sensor);
+	}
 
-	if (NULL == topic_handler) {
-		rdlog(LOG_ERR,"Invalid topic %s received from client %s",
-			topic,client_ip);
-		return NULL;
-	} else if (NULL == sensor) {
+	if (NULL == sensor) {
 		rdlog(LOG_ERR,"Invalid sensor UUID %s from client %s",
 			sensor_uuid,client_ip);
-		topic_decref(topic_handler);
+		return NULL;
+	} else if (NULL == topic_handler) {
+		rdlog(LOG_ERR,"Invalid topic %s received from client %s",
+			topic,client_ip);
+		sensor_db_entry_decref(sensor);
 		return NULL;
 	}
 
@@ -512,6 +515,7 @@ err_sess:
 
 sensor_err:
 	sensor_db_entry_decref(sensor);
+	topic_decref(topic_handler);
 
 	return NULL;
 }
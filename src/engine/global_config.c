@@ -18,9 +18,13 @@
 
 #include "util/util.h"
 #include "global_config.h"
+#include "rb_addr.h"
 #ifdef HAVE_LIBMICROHTTPD
 #include "listener/http.h"
 #endif
+#ifdef HAVE_LIBNGHTTP2
+#include "listener/http2.h"
+#endif
 #include "listener/socket.h"
 
 
@@ -52,15 +56,21 @@
 #define CONFIG_DEBUG_KEY "debug"
 #define CONFIG_RESPONSE_KEY "response"
 #define CONFIG_BLACKLIST_KEY "blacklist"
+#define CONFIG_ALLOWLIST_KEY "allowlist"
 #define CONFIG_MSE_SENSORS_KEY "mse-sensors"
 #define CONFIG_MERAKI_SECRETS_KEY "meraki-secrets"
 #define CONFIG_RBHTTP2K_CONFIG "rb_http2k_config"
 #define CONFIG_RDKAFKA_KEY "rdkafka."
 #define CONFIG_TCP_KEEPALIVE "tcp_keepalive"
+#define CONFIG_PRODUCER_INSTANCES_KEY "producer_instances"
+#define CONFIG_PRODUCE_POLICY_KEY "produce_policy"
+#define CONFIG_PRODUCE_BLOCK_TIMEOUT_KEY "produce_block_timeout_ms"
+#define CONFIG_SPILL_JOURNAL_KEY "spill_journal"
 
 #define CONFIG_PROTO_TCP  "tcp"
 #define CONFIG_PROTO_UDP  "udp"
 #define CONFIG_PROTO_HTTP "http"
+#define CONFIG_PROTO_HTTP2 "http2"
 
 #define CONFIG_DECODE_AS_NULL           ""
 #define CONFIG_DECODE_AS_MSE            "MSE"
@@ -86,7 +96,8 @@ static const struct registered_decoder{
     /// Decoders flags
     int flags;
 } registered_decoders[] = {
-	{CONFIG_DECODE_AS_NULL,NULL,dumb_decoder,NULL,NULL,NULL,0},
+	{CONFIG_DECODE_AS_NULL,NULL,dumb_decoder,dumb_opaque_creator,
+	    dumb_opaque_reload,dumb_opaque_done,0},
 	// @TODO destructors
 	{CONFIG_DECODE_AS_MSE,CONFIG_MSE_SENSORS_KEY,mse_decode,mse_opaque_creator,mse_opaque_reload,
 	    mse_opaque_done,0},
@@ -102,6 +113,9 @@ static const struct registered_listener{
 } registered_listeners[] = {
 #ifdef HAVE_LIBMICROHTTPD
 	{CONFIG_PROTO_HTTP, create_http_listener},
+#endif
+#ifdef HAVE_LIBNGHTTP2
+	{CONFIG_PROTO_HTTP2, create_http2_listener},
 #endif
 	{CONFIG_PROTO_TCP, create_tcp_listener},
 	{CONFIG_PROTO_UDP, create_udp_listener},
@@ -116,7 +130,10 @@ void init_global_config(){
 	memset(&global_config,0,sizeof(global_config));
 	global_config.kafka_conf = rd_kafka_conf_new();
 	global_config.kafka_topic_conf = rd_kafka_topic_conf_new();
-	global_config.blacklist = in_addr_list_new();
+	global_config.addr_filter = addr_filter_new();
+	if (NULL == global_config.addr_filter) {
+		abort();
+	}
 	rd_log_set_severity(LOG_INFO);
 	LIST_INIT(&global_config.listeners);
 
@@ -150,14 +167,6 @@ static const json_t *assert_json_array(const char *key,const json_t *value){
 	return value;
 }
 
-static void *assert_pton(int af,const char *src,void *dst){
-	const int pton_rc = inet_pton(af,src,dst);
-	if(pton_rc < 0){
-		fatal("pton(%s) error: %s",src,strerror(errno));
-	}
-	return dst;
-}
-
 static void parse_response(const char *key,const json_t *value){
 	const char *filename = assert_json_string(key,value);
 	global_config.response = rd_file_read(filename,&global_config.response_len);
@@ -200,19 +209,44 @@ static void parse_rdkafka_config_json(const char *key,const json_t *jvalue){
 	parse_rdkafka_keyval_config(key,value);
 }
 
-static void parse_blacklist(const char *key,const json_t *value){
-	assert_json_array(key,value);
+/** Add blacklist/allowlist addresses to filter
+  @param filter Filter
+  @param key Config key
+  @param value Array of CIDR
+  @param action Action of addresses
+  @return 0 if success, !0 in other case
+  */
+static int parse_addr_filter_list(addr_filter_t *filter,const char *key,
+		const json_t *value,enum addr_filter_action action){
+	if(!json_is_array(value)){
+		rdlog(LOG_ERR,"%s value must be an array",key);
+		return -1;
+	}
 
 	const size_t arr_len = json_array_size(value);
 	size_t i;
 	for(i=0;i<arr_len;++i){
-		struct in_addr addr;
 		const json_t *json_i = json_array_get(value,i);
-		const char *addr_string = assert_json_string("blacklist values",json_i);
+		const char *addr_string = json_string_value(json_i);
+		if(NULL == addr_string) {
+			rdlog(LOG_ERR,"%s values must be strings",key);
+			return -1;
+		}
 		if(global_config.debug)
-			rdbg("adding %s address to blacklist",addr_string);
-		assert_pton(AF_INET,addr_string,&addr);
-		in_addr_list_add(global_config.blacklist,&addr);
+			rdbg("adding %s address to %s",addr_string,key);
+		if(0 != addr_filter_add(filter,addr_string,action)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void parse_addr_filter(const char *key,const json_t *value,
+					enum addr_filter_action action){
+	if(0 != parse_addr_filter_list(global_config.addr_filter,key,value,
+								action)) {
+		fatal("Can't parse %s",key);
 	}
 }
 
@@ -327,6 +361,14 @@ static void parse_config_keyval(const char *key,const json_t *value){
 		// Already parsed
 	} else if(!strcasecmp(key,CONFIG_N2KAFKA_ID_KEY)) {
 		// Already parsed
+	}else if(!strcasecmp(key,CONFIG_PRODUCER_INSTANCES_KEY)){
+		// Already parsed
+	}else if(!strcasecmp(key,CONFIG_PRODUCE_POLICY_KEY)){
+		// Already parsed
+	}else if(!strcasecmp(key,CONFIG_PRODUCE_BLOCK_TIMEOUT_KEY)){
+		// Already parsed
+	}else if(!strcasecmp(key,CONFIG_SPILL_JOURNAL_KEY)){
+		// Already parsed
 	}else if(!strcasecmp(key,CONFIG_LISTENERS_ARRAY)){
 		parse_listeners_array(key,value);
 	}else if(!strcasecmp(key,CONFIG_DEBUG_KEY)){
@@ -336,7 +378,9 @@ static void parse_config_keyval(const char *key,const json_t *value){
 	}else if(!strncasecmp(key,CONFIG_RDKAFKA_KEY,strlen(CONFIG_RDKAFKA_KEY))){
 		// Already parsed
 	}else if(!strcasecmp(key,CONFIG_BLACKLIST_KEY)){
-		parse_blacklist(key,value);
+		parse_addr_filter(key,value,ADDR_FILTER_DENY);
+	}else if(!strcasecmp(key,CONFIG_ALLOWLIST_KEY)){
+		parse_addr_filter(key,value,ADDR_FILTER_ALLOW);
 	/// @TODO replace next entries by a for in decoders
 	}else if(!strcasecmp(key,CONFIG_MSE_SENSORS_KEY)){
 		// Already parsed
@@ -360,12 +404,52 @@ static void parse_rdkafka_config_keyval(const char *key,const json_t *value) {
 							global_config.brokers);
 	} else if(!strcasecmp(key,CONFIG_N2KAFKA_ID_KEY)) {
 		global_config.n2kafka_id = strdup(assert_json_string(key,value));
+	} else if(!strcasecmp(key,CONFIG_PRODUCER_INSTANCES_KEY)) {
+		const int instances = assert_json_integer(key,value);
+		if (instances < 1) {
+			fatal("%s must be greater than 0",key);
+		}
+		global_config.producer_instances = (size_t)instances;
 	} else if(!strncasecmp(key,CONFIG_RDKAFKA_KEY,strlen(CONFIG_RDKAFKA_KEY))) {
 		// if starts with
 		parse_rdkafka_config_json(key,value);
 	}
 }
 
+/** Parse produce policy, and set it
+  @param config Config file root
+  @return 0 if success, -1 if error
+  */
+static int parse_produce_policy(json_t *config) {
+	json_error_t jerr;
+	const char *policy_name = "drop";
+	int block_timeout_ms = 1000;
+	enum kafka_produce_policy policy;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,
+		"{s?s,s?i}",
+		CONFIG_PRODUCE_POLICY_KEY,&policy_name,
+		CONFIG_PRODUCE_BLOCK_TIMEOUT_KEY,&block_timeout_ms);
+	if (unpack_rc != 0) {
+		rdlog(LOG_ERR,"Can't parse produce policy: %s",jerr.text);
+		return -1;
+	}
+
+	if (0 != kafka_produce_policy_parse(policy_name,&policy)) {
+		rdlog(LOG_ERR,"Unknown produce policy %s",policy_name);
+		return -1;
+	}
+
+	if (block_timeout_ms < 0) {
+		rdlog(LOG_ERR,"%s can't be negative",
+			CONFIG_PRODUCE_BLOCK_TIMEOUT_KEY);
+		return -1;
+	}
+
+	kafka_set_produce_policy(policy,block_timeout_ms);
+	return 0;
+}
+
 static void parse_config0(json_t *root){
 	json_error_t jerr;
 	json_t *mse=NULL,*meraki=NULL,*rb_http2k=NULL;
@@ -378,10 +462,22 @@ static void parse_config0(json_t *root){
 		parse_rdkafka_config_keyval(key,value);
 	}
 
+	/* Delivery reports thread can spill messages as soon as producers
+	   are created */
+	json_t *spill_journal = json_object_get(root,CONFIG_SPILL_JOURNAL_KEY);
+	if(spill_journal && !only_stdout_output() &&
+				0 != kafka_spill_init(spill_journal)) {
+		exit(-1);
+	}
+
 	if(!only_stdout_output()) {
 		init_rdkafka();
 	}
 
+	if(0 != parse_produce_policy(root)) {
+		exit(-1);
+	}
+
 	/// @TODO replace next unpack by a for loop in decoders struct
 	const int unpack_rc = json_unpack_ex(root,&jerr,0,"{s?o,s?o,s?o}",
 		CONFIG_MSE_SENSORS_KEY,&mse,
@@ -547,6 +643,54 @@ static void reload_listeners(json_t *new_config,struct n2kafka_config *config){
 	reload_listeners_create_new_ones(listeners_array,config);
 }
 
+/** Build a new address filter from new config, and swap it with the
+  current one. Listeners could be using the old filter right now, so it is
+  freed in the next reload. */
+static void reload_addr_filter(json_t *new_config,
+					struct n2kafka_config *config) {
+	json_error_t jerr;
+	json_t *blacklist = NULL,*allowlist = NULL;
+
+	const int unpack_rc = json_unpack_ex(new_config,&jerr,0,"{s?o,s?o}",
+		CONFIG_BLACKLIST_KEY,&blacklist,
+		CONFIG_ALLOWLIST_KEY,&allowlist);
+	if(unpack_rc != 0) {
+		rdlog(LOG_ERR,"Can't reload address filter: %s",jerr.text);
+		return;
+	}
+
+	addr_filter_t *new_filter = addr_filter_new();
+	if(NULL == new_filter) {
+		return;
+	}
+
+	if((blacklist && 0 != parse_addr_filter_list(new_filter,
+			CONFIG_BLACKLIST_KEY,blacklist,ADDR_FILTER_DENY)) ||
+	   (allowlist && 0 != parse_addr_filter_list(new_filter,
+			CONFIG_ALLOWLIST_KEY,allowlist,ADDR_FILTER_ALLOW))) {
+		rdlog(LOG_ERR,"Can't reload address filter, keeping old one");
+		addr_filter_done(new_filter);
+		return;
+	}
+
+	addr_filter_t **retired = realloc(config->retired_addr_filters,
+		(config->retired_addr_filters_count + 1)*sizeof(retired[0]));
+	if(NULL == retired) {
+		rdlog(LOG_ERR,"Can't reload address filter (out of memory?), "
+			"keeping old one");
+		addr_filter_done(new_filter);
+		return;
+	}
+	config->retired_addr_filters = retired;
+
+	rdlog(LOG_INFO,"Reloading address filter");
+	addr_filter_log_stats(config->addr_filter);
+
+	/* Listener threads could be checking old filter right now */
+	retired[config->retired_addr_filters_count++] = __atomic_exchange_n(
+		&config->addr_filter,new_filter,__ATOMIC_ACQ_REL);
+}
+
 typedef int (*reload_cb)(void *database,const struct json_t *config);
 
 static json_t *reload_decoder(struct n2kafka_config *config,const char *decoder_config_key,
@@ -626,6 +770,13 @@ void reload_config(struct n2kafka_config *config) {
 			jerr.text,jerr.line,jerr.column);
 	}
 
+	rb_addr_cache_log_stats();
+	kafka_log_produce_wait_stats();
+	kafka_log_spill_stats();
+	if(new_config_file && 0 != parse_produce_policy(new_config_file)) {
+		rdlog(LOG_ERR,"Can't reload produce policy, keeping old one");
+	}
+	reload_addr_filter(new_config_file,config);
 	reload_listeners(new_config_file,config);
 	reload_decoders(config);
 	json_decref(new_config_file);
@@ -668,6 +819,10 @@ void execute_global_timers() {
 }
 
 void free_global_config(){
+	size_t i;
+
+	/* Listeners could be waiting for room in producer queue */
+	kafka_produce_stop_blocking();
 	shutdown_listeners(&global_config);
 
 	free_valid_mse_database(&global_config.mse.database);
@@ -680,7 +835,13 @@ void free_global_config(){
 
 	free(global_config.config_path);
 
-	in_addr_list_done(global_config.blacklist);
+	addr_filter_log_stats(global_config.addr_filter);
+	rb_addr_cache_log_stats();
+	addr_filter_done(global_config.addr_filter);
+	for(i=0;i<global_config.retired_addr_filters_count;++i) {
+		addr_filter_done(global_config.retired_addr_filters[i]);
+	}
+	free(global_config.retired_addr_filters);
 	free(global_config.topic);
 	free(global_config.brokers);
 	free(global_config.n2kafka_id);
@@ -24,7 +24,7 @@
 #include "decoder/meraki/rb_meraki.h"
 #include "decoder/rb_http2k/rb_http2k_decoder.h"
 #include "util/kafka.h"
-#include "util/in_addr_list.h"
+#include "util/addr_filter.h"
 #include "util/pair.h"
 #include "util/rb_timer.h"
 
@@ -35,6 +35,15 @@
 
 struct json_t;
 struct listener;
+/** Decoder entry point
+  @param buffer Received data. It is owned by the listener, so the decoder
+  can't free or keep it after the call: it has to copy what it needs. This
+  way, listeners can reuse their buffers.
+  @param buf_size Size of buffer
+  @param props Listener provided properties (client_ip, topic...)
+  @param listener_callback_opaque Decoder per-listener opaque
+  @param sessionp Streaming session, if decoder support it
+  */
 typedef void (*decoder_callback)(char *buffer,size_t buf_size,
     const keyval_list_t *props,void *listener_callback_opaque,
     void **sessionp);
@@ -92,8 +101,15 @@ struct n2kafka_config{
 
     rd_kafka_conf_t *kafka_conf;
     rd_kafka_topic_conf_t *kafka_topic_conf;rd_kafka_t *rk;
+    /// Number of rdkafka producer handlers. rk is the first one
+    size_t producer_instances;
 
-    in_addr_list_t *blacklist;
+    /// Client addresses blacklist/allowlist. Swapped on reload.
+    addr_filter_t *addr_filter;
+    /// Previous addr_filters. Listener threads could still be checking
+    /// them with no way to know when they end, so they are freed at exit.
+    addr_filter_t **retired_addr_filters;
+    size_t retired_addr_filters_count;
 
     /// List of global timers
     rb_timers_list_t timers;
@@ -119,6 +135,16 @@ static inline bool only_stdout_output(){
 	return global_config.debug && !global_config.brokers;
 }
 
+/** Check if client address is allowed by blacklist/allowlist
+  @param sa Client address
+  @return true if allowed
+  */
+static inline bool client_addr_allowed(const struct sockaddr *sa) {
+	addr_filter_t *filter = __atomic_load_n(&global_config.addr_filter,
+		__ATOMIC_ACQUIRE);
+	return ADDR_FILTER_ALLOW == addr_filter_check(filter,sa);
+}
+
 void init_global_config();
 
 void parse_config(const char *config_file_path);
@@ -58,7 +58,8 @@ static void show_usage(const char *progname){
 	fprintf(stdout,"\t\"topic\":\"kafka topic\",\n");
 	fprintf(stdout,"\t\"rdkafka.socket.max.fails\":\"3\",\n");
 	fprintf(stdout,"\t\"rdkafka.socket.keepalive.enable\":\"true\",\n");
-	fprintf(stdout,"\t\"blacklist\":[\"192.168.101.3\"]\n");
+	fprintf(stdout,"\t\"blacklist\":[\"192.168.101.3\",\"10.0.0.0/8\"],\n");
+	fprintf(stdout,"\t\"allowlist\":[\"192.168.0.0/16\"]\n");
 	fprintf(stdout,"}\n\n");
 	fprintf(stdout,"(1) Modes can be:\n");
 	fprintf(stdout,
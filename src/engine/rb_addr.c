@@ -18,11 +18,23 @@
 
 #include "rb_addr.h"
 
+#include "config.h"
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/queue.h>
 #include <librd/rdlog.h>
 
-const char *sockaddr2str(char *buf, size_t buf_size, struct sockaddr *sockaddr) {
+/// Address cache sets. Need to be a power of 2
+#define RB_ADDR_CACHE_SETS 2048
+/// Addresses per cache set
+#define RB_ADDR_CACHE_WAYS 4
+
+const char *sockaddr2str(char *buf, size_t buf_size,
+					const struct sockaddr *sockaddr) {
 	char errbuf[BUFSIZ];
 
 	const void *addr_buf = NULL;
@@ -30,10 +42,10 @@ const char *sockaddr2str(char *buf, size_t buf_size, struct sockaddr *sockaddr)
 
 	switch(sockaddr->sa_family) {
 	case AF_INET:
-		addr_buf = &((struct sockaddr_in *)sockaddr)->sin_addr;
+		addr_buf = &((const struct sockaddr_in *)sockaddr)->sin_addr;
 		break;
 	case AF_INET6:
-		addr_buf = &((struct sockaddr_in6 *)sockaddr)->sin6_addr;
+		addr_buf = &((const struct sockaddr_in6 *)sockaddr)->sin6_addr;
 		break;
 	default:
 		break;
@@ -52,3 +64,187 @@ const char *sockaddr2str(char *buf, size_t buf_size, struct sockaddr *sockaddr)
 
 	return ret;
 }
+
+/** Per thread address cache, set associative. Keys are IPv6 addresses
+  (IPv4 ones are stored as mapped) */
+struct rb_addr_cache {
+	struct rb_addr_cache_entry {
+		struct in6_addr addr;
+		struct rb_addr_str *str;
+	} entries[RB_ADDR_CACHE_SETS][RB_ADDR_CACHE_WAYS];
+
+	/// Next entry to replace in each set
+	uint8_t victim[RB_ADDR_CACHE_SETS];
+
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+	} stats;
+
+	LIST_ENTRY(rb_addr_cache) entry;
+};
+
+/// All threads caches, to print stats
+static struct {
+	pthread_mutex_t mutex;
+	LIST_HEAD(,rb_addr_cache) caches;
+	/// Stats of caches of finished threads
+	uint64_t hits,misses;
+} rb_addr_caches = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct rb_addr_cache *thread_cache = NULL;
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+struct rb_addr_str *rb_addr_str_incref(struct rb_addr_str *addr_str) {
+	ATOMIC_OP(add,fetch,&addr_str->refcnt,1);
+	return addr_str;
+}
+
+void rb_addr_str_decref(struct rb_addr_str *addr_str) {
+	if (0 == ATOMIC_OP(sub,fetch,&addr_str->refcnt,1)) {
+		free(addr_str);
+	}
+}
+
+static void rb_addr_cache_destroy(void *_cache) {
+	struct rb_addr_cache *cache = _cache;
+	size_t i,j;
+
+	pthread_mutex_lock(&rb_addr_caches.mutex);
+	LIST_REMOVE(cache,entry);
+	rb_addr_caches.hits += ATOMIC_OP(fetch,add,&cache->stats.hits,0);
+	rb_addr_caches.misses += ATOMIC_OP(fetch,add,&cache->stats.misses,0);
+	pthread_mutex_unlock(&rb_addr_caches.mutex);
+
+	for (i=0; i<RB_ADDR_CACHE_SETS; ++i) {
+		for (j=0; j<RB_ADDR_CACHE_WAYS; ++j) {
+			if (cache->entries[i][j].str) {
+				rb_addr_str_decref(cache->entries[i][j].str);
+			}
+		}
+	}
+
+	free(cache);
+}
+
+static void rb_addr_cache_create_key() {
+	pthread_key_create(&thread_cache_key,rb_addr_cache_destroy);
+}
+
+/// Get (or create) calling thread cache
+static struct rb_addr_cache *rb_addr_thread_cache() {
+	if (thread_cache) {
+		return thread_cache;
+	}
+
+	pthread_once(&thread_cache_key_once,rb_addr_cache_create_key);
+	thread_cache = calloc(1,sizeof(*thread_cache));
+	if (NULL == thread_cache) {
+		rdlog(LOG_ERR,"Can't allocate address cache (out of memory?)");
+		return NULL;
+	}
+
+	pthread_setspecific(thread_cache_key,thread_cache);
+	pthread_mutex_lock(&rb_addr_caches.mutex);
+	LIST_INSERT_HEAD(&rb_addr_caches.caches,thread_cache,entry);
+	pthread_mutex_unlock(&rb_addr_caches.mutex);
+
+	return thread_cache;
+}
+
+/// Cache key of an address
+static int rb_addr_cache_key(const struct sockaddr *sockaddr,
+							struct in6_addr *key) {
+	switch(sockaddr->sa_family) {
+	case AF_INET:
+		memset(key,0,sizeof(*key));
+		key->s6_addr[10] = key->s6_addr[11] = 0xff;
+		memcpy(&key->s6_addr[12],
+			&((const struct sockaddr_in *)sockaddr)->sin_addr,4);
+		return 0;
+	case AF_INET6:
+		memcpy(key,&((const struct sockaddr_in6 *)sockaddr)->sin6_addr,
+			sizeof(*key));
+		return 0;
+	default:
+		return -1;
+	};
+}
+
+static size_t rb_addr_cache_set(const struct in6_addr *key) {
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i=0; i<sizeof(key->s6_addr); ++i) {
+		h = (h ^ key->s6_addr[i]) * 16777619u;
+	}
+
+	return h & (RB_ADDR_CACHE_SETS - 1);
+}
+
+struct rb_addr_str *rb_addr_cache_get(const struct sockaddr *sockaddr) {
+	struct in6_addr key;
+	size_t i;
+
+	struct rb_addr_cache *cache = rb_addr_thread_cache();
+	if (NULL == cache || 0 != rb_addr_cache_key(sockaddr,&key)) {
+		return NULL;
+	}
+
+	const size_t set = rb_addr_cache_set(&key);
+	struct rb_addr_cache_entry *entries = cache->entries[set];
+	for (i=0; i<RB_ADDR_CACHE_WAYS; ++i) {
+		if (entries[i].str &&
+			0 == memcmp(&entries[i].addr,&key,sizeof(key))) {
+			ATOMIC_OP(add,fetch,&cache->stats.hits,1);
+			return entries[i].str;
+		}
+	}
+
+	ATOMIC_OP(add,fetch,&cache->stats.misses,1);
+
+	struct rb_addr_str *addr_str = calloc(1,sizeof(*addr_str));
+	if (NULL == addr_str) {
+		rdlog(LOG_ERR,"Can't allocate address string (out of memory?)");
+		return NULL;
+	}
+
+	if (NULL == sockaddr2str(addr_str->str,sizeof(addr_str->str),
+								sockaddr)) {
+		free(addr_str);
+		return NULL;
+	}
+	addr_str->refcnt = 1; /* Cache reference */
+
+	struct rb_addr_cache_entry *victim = &entries[cache->victim[set]];
+	cache->victim[set] = (cache->victim[set] + 1) % RB_ADDR_CACHE_WAYS;
+	if (victim->str) {
+		rb_addr_str_decref(victim->str);
+	}
+
+	memcpy(&victim->addr,&key,sizeof(key));
+	victim->str = addr_str;
+
+	return addr_str;
+}
+
+void rb_addr_cache_log_stats() {
+	struct rb_addr_cache *cache = NULL;
+
+	pthread_mutex_lock(&rb_addr_caches.mutex);
+	uint64_t hits = rb_addr_caches.hits;
+	uint64_t misses = rb_addr_caches.misses;
+	LIST_FOREACH(cache,&rb_addr_caches.caches,entry) {
+		hits += ATOMIC_OP(fetch,add,&cache->stats.hits,0);
+		misses += ATOMIC_OP(fetch,add,&cache->stats.misses,0);
+	}
+	pthread_mutex_unlock(&rb_addr_caches.mutex);
+
+	rdlog(LOG_INFO,"Client address cache: %"PRIu64" hits, %"PRIu64
+		" misses (%.1f%% hit ratio)",hits,misses,
+		hits + misses ? 100.0*hits/(hits + misses) : 0.0);
+}
@@ -22,4 +22,38 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-const char *sockaddr2str(char *buf, size_t buf_size, struct sockaddr *sockaddr);
+#include <stdint.h>
+
+const char *sockaddr2str(char *buf, size_t buf_size,
+					const struct sockaddr *sockaddr);
+
+/// Interned client address string
+struct rb_addr_str {
+	/// Reference counter. Use rb_addr_str_incref/decref to modify it
+	uint64_t refcnt;
+	/// Address string
+	char str[INET6_ADDRSTRLEN];
+};
+
+/** Get the string of an address using calling thread cache, so the same
+  client addresses are not printed over and over.
+  @param sockaddr Address (AF_INET or AF_INET6)
+  @return Address string. It's only valid until next call of this function
+  in the same thread: Take a reference with rb_addr_str_incref if you need
+  it for longer. NULL if error.
+  */
+struct rb_addr_str *rb_addr_cache_get(const struct sockaddr *sockaddr);
+
+/** Take a reference of an interned address string
+  @param addr_str Address string
+  @return Same address string
+  */
+struct rb_addr_str *rb_addr_str_incref(struct rb_addr_str *addr_str);
+
+/** Release a reference of an interned address string
+  @param addr_str Address string
+  */
+void rb_addr_str_decref(struct rb_addr_str *addr_str);
+
+/// Log address cache hits and misses of all threads
+void rb_addr_cache_log_stats();
@@ -1,5 +1,8 @@
 THIS_SRCS := \
+	backpressure.c \
 	http.c \
+	http2.c \
+	http_codec.c \
 	socket.c \
 
 SRCS += $(addprefix $(CURRENT_N2KAFKA_DIR), $(THIS_SRCS))
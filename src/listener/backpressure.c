@@ -0,0 +1,209 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "config.h"
+
+#include "backpressure.h"
+#include "util/kafka.h"
+
+#include <inttypes.h>
+#include <jansson.h>
+#include <librd/rdlog.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+/// Min interval between kafka drain rate samples, in seconds
+#define BACKPRESSURE_SAMPLE_INTERVAL 1.
+/// Min interval between rejected requests warnings, in seconds
+#define BACKPRESSURE_WARN_INTERVAL 10.
+
+#define HTTP_TOO_MANY_REQUESTS 429
+#define HTTP_SERVICE_UNAVAILABLE 503
+
+int backpressure_config_parse(struct backpressure_config *config,
+                                        struct json_t *listener_config) {
+	json_error_t error;
+	int max_messages = 0,status_code = HTTP_SERVICE_UNAVAILABLE;
+	json_int_t max_bytes = 0;
+
+	const int unpack_rc = json_unpack_ex(listener_config,&error,0,
+		"{"
+			"s?i," /* backpressure_max_messages */
+			"s?I," /* backpressure_max_bytes */
+			"s?i"  /* backpressure_status_code */
+		"}",
+		"backpressure_max_messages",&max_messages,
+		"backpressure_max_bytes",&max_bytes,
+		"backpressure_status_code",&status_code);
+
+	if(unpack_rc != 0) {
+		rdlog(LOG_ERR,"Can't parse backpressure options: %s",error.text);
+		return -1;
+	}
+
+	if(max_messages < 0 || max_bytes < 0) {
+		rdlog(LOG_ERR,"Backpressure watermarks can't be negative");
+		return -1;
+	}
+
+	if(status_code != HTTP_TOO_MANY_REQUESTS &&
+	                                status_code != HTTP_SERVICE_UNAVAILABLE) {
+		rdlog(LOG_ERR,"Invalid backpressure_status_code %d, it must be "
+			"429 or 503",status_code);
+		return -1;
+	}
+
+	config->max_messages = (size_t)max_messages;
+	config->max_bytes = (uint64_t)max_bytes;
+	config->status_code = (unsigned int)status_code;
+	return 0;
+}
+
+void backpressure_init(struct backpressure *bp,int port,
+                                const struct backpressure_config *config) {
+	memset(bp,0,sizeof(*bp));
+	bp->config = *config;
+	bp->port = port;
+	pthread_mutex_init(&bp->lock,NULL);
+}
+
+static double monotonic_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+/** Seconds needed to drain kafka queue excess over a watermark
+  @param excess Excess over watermark
+  @param rate Drain rate, units per second
+  @return Seconds, or BACKPRESSURE_RETRY_AFTER_MAX if it is not draining
+  */
+static double backpressure_drain_time(uint64_t excess,double rate) {
+	if(0 == excess) {
+		return 0;
+	}
+
+	return rate > 0 ? (double)excess/rate : BACKPRESSURE_RETRY_AFTER_MAX;
+}
+
+/** Update kafka drain rate and compute Retry-After of a rejected request.
+  Need to hold backpressure lock.
+  @param bp Backpressure
+  @param status Kafka producer status
+  @param now Current monotonic time
+  @return Seconds client should wait before retrying
+  */
+static unsigned int backpressure_retry_after0(struct backpressure *bp,
+		const struct kafka_queue_status *status,double now) {
+	const double elapsed = now - bp->last_sample.ts;
+
+	if(elapsed >= BACKPRESSURE_SAMPLE_INTERVAL) {
+		if(bp->last_sample.ts > 0) {
+			bp->msgs_rate = (double)(status->delivered_msgs
+				- bp->last_sample.delivered_msgs)/elapsed;
+			bp->bytes_rate = (double)(status->delivered_bytes
+				- bp->last_sample.delivered_bytes)/elapsed;
+		}
+		bp->last_sample.ts = now;
+		bp->last_sample.delivered_msgs = status->delivered_msgs;
+		bp->last_sample.delivered_bytes = status->delivered_bytes;
+	}
+
+	const uint64_t excess_msgs = bp->config.max_messages &&
+		status->outq_len > bp->config.max_messages ?
+		status->outq_len - bp->config.max_messages : 0;
+	const uint64_t excess_bytes = bp->config.max_bytes &&
+		status->inflight_bytes > bp->config.max_bytes ?
+		status->inflight_bytes - bp->config.max_bytes : 0;
+
+	const double msgs_time = backpressure_drain_time(excess_msgs,
+		bp->msgs_rate);
+	const double bytes_time = backpressure_drain_time(excess_bytes,
+		bp->bytes_rate);
+	const double drain_time = ceil(msgs_time > bytes_time ? msgs_time :
+		bytes_time);
+
+	return drain_time < BACKPRESSURE_RETRY_AFTER_MIN ?
+			BACKPRESSURE_RETRY_AFTER_MIN :
+	       drain_time > BACKPRESSURE_RETRY_AFTER_MAX ?
+			BACKPRESSURE_RETRY_AFTER_MAX :
+	       (unsigned int)drain_time;
+}
+
+/** Check kafka producer status against listener watermarks
+  @param bp Backpressure
+  @param status Kafka producer status
+  @param now Current monotonic time
+  @return 0 if request can be accepted, or seconds client should wait before
+  retrying if it has to be rejected
+  */
+static unsigned int backpressure_check0(struct backpressure *bp,
+		const struct kafka_queue_status *status,double now) {
+	const int over_messages = bp->config.max_messages &&
+		status->outq_len > bp->config.max_messages;
+	const int over_bytes = bp->config.max_bytes &&
+		status->inflight_bytes > bp->config.max_bytes;
+	if(!over_messages && !over_bytes) {
+		return 0;
+	}
+
+	const uint64_t rejected = ATOMIC_OP(add,fetch,&bp->rejected,1);
+	uint64_t warn_rejected = 0;
+
+	pthread_mutex_lock(&bp->lock);
+	const unsigned int retry_after = backpressure_retry_after0(bp,status,
+		now);
+	if(now - bp->last_warn_ts >= BACKPRESSURE_WARN_INTERVAL) {
+		warn_rejected = rejected - bp->last_warn_rejected;
+		bp->last_warn_ts = now;
+		bp->last_warn_rejected = rejected;
+	}
+	pthread_mutex_unlock(&bp->lock);
+
+	if(warn_rejected) {
+		rdlog(LOG_WARNING,"Listener %d: kafka queue over watermark (%zu "
+			"messages, %"PRIu64" bytes), rejected %"PRIu64" requests "
+			"with Retry-After %u",bp->port,status->outq_len,
+			status->inflight_bytes,warn_rejected,retry_after);
+	}
+
+	return retry_after;
+}
+
+unsigned int backpressure_check(struct backpressure *bp) {
+	struct kafka_queue_status status;
+
+	if(0 == bp->config.max_messages && 0 == bp->config.max_bytes) {
+		return 0;
+	}
+
+	kafka_queue_status(&status);
+	return backpressure_check0(bp,&status,monotonic_now());
+}
+
+void backpressure_done(struct backpressure *bp) {
+	const uint64_t rejected = ATOMIC_OP(fetch,add,&bp->rejected,0);
+	if(rejected) {
+		rdlog(LOG_INFO,"Listener %d rejected %"PRIu64" requests because "
+			"of kafka backpressure",bp->port,rejected);
+	}
+	pthread_mutex_destroy(&bp->lock);
+}
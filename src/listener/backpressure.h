@@ -0,0 +1,93 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct json_t;
+struct kafka_queue_status;
+
+/// Retry-After bounds of rejected requests, in seconds
+#define BACKPRESSURE_RETRY_AFTER_MIN 1
+#define BACKPRESSURE_RETRY_AFTER_MAX 60
+
+/// Listener backpressure options
+struct backpressure_config {
+	/// rdkafka queue length watermark. 0 to disable
+	size_t max_messages;
+	/// Produced bytes waiting delivery report watermark. 0 to disable
+	uint64_t max_bytes;
+	/// Rejected requests response code
+	unsigned int status_code;
+};
+
+/// Reject new requests if kafka producer can't keep up
+struct backpressure {
+	struct backpressure_config config;
+	/// Listener port, for logging
+	int port;
+	/// Rejected requests. Updated atomically
+	uint64_t rejected;
+
+	/// Protects kafka drain rate estimation
+	pthread_mutex_t lock;
+	/// Last drain rate sample
+	struct {
+		double ts;
+		uint64_t delivered_msgs,delivered_bytes;
+	} last_sample;
+	/// Kafka delivery rate
+	double msgs_rate,bytes_rate;
+	/// Last warning of rejected requests
+	double last_warn_ts;
+	uint64_t last_warn_rejected;
+};
+
+/** Parse backpressure_max_messages, backpressure_max_bytes and
+  backpressure_status_code listener options
+  @param config Returned backpressure options
+  @param listener_config Listener config
+  @return 0 if success, -1 if options are not valid
+  */
+int backpressure_config_parse(struct backpressure_config *config,
+					struct json_t *listener_config);
+
+/** Initialize listener backpressure
+  @param bp Backpressure
+  @param port Listener port
+  @param config Backpressure options
+  */
+void backpressure_init(struct backpressure *bp,int port,
+				const struct backpressure_config *config);
+
+/** Check kafka producer queue against listener watermarks. Thread safe.
+  @param bp Backpressure
+  @return 0 if request can be accepted, or seconds client should wait before
+  retrying if it has to be rejected
+  */
+unsigned int backpressure_check(struct backpressure *bp);
+
+/** Log rejected requests and release backpressure resources
+  @param bp Backpressure
+  */
+void backpressure_done(struct backpressure *bp);
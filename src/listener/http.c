@@ -31,11 +31,16 @@
 #include "http.h"
 #include "engine/rb_addr.h"
 #include "util/topic_database.h"
+#include "util/cpu_affinity.h"
+#include "util/kafka.h"
+#include "http_codec.h"
+#include "backpressure.h"
 
 #include "engine/global_config.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <jansson.h>
 #include <librd/rdlog.h>
 #include <librd/rdmem.h>
@@ -43,30 +48,40 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include <zlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/queue.h>
 
 /// Initial string to start with
 #define STRING_INITIAL_SIZE 2048
+/// Max request buffer allocated upfront from Content-Length
+#define STRING_MAX_PRESIZE (16*1024*1024)
 
-/// Chunk to store decompression flow
-#define ZLIB_CHUNK          (512*1024)
+/// Default max wait for delivery reports, in milliseconds
+#define DELIVERY_ACK_DEFAULT_TIMEOUT_MS 10000
+/// Request memory for URL strings and small bodies, in request block
+#define REQUEST_MEM_SIZE 4096
+/// Max recycled request blocks kept by every thread
+#define HTTP_ARENA_MAX_FREE 256
 
 struct string {
 	char *buf;
 	size_t allocated,used;
+	/// buf is in request memory, not in heap
+	int inplace;
 };
 
 #define HTTP_PRIVATE_MAGIC 0xC0B345FE
 
+struct conn_info;
+
 /// Connection private data
 struct http_private{
 #ifdef HTTP_PRIVATE_MAGIC
 	/// Casting magic
 	uint64_t magic;
 #endif
-	/// Associated daemon
-	struct MHD_Daemon *d;
-
 	/// Check redborder-style URI
 	int redborder_uri;
 
@@ -78,6 +93,57 @@ struct http_private{
 
 	/// Callback flags
 	int callback_flags;
+
+	/// Listener port
+	int port;
+
+	/// Daemon threads CPU affinity
+	struct cpu_affinity affinity;
+
+	/// Number of daemon threads already pinned
+	size_t pinned_threads;
+
+	/// Content-Encoding decompression counters
+	struct http_codec_stats codec_stats[HTTP_CODEC_MAX];
+	/// Max decompressed body of non streaming decoders requests. 0 means
+	/// no limit
+	size_t max_decompressed_body;
+
+	/// Reject new requests if kafka producer can't keep up
+	struct backpressure backpressure;
+
+	/// Answer requests when all their messages are delivered to kafka
+	struct {
+		/// Delivery acknowledgement mode enabled
+		int enabled;
+		/// Max wait for delivery reports, in seconds
+		double timeout;
+		/// Protects queues and counters
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		/// Resumes answered connections and expires timed out ones
+		pthread_t thread;
+		/// Listener is stopping
+		int stop;
+		/// Suspended requests waiting for delivery reports, by deadline
+		TAILQ_HEAD(,conn_info) pending;
+		/// Answered requests waiting to be resumed
+		TAILQ_HEAD(,conn_info) answered;
+		/// Answered requests
+		uint64_t delivered,failed,timeouts;
+		/// Request end to answer latency, in seconds
+		double latency_sum,latency_max;
+	} ack;
+
+	/// Request heap allocations, for debugging. Updated atomically
+	struct {
+		uint64_t requests,heap_allocs;
+	} alloc_stats;
+
+	/// Number of daemons
+	size_t num_daemons;
+	/// Associated daemons, sharing port with SO_REUSEPORT if many
+	struct MHD_Daemon *daemons[];
 };
 
 static size_t smax(size_t n1, size_t n2) {
@@ -88,7 +154,27 @@ static size_t smin(size_t n1, size_t n2) {
 	return n1>n2?n2:n1;
 }
 
-static int init_string(struct string *s,size_t size) {
+/** Init string buffer
+  @param s String
+  @param size Buffer size
+  @param mem Request memory to use if size fits in it, or NULL
+  @param mem_size Request memory size
+  @return 1 if success, 0 if no memory
+  */
+static int init_string(struct string *s,size_t size,char *mem,
+                                                        size_t mem_size) {
+	if(0 == size) {
+		/* Streaming decoders does not need buffer */
+		return 1;
+	}
+
+	if(mem && size <= mem_size) {
+		s->buf = mem;
+		s->allocated = mem_size;
+		s->inplace = 1;
+		return 1;
+	}
+
 	s->buf = malloc(size);
 	if(s->buf) {
 		s->allocated = size;
@@ -103,20 +189,36 @@ static size_t string_free_space(const struct string *str) {
 
 static size_t string_grow(struct string *str,size_t delta) {
 	const size_t newsize = smax(str->allocated + delta,str->allocated*2);
-	char *new_buf = realloc(str->buf,newsize);
+	char *new_buf = str->inplace ? malloc(newsize) :
+		realloc(str->buf,newsize);
 	if(NULL != new_buf) {
+		if(str->inplace) {
+			memcpy(new_buf,str->buf,str->used);
+			str->inplace = 0;
+		}
 		str->buf = new_buf;
 		str->allocated = newsize;
 	}
 	return str->allocated;
 }
 
+static void string_done(struct string *str) {
+	if(!str->inplace) {
+		free(str->buf);
+	}
+	str->buf = NULL;
+}
+
+struct http_arena;
+
 /// Per connection information
 struct conn_info {
 	/// URL specified Topic
 	const char *topic;
-	/// URL specified client
+	/// Client address
 	const char *client;
+	/// Client address interned string. client points to it.
+	struct rb_addr_str *client_str;
 	/// URL specified sensor uuid
 	const char *sensor_uuid;
 	/// Per connection string
@@ -125,23 +227,210 @@ struct conn_info {
 	keyval_list_t decoder_params;
 	/// Memory pool for decoder_params
 	struct pair decoder_opts[3];
+	/// rb_http2k topic and sensor, looked up in URL validation. Decoder
+	/// session takes them.
+	struct rb_http2k_handlers rb_handlers;
+	/// decoder_params entry pointing to rb_handlers
+	struct pair rb_handlers_opt;
 
-	/// libz related
+	/// Content-Encoding decompression
 	struct {
 		/// Request has asked for compressed data
 		int enable;
-		/// zlib handler
-		z_stream strm;
-	} zlib;
+		/// Request codec
+		enum http_codec_type codec;
+		/// Codec stream, taken from thread pool. NULL if stream failed
+		struct http_codec_stream *stream;
+		/// Answer if stream failed or body is too large, 0 if none
+		unsigned int status_code;
+	} codec;
 
 	/// Session pointer.
 	void *decoder_sessp;
+	/// Decoder has processed the whole request
+	int decoded;
+
+	/// Kafka delivery acknowledgement, if listener waits for it
+	struct {
+		/// Produced messages tracking
+		struct kafka_delivery_ack *kafka;
+		struct http_private *h;
+		/// Suspended connection
+		struct MHD_Connection *connection;
+		enum {
+			/// Request not received yet
+			CONN_ACK_NONE,
+			/// Waiting for delivery reports
+			CONN_ACK_PENDING,
+			/// status_code decided, waiting to be resumed
+			CONN_ACK_ANSWERED,
+		} state;
+		unsigned int status_code;
+		/// Request end and answer deadline, monotonic seconds
+		double start,deadline;
+		TAILQ_ENTRY(conn_info) entry;
+	} ack;
+
+	/// Heap allocations done for this request
+	size_t heap_allocs;
+	/// Topic and uuid, if they don't fit in request memory
+	char *heap_strings;
+	/// Thread arena that recycles this block, NULL if none
+	struct http_arena *arena;
+	SLIST_ENTRY(conn_info) arena_entry;
+
+	/// Request scoped memory: URL strings and small request bodies. Must be
+	/// the last member, it is not cleared when the block is recycled.
+	struct {
+		size_t used;
+		char buf[REQUEST_MEM_SIZE];
+	} mem;
+};
+
+/*
+ *  REQUEST BLOCKS ARENA
+ */
+
+/// Per thread recycled request blocks. Requests are released in the daemon
+/// thread that handles their connection, so no locking is needed.
+struct http_arena {
+	SLIST_HEAD(,conn_info) free_blocks;
+	size_t free_count;
 };
 
+static __thread struct http_arena *thread_arena = NULL;
+static pthread_key_t thread_arena_key;
+static pthread_once_t thread_arena_key_once = PTHREAD_ONCE_INIT;
+
+static void http_arena_destroy(void *_arena) {
+	struct http_arena *arena = _arena;
+	struct conn_info *con_info = NULL;
+
+	while((con_info = SLIST_FIRST(&arena->free_blocks))) {
+		SLIST_REMOVE_HEAD(&arena->free_blocks,arena_entry);
+		free(con_info);
+	}
+	free(arena);
+}
+
+static void http_arena_create_key() {
+	pthread_key_create(&thread_arena_key,http_arena_destroy);
+}
+
+/// Get (or create) calling thread arena. NULL if no memory
+static struct http_arena *http_thread_arena() {
+	if(thread_arena) {
+		return thread_arena;
+	}
+
+	pthread_once(&thread_arena_key_once,http_arena_create_key);
+	struct http_arena *arena = calloc(1,sizeof(*arena));
+	if(NULL == arena) {
+		return NULL;
+	}
+
+	SLIST_INIT(&arena->free_blocks);
+	pthread_setspecific(thread_arena_key,arena);
+	return thread_arena = arena;
+}
+
+/// Get a zeroed request block, recycled if possible
+static struct conn_info *conn_info_alloc() {
+	struct http_arena *arena = http_thread_arena();
+	struct conn_info *con_info = arena ? SLIST_FIRST(&arena->free_blocks) :
+		NULL;
+	size_t heap_allocs = 0;
+
+	if(con_info) {
+		SLIST_REMOVE_HEAD(&arena->free_blocks,arena_entry);
+		arena->free_count--;
+	} else {
+		con_info = malloc(sizeof(*con_info));
+		if(NULL == con_info) {
+			return NULL;
+		}
+		heap_allocs++;
+	}
+
+	/* Request memory does not need to be cleared */
+	memset(con_info,0,offsetof(struct conn_info,mem));
+	con_info->mem.used = 0;
+	con_info->arena = arena;
+	con_info->heap_allocs = heap_allocs;
+	return con_info;
+}
+
+/// Return request block to its arena, so it is reset and reused
+static void conn_info_release(struct conn_info *con_info) {
+	struct http_arena *arena = con_info->arena;
+
+	if(arena && arena == thread_arena &&
+	                                arena->free_count < HTTP_ARENA_MAX_FREE) {
+		SLIST_INSERT_HEAD(&arena->free_blocks,con_info,arena_entry);
+		arena->free_count++;
+	} else {
+		free(con_info);
+	}
+}
+
+/** Allocate from request memory
+  @param con_info Request
+  @param size Bytes to allocate
+  @return Allocated memory, or NULL if it does not fit
+  */
+static char *conn_info_mem(struct conn_info *con_info,size_t size) {
+	if(size > sizeof(con_info->mem.buf) - con_info->mem.used) {
+		return NULL;
+	}
+
+	char *ret = &con_info->mem.buf[con_info->mem.used];
+	con_info->mem.used += size;
+	return ret;
+}
+
+/// Copy URL topic and uuid to request memory, or to heap if they don't fit
+static int conn_info_set_strings(struct conn_info *con_info,
+                                        const char *topic,const char *uuid) {
+	const size_t topic_size = topic ? strlen(topic) + 1 : 0;
+	const size_t uuid_size = uuid ? strlen(uuid) + 1 : 0;
+
+	if(0 == topic_size + uuid_size) {
+		return 0;
+	}
+
+	char *buf = conn_info_mem(con_info,topic_size + uuid_size);
+	if(NULL == buf) {
+		buf = con_info->heap_strings = malloc(topic_size + uuid_size);
+		if(NULL == buf) {
+			return -1;
+		}
+		con_info->heap_allocs++;
+	}
+
+	if(topic) {
+		memcpy(buf,topic,topic_size);
+		con_info->topic = buf;
+		buf += topic_size;
+	}
+	if(uuid) {
+		memcpy(buf,uuid,uuid_size);
+		con_info->sensor_uuid = buf;
+	}
+	return 0;
+}
+
 static void free_con_info(struct conn_info *con_info) {
-	free(con_info->str.buf);
-	con_info->str.buf = NULL;
-	free(con_info);
+	if(con_info->ack.kafka) {
+		/* Late delivery reports will not call us */
+		kafka_delivery_ack_done(con_info->ack.kafka);
+	}
+	if(con_info->client_str) {
+		rb_addr_str_decref(con_info->client_str);
+	}
+	rb_http2k_handlers_done(&con_info->rb_handlers);
+	string_done(&con_info->str);
+	free(con_info->heap_strings);
+	conn_info_release(con_info);
 }
 
 static void prepare_decoder_params(struct conn_info *con_info,struct pair *mem,
@@ -162,6 +451,37 @@ static void prepare_decoder_params(struct conn_info *con_info,struct pair *mem,
 	add_key_value_pair(list,&mem[2]);
 }
 
+/// Send data to decoder, tracking produced messages if request waits for
+/// their delivery
+static void decoder_call(struct http_private *h,struct conn_info *con_info,
+                                char *buf,size_t len,void **sessionp) {
+	kafka_delivery_ack_track(con_info->ack.kafka);
+	h->callback(buf,len,&con_info->decoder_params,h->callback_opaque,
+		sessionp);
+	kafka_delivery_ack_track(NULL);
+}
+
+/// Send end of request to decoder, if not sent yet
+static void decode_request_end(struct http_private *h,
+                                                struct conn_info *con_info) {
+	if(con_info->decoded) {
+		return;
+	}
+
+	con_info->decoded = 1;
+	if(!(h->callback_flags & DECODER_F_SUPPORT_STREAMING)) {
+		/* No streaming processing -> need to process buffer, unless
+		   it is incomplete */
+		if(0 == con_info->codec.status_code) {
+			decoder_call(h,con_info,con_info->str.buf,
+				con_info->str.used,NULL);
+		}
+	} else {
+		/* Streaming processing -> need to free session pointer */
+		decoder_call(h,con_info,NULL,0,&con_info->decoder_sessp);
+	}
+}
+
 static void request_completed (void *cls,
                                struct MHD_Connection *connection HTTP_UNUSED,
                                void **con_cls,
@@ -181,92 +501,54 @@ static void request_completed (void *cls,
 	assert(HTTP_PRIVATE_MAGIC == h->magic);
 #endif
 
-	if(!h->callback_flags & DECODER_F_SUPPORT_STREAMING) {
-		/* No streaming processing -> need to process buffer */
-		h->callback(con_info->str.buf,con_info->str.used,
-			&con_info->decoder_params,h->callback_opaque,NULL);
-		con_info->str.buf = NULL; /* librdkafka will free it */
-	} else {
-		/* Streaming processing -> need to free session pointer */
-		h->callback(NULL,0,&con_info->decoder_params,
-			h->callback_opaque,&con_info->decoder_sessp);
-	}
+	decode_request_end(h,con_info);
 
-	if(con_info->zlib.enable) {
-		inflateEnd(&con_info->zlib.strm);
+	if(con_info->codec.stream) {
+		http_codec_stream_release(con_info->codec.stream);
 	}
 
+	ATOMIC_OP(add,fetch,&h->alloc_stats.requests,1);
+	ATOMIC_OP(add,fetch,&h->alloc_stats.heap_allocs,con_info->heap_allocs);
 	free_con_info(con_info);
 	*con_cls = NULL;
 }
 
-static int connection_gzip_iterator(void *cls,enum MHD_ValueKind kind,
-                                    const char *key,const char *value) {
-	int *ret = cls;
-
-	(void)kind;
-
-	if(key && value && 0 == strcmp("Content-Encoding",key)
-	                                        && 0==strcmp("deflate",value)) {
-		*ret = 1;
-		return MHD_NO; /* We have found what we were looking for */
-	} else {
-		return MHD_YES;
-	}
-}
-
-/** Find if 'Content-Encoding' header of the connection is gzipped */
-static int is_connection_gzip(struct MHD_Connection *conn) {
-	int ret = 0;
-	MHD_get_connection_values(conn,MHD_HEADER_KIND,connection_gzip_iterator,&ret);
-	return ret;
-}
-
-static const char *zlib_error2str(const int z_status) {
-	switch(z_status) {
-	case Z_OK:
-		return "success";
-		break;
-	case Z_MEM_ERROR:
-		return "there was not enough memory";
-		break;
-	case Z_VERSION_ERROR:
-		return "the zlib library version is incompatible with the"
-			" version assumed by the caller";
-		break;
-	case Z_STREAM_ERROR:
-		return "the parameters are invalid";
-		break;
-	default:
-		return "Unknown error";
-		break;
-	};
-}
-
 static struct conn_info *create_connection_info(size_t string_size,
-		const char *topic,const char *client,const char *s_uuid,
-		struct MHD_Connection *connection) {
+		const char *topic,struct rb_addr_str *client,const char *s_uuid,
+		struct rb_http2k_handlers *rb_handlers,
+		const enum http_codec_type *codec) {
 
 	/* First call, creating all needed structs */
 
-	struct conn_info *con_info = NULL;
-
-	rd_calloc_struct(&con_info,sizeof(*con_info),
-		topic?-1:0,topic,&con_info->topic,
-		client?-1:0,client,&con_info->client,
-		s_uuid?-1:0,s_uuid,&con_info->sensor_uuid,
-		RD_MEM_END_TOKEN);
+	struct conn_info *con_info = conn_info_alloc();
 
 	if( NULL == con_info ){
 		rdlog(LOG_ERR,"Can't allocate conection context (out of memory?)");
 		return NULL; /* Doesn't have resources */
 	}
 
-	if ( !init_string(&con_info->str,string_size) ) {
+	/* Address string is shared with listener thread cache */
+	con_info->client_str = rb_addr_str_incref(client);
+	con_info->client = client->str;
+
+	if( 0 != conn_info_set_strings(con_info,topic,s_uuid) ) {
+		rdlog(LOG_ERR,"Can't allocate conection context (out of memory?)");
+		free_con_info(con_info);
+		return NULL; /* Doesn't have resources */
+	}
+
+	/* Small bodies are kept in request memory */
+	const size_t mem_free = sizeof(con_info->mem.buf) - con_info->mem.used;
+	char *mem = string_size <= mem_free ? conn_info_mem(con_info,mem_free) :
+		NULL;
+	if ( !init_string(&con_info->str,string_size,mem,mem_free) ) {
 		rdlog(LOG_ERR,"Can't allocate connection string buffer (out of memory?)");
 		free_con_info(con_info);
 		return NULL; /* Doesn't have resources */
 	}
+	if(con_info->str.buf && !con_info->str.inplace) {
+		con_info->heap_allocs++;
+	}
 
 	keyval_list_init(&con_info->decoder_params);
 
@@ -274,24 +556,59 @@ static struct conn_info *create_connection_info(size_t string_size,
 		RD_ARRAY_SIZE(con_info->decoder_opts),
 		&con_info->decoder_params);
 
-	con_info->zlib.enable = is_connection_gzip(connection);
-	if(con_info->zlib.enable) {
-		con_info->zlib.strm.zalloc = Z_NULL;
-		con_info->zlib.strm.zfree = Z_NULL;
-		con_info->zlib.strm.opaque = Z_NULL;
-		con_info->zlib.strm.avail_in = 0;
-		con_info->zlib.strm.next_in = Z_NULL;
-
-		const int rc = inflateInit(&con_info->zlib.strm);
-		if(rc != Z_OK) {
-			rdlog(LOG_ERR,"Couldn't init inflate. Error was %d: %s",rc,
-				zlib_error2str(rc));
-		}
+	if(rb_handlers) {
+		/* Connection takes the handlers */
+		con_info->rb_handlers = *rb_handlers;
+		memset(rb_handlers,0,sizeof(*rb_handlers));
+		con_info->rb_handlers_opt.key = RB_HTTP2K_HANDLERS_KEY;
+		con_info->rb_handlers_opt.value =
+			(const char *)(const void *)&con_info->rb_handlers;
+		add_key_value_pair(&con_info->decoder_params,
+			&con_info->rb_handlers_opt);
+	}
+
+	if(codec) {
+		con_info->codec.enable = 1;
+		con_info->codec.codec = *codec;
+		con_info->codec.stream = http_codec_stream_acquire(*codec);
 	}
 
 	return con_info;
 }
 
+/** Request buffer size to allocate upfront. Buffered requests body size is
+  taken from Content-Length, so it does not need to be reallocated.
+  @param h HTTP listener
+  @param connection Request connection
+  @param compressed Request body is compressed
+  @return Buffer size, 0 if request does not need buffer
+  */
+static size_t request_string_size(const struct http_private *h,
+                struct MHD_Connection *connection,int compressed) {
+	if(h->callback_flags & DECODER_F_SUPPORT_STREAMING) {
+		return 0;
+	}
+
+	const char *content_length = MHD_lookup_connection_value(connection,
+		MHD_HEADER_KIND,MHD_HTTP_HEADER_CONTENT_LENGTH);
+	if(NULL == content_length) {
+		/* Chunked request */
+		return STRING_INITIAL_SIZE;
+	}
+
+	char *endptr = NULL;
+	const unsigned long long len = strtoull(content_length,&endptr,10);
+	if(endptr == content_length || '\0' != *endptr) {
+		return STRING_INITIAL_SIZE;
+	}
+
+	/* Compressed body size is only a hint, buffer will grow if needed */
+	const unsigned long long size = compressed ? 2*len : len;
+	return size < STRING_INITIAL_SIZE ? STRING_INITIAL_SIZE :
+	       size > STRING_MAX_PRESIZE  ? STRING_MAX_PRESIZE :
+	       (size_t)size;
+}
+
 static int send_buffered_response(struct MHD_Connection *con,size_t sz,
                    char *buf,int buf_kind,unsigned int response_code,
                    int (*custom_response)(struct MHD_Response *)) {
@@ -342,31 +659,59 @@ static int send_http_bad_request(struct MHD_Connection *connection) {
 		MHD_HTTP_BAD_REQUEST,NULL);
 }
 
+static int send_http_unsupported_media_type(
+                                        struct MHD_Connection *connection) {
+	return send_buffered_response(connection,0,NULL,MHD_RESPMEM_PERSISTENT,
+		MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,NULL);
+}
+
+static int send_http_backpressure(struct MHD_Connection *connection,
+                unsigned int status_code,unsigned int retry_after) {
+	char retry_after_str[sizeof("4294967295")];
+	struct MHD_Response *http_response = MHD_create_response_from_buffer(
+		0,NULL,MHD_RESPMEM_PERSISTENT);
+
+	if(NULL == http_response) {
+		rdlog(LOG_CRIT,"Can't create HTTP response");
+		return MHD_NO;
+	}
+
+	snprintf(retry_after_str,sizeof(retry_after_str),"%u",retry_after);
+	MHD_add_response_header(http_response,MHD_HTTP_HEADER_RETRY_AFTER,
+		retry_after_str);
+
+	const int ret = MHD_queue_response(connection,status_code,http_response);
+	MHD_destroy_response(http_response);
+	return ret;
+}
+
 static size_t append_http_data_to_connection_data(struct conn_info *con_info,
 												  const char *upload_data,
 												  size_t upload_data_size) {
 
 	if( upload_data_size > string_free_space(&con_info->str) ) {
 		/* TODO error handling */
+		const char *old_buf = con_info->str.buf;
 		string_grow(&con_info->str,upload_data_size);
+		if(old_buf != con_info->str.buf) {
+			con_info->heap_allocs++;
+		}
 	}
 
 	size_t ncopy = smin(upload_data_size,string_free_space(&con_info->str));
-	strncpy(&con_info->str.buf[con_info->str.used],upload_data,ncopy);
+	memcpy(&con_info->str.buf[con_info->str.used],upload_data,ncopy);
 	con_info->str.used += ncopy;
 	return ncopy;
 }
 
 /* Return code: Valid prefix (i.e., /rbdata/)*/
-static int extract_rb_url_info(const char *url,size_t url_len,char *dst,
-								const char **uuid, const char **topic) {
-	assert(url);
+static int extract_rb_url_info(char *dst,const char **uuid,
+							const char **topic) {
 	assert(dst);
 	assert(uuid);
 	assert(topic);
 
 	char *aux=NULL;
-	memcpy(dst,url,url_len+1);
 
 	const char *rbdata = strtok_r(dst,"/",&aux);
 	const int invalid_rbdata = (NULL == rbdata) || strcmp(rbdata,"rbdata");
@@ -377,31 +722,32 @@ static int extract_rb_url_info(const char *url,size_t url_len,char *dst,
 	return !invalid_rbdata;
 }
 
-static const char *client_addr(char *buf, size_t buf_size,
-                            struct MHD_Connection *con_info) {
-	const union MHD_ConnectionInfo *cinfo = MHD_get_connection_info(con_info,
-	                                    MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-	if(NULL == cinfo || NULL == cinfo->client_addr) {
-		rdlog(LOG_WARNING,"Can't obtain client address info to print debug message.");
-		return NULL;
-	}
-
-	return sockaddr2str(buf, buf_size, cinfo->client_addr);
-}
-
-/// @TODO this should be in the decoder, not here
+/** Validate rb_http2k URL, and look up its sensor and topic.
+  @param con_info Connection
+  @param url Request URL
+  @param url_buf Buffer to tokenize URL, strlen(url)+1 bytes. Returned topic
+  and uuid point to it.
+  @param rb_database Database to look up sensor and topic
+  @param allok Set to 1 if request is valid, 0 if not
+  @param ret_topic Returned topic
+  @param ret_uuid Returned sensor uuid
+  @param handlers Returned topic and sensor handlers if request is valid
+  @param source Client address
+  @return Response queue result if request is not valid
+  @TODO this should be in the decoder, not here
+  */
 static int rb_http2k_validation(struct MHD_Connection *con_info,const char *url,
-							struct rb_database *rb_database, int *allok,
-							char **ret_topic,char **ret_uuid,const char *source) {
+		char *url_buf,struct rb_database *rb_database, int *allok,
+		const char **ret_topic,const char **ret_uuid,
+		struct rb_http2k_handlers *handlers,const char *source) {
 
 	/*
 	 * Need to validate that URL is valid:
 	 * POST https://<host>/<sensor_uuid>/<topic>
 	 */
 	const char *uuid=NULL,*topic=NULL;
-	const size_t url_len = strlen(url);
-	char my_url[url_len+1];
-	const int valid_prefix = extract_rb_url_info(url,url_len,my_url,&uuid,&topic);
+	strcpy(url_buf,url);
+	const int valid_prefix = extract_rb_url_info(url_buf,&uuid,&topic);
 
 	/// @TODO check uuid url/message equality
 	if(!valid_prefix || NULL == uuid || NULL == topic) {
@@ -423,122 +769,359 @@ static int rb_http2k_validation(struct MHD_Connection *con_info,const char *url,
 	rdlog(LOG_DEBUG,"Receiving message with uuid '%s' and topic '%s' from "
 		"client %s",uuid,topic,source);
 
-	const int valid_uuid = rb_http2k_validate_uuid(rb_database,uuid);
-	if(!valid_uuid) {
+	/* Only one database lookup, decoder session will use the handlers */
+	rb_http2k_database_get_topic_client(rb_database,topic,uuid,
+		&handlers->topic,&handlers->sensor);
+
+	if(NULL == handlers->sensor) {
 		rdlog(LOG_WARNING,"Received invalid uuid %s from %s. Closing connection.",uuid,
 			source);
 		*allok = 0;
 		return send_http_unauthorized(con_info);
 	}
 
-	if(NULL != topic) {
-		const int valid_topic = rb_http2k_validate_topic(&global_config.rb.database,topic);
-
-		if(!valid_topic) {
-			rdlog(LOG_WARNING,"Received topic %s from %s. Closing connection.",topic?topic:NULL,
-				source);
-			*allok = 0;
-			return send_http_forbidden(con_info);
-		}
-	} else {
-		rdlog(LOG_WARNING,"Received no topic in url [%s] from %s. Closing connection.",url,
+	if(NULL == handlers->topic) {
+		rdlog(LOG_WARNING,"Received topic %s from %s. Closing connection.",topic,
 			source);
+		rb_http2k_handlers_done(handlers);
 		*allok = 0;
-		return send_http_bad_request(con_info);
+		return send_http_forbidden(con_info);
 	}
 
 	*allok = 1;
+	*ret_topic = topic;
+	*ret_uuid = uuid;
 
-	if(ret_topic) {
-		*ret_topic = strdup(topic);
+	return MHD_YES;
+}
+
+/// Decompressed data destination
+struct decompress_output {
+	struct http_private *h;
+	struct conn_info *con_info;
+	/// Request body would exceed max_decompressed_body
+	int too_large;
+};
+
+/// Forward decompressed data to decoder, or to request buffer if decoder
+/// does not support streaming
+static void decompressed_data_cb(char *buf,size_t len,void *opaque) {
+	struct decompress_output *out = opaque;
+	struct http_private *h = out->h;
+	struct conn_info *con_info = out->con_info;
+
+	if(out->too_large) {
+		return;
+	} else if(!(h->callback_flags & DECODER_F_SUPPORT_STREAMING)) {
+		if(h->max_decompressed_body &&
+		    len > h->max_decompressed_body - con_info->str.used) {
+			out->too_large = 1;
+			return;
+		}
+		append_http_data_to_connection_data(con_info,buf,len);
+	} else {
+		/* Decoder does not own the buffer, so no need to copy */
+		decoder_call(h,con_info,buf,len,&con_info->decoder_sessp);
 	}
-	if(ret_uuid) {
-		*ret_uuid = strdup(uuid);
+}
+
+/** Decompress a request chunk, and send decompressed data to decoder or
+  request buffer
+  @param h HTTP listener
+  @param con_info Request
+  @param upload_data Compressed chunk
+  @param upload_data_size Chunk size
+  @return Consumed bytes. If stream is corrupted or body is too large, the
+  rest of the request is discarded and answered with an error
+  */
+static size_t decompress_upload_data(struct http_private *h,
+                struct conn_info *con_info,
+                const char *upload_data,size_t upload_data_size) {
+	static pthread_mutex_t last_warning_timestamp_mutex =
+		PTHREAD_MUTEX_INITIALIZER;
+	static time_t last_warning_timestamp = 0;
+	static const time_t threshold_s = 5*60;
+	struct decompress_output out = {.h = h, .con_info = con_info};
+	struct http_codec_stream *stream = con_info->codec.stream;
+	const enum http_codec_type codec = con_info->codec.codec;
+
+	if(NULL == stream) {
+		/* Stream failed before, or no resources: discard */
+		return upload_data_size;
+	}
+
+	const ssize_t rc = http_codec_decompress(stream,upload_data,
+		upload_data_size,decompressed_data_cb,&out,
+		&h->codec_stats[codec]);
+	if(rc >= 0 && !out.too_large) {
+		return (size_t)rc;
 	}
 
+	if(out.too_large) {
+		ATOMIC_OP(add,fetch,&h->codec_stats[codec].errors,1);
+		con_info->codec.status_code = MHD_HTTP_REQUEST_ENTITY_TOO_LARGE;
+	} else {
+		con_info->codec.status_code = MHD_HTTP_BAD_REQUEST;
+	}
+
+	pthread_mutex_lock(&last_warning_timestamp_mutex);
+	const time_t now = time(NULL);
+	const int warn = difftime(now,last_warning_timestamp) > threshold_s;
+	if(warn) {
+		last_warning_timestamp = now;
+	}
+	pthread_mutex_unlock(&last_warning_timestamp_mutex);
+
+	if(warn && out.too_large) {
+		rdlog(LOG_ERR,"Decompressed %s body from uuid %s (ip %s) is "
+			"larger than %zu bytes",http_codec_name(codec),
+			con_info->sensor_uuid,con_info->client,
+			h->max_decompressed_body);
+	} else if(warn) {
+		rdlog(LOG_ERR,"Error in %s compressed input from uuid %s "
+			"(ip %s): %s",http_codec_name(codec),con_info->sensor_uuid,
+			con_info->client,http_codec_stream_error(stream));
+	}
+
+	/* Rest of request will be discarded, and answered at its end */
+	http_codec_stream_release(stream);
+	con_info->codec.stream = NULL;
+	return upload_data_size;
+}
+
+static double monotonic_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+/*
+ *  DELIVERY ACKNOWLEDGEMENT
+ */
+
+/** Decide request answer, and queue it to be resumed. Need to hold ack lock.
+  @param h HTTP listener
+  @param con_info Pending request
+  @param status_code Answer
+  */
+static void delivery_ack_answer(struct http_private *h,
+                        struct conn_info *con_info,unsigned int status_code) {
+	const double latency = monotonic_now() - con_info->ack.start;
+
+	TAILQ_REMOVE(&h->ack.pending,con_info,ack.entry);
+	con_info->ack.state = CONN_ACK_ANSWERED;
+	con_info->ack.status_code = status_code;
+	TAILQ_INSERT_TAIL(&h->ack.answered,con_info,ack.entry);
+
+	switch(status_code) {
+	case MHD_HTTP_OK:
+		h->ack.delivered++;
+		break;
+	case MHD_HTTP_GATEWAY_TIMEOUT:
+		h->ack.timeouts++;
+		break;
+	default:
+		h->ack.failed++;
+		break;
+	};
+
+	h->ack.latency_sum += latency;
+	if(latency > h->ack.latency_max) {
+		h->ack.latency_max = latency;
+	}
+
+	pthread_cond_signal(&h->ack.cond);
+}
+
+/// All request messages have been reported by kafka
+static void delivery_ack_cb(size_t msgs,size_t failed,void *opaque) {
+	struct conn_info *con_info = opaque;
+	struct http_private *h = con_info->ack.h;
+	(void)msgs;
+
+	/* Connection can't be resumed here, kafka ack lock is held */
+	pthread_mutex_lock(&h->ack.lock);
+	if(CONN_ACK_PENDING == con_info->ack.state) {
+		delivery_ack_answer(h,con_info,failed ?
+			MHD_HTTP_SERVICE_UNAVAILABLE : MHD_HTTP_OK);
+	}
+	pthread_mutex_unlock(&h->ack.lock);
+}
+
+/// Prepare request to wait for its messages delivery
+static int delivery_ack_init(struct http_private *h,
+                                                struct conn_info *con_info) {
+	con_info->ack.h = h;
+	con_info->ack.kafka = kafka_delivery_ack_new(delivery_ack_cb,con_info);
+	con_info->heap_allocs++;
+	return con_info->ack.kafka ? 0 : -1;
+}
+
+/** Request completely received. Process it and suspend connection until
+  kafka reports all its messages, or answer it if that has already happened
+  @param h HTTP listener
+  @param connection Request connection
+  @param con_info Request
+  @return MHD_YES or response queue result
+  */
+static int delivery_ack_handle(struct http_private *h,
+                struct MHD_Connection *connection,struct conn_info *con_info) {
+	if(CONN_ACK_ANSWERED == con_info->ack.state) {
+		/* Resumed */
+		return send_buffered_response(connection,0,NULL,
+			MHD_RESPMEM_PERSISTENT,con_info->ack.status_code,NULL);
+	}
+
+	decode_request_end(h,con_info);
+
+	pthread_mutex_lock(&h->ack.lock);
+	if(h->ack.stop) {
+		pthread_mutex_unlock(&h->ack.lock);
+		return send_buffered_response(connection,0,NULL,
+			MHD_RESPMEM_PERSISTENT,MHD_HTTP_SERVICE_UNAVAILABLE,NULL);
+	}
+
+	con_info->ack.state = CONN_ACK_PENDING;
+	con_info->ack.connection = connection;
+	con_info->ack.start = monotonic_now();
+	con_info->ack.deadline = con_info->ack.start + h->ack.timeout;
+	if(TAILQ_EMPTY(&h->ack.pending)) {
+		/* Thread needs to know the new deadline */
+		pthread_cond_signal(&h->ack.cond);
+	}
+	TAILQ_INSERT_TAIL(&h->ack.pending,con_info,ack.entry);
+	MHD_suspend_connection(connection);
+	pthread_mutex_unlock(&h->ack.lock);
+
+	/* May answer it right now, if all messages are already reported */
+	kafka_delivery_ack_seal(con_info->ack.kafka);
 	return MHD_YES;
 }
 
-static size_t compressed_callback(struct http_private * cls,
-                struct conn_info *con_info,
-                const char *upload_data,size_t upload_data_size) {
-	static pthread_mutex_t last_zlib_warning_timestamp_mutex = PTHREAD_MUTEX_INITIALIZER;
-	time_t last_zlib_warning_timestamp = 0;
-	size_t rc = 0;
-
-	/* Ugly hack, assignement discard const qualifier */
-	memcpy(&con_info->zlib.strm.next_in,&upload_data,sizeof(upload_data));
-	con_info->zlib.strm.avail_in = upload_data_size;
-
-	unsigned char *buffer = malloc(ZLIB_CHUNK);
-
-	/* run inflate until output buffer not full */
-	do {
-		/* Reset counters */
-		con_info->zlib.strm.next_out = buffer;
-		con_info->zlib.strm.avail_out = ZLIB_CHUNK;
-
-		const int ret = inflate(&con_info->zlib.strm, Z_NO_FLUSH /* TODO compare different flush */);
-		if(ret != Z_OK && ret != Z_STREAM_END) {
-			static const time_t threshold_s = 5*60;
-
-			pthread_mutex_lock(&last_zlib_warning_timestamp_mutex);
-			const time_t now = time(NULL);
-			const int warn = difftime(now,last_zlib_warning_timestamp) > threshold_s;
-			pthread_mutex_unlock(&last_zlib_warning_timestamp_mutex);
-
-			if(warn) {
-				switch(ret) {
-				case Z_STREAM_ERROR:
-					rdlog(LOG_ERR,"Input from uuid %s (ip %s) is not a valid zlib stream",
-						con_info->sensor_uuid,con_info->client);
-					break;
-
-				case Z_NEED_DICT:
-					rdlog(LOG_ERR,"Need unkown dict in input stream from %s(%s)",
-						con_info->sensor_uuid,con_info->client);
-					break;
-
-				case Z_DATA_ERROR:
-					rdlog(LOG_ERR,"Error in compressed input from %s(%s)",
-						con_info->sensor_uuid,con_info->client);
-					break;
-
-				case Z_MEM_ERROR:
-					rdlog(LOG_ERR,"Memory error, couldn't allocate memory for %s(%s)",
-						con_info->sensor_uuid,con_info->client);
-					break;
-
-				case Z_OK:
-				case Z_STREAM_END:
-					/* All ok, keep working */
-					break;
-
-				default:
-					rdlog(LOG_ERR, "Unknown error: inflate returned %d for %s uuid (%s ip)",ret,
-						con_info->sensor_uuid,con_info->client);
-					break;
-				};
+static void *delivery_ack_thread(void *_h) {
+	struct http_private *h = _h;
+	TAILQ_HEAD(,conn_info) resume = TAILQ_HEAD_INITIALIZER(resume);
+	struct conn_info *con_info = NULL;
+
+	pthread_mutex_lock(&h->ack.lock);
+	while(1) {
+		const double now = monotonic_now();
+		/* Same timeout for all, so pending queue is sorted by deadline */
+		while((con_info = TAILQ_FIRST(&h->ack.pending)) &&
+		                (h->ack.stop || con_info->ack.deadline <= now)) {
+			delivery_ack_answer(h,con_info,h->ack.stop ?
+				MHD_HTTP_SERVICE_UNAVAILABLE :
+				MHD_HTTP_GATEWAY_TIMEOUT);
+		}
+
+		if(!TAILQ_EMPTY(&h->ack.answered)) {
+			TAILQ_CONCAT(&resume,&h->ack.answered,ack.entry);
+			pthread_mutex_unlock(&h->ack.lock);
+			while((con_info = TAILQ_FIRST(&resume))) {
+				/* con_info can be freed as soon as resumed */
+				TAILQ_REMOVE(&resume,con_info,ack.entry);
+				MHD_resume_connection(con_info->ack.connection);
 			}
+			pthread_mutex_lock(&h->ack.lock);
+			continue;
+		}
 
-			inflateEnd(&con_info->zlib.strm);
-			break; // @TODO send HTTP error!
+		if(h->ack.stop) {
+			break;
 		}
 
-		const size_t zprocessed = ZLIB_CHUNK - con_info->zlib.strm.avail_out;
-		rc += zprocessed; // @TODO this should be returned by callback call
-		if(zprocessed > 0) {
-			cls->callback((char *)buffer,zprocessed,
-				&con_info->decoder_params,cls->callback_opaque,
-				&con_info->decoder_sessp);
+		con_info = TAILQ_FIRST(&h->ack.pending);
+		if(NULL == con_info) {
+			pthread_cond_wait(&h->ack.cond,&h->ack.lock);
+		} else {
+			const double deadline = con_info->ack.deadline;
+			struct timespec ts;
+			ts.tv_sec = (time_t)deadline;
+			ts.tv_nsec = (long)((deadline - (double)ts.tv_sec)*1e9);
+			pthread_cond_timedwait(&h->ack.cond,&h->ack.lock,&ts);
 		}
-	} while(con_info->zlib.strm.avail_out == 0);
+	}
+	pthread_mutex_unlock(&h->ack.lock);
+
+	return NULL;
+}
+
+/** Start delivery acknowledgement thread
+  @param h HTTP listener
+  @param timeout_ms Max wait for delivery reports
+  @return 0 if success, -1 if not
+  */
+static int start_delivery_ack(struct http_private *h,int timeout_ms) {
+	pthread_condattr_t cond_attr;
+
+	h->ack.timeout = timeout_ms/1000.;
+	TAILQ_INIT(&h->ack.pending);
+	TAILQ_INIT(&h->ack.answered);
+	pthread_mutex_init(&h->ack.lock,NULL);
+	pthread_condattr_init(&cond_attr);
+	/* Deadlines are monotonic */
+	pthread_condattr_setclock(&cond_attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&h->ack.cond,&cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	const int rc = pthread_create(&h->ack.thread,NULL,delivery_ack_thread,h);
+	if(0 != rc) {
+		rdlog(LOG_ERR,"Can't create HTTP delivery ack thread: %s",
+			strerror(rc));
+		pthread_cond_destroy(&h->ack.cond);
+		pthread_mutex_destroy(&h->ack.lock);
+		return -1;
+	}
+
+	h->ack.enabled = 1;
+	return 0;
+}
+
+/// Answer all pending requests and stop delivery acknowledgement thread.
+/// New requests will be answered with 503.
+static void stop_delivery_ack(struct http_private *h) {
+	if(!h->ack.enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&h->ack.lock);
+	h->ack.stop = 1;
+	pthread_cond_signal(&h->ack.cond);
+	pthread_mutex_unlock(&h->ack.lock);
+	pthread_join(h->ack.thread,NULL);
+}
+
+/// Release delivery acknowledgement resources. Daemons must be stopped.
+static void delivery_ack_done(struct http_private *h) {
+	if(!h->ack.enabled) {
+		return;
+	}
+
+	pthread_cond_destroy(&h->ack.cond);
+	pthread_mutex_destroy(&h->ack.lock);
+}
 
-	/* Do not want to waste memory */
-	free(buffer);
-	con_info->zlib.strm.next_out = NULL;
+/** Pin libmicrohttpd thread to its CPU. We can't know when daemon creates
+  threads, so we pin them in their first request
+  @param h HTTP listener
+  */
+static void pin_http_thread(struct http_private *h) {
+	static __thread int thread_pinned = 0;
+	char thread_name[64];
 
-	return upload_data_size - con_info->zlib.strm.avail_in;
+	if(thread_pinned) {
+		return;
+	}
+
+	thread_pinned = 1;
+	if(0 == h->affinity.cpus_count) {
+		return;
+	}
+
+	const size_t idx = ATOMIC_OP(add,fetch,&h->pinned_threads,1) - 1;
+	snprintf(thread_name,sizeof(thread_name),"Listener %d HTTP thread %zu",
+		h->port,idx);
+	cpu_affinity_pin_thread(&h->affinity,idx,thread_name);
 }
 
 static int post_handle(void *_cls,
@@ -554,6 +1137,8 @@ static int post_handle(void *_cls,
 	assert(HTTP_PRIVATE_MAGIC == cls->magic);
 #endif
 
+	pin_http_thread(cls);
+
 	if (0 != strcmp(method, MHD_HTTP_METHOD_POST)) {
 		rdlog(LOG_WARNING,"Received invalid method %s. "
 			"Returning METHOD NOT ALLOWED.",method);
@@ -565,44 +1150,87 @@ static int post_handle(void *_cls,
 	}
 
 	if ( NULL == *ptr ) {
-		char client_buf[BUFSIZ];
-		const char *client = client_addr(client_buf,sizeof(client_buf),connection);
-		if(NULL == client) {
+		const union MHD_ConnectionInfo *cinfo = MHD_get_connection_info(
+			connection,MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+		if(NULL == cinfo || NULL == cinfo->client_addr) {
+			rdlog(LOG_WARNING,"Can't obtain client address info.");
 			return MHD_NO;
 		}
+
+		if(!client_addr_allowed(cinfo->client_addr)) {
+			return send_http_forbidden(connection);
+		}
+
+		/* Reject before the body is read if kafka can't keep up */
+		const unsigned int retry_after = backpressure_check(
+			&cls->backpressure);
+		if(retry_after) {
+			return send_http_backpressure(connection,
+				cls->backpressure.config.status_code,retry_after);
+		}
+
+		struct rb_addr_str *client_str = rb_addr_cache_get(
+			cinfo->client_addr);
+		if(NULL == client_str) {
+			return MHD_NO;
+		}
+		const char *client = client_str->str;
+
+		enum http_codec_type codec;
+		const char *content_encoding = MHD_lookup_connection_value(
+			connection,MHD_HEADER_KIND,
+			MHD_HTTP_HEADER_CONTENT_ENCODING);
+		const int codec_rc = http_codec_find(content_encoding,&codec);
+		if(codec_rc < 0) {
+			rdlog(LOG_WARNING,"Received unsupported Content-Encoding %s "
+				"from %s. Returning UNSUPPORTED MEDIA TYPE.",
+				content_encoding,client);
+			return send_http_unsupported_media_type(connection);
+		}
+
 		/* First message of connection */
-		char *topic = NULL,*uuid=NULL;
+		const char *topic = NULL,*uuid=NULL;
+		struct rb_http2k_handlers rb_handlers = {NULL,NULL};
+		char url_buf[cls->redborder_uri ? strlen(url)+1 : 1];
 		if (cls->redborder_uri) {
 			int aok = 1;
-			const int rc = rb_http2k_validation(connection,url,
-				&global_config.rb.database,&aok,&topic,&uuid,client);
+			const int rc = rb_http2k_validation(connection,url,url_buf,
+				&global_config.rb.database,&aok,&topic,&uuid,
+				&rb_handlers,client);
 			if(0 == aok) {
-				free(topic);
-				free(uuid);
 				return rc;
 			}
 		}
-		*ptr = create_connection_info(STRING_INITIAL_SIZE,topic,client,uuid,
-			connection);
-		free(topic);
-		free(uuid);
+		const size_t string_size = request_string_size(cls,connection,
+			0 == codec_rc);
+		*ptr = create_connection_info(string_size,topic,client_str,
+			uuid,cls->redborder_uri ? &rb_handlers : NULL,
+			0 == codec_rc ? &codec : NULL);
+		if(*ptr && cls->ack.enabled && 0 != delivery_ack_init(cls,*ptr)) {
+			free_con_info(*ptr);
+			*ptr = NULL;
+		}
+		if(*ptr && 0 == codec_rc) {
+			ATOMIC_OP(add,fetch,&cls->codec_stats[codec].requests,1);
+		}
+		/* Only if connection creation failed */
+		rb_http2k_handlers_done(&rb_handlers);
 		return (NULL == *ptr) ? MHD_NO : MHD_YES;
 	} else if ( *upload_data_size > 0 ) {
 		/* middle calls, process string sent */
 		struct conn_info *con_info = *ptr;
 		size_t rc;
-		if(!cls->callback_flags & DECODER_F_SUPPORT_STREAMING) {
+		if (con_info->codec.enable) {
+			/* We will decompress & process until end of received chunk */
+			rc = decompress_upload_data(cls,con_info,upload_data,
+				*upload_data_size);
+		} else if(!(cls->callback_flags & DECODER_F_SUPPORT_STREAMING)) {
 			/* Does not support stream, we need to allocate a big buffer */
 			rc = append_http_data_to_connection_data(con_info,
 			                                upload_data,*upload_data_size);
-		} else if (con_info->zlib.enable) {
-			/* Does support streaming, we will decompress & process until */
-			/* end of received chunk */
-			rc = compressed_callback(cls,con_info,upload_data,*upload_data_size);
 		} else {
 			/* Does support streaming processing, sending the chunk */
-			cls->callback(upload_data,*upload_data_size,
-				&con_info->decoder_params,cls->callback_opaque,
+			decoder_call(cls,con_info,upload_data,*upload_data_size,
 				&con_info->decoder_sessp);
 			/// @TODO fix it
 			rc = *upload_data_size;
@@ -610,6 +1238,14 @@ static int post_handle(void *_cls,
 		(*upload_data_size) -= rc;
 		return (*upload_data_size != 0) ? MHD_NO : MHD_YES;
 
+	} else if(((const struct conn_info *)*ptr)->codec.status_code) {
+		/* Corrupted or too large compressed body */
+		const struct conn_info *con_info = *ptr;
+		return send_buffered_response(connection,0,NULL,
+			MHD_RESPMEM_PERSISTENT,con_info->codec.status_code,NULL);
+	} else if(cls->ack.enabled) {
+		/* Answer when kafka reports messages delivery */
+		return delivery_ack_handle(cls,connection,*ptr);
 	} else {
 		/* Send OK. Resources will be freed in request_completed */
 		return send_http_ok(connection);
@@ -620,6 +1256,7 @@ struct http_loop_args {
 	const char *mode;
 	int port;
 	int num_threads;
+	int num_daemons;
 	struct{
 		int connection_memory_limit;
 		int connection_limit;
@@ -627,8 +1264,25 @@ struct http_loop_args {
 		int per_ip_connection_limit;
 	}server_parameters;
 	int redborder_uri;
+	const char *cpu_affinity;
+	int numa_node;
+	struct backpressure_config backpressure;
+	struct {
+		int enabled;
+		int timeout_ms;
+	} delivery_ack;
+	json_int_t max_decompressed_body;
 };
 
+/// Stop all listener started daemons
+static void stop_http_daemons(struct http_private *h) {
+	size_t i;
+
+	for(i=0;i<h->num_daemons;++i) {
+		MHD_stop_daemon(h->daemons[i]);
+	}
+}
+
 static struct http_private *start_http_loop(const struct http_loop_args *args,
             decoder_callback callback,int callback_flags,void *cb_opaque) {
 	struct http_private *h = NULL;
@@ -652,7 +1306,35 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 
 	flags |= MHD_USE_DEBUG;
 
-	h = calloc(1,sizeof(*h));
+	if(args->num_daemons < 1) {
+		rdlog(LOG_ERR,"HTTP num_daemons must be at least 1");
+		return NULL;
+	}
+
+	if(args->num_daemons > 1 && (flags & MHD_USE_THREAD_PER_CONNECTION)) {
+		rdlog(LOG_ERR,"HTTP num_daemons can't be used in "
+			MODE_THREAD_PER_CONNECTION " mode");
+		return NULL;
+	}
+
+	if(args->delivery_ack.enabled) {
+		if(flags & MHD_USE_THREAD_PER_CONNECTION) {
+			rdlog(LOG_ERR,"HTTP delivery_ack can't be used in "
+				MODE_THREAD_PER_CONNECTION " mode");
+			return NULL;
+		}
+
+		if(args->delivery_ack.timeout_ms <= 0) {
+			rdlog(LOG_ERR,"HTTP delivery_ack_timeout_ms must be "
+				"positive");
+			return NULL;
+		}
+
+		/* Connections wait for delivery reports suspended */
+		flags |= MHD_USE_SUSPEND_RESUME;
+	}
+
+	h = calloc(1,sizeof(*h) + (size_t)args->num_daemons*sizeof(h->daemons[0]));
 	if(!h) {
 		rdlog(LOG_ERR,"Can't allocate LIBMICROHTTPD private"
 		         " (out of memory?)");
@@ -665,6 +1347,26 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 	h->callback_flags = callback_flags;
 	h->callback_opaque = cb_opaque;
 	h->redborder_uri = args->redborder_uri;
+	h->port = args->port;
+	h->max_decompressed_body = (size_t)args->max_decompressed_body;
+	if(0 != cpu_affinity_init(&h->affinity,args->cpu_affinity,
+	                                                    args->numa_node)) {
+		free(h);
+		return NULL;
+	}
+	backpressure_init(&h->backpressure,h->port,&args->backpressure);
+	if(args->delivery_ack.enabled && 0 != start_delivery_ack(h,
+	                                        args->delivery_ack.timeout_ms)) {
+		cpu_affinity_done(&h->affinity);
+		backpressure_done(&h->backpressure);
+		free(h);
+		return NULL;
+	}
+
+	/* Connection limit is for the whole listener */
+	const int daemon_connection_limit =
+		(args->server_parameters.connection_limit + args->num_daemons - 1)
+		/ args->num_daemons;
 
 	struct MHD_OptionItem opts[] = {
 		{MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&request_completed, h},
@@ -673,8 +1375,7 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 		{MHD_OPTION_NONCE_NC_SIZE, 0, NULL},
 
 		/* Max number of concurrent onnections */
-		{MHD_OPTION_CONNECTION_LIMIT,
-			args->server_parameters.connection_limit, NULL},
+		{MHD_OPTION_CONNECTION_LIMIT,daemon_connection_limit,NULL},
 
 		/* Max number of connections per IP */
 		{MHD_OPTION_PER_IP_CONNECTION_LIMIT,
@@ -691,31 +1392,104 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 		/* Thread pool size */
 		{MHD_OPTION_THREAD_POOL_SIZE, args->num_threads, NULL},
 
+		/* Every daemon binds its own socket with SO_REUSEPORT. Only
+		   passed if needed, older libmicrohttpd does not know it */
+		{args->num_daemons > 1 ? MHD_OPTION_LISTENING_ADDRESS_REUSE :
+			MHD_OPTION_END, 1, NULL},
+
 		{ MHD_OPTION_END, 0, NULL }
 	};
 
-	h->d = MHD_start_daemon(flags,
-		args->port,
-		NULL, /* Auth callback */
-		NULL, /* Auth callback parameter */
-		post_handle, /* Request handler */
-		h, /* Request handler parameter */
-		MHD_OPTION_ARRAY, opts,
-		MHD_OPTION_END);
-
-	if(NULL == h->d) {
-		rdlog(LOG_ERR,"Can't allocate LIBMICROHTTPD handler"
-		         " (out of memory?)");
-		free(h);
-		return NULL;
+	for(h->num_daemons=0;h->num_daemons<(size_t)args->num_daemons;
+	                                                        ++h->num_daemons) {
+		struct MHD_Daemon *d = MHD_start_daemon(flags,
+			args->port,
+			NULL, /* Auth callback */
+			NULL, /* Auth callback parameter */
+			post_handle, /* Request handler */
+			h, /* Request handler parameter */
+			MHD_OPTION_ARRAY, opts,
+			MHD_OPTION_END);
+
+		if(NULL == d) {
+			rdlog(LOG_ERR,"Can't allocate LIBMICROHTTPD handler %zu"
+			         " (out of memory or port in use?)",h->num_daemons);
+			stop_delivery_ack(h);
+			stop_http_daemons(h);
+			delivery_ack_done(h);
+			cpu_affinity_done(&h->affinity);
+			backpressure_done(&h->backpressure);
+			free(h);
+			return NULL;
+		}
+
+		h->daemons[h->num_daemons] = d;
+	}
+
+	if(h->num_daemons > 1) {
+		rdlog(LOG_INFO,"Listener %d: %zu HTTP daemons sharing port",
+			h->port,h->num_daemons);
 	}
 
 	return h;
 }
 
+/// Log listener Content-Encoding counters
+static void log_http_codec_stats(struct http_private *h) {
+	size_t i;
+
+	for(i=0;i<HTTP_CODEC_MAX;++i) {
+		struct http_codec_stats *stats = &h->codec_stats[i];
+		const uint64_t requests = ATOMIC_OP(fetch,add,&stats->requests,0);
+		if(0 == requests) {
+			continue;
+		}
+
+		rdlog(LOG_INFO,"Listener %d %s requests: %"PRIu64", bytes in: "
+			"%"PRIu64", bytes out: %"PRIu64", errors: %"PRIu64,
+			h->port,http_codec_name((enum http_codec_type)i),requests,
+			ATOMIC_OP(fetch,add,&stats->bytes_in,0),
+			ATOMIC_OP(fetch,add,&stats->bytes_out,0),
+			ATOMIC_OP(fetch,add,&stats->errors,0));
+	}
+}
+
+/// Log listener delivery acknowledgement counters
+static void log_delivery_ack_stats(struct http_private *h) {
+	if(!h->ack.enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&h->ack.lock);
+	const uint64_t answered = h->ack.delivered + h->ack.failed +
+		h->ack.timeouts;
+	rdlog(LOG_INFO,"Listener %d delivery acks: %"PRIu64" delivered, "
+		"%"PRIu64" failed, %"PRIu64" timed out, latency avg %.3fs "
+		"max %.3fs",h->port,h->ack.delivered,h->ack.failed,
+		h->ack.timeouts,answered ? h->ack.latency_sum/(double)answered : 0,
+		h->ack.latency_max);
+	pthread_mutex_unlock(&h->ack.lock);
+}
+
+/// Log listener request heap allocations
+static void log_http_alloc_stats(struct http_private *h) {
+	const uint64_t requests = ATOMIC_OP(fetch,add,&h->alloc_stats.requests,0);
+	const uint64_t heap_allocs = ATOMIC_OP(fetch,add,
+		&h->alloc_stats.heap_allocs,0);
+
+	rdlog(LOG_DEBUG,"Listener %d heap allocations per request: %.2f "
+		"(%"PRIu64" allocations, %"PRIu64" requests)",h->port,
+		requests ? (double)heap_allocs/(double)requests : 0,heap_allocs,
+		requests);
+}
+
 static void reload_listener_http(json_t *new_config,
                 decoder_listener_opaque_reload opaque_reload,
-                void *cb_opaque, void *_private __attribute__((unused))) {
+                void *cb_opaque, void *_private) {
+	log_http_codec_stats(_private);
+	log_delivery_ack_stats(_private);
+	log_http_alloc_stats(_private);
+
 	if(opaque_reload){
 		rdlog(LOG_INFO,"Reloading opaque");
 		opaque_reload(new_config,cb_opaque);
@@ -726,7 +1500,15 @@ static void reload_listener_http(json_t *new_config,
 
 static void break_http_loop(void *_h){
 	struct http_private *h = _h;
-	MHD_stop_daemon(h->d);
+	/* Suspended connections must be resumed before stopping daemons */
+	stop_delivery_ack(h);
+	stop_http_daemons(h);
+	log_http_codec_stats(h);
+	log_delivery_ack_stats(h);
+	log_http_alloc_stats(h);
+	delivery_ack_done(h);
+	cpu_affinity_done(&h->affinity);
+	backpressure_done(&h->backpressure);
 	free(h);
 }
 
@@ -741,11 +1523,16 @@ struct listener *create_http_listener(struct json_t *config,
 	/* Default arguments */
 
 	handler_args.num_threads = 1;
+	handler_args.num_daemons = 1;
 	handler_args.mode = MODE_SELECT;
 	handler_args.server_parameters.connection_memory_limit = 128*1024;
 	handler_args.server_parameters.connection_limit = 1024;
 	handler_args.server_parameters.connection_timeout = 30;
 	handler_args.server_parameters.per_ip_connection_limit = 0;
+	handler_args.numa_node = CPU_AFFINITY_NO_NUMA_NODE;
+	handler_args.delivery_ack.timeout_ms = DELIVERY_ACK_DEFAULT_TIMEOUT_MS;
+	handler_args.max_decompressed_body =
+				HTTP_CODEC_MAX_DECOMPRESSED_BODY_DEFAULT;
 
 	/* Unpacking */
 
@@ -754,14 +1541,21 @@ struct listener *create_http_listener(struct json_t *config,
 			"s:i," /* port */
 			"s?s," /* mode */
 			"s?i," /* num_threads */
+			"s?i," /* num_daemons */
 			"s?b," /* redborder_uri */
 			"s?i," /* connection_memory_limit */
 			"s?i," /* connection_limit */
 			"s?i," /* connection_timeout */
-			"s?i"  /* per_ip_connection_limit */
+			"s?i," /* per_ip_connection_limit */
+			"s?s," /* cpu_affinity */
+			"s?i," /* numa_node */
+			"s?b," /* delivery_ack */
+			"s?i," /* delivery_ack_timeout_ms */
+			"s?I"  /* max_decompressed_body */
 		"}",
 		"port",&handler_args.port,"mode",&handler_args.mode,
 		"num_threads",&handler_args.num_threads,
+		"num_daemons",&handler_args.num_daemons,
 		"redborder_uri",&handler_args.redborder_uri,
 		"connection_memory_limit",
 			&handler_args.server_parameters.connection_memory_limit,
@@ -770,13 +1564,27 @@ struct listener *create_http_listener(struct json_t *config,
 		"connection_timeout",
 			&handler_args.server_parameters.connection_timeout,
 		"per_ip_connection_limit",
-			&handler_args.server_parameters.per_ip_connection_limit);
+			&handler_args.server_parameters.per_ip_connection_limit,
+		"cpu_affinity",&handler_args.cpu_affinity,
+		"numa_node",&handler_args.numa_node,
+		"delivery_ack",&handler_args.delivery_ack.enabled,
+		"delivery_ack_timeout_ms",&handler_args.delivery_ack.timeout_ms,
+		"max_decompressed_body",&handler_args.max_decompressed_body);
 
 	if( unpack_rc != 0 /* Failure */ ) {
 		rdlog(LOG_ERR,"Can't parse HTTP options: %s",error.text);
 		return NULL;
 	}
 
+	if(handler_args.max_decompressed_body < 0) {
+		rdlog(LOG_ERR,"HTTP max_decompressed_body can't be negative");
+		return NULL;
+	}
+
+	if(0 != backpressure_config_parse(&handler_args.backpressure,config)) {
+		return NULL;
+	}
+
 	struct http_private *priv = start_http_loop(&handler_args,cb,cb_flags,
 	                                                           cb_opaque);
 	if( NULL == priv ) {
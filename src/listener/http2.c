@@ -0,0 +1,1420 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* accept4 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_LIBNGHTTP2
+
+#include "http2.h"
+#include "http_codec.h"
+#include "backpressure.h"
+#include "engine/rb_addr.h"
+#include "util/cpu_affinity.h"
+#include "util/kafka.h"
+#include "util/util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+#include <nghttp2/nghttp2.h>
+#include <ev.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define HTTP2_MAX_THREADS 256
+/// Socket read size
+#define HTTP2_READ_BUFFER_SIZE (64*1024)
+/// Initial body buffer of non streaming decoders requests
+#define HTTP2_BODY_INITIAL_SIZE 2048
+#define ERROR_BUFFER_SIZE 256
+/// Default max wait for delivery reports, in milliseconds
+#define HTTP2_DELIVERY_ACK_DEFAULT_TIMEOUT_MS 10000
+
+struct http2_worker;
+struct http2_connection;
+
+/// Request stream
+struct http2_stream {
+	/// Stream id
+	int32_t id;
+	/// Stream connection
+	struct http2_connection *conn;
+	/// Request method is POST
+	int post;
+	/// Response status if request has been answered, 0 if not yet
+	unsigned int status;
+	/// Retry-After of response, if rejected because of backpressure
+	unsigned int retry_after;
+	/// Request path. Tokenized if listener check redborder URI
+	char *path;
+	/// Content-Encoding lookup result, as http_codec_find
+	int codec_rc;
+
+	/// Request has been accepted and sent to decoder
+	int decoder_started;
+	/// Decoders parameters
+	keyval_list_t decoder_params;
+	/// Memory pool for decoder_params
+	struct pair decoder_opts[3];
+	/// rb_http2k topic and sensor. Decoder session takes them.
+	struct rb_http2k_handlers rb_handlers;
+	/// decoder_params entry pointing to rb_handlers
+	struct pair rb_handlers_opt;
+	/// Decoder session pointer
+	void *decoder_sessp;
+
+	/// Content-Encoding decompression
+	struct {
+		enum http_codec_type codec;
+		/// Codec stream. NULL if not compressed or stream failed
+		struct http_codec_stream *stream;
+	} codec;
+
+	/// Request body, if decoder does not support streaming
+	struct {
+		char *buf;
+		size_t used,allocated;
+	} body;
+
+	/// Answer when all request messages are delivered to kafka
+	struct {
+		/// Kafka delivery acknowledgement. NULL if not enabled
+		struct kafka_delivery_ack *kafka;
+		/// Request ended, waiting for delivery reports
+		int pending;
+		/// Answered by kafka and queued in worker. Protected by its lock
+		int queued;
+		unsigned int status_code;
+		/// Max wait for delivery reports
+		ev_timer w_timeout;
+		TAILQ_ENTRY(http2_stream) entry;
+	} ack;
+
+	LIST_ENTRY(http2_stream) entry;
+};
+
+/// HTTP/2 connection
+struct http2_connection {
+	int fd;
+	struct http2_worker *worker;
+	nghttp2_session *session;
+	/// Client address string
+	struct rb_addr_str *client_str;
+	ev_io w_read,w_write;
+	/// Idle timeout
+	ev_timer w_timeout;
+	/// Output got from nghttp2 and not sent yet
+	const uint8_t *wbuf;
+	size_t wbuf_len;
+	/// Open streams
+	LIST_HEAD(,http2_stream) streams;
+	LIST_ENTRY(http2_connection) entry;
+};
+
+/// Listener thread. Every one has its own socket and event loop
+struct http2_worker {
+	struct http2_listener *listener;
+	size_t idx;
+	int listen_fd;
+	pthread_t thread;
+	struct ev_loop *loop;
+	ev_io w_accept;
+	ev_async w_stop;
+	/// Socket read buffer
+	uint8_t *rbuf;
+	LIST_HEAD(,http2_connection) connections;
+
+	/// Streams answered by kafka delivery reports, to answer in this thread
+	struct {
+		pthread_mutex_t lock;
+		TAILQ_HEAD(,http2_stream) answered;
+		ev_async w_answered;
+	} ack;
+};
+
+struct http2_listener {
+	int port;
+	/// Check redborder-style URI
+	int redborder_uri;
+	decoder_callback callback;
+	void *callback_opaque;
+	int callback_flags;
+
+	/// SETTINGS_MAX_CONCURRENT_STREAMS
+	uint32_t max_concurrent_streams;
+	/// Stream and connection flow control windows
+	int32_t initial_window_size,connection_window_size;
+	/// Idle connection timeout
+	ev_tstamp connection_timeout;
+	struct cpu_affinity affinity;
+	nghttp2_session_callbacks *callbacks;
+	/// Reject new streams if kafka producer can't keep up
+	struct backpressure backpressure;
+	/// Answer streams when their messages are delivered to kafka
+	struct {
+		int enabled;
+		/// Max wait for delivery reports, in seconds
+		ev_tstamp timeout;
+		/// Answered streams. Updated atomically
+		uint64_t delivered,failed,timeouts;
+	} ack;
+
+	/// Counters. Updated atomically
+	struct {
+		uint64_t connections,streams,rejected_streams,bytes;
+	} stats;
+	struct http_codec_stats codec_stats[HTTP_CODEC_MAX];
+	/// Max decompressed body of non streaming decoders requests. 0 means
+	/// no limit
+	size_t max_decompressed_body;
+
+	size_t num_workers;
+	struct http2_worker workers[];
+};
+
+static __thread char errbuf[ERROR_BUFFER_SIZE];
+
+/*
+ *  STREAMS
+ */
+
+static struct http2_listener *connection_listener(
+                                        const struct http2_connection *conn) {
+	return conn->worker->listener;
+}
+
+static int decoder_support_streaming(const struct http2_listener *l) {
+	return l->callback_flags & DECODER_F_SUPPORT_STREAMING;
+}
+
+static void prepare_decoder_params(struct http2_connection *conn,
+                                        struct http2_stream *stream,
+                                        const char *topic,const char *uuid) {
+	struct pair *mem = stream->decoder_opts;
+
+	keyval_list_init(&stream->decoder_params);
+	mem[0].key   = "topic";
+	mem[0].value = topic;
+	mem[1].key   = "sensor_uuid";
+	mem[1].value = uuid;
+	mem[2].key   = "client_ip";
+	mem[2].value = conn->client_str->str;
+
+	add_key_value_pair(&stream->decoder_params,&mem[0]);
+	add_key_value_pair(&stream->decoder_params,&mem[1]);
+	add_key_value_pair(&stream->decoder_params,&mem[2]);
+
+	if(stream->rb_handlers.topic) {
+		stream->rb_handlers_opt.key = RB_HTTP2K_HANDLERS_KEY;
+		stream->rb_handlers_opt.value =
+			(const char *)(const void *)&stream->rb_handlers;
+		add_key_value_pair(&stream->decoder_params,
+			&stream->rb_handlers_opt);
+	}
+}
+
+/** Answer stream request. Rest of request data will be discarded.
+  @param conn Connection
+  @param stream Stream
+  @param status HTTP status
+  @return 0 if success, nghttp2 error if not
+  */
+static int stream_respond(struct http2_connection *conn,
+                        struct http2_stream *stream,unsigned int status) {
+	static char status_name[] = ":status";
+	static char allow_name[] = "allow";
+	static char allow_value[] = "POST";
+	static char retry_after_name[] = "retry-after";
+	char status_value[sizeof("999")];
+	char retry_after_value[sizeof("4294967295")];
+	nghttp2_nv nva[2];
+	size_t nvlen = 0;
+
+	snprintf(status_value,sizeof(status_value),"%u",status);
+	nva[nvlen++] = (nghttp2_nv){(uint8_t *)status_name,
+		(uint8_t *)status_value,strlen(status_name),
+		strlen(status_value),NGHTTP2_NV_FLAG_NONE};
+	if(405 == status) {
+		nva[nvlen++] = (nghttp2_nv){(uint8_t *)allow_name,
+			(uint8_t *)allow_value,strlen(allow_name),
+			strlen(allow_value),NGHTTP2_NV_FLAG_NONE};
+	} else if(stream->retry_after) {
+		snprintf(retry_after_value,sizeof(retry_after_value),"%u",
+			stream->retry_after);
+		nva[nvlen++] = (nghttp2_nv){(uint8_t *)retry_after_name,
+			(uint8_t *)retry_after_value,strlen(retry_after_name),
+			strlen(retry_after_value),NGHTTP2_NV_FLAG_NONE};
+	}
+
+	stream->status = status;
+	if(200 != status) {
+		ATOMIC_OP(add,fetch,
+			&connection_listener(conn)->stats.rejected_streams,1);
+	}
+
+	return nghttp2_submit_response(conn->session,stream->id,nva,nvlen,
+		NULL);
+}
+
+/** Answer a stream waiting for delivery reports. Response will be sent when
+  connection is writable.
+  @param stream Stream
+  @param status_code HTTP status
+  */
+static void stream_ack_answer(struct http2_stream *stream,
+                                                unsigned int status_code) {
+	struct http2_connection *conn = stream->conn;
+	struct http2_listener *l = connection_listener(conn);
+
+	ev_timer_stop(conn->worker->loop,&stream->ack.w_timeout);
+	stream->ack.pending = 0;
+	switch(status_code) {
+	case 200:
+		ATOMIC_OP(add,fetch,&l->ack.delivered,1);
+		break;
+	case 504:
+		ATOMIC_OP(add,fetch,&l->ack.timeouts,1);
+		break;
+	default:
+		ATOMIC_OP(add,fetch,&l->ack.failed,1);
+		break;
+	};
+
+	if(0 != stream_respond(conn,stream,status_code)) {
+		rdlog(LOG_ERR,"Can't answer HTTP/2 stream of %s",
+			conn->client_str->str);
+	}
+	ev_io_start(conn->worker->loop,&conn->w_write);
+}
+
+/// All request messages have been reported by kafka. Called from kafka
+/// threads, so stream is answered in its worker thread.
+static void stream_ack_cb(size_t msgs,size_t failed,void *opaque) {
+	struct http2_stream *stream = opaque;
+	struct http2_worker *worker = stream->conn->worker;
+	(void)msgs;
+
+	pthread_mutex_lock(&worker->ack.lock);
+	stream->ack.status_code = failed ? 503 : 200;
+	stream->ack.queued = 1;
+	TAILQ_INSERT_TAIL(&worker->ack.answered,stream,ack.entry);
+	pthread_mutex_unlock(&worker->ack.lock);
+	ev_async_send(worker->loop,&worker->ack.w_answered);
+}
+
+/// Answer streams answered by kafka threads
+static void stream_ack_answered_cb(struct ev_loop *loop,ev_async *w,
+                                                                int revents) {
+	struct http2_worker *worker = w->data;
+	struct http2_stream *stream = NULL;
+	(void)loop;
+	(void)revents;
+
+	pthread_mutex_lock(&worker->ack.lock);
+	while((stream = TAILQ_FIRST(&worker->ack.answered))) {
+		TAILQ_REMOVE(&worker->ack.answered,stream,ack.entry);
+		stream->ack.queued = 0;
+		const unsigned int status_code = stream->ack.status_code;
+		pthread_mutex_unlock(&worker->ack.lock);
+
+		/* Does not close stream, so next ones are still valid */
+		stream_ack_answer(stream,status_code);
+		pthread_mutex_lock(&worker->ack.lock);
+	}
+	pthread_mutex_unlock(&worker->ack.lock);
+}
+
+static void stream_ack_timeout_cb(struct ev_loop *loop,ev_timer *w,
+                                                                int revents) {
+	struct http2_stream *stream = w->data;
+	struct http2_worker *worker = stream->conn->worker;
+	(void)loop;
+	(void)revents;
+
+	/* Kafka callback will not be called after this */
+	kafka_delivery_ack_done(stream->ack.kafka);
+	stream->ack.kafka = NULL;
+
+	pthread_mutex_lock(&worker->ack.lock);
+	const int answered = stream->ack.queued;
+	pthread_mutex_unlock(&worker->ack.lock);
+
+	if(!answered) {
+		stream_ack_answer(stream,504);
+	}
+}
+
+/** Request decoded: wait for its messages delivery reports. Stream can be
+  answered right now if all messages are already reported.
+  @param stream Stream
+  */
+static void stream_ack_wait(struct http2_stream *stream) {
+	struct http2_connection *conn = stream->conn;
+	struct http2_listener *l = connection_listener(conn);
+
+	stream->ack.pending = 1;
+	ev_timer_init(&stream->ack.w_timeout,stream_ack_timeout_cb,
+		l->ack.timeout,0.);
+	stream->ack.w_timeout.data = stream;
+	ev_timer_start(conn->worker->loop,&stream->ack.w_timeout);
+	kafka_delivery_ack_seal(stream->ack.kafka);
+}
+
+/// Release stream delivery acknowledgement
+static void stream_ack_done(struct http2_stream *stream) {
+	struct http2_worker *worker = stream->conn->worker;
+
+	if(!worker->listener->ack.enabled) {
+		return;
+	}
+
+	ev_timer_stop(worker->loop,&stream->ack.w_timeout);
+	if(stream->ack.kafka) {
+		/* Kafka callback will not be called after this */
+		kafka_delivery_ack_done(stream->ack.kafka);
+	}
+	pthread_mutex_lock(&worker->ack.lock);
+	if(stream->ack.queued) {
+		TAILQ_REMOVE(&worker->ack.answered,stream,ack.entry);
+	}
+	pthread_mutex_unlock(&worker->ack.lock);
+}
+
+/** Validate rb_http2k path (/rbdata/<uuid>/<topic>), and look up its sensor
+  and topic.
+  @param conn Connection
+  @param stream Stream. Path is tokenized, and handlers are stored in it
+  @param topic Returned topic
+  @param uuid Returned uuid
+  @return HTTP status to reject request, or 0 if it is valid
+  */
+static unsigned int stream_rb_validation(struct http2_connection *conn,
+                struct http2_stream *stream,const char **topic,
+                const char **uuid) {
+	const char *client = conn->client_str->str;
+	char *aux = NULL;
+
+	/* Query string is not part of the path */
+	stream->path[strcspn(stream->path,"?")] = '\0';
+
+	const char *rbdata = strtok_r(stream->path,"/",&aux);
+	if(NULL == rbdata || 0 != strcmp(rbdata,"rbdata")) {
+		rdlog(LOG_WARNING,"Received no expected prefix url from %s. "
+			"Rejecting stream.",client);
+		return 400;
+	}
+
+	*uuid = strtok_r(NULL,"/",&aux);
+	*topic = strtok_r(NULL,"/",&aux);
+	if(NULL == *uuid || NULL == *topic) {
+		rdlog(LOG_WARNING,"Received no uuid/topic in url from %s. "
+			"Rejecting stream.",client);
+		return 400;
+	}
+
+	rb_http2k_database_get_topic_client(&global_config.rb.database,*topic,
+		*uuid,&stream->rb_handlers.topic,&stream->rb_handlers.sensor);
+	if(NULL == stream->rb_handlers.sensor) {
+		rdlog(LOG_WARNING,"Received invalid uuid %s from %s. "
+			"Rejecting stream.",*uuid,client);
+		return 401;
+	}
+
+	if(NULL == stream->rb_handlers.topic) {
+		rdlog(LOG_WARNING,"Received topic %s from %s. Rejecting stream.",
+			*topic,client);
+		rb_http2k_handlers_done(&stream->rb_handlers);
+		return 403;
+	}
+
+	return 0;
+}
+
+/** Request headers received: validate request and prepare decoder
+  @param conn Connection
+  @param stream Stream
+  @return HTTP status to reject request, or 0 if it is valid
+  */
+static unsigned int stream_request_headers(struct http2_connection *conn,
+                                                struct http2_stream *stream) {
+	struct http2_listener *l = connection_listener(conn);
+	const char *topic = NULL,*uuid = NULL;
+
+	if(!stream->post) {
+		rdlog(LOG_WARNING,"Received invalid method from %s. "
+			"Returning METHOD NOT ALLOWED.",conn->client_str->str);
+		return 405;
+	}
+
+	/* Reject before the body is read if kafka can't keep up */
+	stream->retry_after = backpressure_check(&l->backpressure);
+	if(stream->retry_after) {
+		return l->backpressure.config.status_code;
+	}
+
+	if(stream->codec_rc < 0) {
+		rdlog(LOG_WARNING,"Received unsupported Content-Encoding from %s. "
+			"Returning UNSUPPORTED MEDIA TYPE.",conn->client_str->str);
+		return 415;
+	}
+
+	if(l->redborder_uri) {
+		if(NULL == stream->path) {
+			return 400;
+		}
+
+		const unsigned int status = stream_rb_validation(conn,stream,
+			&topic,&uuid);
+		if(status) {
+			return status;
+		}
+	}
+
+	if(0 == stream->codec_rc) {
+		ATOMIC_OP(add,fetch,
+			&l->codec_stats[stream->codec.codec].requests,1);
+		stream->codec.stream = http_codec_stream_acquire(
+			stream->codec.codec);
+		if(NULL == stream->codec.stream) {
+			return 500;
+		}
+	}
+
+	if(l->ack.enabled) {
+		stream->ack.kafka = kafka_delivery_ack_new(stream_ack_cb,stream);
+		if(NULL == stream->ack.kafka) {
+			rdlog(LOG_ERR,"Can't allocate delivery ack "
+				"(out of memory?)");
+			return 500;
+		}
+	}
+
+	prepare_decoder_params(conn,stream,topic,uuid);
+	stream->decoder_started = 1;
+	return 0;
+}
+
+/// Call decoder, tracking produced messages if delivery ack is enabled
+static void stream_decoder_call(struct http2_listener *l,
+                        struct http2_stream *stream,char *buf,size_t len,
+                        void **sessionp) {
+	kafka_delivery_ack_track(stream->ack.kafka);
+	l->callback(buf,len,&stream->decoder_params,l->callback_opaque,
+		sessionp);
+	kafka_delivery_ack_track(NULL);
+}
+
+/// End streaming decoder session, so it can flush pending messages
+static void stream_decoder_end(struct http2_listener *l,
+                                                struct http2_stream *stream) {
+	if(stream->decoder_started && decoder_support_streaming(l)) {
+		/* Streaming processing -> need to free session pointer */
+		stream_decoder_call(l,stream,NULL,0,&stream->decoder_sessp);
+		stream->decoder_started = 0;
+	}
+}
+
+/// Send request data to decoder, or to request body if decoder does not
+/// support streaming
+static void stream_decoder_data(struct http2_connection *conn,
+                        struct http2_stream *stream,char *buf,size_t len) {
+	struct http2_listener *l = connection_listener(conn);
+
+	if(decoder_support_streaming(l)) {
+		/* Decoder does not own the buffer */
+		stream_decoder_call(l,stream,buf,len,&stream->decoder_sessp);
+		return;
+	}
+
+	if(0 == stream->codec_rc && l->max_decompressed_body &&
+	                len > l->max_decompressed_body - stream->body.used) {
+		rdlog(LOG_ERR,"Decompressed %s body from uuid %s (ip %s) is "
+			"larger than %zu bytes",
+			http_codec_name(stream->codec.codec),
+			valueof(&stream->decoder_params,"sensor_uuid"),
+			conn->client_str->str,l->max_decompressed_body);
+		ATOMIC_OP(add,fetch,&l->codec_stats[stream->codec.codec].errors,
+									1);
+		stream_respond(conn,stream,413);
+		return;
+	}
+
+	if(len > stream->body.allocated - stream->body.used) {
+		const size_t needed = stream->body.used + len;
+		size_t new_size = stream->body.allocated ?
+			stream->body.allocated : HTTP2_BODY_INITIAL_SIZE;
+		while(new_size < needed) {
+			new_size *= 2;
+		}
+
+		char *new_buf = realloc(stream->body.buf,new_size);
+		if(NULL == new_buf) {
+			rdlog(LOG_ERR,"Can't allocate request body (out of memory?)");
+			stream_respond(conn,stream,500);
+			return;
+		}
+		stream->body.buf = new_buf;
+		stream->body.allocated = new_size;
+	}
+
+	memcpy(&stream->body.buf[stream->body.used],buf,len);
+	stream->body.used += len;
+}
+
+/// Decompressed data destination
+struct stream_decompress_output {
+	struct http2_connection *conn;
+	struct http2_stream *stream;
+};
+
+static void stream_decompressed_data_cb(char *buf,size_t len,void *opaque) {
+	struct stream_decompress_output *out = opaque;
+	if(0 == out->stream->status) {
+		stream_decoder_data(out->conn,out->stream,buf,len);
+	}
+}
+
+/// Request completely received
+static int stream_request_done(struct http2_connection *conn,
+                                                struct http2_stream *stream) {
+	struct http2_listener *l = connection_listener(conn);
+
+	if(stream->status) {
+		/* Already answered */
+		return 0;
+	}
+
+	if(decoder_support_streaming(l)) {
+		stream_decoder_end(l,stream);
+	} else {
+		stream_decoder_call(l,stream,stream->body.buf,stream->body.used,
+			NULL);
+	}
+
+	if(stream->ack.kafka) {
+		stream_ack_wait(stream);
+		return 0;
+	}
+
+	return stream_respond(conn,stream,200);
+}
+
+/// Release stream resources, and end its decoder session
+static void stream_done(struct http2_connection *conn,
+                                                struct http2_stream *stream) {
+	struct http2_listener *l = connection_listener(conn);
+
+	stream_decoder_end(l,stream);
+	stream_ack_done(stream);
+	if(stream->codec.stream) {
+		http_codec_stream_release(stream->codec.stream);
+	}
+
+	rb_http2k_handlers_done(&stream->rb_handlers);
+	LIST_REMOVE(stream,entry);
+	free(stream->body.buf);
+	free(stream->path);
+	free(stream);
+}
+
+/*
+ *  NGHTTP2 CALLBACKS
+ */
+
+static int on_begin_headers_callback(nghttp2_session *session,
+                        const nghttp2_frame *frame,void *user_data) {
+	struct http2_connection *conn = user_data;
+
+	if(frame->hd.type != NGHTTP2_HEADERS ||
+	                        frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+		return 0;
+	}
+
+	struct http2_stream *stream = calloc(1,sizeof(*stream));
+	if(NULL == stream) {
+		rdlog(LOG_ERR,"Can't allocate HTTP/2 stream (out of memory?)");
+		nghttp2_submit_rst_stream(session,NGHTTP2_FLAG_NONE,
+			frame->hd.stream_id,NGHTTP2_INTERNAL_ERROR);
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	}
+
+	stream->id = frame->hd.stream_id;
+	stream->conn = conn;
+	/* Not encoded until we see Content-Encoding */
+	stream->codec_rc = 1;
+	LIST_INSERT_HEAD(&conn->streams,stream,entry);
+	nghttp2_session_set_stream_user_data(session,stream->id,stream);
+	ATOMIC_OP(add,fetch,&connection_listener(conn)->stats.streams,1);
+	return 0;
+}
+
+static int header_is(const uint8_t *name,size_t namelen,const char *expected) {
+	return namelen == strlen(expected) && 0 == memcmp(name,expected,namelen);
+}
+
+static int on_header_callback(nghttp2_session *session,
+                const nghttp2_frame *frame,const uint8_t *name,size_t namelen,
+                const uint8_t *value,size_t valuelen,uint8_t flags,
+                void *user_data) {
+	(void)flags;
+	(void)user_data;
+
+	if(frame->hd.type != NGHTTP2_HEADERS ||
+	                        frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+		return 0;
+	}
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	if(NULL == stream) {
+		return 0;
+	}
+
+	/* nghttp2 guarantees NUL terminated name and value */
+	if(header_is(name,namelen,":method")) {
+		stream->post = header_is(value,valuelen,"POST");
+	} else if(header_is(name,namelen,":path") && NULL == stream->path) {
+		stream->path = strdup((const char *)value);
+	} else if(header_is(name,namelen,"content-encoding")) {
+		stream->codec_rc = http_codec_find((const char *)value,
+			&stream->codec.codec);
+	}
+
+	return 0;
+}
+
+static int on_frame_recv_callback(nghttp2_session *session,
+                                const nghttp2_frame *frame,void *user_data) {
+	struct http2_connection *conn = user_data;
+
+	if(frame->hd.type != NGHTTP2_HEADERS &&
+	                                        frame->hd.type != NGHTTP2_DATA) {
+		return 0;
+	}
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	if(NULL == stream) {
+		return 0;
+	}
+
+	if(frame->hd.type == NGHTTP2_HEADERS &&
+	                        frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+		const unsigned int status = stream_request_headers(conn,stream);
+		if(status && 0 != stream_respond(conn,stream,status)) {
+			return NGHTTP2_ERR_CALLBACK_FAILURE;
+		}
+	}
+
+	if(frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+		return 0 == stream_request_done(conn,stream) ? 0 :
+			NGHTTP2_ERR_CALLBACK_FAILURE;
+	}
+
+	return 0;
+}
+
+static int on_data_chunk_recv_callback(nghttp2_session *session,
+                uint8_t flags,int32_t stream_id,const uint8_t *data,
+                size_t len,void *user_data) {
+	struct http2_connection *conn = user_data;
+	struct http2_listener *l = connection_listener(conn);
+	(void)flags;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,stream_id);
+	ATOMIC_OP(add,fetch,&l->stats.bytes,len);
+	if(NULL == stream || stream->status) {
+		/* Rejected request, discarding */
+		return 0;
+	}
+
+	/* Ugly hack, decoder callback does not take const buffers */
+	char *buf;
+	memcpy(&buf,&data,sizeof(buf));
+
+	if(0 != stream->codec_rc) {
+		stream_decoder_data(conn,stream,buf,len);
+		return 0;
+	}
+
+	struct stream_decompress_output out = {.conn = conn, .stream = stream};
+	const ssize_t rc = http_codec_decompress(stream->codec.stream,buf,len,
+		stream_decompressed_data_cb,&out,
+		&l->codec_stats[stream->codec.codec]);
+	if(rc < 0) {
+		rdlog(LOG_ERR,"Error in %s compressed input from uuid %s "
+			"(ip %s): %s",http_codec_name(stream->codec.codec),
+			valueof(&stream->decoder_params,"sensor_uuid"),
+			conn->client_str->str,
+			http_codec_stream_error(stream->codec.stream));
+		http_codec_stream_release(stream->codec.stream);
+		stream->codec.stream = NULL;
+		return 0 == stream_respond(conn,stream,400) ? 0 :
+			NGHTTP2_ERR_CALLBACK_FAILURE;
+	}
+
+	return 0;
+}
+
+static int on_stream_close_callback(nghttp2_session *session,
+                int32_t stream_id,uint32_t error_code,void *user_data) {
+	struct http2_connection *conn = user_data;
+	(void)error_code;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,stream_id);
+	if(stream) {
+		stream_done(conn,stream);
+	}
+
+	return 0;
+}
+
+/*
+ *  CONNECTIONS
+ */
+
+static void connection_close(struct http2_connection *conn) {
+	struct ev_loop *loop = conn->worker->loop;
+	struct http2_stream *stream = NULL;
+
+	ev_io_stop(loop,&conn->w_read);
+	ev_io_stop(loop,&conn->w_write);
+	ev_timer_stop(loop,&conn->w_timeout);
+
+	/* nghttp2_session_del does not close streams */
+	while((stream = LIST_FIRST(&conn->streams))) {
+		stream_done(conn,stream);
+	}
+
+	nghttp2_session_del(conn->session);
+	rb_addr_str_decref(conn->client_str);
+	close(conn->fd);
+	LIST_REMOVE(conn,entry);
+	free(conn);
+}
+
+/** Send nghttp2 pending output
+  @param conn Connection
+  @return 0 if connection has to be kept, !0 if it has to be closed
+  */
+static int connection_flush(struct http2_connection *conn) {
+	struct ev_loop *loop = conn->worker->loop;
+
+	while(1) {
+		if(0 == conn->wbuf_len) {
+			const ssize_t n = nghttp2_session_mem_send(conn->session,
+				&conn->wbuf);
+			if(n < 0) {
+				rdlog(LOG_ERR,"HTTP/2 error with %s: %s",
+					conn->client_str->str,
+					nghttp2_strerror((int)n));
+				return -1;
+			} else if(0 == n) {
+				break;
+			}
+			conn->wbuf_len = (size_t)n;
+		}
+
+		const ssize_t sent = send(conn->fd,conn->wbuf,conn->wbuf_len,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent < 0) {
+			if(errno == EINTR) {
+				continue;
+			} else if(errno == EAGAIN) {
+				ev_io_start(loop,&conn->w_write);
+				return 0;
+			}
+
+			rdlog(LOG_ERR,"Error sending to %s: %s",
+				conn->client_str->str,
+				mystrerror(errno,errbuf,sizeof(errbuf)));
+			return -1;
+		}
+
+		conn->wbuf += sent;
+		conn->wbuf_len -= (size_t)sent;
+	}
+
+	ev_io_stop(loop,&conn->w_write);
+	return !nghttp2_session_want_read(conn->session) &&
+		!nghttp2_session_want_write(conn->session);
+}
+
+static void connection_read_cb(struct ev_loop *loop,ev_io *w,int revents) {
+	struct http2_connection *conn = w->data;
+	struct http2_worker *worker = conn->worker;
+	(void)revents;
+
+	const ssize_t n = recv(conn->fd,worker->rbuf,HTTP2_READ_BUFFER_SIZE,0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	} else if(n <= 0) {
+		if(n < 0) {
+			rdlog(LOG_ERR,"Error reading from %s: %s",
+				conn->client_str->str,
+				mystrerror(errno,errbuf,sizeof(errbuf)));
+		}
+		connection_close(conn);
+		return;
+	}
+
+	ev_timer_again(loop,&conn->w_timeout);
+	const ssize_t rc = nghttp2_session_mem_recv(conn->session,worker->rbuf,
+		(size_t)n);
+	if(rc < 0) {
+		rdlog(LOG_ERR,"HTTP/2 error with %s: %s",conn->client_str->str,
+			nghttp2_strerror((int)rc));
+		connection_close(conn);
+		return;
+	}
+
+	if(0 != connection_flush(conn)) {
+		connection_close(conn);
+	}
+}
+
+static void connection_write_cb(struct ev_loop *loop,ev_io *w,int revents) {
+	struct http2_connection *conn = w->data;
+	(void)revents;
+
+	ev_timer_again(loop,&conn->w_timeout);
+	if(0 != connection_flush(conn)) {
+		connection_close(conn);
+	}
+}
+
+static void connection_timeout_cb(struct ev_loop *loop,ev_timer *w,
+                                                                int revents) {
+	struct http2_connection *conn = w->data;
+	(void)loop;
+	(void)revents;
+
+	rdlog(LOG_DEBUG,"Closing idle HTTP/2 connection from %s",
+		conn->client_str->str);
+	connection_close(conn);
+}
+
+static void new_connection(struct http2_worker *worker,int fd,
+                                        const struct sockaddr *client_addr) {
+	struct http2_listener *l = worker->listener;
+	const int one = 1;
+
+	struct rb_addr_str *client_str = rb_addr_cache_get(client_addr);
+	struct http2_connection *conn = client_str ? calloc(1,sizeof(*conn)) :
+		NULL;
+	if(NULL == conn) {
+		rdlog(LOG_ERR,"Can't allocate HTTP/2 connection (out of memory?)");
+		close(fd);
+		return;
+	}
+
+	conn->fd = fd;
+	conn->worker = worker;
+	conn->client_str = rb_addr_str_incref(client_str);
+	LIST_INIT(&conn->streams);
+
+	if(0 != nghttp2_session_server_new(&conn->session,l->callbacks,conn)) {
+		rdlog(LOG_ERR,"Can't create HTTP/2 session (out of memory?)");
+		rb_addr_str_decref(conn->client_str);
+		free(conn);
+		close(fd);
+		return;
+	}
+
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+	const nghttp2_settings_entry settings[] = {
+		{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+			l->max_concurrent_streams},
+		{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+			(uint32_t)l->initial_window_size},
+	};
+	nghttp2_submit_settings(conn->session,NGHTTP2_FLAG_NONE,settings,
+		sizeof(settings)/sizeof(settings[0]));
+	nghttp2_session_set_local_window_size(conn->session,NGHTTP2_FLAG_NONE,
+		0,l->connection_window_size);
+
+	ev_io_init(&conn->w_read,connection_read_cb,fd,EV_READ);
+	ev_io_init(&conn->w_write,connection_write_cb,fd,EV_WRITE);
+	ev_init(&conn->w_timeout,connection_timeout_cb);
+	conn->w_timeout.repeat = l->connection_timeout;
+	conn->w_read.data = conn->w_write.data = conn->w_timeout.data = conn;
+	LIST_INSERT_HEAD(&worker->connections,conn,entry);
+	ATOMIC_OP(add,fetch,&l->stats.connections,1);
+
+	ev_io_start(worker->loop,&conn->w_read);
+	ev_timer_again(worker->loop,&conn->w_timeout);
+
+	/* Send server SETTINGS */
+	if(0 != connection_flush(conn)) {
+		connection_close(conn);
+	}
+}
+
+/// Convert IPv4 mapped addresses of dual stack socket to plain IPv4, so
+/// client_ip is the same as in other listeners
+static void unmap_ipv4_addr(struct sockaddr_storage *addr) {
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+	struct sockaddr_in sin;
+
+	if(addr->ss_family != AF_INET6 ||
+	                        !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+		return;
+	}
+
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = sin6->sin6_port;
+	memcpy(&sin.sin_addr,&sin6->sin6_addr.s6_addr[12],
+		sizeof(sin.sin_addr));
+	memcpy(addr,&sin,sizeof(sin));
+}
+
+static void accept_cb(struct ev_loop *loop,ev_io *w,int revents) {
+	struct http2_worker *worker = ev_userdata(loop);
+	(void)w;
+	(void)revents;
+
+	while(1) {
+		struct sockaddr_storage client_addr;
+		socklen_t addrlen = sizeof(client_addr);
+
+		const int fd = accept4(worker->listen_fd,
+			(struct sockaddr *)&client_addr,&addrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno != EAGAIN && errno != EINTR) {
+				rdlog(LOG_ERR,"Error accepting HTTP/2 connection: %s",
+					mystrerror(errno,errbuf,sizeof(errbuf)));
+			}
+			return;
+		}
+
+		unmap_ipv4_addr(&client_addr);
+		if(!client_addr_allowed((const struct sockaddr *)&client_addr)) {
+			close(fd);
+			continue;
+		}
+
+		new_connection(worker,fd,(const struct sockaddr *)&client_addr);
+	}
+}
+
+static void stop_cb(struct ev_loop *loop,ev_async *w,int revents) {
+	(void)w;
+	(void)revents;
+	ev_break(loop,EVBREAK_ALL);
+}
+
+/*
+ *  LISTENER
+ */
+
+static void *http2_worker_main(void *_worker) {
+	struct http2_worker *worker = _worker;
+	struct http2_listener *l = worker->listener;
+	struct http2_connection *conn = NULL;
+	char thread_name[64];
+
+	snprintf(thread_name,sizeof(thread_name),"Listener %d HTTP/2 thread %zu",
+		l->port,worker->idx);
+	cpu_affinity_pin_thread(&l->affinity,worker->idx,thread_name);
+
+	/* After pinning, so it's allocated in thread NUMA node */
+	worker->rbuf = malloc(HTTP2_READ_BUFFER_SIZE);
+	if(NULL == worker->rbuf) {
+		rdlog(LOG_ERR,"Can't allocate HTTP/2 read buffer "
+			"(out of memory?)");
+		return NULL;
+	}
+
+	ev_io_start(worker->loop,&worker->w_accept);
+	ev_run(worker->loop,0);
+	ev_io_stop(worker->loop,&worker->w_accept);
+
+	while((conn = LIST_FIRST(&worker->connections))) {
+		connection_close(conn);
+	}
+	free(worker->rbuf);
+	worker->rbuf = NULL;
+	return NULL;
+}
+
+/** Create listening socket. It is dual stack (IPv6 and IPv4 mapped) if kernel
+  supports IPv6, IPv4 only if not.
+  @param port Port to listen
+  @param reuseport Set SO_REUSEPORT, so many workers can share port
+  @return Socket, or -1 if error
+  */
+static int create_listen_socket(uint16_t port,int reuseport) {
+	const int one = 1,zero = 0;
+	struct sockaddr_storage server_addr;
+	socklen_t server_addrlen;
+
+	int fd = socket(AF_INET6,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+	if(fd < 0 && errno == EAFNOSUPPORT) {
+		fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+	}
+	if(fd < 0) {
+		rdlog(LOG_ERR,"Error creating socket: %s",
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	if(reuseport && 0 != setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,
+	                                                        sizeof(one))) {
+		rdlog(LOG_ERR,"Error setting SO_REUSEPORT: %s",
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		close(fd);
+		return -1;
+	}
+
+	memset(&server_addr,0,sizeof(server_addr));
+	if(0 == setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&zero,sizeof(zero))) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&server_addr;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(port);
+		server_addrlen = sizeof(*sin6);
+	} else {
+		/* IPv4 socket */
+		struct sockaddr_in *sin = (struct sockaddr_in *)&server_addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(port);
+		server_addrlen = sizeof(*sin);
+	}
+
+	if(0 != bind(fd,(struct sockaddr *)&server_addr,server_addrlen) ||
+	                                        0 != listen(fd,SOMAXCONN)) {
+		rdlog(LOG_ERR,"Error binding HTTP/2 socket to port %u: %s",port,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static nghttp2_session_callbacks *create_session_callbacks() {
+	nghttp2_session_callbacks *callbacks = NULL;
+
+	if(0 != nghttp2_session_callbacks_new(&callbacks)) {
+		return NULL;
+	}
+
+	nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+		on_begin_headers_callback);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks,
+		on_header_callback);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+		on_frame_recv_callback);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+		on_data_chunk_recv_callback);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+		on_stream_close_callback);
+
+	return callbacks;
+}
+
+/// Stop and release started workers
+static void stop_http2_workers(struct http2_listener *l,size_t num_workers) {
+	size_t i;
+
+	for(i=0;i<num_workers;++i) {
+		ev_async_send(l->workers[i].loop,&l->workers[i].w_stop);
+	}
+
+	for(i=0;i<num_workers;++i) {
+		struct http2_worker *worker = &l->workers[i];
+		pthread_join(worker->thread,NULL);
+		ev_async_stop(worker->loop,&worker->w_stop);
+		ev_async_stop(worker->loop,&worker->ack.w_answered);
+		ev_loop_destroy(worker->loop);
+		pthread_mutex_destroy(&worker->ack.lock);
+		close(worker->listen_fd);
+	}
+}
+
+static int start_http2_worker(struct http2_listener *l,size_t idx) {
+	struct http2_worker *worker = &l->workers[idx];
+
+	worker->listener = l;
+	worker->idx = idx;
+	LIST_INIT(&worker->connections);
+	worker->listen_fd = create_listen_socket((uint16_t)l->port,
+		l->num_workers > 1);
+	if(worker->listen_fd < 0) {
+		return -1;
+	}
+
+	worker->loop = ev_loop_new(EVFLAG_AUTO);
+	if(NULL == worker->loop) {
+		rdlog(LOG_ERR,"Can't create HTTP/2 event loop");
+		close(worker->listen_fd);
+		return -1;
+	}
+
+	ev_set_userdata(worker->loop,worker);
+	ev_io_init(&worker->w_accept,accept_cb,worker->listen_fd,EV_READ);
+	ev_async_init(&worker->w_stop,stop_cb);
+	ev_async_start(worker->loop,&worker->w_stop);
+	pthread_mutex_init(&worker->ack.lock,NULL);
+	TAILQ_INIT(&worker->ack.answered);
+	ev_async_init(&worker->ack.w_answered,stream_ack_answered_cb);
+	worker->ack.w_answered.data = worker;
+	ev_async_start(worker->loop,&worker->ack.w_answered);
+
+	const int rc = pthread_create(&worker->thread,NULL,http2_worker_main,
+		worker);
+	if(0 != rc) {
+		rdlog(LOG_ERR,"Can't create HTTP/2 thread: %s",
+			mystrerror(rc,errbuf,sizeof(errbuf)));
+		ev_async_stop(worker->loop,&worker->w_stop);
+		ev_async_stop(worker->loop,&worker->ack.w_answered);
+		ev_loop_destroy(worker->loop);
+		pthread_mutex_destroy(&worker->ack.lock);
+		close(worker->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void log_http2_stats(struct http2_listener *l) {
+	size_t i;
+
+	rdlog(LOG_INFO,"Listener %d HTTP/2 connections: %"PRIu64", streams: "
+		"%"PRIu64", rejected streams: %"PRIu64", bytes: %"PRIu64,
+		l->port,ATOMIC_OP(fetch,add,&l->stats.connections,0),
+		ATOMIC_OP(fetch,add,&l->stats.streams,0),
+		ATOMIC_OP(fetch,add,&l->stats.rejected_streams,0),
+		ATOMIC_OP(fetch,add,&l->stats.bytes,0));
+
+	if(l->ack.enabled) {
+		rdlog(LOG_INFO,"Listener %d HTTP/2 delivery acks: %"PRIu64
+			" delivered, %"PRIu64" failed, %"PRIu64" timed out",
+			l->port,ATOMIC_OP(fetch,add,&l->ack.delivered,0),
+			ATOMIC_OP(fetch,add,&l->ack.failed,0),
+			ATOMIC_OP(fetch,add,&l->ack.timeouts,0));
+	}
+
+	for(i=0;i<HTTP_CODEC_MAX;++i) {
+		struct http_codec_stats *stats = &l->codec_stats[i];
+		const uint64_t requests = ATOMIC_OP(fetch,add,&stats->requests,0);
+		if(0 == requests) {
+			continue;
+		}
+
+		rdlog(LOG_INFO,"Listener %d %s requests: %"PRIu64", bytes in: "
+			"%"PRIu64", bytes out: %"PRIu64", errors: %"PRIu64,
+			l->port,http_codec_name((enum http_codec_type)i),requests,
+			ATOMIC_OP(fetch,add,&stats->bytes_in,0),
+			ATOMIC_OP(fetch,add,&stats->bytes_out,0),
+			ATOMIC_OP(fetch,add,&stats->errors,0));
+	}
+}
+
+static void reload_listener_http2(json_t *new_config,
+                decoder_listener_opaque_reload opaque_reload,
+                void *cb_opaque, void *_private) {
+	log_http2_stats(_private);
+
+	if(opaque_reload){
+		rdlog(LOG_INFO,"Reloading opaque");
+		opaque_reload(new_config,cb_opaque);
+	} else {
+		rdlog(LOG_INFO,"Not reload opaque provided");
+	}
+}
+
+static void http2_listener_done(struct http2_listener *l) {
+	backpressure_done(&l->backpressure);
+	nghttp2_session_callbacks_del(l->callbacks);
+	cpu_affinity_done(&l->affinity);
+	free(l);
+}
+
+static void break_http2_listener(void *_l) {
+	struct http2_listener *l = _l;
+
+	stop_http2_workers(l,l->num_workers);
+	log_http2_stats(l);
+	http2_listener_done(l);
+}
+
+struct listener *create_http2_listener(struct json_t *config,
+        decoder_callback cb,int cb_flags,void *cb_opaque) {
+	json_error_t error;
+	int port = 0,num_threads = 1,redborder_uri = 0;
+	int max_concurrent_streams = 100;
+	int initial_window_size = 256*1024;
+	int connection_window_size = 1024*1024;
+	int connection_timeout = 30;
+	int delivery_ack = 0;
+	int delivery_ack_timeout_ms = HTTP2_DELIVERY_ACK_DEFAULT_TIMEOUT_MS;
+	json_int_t max_decompressed_body =
+				HTTP_CODEC_MAX_DECOMPRESSED_BODY_DEFAULT;
+	const char *cpu_affinity = NULL;
+	int numa_node = CPU_AFFINITY_NO_NUMA_NODE;
+	struct backpressure_config backpressure;
+	size_t i;
+
+	const int unpack_rc = json_unpack_ex(config,&error,0,
+		"{"
+			"s:i," /* port */
+			"s?i," /* num_threads */
+			"s?b," /* redborder_uri */
+			"s?i," /* max_concurrent_streams */
+			"s?i," /* initial_window_size */
+			"s?i," /* connection_window_size */
+			"s?i," /* connection_timeout */
+			"s?s," /* cpu_affinity */
+			"s?i," /* numa_node */
+			"s?b," /* delivery_ack */
+			"s?i," /* delivery_ack_timeout_ms */
+			"s?I"  /* max_decompressed_body */
+		"}",
+		"port",&port,
+		"num_threads",&num_threads,
+		"redborder_uri",&redborder_uri,
+		"max_concurrent_streams",&max_concurrent_streams,
+		"initial_window_size",&initial_window_size,
+		"connection_window_size",&connection_window_size,
+		"connection_timeout",&connection_timeout,
+		"cpu_affinity",&cpu_affinity,
+		"numa_node",&numa_node,
+		"delivery_ack",&delivery_ack,
+		"delivery_ack_timeout_ms",&delivery_ack_timeout_ms,
+		"max_decompressed_body",&max_decompressed_body);
+
+	if(unpack_rc != 0) {
+		rdlog(LOG_ERR,"Can't parse HTTP/2 options: %s",error.text);
+		return NULL;
+	}
+
+	if(port <= 0 || port > 65535) {
+		rdlog(LOG_ERR,"Invalid HTTP/2 port %d",port);
+		return NULL;
+	}
+
+	if(num_threads < 1 || num_threads > HTTP2_MAX_THREADS) {
+		rdlog(LOG_ERR,"HTTP/2 num_threads must be between 1 and %d",
+			HTTP2_MAX_THREADS);
+		return NULL;
+	}
+
+	if(max_concurrent_streams < 1 || initial_window_size < 1 ||
+	                connection_window_size < 1 || connection_timeout < 1 ||
+	                                        delivery_ack_timeout_ms < 1) {
+		rdlog(LOG_ERR,"HTTP/2 max_concurrent_streams, window sizes, "
+			"connection_timeout and delivery_ack_timeout_ms must be "
+			"positive");
+		return NULL;
+	}
+
+	if(max_decompressed_body < 0) {
+		rdlog(LOG_ERR,"HTTP/2 max_decompressed_body can't be negative");
+		return NULL;
+	}
+
+	if(0 != backpressure_config_parse(&backpressure,config)) {
+		return NULL;
+	}
+
+	struct http2_listener *l = calloc(1,sizeof(*l) +
+		(size_t)num_threads*sizeof(l->workers[0]));
+	struct listener *listener = calloc(1,sizeof(*listener));
+	if(NULL == l || NULL == listener) {
+		rdlog(LOG_ERR,"Can't create HTTP/2 listener (out of memory?)");
+		free(l);
+		free(listener);
+		return NULL;
+	}
+
+	l->port = port;
+	l->redborder_uri = redborder_uri;
+	l->callback = cb;
+	l->callback_opaque = cb_opaque;
+	l->callback_flags = cb_flags;
+	l->max_concurrent_streams = (uint32_t)max_concurrent_streams;
+	l->initial_window_size = initial_window_size;
+	l->connection_window_size = connection_window_size;
+	l->connection_timeout = connection_timeout;
+	l->ack.enabled = delivery_ack;
+	l->ack.timeout = delivery_ack_timeout_ms/1000.;
+	l->max_decompressed_body = (size_t)max_decompressed_body;
+	l->num_workers = (size_t)num_threads;
+
+	if(0 != cpu_affinity_init(&l->affinity,cpu_affinity,numa_node)) {
+		free(l);
+		free(listener);
+		return NULL;
+	}
+
+	l->callbacks = create_session_callbacks();
+	if(NULL == l->callbacks) {
+		rdlog(LOG_ERR,"Can't create HTTP/2 callbacks (out of memory?)");
+		cpu_affinity_done(&l->affinity);
+		free(l);
+		free(listener);
+		return NULL;
+	}
+
+	backpressure_init(&l->backpressure,port,&backpressure);
+	for(i=0;i<l->num_workers;++i) {
+		if(0 != start_http2_worker(l,i)) {
+			stop_http2_workers(l,i);
+			http2_listener_done(l);
+			free(listener);
+			return NULL;
+		}
+	}
+
+	rdlog(LOG_INFO,"Creating new HTTP/2 listener on port %d",port);
+
+	listener->create       = create_http2_listener;
+	listener->cb.cb_opaque = cb_opaque;
+	listener->cb.callback  = cb;
+	listener->join         = break_http2_listener;
+	listener->private      = l;
+	listener->reload       = reload_listener_http2;
+	listener->port         = (uint16_t)port;
+
+	return listener;
+}
+
+#endif
@@ -16,21 +16,22 @@
 ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#pragma once
-
-#include <sys/queue.h>
-#include <netinet/in.h>
 
-typedef struct in_addr_list_s in_addr_list_t; /* FW DECLARATION */
-
-/// Init a sockaddr_in list.
-in_addr_list_t *in_addr_list_new();
+#pragma once
 
-/// Add an address to list.
-void in_addr_list_add(in_addr_list_t *list,const struct in_addr *addr);
+#include "engine/global_config.h"
 
-/// Check if an addr is in list.
-int in_addr_list_contains(const in_addr_list_t *list,const struct in_addr *addr);
+#ifdef HAVE_LIBNGHTTP2
+struct json_t;
 
-/// Deallocate a list.
-void in_addr_list_done(in_addr_list_t *list);
+/** Create an HTTP/2 cleartext (h2c, with prior knowledge) listener. Every
+  request stream is sent to the decoder, with its own decoder session.
+  @param config Listener config
+  @param cb Decoder callback
+  @param cb_flags Decoder flags
+  @param cb_opaque Decoder opaque
+  @return New listener, or NULL if error
+  */
+struct listener *create_http2_listener(struct json_t *config,
+            decoder_callback cb,int cb_flags,void *cb_opaque);
+#endif
@@ -0,0 +1,474 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "config.h"
+#include "http_codec.h"
+
+#include <librd/rdlog.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+/// Decompressed output slice size
+#define HTTP_CODEC_OUT_SIZE (512*1024)
+/// Initialized streams of each codec kept by every thread for reuse
+#define HTTP_CODEC_POOL_SIZE 64
+
+struct http_codec_stream {
+	enum http_codec_type codec;
+	/// Last error description
+	const char *error;
+	union {
+		z_stream zlib;
+#ifdef HAVE_LIBZSTD
+		ZSTD_DStream *zstd;
+#endif
+#ifdef HAVE_LIBLZ4
+		LZ4F_dctx *lz4;
+#endif
+	};
+};
+
+/// Codec implementation
+struct http_codec_ops {
+	/// Prepare a new stream
+	int (*init)(struct http_codec_stream *stream);
+	/// Prepare stream for a new request
+	int (*reset)(struct http_codec_stream *stream);
+	/// Free stream resources
+	void (*done)(struct http_codec_stream *stream);
+	/** Decompress as much input as possible into out
+	  @param stream Stream
+	  @param in Input. Advanced with consumed bytes
+	  @param in_len Input length. Decreased with consumed bytes
+	  @param out Output buffer
+	  @param out_len Output buffer size as input, produced bytes as output
+	  @return 0 if success, !0 if stream is corrupted
+	  */
+	int (*decompress)(struct http_codec_stream *stream,const char **in,
+		size_t *in_len,char *out,size_t *out_len);
+};
+
+/*
+ *  ZLIB (deflate & gzip)
+ */
+
+static const char *zlib_error2str(const int z_status) {
+	switch(z_status) {
+	case Z_OK:
+		return "success";
+		break;
+	case Z_MEM_ERROR:
+		return "there was not enough memory";
+		break;
+	case Z_VERSION_ERROR:
+		return "the zlib library version is incompatible with the"
+			" version assumed by the caller";
+		break;
+	case Z_STREAM_ERROR:
+		return "the parameters are invalid";
+		break;
+	default:
+		return "Unknown error";
+		break;
+	};
+}
+
+static int zlib_init(struct http_codec_stream *stream,int window_bits) {
+	z_stream *strm = &stream->zlib;
+
+	strm->zalloc = Z_NULL;
+	strm->zfree = Z_NULL;
+	strm->opaque = Z_NULL;
+	strm->avail_in = 0;
+	strm->next_in = Z_NULL;
+
+	const int rc = inflateInit2(strm,window_bits);
+	if(rc != Z_OK) {
+		rdlog(LOG_ERR,"Couldn't init inflate. Error was %d: %s",rc,
+			zlib_error2str(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int deflate_init(struct http_codec_stream *stream) {
+	/* HTTP deflate is zlib format */
+	return zlib_init(stream,MAX_WBITS);
+}
+
+static int gzip_init(struct http_codec_stream *stream) {
+	return zlib_init(stream,16 + MAX_WBITS);
+}
+
+static int zlib_reset(struct http_codec_stream *stream) {
+	return Z_OK == inflateReset(&stream->zlib) ? 0 : -1;
+}
+
+static void zlib_done(struct http_codec_stream *stream) {
+	inflateEnd(&stream->zlib);
+}
+
+static int zlib_decompress(struct http_codec_stream *stream,const char **in,
+                                size_t *in_len,char *out,size_t *out_len) {
+	z_stream *strm = &stream->zlib;
+	const uInt avail_in = *in_len > UINT_MAX ? UINT_MAX : (uInt)*in_len;
+
+	/* Ugly hack, assignement discard const qualifier */
+	memcpy(&strm->next_in,in,sizeof(*in));
+	strm->avail_in = avail_in;
+	strm->next_out = (Bytef *)out;
+	strm->avail_out = (uInt)*out_len;
+
+	int ret = inflate(strm,Z_NO_FLUSH);
+	if(ret == Z_STREAM_END && strm->avail_in > 0) {
+		/* Concatenated gzip members */
+		ret = inflateReset(strm);
+	}
+
+	const size_t consumed = avail_in - strm->avail_in;
+	*in += consumed;
+	*in_len -= consumed;
+	*out_len -= strm->avail_out;
+	strm->next_in = Z_NULL;
+	strm->next_out = Z_NULL;
+
+	switch(ret) {
+	case Z_OK:
+	case Z_STREAM_END:
+	case Z_BUF_ERROR: /* No progress possible, need more input */
+		return 0;
+	case Z_NEED_DICT:
+		stream->error = "Need unknown dict in input stream";
+		return -1;
+	default:
+		stream->error = strm->msg ? strm->msg : zError(ret);
+		return -1;
+	};
+}
+
+#ifdef HAVE_LIBZSTD
+/*
+ *  ZSTD
+ */
+
+static int zstd_init(struct http_codec_stream *stream) {
+	stream->zstd = ZSTD_createDStream();
+	if(NULL == stream->zstd) {
+		rdlog(LOG_ERR,"Couldn't create zstd stream (out of memory?)");
+		return -1;
+	}
+
+	const size_t rc = ZSTD_initDStream(stream->zstd);
+	if(ZSTD_isError(rc)) {
+		rdlog(LOG_ERR,"Couldn't init zstd stream: %s",
+			ZSTD_getErrorName(rc));
+		ZSTD_freeDStream(stream->zstd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int zstd_reset(struct http_codec_stream *stream) {
+	return ZSTD_isError(ZSTD_DCtx_reset(stream->zstd,
+		ZSTD_reset_session_only)) ? -1 : 0;
+}
+
+static void zstd_done(struct http_codec_stream *stream) {
+	ZSTD_freeDStream(stream->zstd);
+}
+
+static int zstd_decompress(struct http_codec_stream *stream,const char **in,
+                                size_t *in_len,char *out,size_t *out_len) {
+	ZSTD_inBuffer in_buf = {.src = *in, .size = *in_len, .pos = 0};
+	ZSTD_outBuffer out_buf = {.dst = out, .size = *out_len, .pos = 0};
+
+	const size_t rc = ZSTD_decompressStream(stream->zstd,&out_buf,&in_buf);
+	*in += in_buf.pos;
+	*in_len -= in_buf.pos;
+	*out_len = out_buf.pos;
+
+	if(ZSTD_isError(rc)) {
+		stream->error = ZSTD_getErrorName(rc);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+/*
+ *  LZ4 frame
+ */
+
+static int lz4_init(struct http_codec_stream *stream) {
+	const LZ4F_errorCode_t rc = LZ4F_createDecompressionContext(
+		&stream->lz4,LZ4F_VERSION);
+	if(LZ4F_isError(rc)) {
+		rdlog(LOG_ERR,"Couldn't create lz4 stream: %s",
+			LZ4F_getErrorName(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lz4_reset(struct http_codec_stream *stream) {
+	LZ4F_resetDecompressionContext(stream->lz4);
+	return 0;
+}
+
+static void lz4_done(struct http_codec_stream *stream) {
+	LZ4F_freeDecompressionContext(stream->lz4);
+}
+
+static int lz4_decompress(struct http_codec_stream *stream,const char **in,
+                                size_t *in_len,char *out,size_t *out_len) {
+	size_t src_size = *in_len;
+
+	const size_t rc = LZ4F_decompress(stream->lz4,out,out_len,*in,
+		&src_size,NULL);
+	*in += src_size;
+	*in_len -= src_size;
+
+	if(LZ4F_isError(rc)) {
+		stream->error = LZ4F_getErrorName(rc);
+		*out_len = 0;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static const char *codec_names[HTTP_CODEC_MAX] = {
+	[HTTP_CODEC_DEFLATE] = STR_HTTP_CODEC_DEFLATE,
+	[HTTP_CODEC_GZIP]    = STR_HTTP_CODEC_GZIP,
+	[HTTP_CODEC_ZSTD]    = STR_HTTP_CODEC_ZSTD,
+	[HTTP_CODEC_LZ4]     = STR_HTTP_CODEC_LZ4,
+};
+
+/// Codecs implementations. Codecs not built in have all NULL
+static const struct http_codec_ops codec_ops[HTTP_CODEC_MAX] = {
+	[HTTP_CODEC_DEFLATE] = {
+		deflate_init,zlib_reset,zlib_done,zlib_decompress},
+	[HTTP_CODEC_GZIP] = {
+		gzip_init,zlib_reset,zlib_done,zlib_decompress},
+#ifdef HAVE_LIBZSTD
+	[HTTP_CODEC_ZSTD] = {
+		zstd_init,zstd_reset,zstd_done,zstd_decompress},
+#endif
+#ifdef HAVE_LIBLZ4
+	[HTTP_CODEC_LZ4] = {
+		lz4_init,lz4_reset,lz4_done,lz4_decompress},
+#endif
+};
+
+/// Content-Encoding values
+static const struct {
+	const char *content_encoding;
+	enum http_codec_type codec;
+} codec_encodings[] = {
+	{STR_HTTP_CODEC_DEFLATE, HTTP_CODEC_DEFLATE},
+	{STR_HTTP_CODEC_GZIP,    HTTP_CODEC_GZIP},
+	{"x-gzip",               HTTP_CODEC_GZIP},
+	{STR_HTTP_CODEC_ZSTD,    HTTP_CODEC_ZSTD},
+	{STR_HTTP_CODEC_LZ4,     HTTP_CODEC_LZ4},
+	{"x-lz4",                HTTP_CODEC_LZ4},
+};
+
+int http_codec_find(const char *content_encoding,enum http_codec_type *codec) {
+	size_t i;
+
+	if(NULL == content_encoding || '\0' == content_encoding[0] ||
+	                        0 == strcasecmp("identity",content_encoding)) {
+		return 1;
+	}
+
+	for(i=0;i<sizeof(codec_encodings)/sizeof(codec_encodings[0]);++i) {
+		if(0 == strcasecmp(codec_encodings[i].content_encoding,
+		                                        content_encoding)) {
+			*codec = codec_encodings[i].codec;
+			return codec_ops[*codec].init ? 0 : -1;
+		}
+	}
+
+	return -1;
+}
+
+const char *http_codec_name(enum http_codec_type codec) {
+	return codec < HTTP_CODEC_MAX ? codec_names[codec] : "unknown";
+}
+
+/*
+ *  Per thread context
+ */
+
+/** Per thread decompression context. All requests of a libmicrohttpd thread
+  share the output buffer, and take streams from the pools */
+struct http_codec_ctx {
+	/// Decompressed data, sent to callback directly
+	char *out;
+	/// Initialized streams, ready to be used again
+	struct http_codec_stream *pool[HTTP_CODEC_MAX][HTTP_CODEC_POOL_SIZE];
+	size_t pool_count[HTTP_CODEC_MAX];
+};
+
+static __thread struct http_codec_ctx *thread_ctx = NULL;
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_key_once = PTHREAD_ONCE_INIT;
+
+static void http_codec_stream_free(struct http_codec_stream *stream) {
+	codec_ops[stream->codec].done(stream);
+	free(stream);
+}
+
+static void http_codec_ctx_destroy(void *_ctx) {
+	struct http_codec_ctx *ctx = _ctx;
+	size_t i,j;
+
+	for(i=0;i<HTTP_CODEC_MAX;++i) {
+		for(j=0;j<ctx->pool_count[i];++j) {
+			http_codec_stream_free(ctx->pool[i][j]);
+		}
+	}
+	free(ctx->out);
+	free(ctx);
+}
+
+static void http_codec_ctx_create_key() {
+	pthread_key_create(&thread_ctx_key,http_codec_ctx_destroy);
+}
+
+/// Get (or create) calling thread context
+static struct http_codec_ctx *http_codec_thread_ctx() {
+	if(thread_ctx) {
+		return thread_ctx;
+	}
+
+	pthread_once(&thread_ctx_key_once,http_codec_ctx_create_key);
+	struct http_codec_ctx *ctx = calloc(1,sizeof(*ctx));
+	if(ctx) {
+		ctx->out = malloc(HTTP_CODEC_OUT_SIZE);
+	}
+
+	if(NULL == ctx || NULL == ctx->out) {
+		rdlog(LOG_ERR,"Can't allocate decompression context "
+			"(out of memory?)");
+		free(ctx);
+		return NULL;
+	}
+
+	pthread_setspecific(thread_ctx_key,ctx);
+	return thread_ctx = ctx;
+}
+
+struct http_codec_stream *http_codec_stream_acquire(
+                                                enum http_codec_type codec) {
+	struct http_codec_ctx *ctx = http_codec_thread_ctx();
+	if(ctx && ctx->pool_count[codec] > 0) {
+		return ctx->pool[codec][--ctx->pool_count[codec]];
+	}
+
+	struct http_codec_stream *stream = calloc(1,sizeof(*stream));
+	if(NULL == stream) {
+		rdlog(LOG_ERR,"Can't allocate %s stream (out of memory?)",
+			http_codec_name(codec));
+		return NULL;
+	}
+
+	stream->codec = codec;
+	if(0 != codec_ops[codec].init(stream)) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+void http_codec_stream_release(struct http_codec_stream *stream) {
+	struct http_codec_ctx *ctx = thread_ctx;
+	const enum http_codec_type codec = stream->codec;
+
+	if(ctx && NULL == stream->error &&
+	                ctx->pool_count[codec] < HTTP_CODEC_POOL_SIZE &&
+	                0 == codec_ops[codec].reset(stream)) {
+		ctx->pool[codec][ctx->pool_count[codec]++] = stream;
+	} else {
+		http_codec_stream_free(stream);
+	}
+}
+
+const char *http_codec_stream_error(const struct http_codec_stream *stream) {
+	return stream->error ? stream->error : "no error";
+}
+
+ssize_t http_codec_decompress(struct http_codec_stream *stream,
+		const char *in,size_t in_len,http_codec_output_cb cb,
+		void *opaque,struct http_codec_stats *stats) {
+	const struct http_codec_ops *ops = &codec_ops[stream->codec];
+	struct http_codec_ctx *ctx = http_codec_thread_ctx();
+	const size_t total_in = in_len;
+	uint64_t total_out = 0;
+	size_t out_len = 0;
+	int progress = 0;
+
+	if(NULL == ctx) {
+		stream->error = "no decompression context";
+		ATOMIC_OP(add,fetch,&stats->errors,1);
+		return -1;
+	}
+
+	/* Until input is consumed and there is no more pending output */
+	do {
+		const size_t in_before = in_len;
+		out_len = HTTP_CODEC_OUT_SIZE;
+
+		if(0 != ops->decompress(stream,&in,&in_len,ctx->out,&out_len)) {
+			ATOMIC_OP(add,fetch,&stats->bytes_in,total_in - in_len);
+			ATOMIC_OP(add,fetch,&stats->bytes_out,total_out);
+			ATOMIC_OP(add,fetch,&stats->errors,1);
+			return -1;
+		}
+
+		if(out_len > 0) {
+			total_out += out_len;
+			cb(ctx->out,out_len,opaque);
+		}
+
+		progress = out_len > 0 || in_len < in_before;
+	} while(progress && (in_len > 0 || out_len == HTTP_CODEC_OUT_SIZE));
+
+	ATOMIC_OP(add,fetch,&stats->bytes_in,total_in - in_len);
+	ATOMIC_OP(add,fetch,&stats->bytes_out,total_out);
+	return (ssize_t)(total_in - in_len);
+}
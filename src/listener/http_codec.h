@@ -0,0 +1,111 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// HTTP Content-Encoding decompression codecs
+enum http_codec_type {
+	#define STR_HTTP_CODEC_DEFLATE "deflate"
+	HTTP_CODEC_DEFLATE,
+	#define STR_HTTP_CODEC_GZIP "gzip"
+	HTTP_CODEC_GZIP,
+	/// Only if built with libzstd
+	#define STR_HTTP_CODEC_ZSTD "zstd"
+	HTTP_CODEC_ZSTD,
+	/// LZ4 frame format. Only if built with liblz4
+	#define STR_HTTP_CODEC_LZ4 "lz4"
+	HTTP_CODEC_LZ4,
+	HTTP_CODEC_MAX
+};
+
+/// Default max decompressed body of requests to non streaming decoders
+#define HTTP_CODEC_MAX_DECOMPRESSED_BODY_DEFAULT (64*1024*1024)
+
+/// Codec counters. Updated atomically
+struct http_codec_stats {
+	/// Requests using the codec
+	uint64_t requests;
+	/// Compressed bytes consumed
+	uint64_t bytes_in;
+	/// Decompressed bytes produced
+	uint64_t bytes_out;
+	/// Corrupted streams, and bodies over the decompressed size limit
+	uint64_t errors;
+};
+
+/// Decompression stream of a request
+struct http_codec_stream;
+
+/** Decompressed data callback
+  @param buf Decompressed data. Only valid during the call
+  @param len Data length
+  @param opaque Opaque passed to http_codec_decompress
+  */
+typedef void (*http_codec_output_cb)(char *buf,size_t len,void *opaque);
+
+/** Get the codec of a Content-Encoding header value
+  @param content_encoding Header value. NULL means no header
+  @param codec Codec found
+  @return 0 if codec found, 1 if content is not encoded, -1 if encoding is
+  unknown or support was not built in
+  */
+int http_codec_find(const char *content_encoding,enum http_codec_type *codec);
+
+/** Get codec name
+  @param codec Codec
+  @return Codec name
+  */
+const char *http_codec_name(enum http_codec_type codec);
+
+/** Take a decompression stream from calling thread pool, or create it if the
+  pool is empty
+  @param codec Codec
+  @return New stream, or NULL if error
+  */
+struct http_codec_stream *http_codec_stream_acquire(enum http_codec_type codec);
+
+/** Give back a stream to calling thread pool, so next request can reuse it
+  @param stream Stream
+  */
+void http_codec_stream_release(struct http_codec_stream *stream);
+
+/** Get last stream error
+  @param stream Stream
+  @return Error description
+  */
+const char *http_codec_stream_error(const struct http_codec_stream *stream);
+
+/** Decompress a chunk of a request body. Output is produced in calling thread
+  buffer, and sent to cb in slices without more copies.
+  @param stream Request stream
+  @param in Compressed data
+  @param in_len Compressed data length
+  @param cb Decompressed data callback
+  @param opaque Callback opaque
+  @param stats Codec counters to update
+  @return Input bytes consumed, or -1 if stream is corrupted. Stream can only
+  be released after an error.
+  */
+ssize_t http_codec_decompress(struct http_codec_stream *stream,
+		const char *in,size_t in_len,http_codec_output_cb cb,
+		void *opaque,struct http_codec_stats *stats);
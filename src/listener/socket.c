@@ -16,10 +16,17 @@
 ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* recvmmsg */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "socket.h"
 #include "engine/global_config.h"
 #include "util/util.h"
 #include "util/rb_mac.h"
+#include "util/framing.h"
+#include "util/cpu_affinity.h"
 #include "engine/rb_addr.h"
 
 #include <librd/rdthread.h>
@@ -28,14 +35,20 @@
 #include <jansson.h>
 
 #include <ev.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include <stdlib.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
@@ -57,14 +70,76 @@ enum thread_mode{
 	MODE_POLL,
 	#define STR_MODE_EPOLL "epoll"
 	MODE_EPOLL,
+	#define STR_MODE_IO_URING "io_uring"
+	MODE_IO_URING,
 	MODE_INVALID
 };
 
+/// Default number of datagrams to read in each recvmmsg call
+#define DEFAULT_UDP_BATCH_SIZE 32
+#define MAX_UDP_BATCH_SIZE 1024
+/// Batch fill histogram buckets: 1, 2-3, 4-7, ..., 512-1023, 1024
+#define UDP_BATCH_FILL_BUCKETS 11
+
+/// Ancillary data of every datagram: SO_RXQ_OVFL drops counter
+#define UDP_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+/// Min interval between receive buffer grows
+#define UDP_RCVBUF_GROW_INTERVAL_S 1
+/// Min interval between kernel drops warnings of the same socket
+#define UDP_DROPS_WARN_INTERVAL_S 10
+
+/// recvmmsg receive batch. Buffers are reused in every call
+struct udp_recv_batch {
+	size_t size;
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	struct sockaddr_in6 *addrs;
+	char *controls;
+	char *buffers;
+};
+
+/// UDP socket kernel drops. Shared by all threads reading the socket
+struct udp_socket_stats {
+	/// Last SO_RXQ_OVFL seen. Kernel counter is cumulative and 32 bits
+	uint32_t last_ovfl;
+	/// Datagrams dropped by kernel because receive buffer was full
+	uint64_t drops;
+	/// Datagrams received from this socket
+	uint64_t packets;
+	/// Current receive buffer size, as requested to kernel
+	int rcvbuf;
+	time_t last_grow;
+
+	/// Rate limited warnings
+	time_t last_warn;
+	uint64_t last_warn_drops;
+	uint64_t last_warn_packets;
+} __attribute__((aligned(64)));
+
+struct socket_listener_private;
 struct udp_thread_info{
-	pthread_mutex_t listenfd_mutex;
+	/// Owner listener
+	struct socket_listener_private *listener;
+	/// Thread index
+	size_t idx;
+	/// Socket drops, shared with other threads if socket is shared
+	struct udp_socket_stats *socket;
+	/// Shared listen socket mutex. NULL if thread owns its socket
+	pthread_mutex_t *listenfd_mutex;
 	int listenfd;
+	size_t batch_size;
 	decoder_callback callback;
 	void *callback_opaque;
+
+	/// Per thread counters, to know how traffic spreads between threads
+	struct {
+		uint64_t packets;
+		uint64_t bytes;
+		/// Number of recvmmsg calls that returned data
+		uint64_t batches;
+		/// batch_fill[i] = Batches with [2^i, 2^(i+1)) datagrams
+		uint64_t batch_fill[UDP_BATCH_FILL_BUCKETS];
+	} stats __attribute__((aligned(64)));
 };
 
 static enum thread_mode thread_mode_str(const char *mode_str) {
@@ -76,18 +151,45 @@ static enum thread_mode thread_mode_str(const char *mode_str) {
 		return MODE_POLL;
 	if(0 == strcmp(STR_MODE_EPOLL,mode_str))
 		return MODE_EPOLL;
+	if(0 == strcmp(STR_MODE_IO_URING,mode_str))
+		return MODE_IO_URING;
 	return MODE_INVALID;
 }
 
+static const char *thread_mode_name(enum thread_mode mode) {
+	switch(mode) {
+	case MODE_THREAD_PER_CONNECTION:
+		return STR_MODE_THREAD_PER_CONNECTION;
+	case MODE_SELECT:
+		return STR_MODE_SELECT;
+	case MODE_POLL:
+		return STR_MODE_POLL;
+	case MODE_EPOLL:
+		return STR_MODE_EPOLL;
+	case MODE_IO_URING:
+		return STR_MODE_IO_URING;
+	case MODE_INVALID:
+	default:
+		return "invalid";
+	};
+}
+
 #define READ_BUFFER_SIZE 4096
+/// TCP connection receive buffer limits
+#define TCP_READ_BUFFER_MIN_SIZE READ_BUFFER_SIZE
+#define TCP_READ_BUFFER_MAX_SIZE (256*1024)
+/// Max records sent in the same batch
+#define FRAMING_BATCH_MAX_RECORDS 1024
 static const struct timeval READ_SELECT_TIMEVAL  = {.tv_sec = 20,.tv_usec = 0};
-static const struct timeval WRITE_SELECT_TIMEVAL = {.tv_sec = 5,.tv_usec = 0};
+/// Max time a connection can keep output pending before it is closed
+static const ev_tstamp WRITE_TIMEOUT = 5.;
 #define ERROR_BUFFER_SIZE 256
 static __thread char errbuf[ERROR_BUFFER_SIZE];
 
 static int do_shutdown = 0;
 
-static int createListenSocket(const char *proto,uint16_t listen_port) {
+static int createListenSocket(const char *proto,uint16_t listen_port,
+                                                               int reuseport) {
 	int listenfd = 0;
 	if (NULL == proto) {
 		rdlog(LOG_ERR,"Can't create listen socket: No protocol given");
@@ -114,6 +216,19 @@ static int createListenSocket(const char *proto,uint16_t listen_port) {
 		rdlog(LOG_WARNING,"Error setting socket option: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
 	}
 
+	if(reuseport) {
+		const int so_reuseport_value = 1;
+		const int reuseport_ret = setsockopt(listenfd,SOL_SOCKET,
+			SO_REUSEPORT,&so_reuseport_value,
+			sizeof(so_reuseport_value));
+		if(reuseport_ret < 0) {
+			rdlog(LOG_ERR,"Error setting SO_REUSEPORT: %s",
+				mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+			close(listenfd);
+			return -1;
+		}
+	}
+
 	struct sockaddr_in server_addr;
 	memset(&server_addr,0,sizeof(server_addr));
 
@@ -181,18 +296,6 @@ static int select_socket(int listenfd,struct timeval *tv){
 	return select(listenfd+1,&listenfd_set,NULL,NULL,tv);
 }
 
-static int write_select_socket(int writefd,struct timeval *tv){
-	fd_set writefd_set;
-	FD_ZERO(&writefd_set);
-	FD_SET(writefd,&writefd_set);
-	return select(writefd+1,NULL,&writefd_set,NULL,tv);
-}
-
-static int receive_from_socket(int fd,struct sockaddr_in6 *addr,char *buffer,const size_t buffer_size){
-	socklen_t socklen = (socklen_t)sizeof(*addr);
-	return recvfrom(fd,buffer,buffer_size,MSG_DONTWAIT,(struct sockaddr *)addr,&socklen);
-}
-
 static void process_data_received_from_socket(char *buffer,const size_t recv_result,
         const char *client,decoder_callback callback,void *callback_opaque){
 	if(unlikely(global_config.debug))
@@ -206,28 +309,11 @@ static void process_data_received_from_socket(char *buffer,const size_t recv_res
 	keyval_list_t attrs = keyval_list_initializer(attrs);
 	add_key_value_pair(&attrs,attrs_mem);
 
-	if(unlikely(only_stdout_output())){
-		free(buffer);
-	} else {
+	if(likely(!only_stdout_output())){
 		callback(buffer,recv_result,&attrs,callback_opaque,NULL);
 	}
 }
 
-static int send_to_socket(int fd,const char *data,size_t len){
-	struct timeval tv = WRITE_SELECT_TIMEVAL;
-	const int select_result = write_select_socket(fd,&tv);
-	if(select_result > 0){
-		return write(fd,data,len);
-	}else if(select_result == 0){
-		rdlog(LOG_ERR,"Socket not ready for writing in %ld.%6ld. Closing.",
-			WRITE_SELECT_TIMEVAL.tv_sec,WRITE_SELECT_TIMEVAL.tv_usec);
-		return select_result;
-	}else{
-		rdlog(LOG_ERR,"Error writing to socket: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
-		return select_result;
-	}
-}
-
 struct connection_private {
 	#ifdef CONNECTION_PRIVATE_MAGIC
 	uint64_t magic;
@@ -236,15 +322,311 @@ struct connection_private {
 	void *callback_opaque;
     decoder_callback callback;
     const char *client;
+	enum framing_mode framing;
+
+	/// Reusable receive buffer
+	struct {
+		char *buf;
+		size_t size;
+		/// Bytes in buffer (incomplete record of last wakeup + new data)
+		size_t used;
+		/// Exponential moving average of bytes read in each wakeup
+		size_t avg_read;
+	} rbuf;
+
+	/// Output waiting for the socket to be writable
+	struct {
+		/// Data to send. Not owned, it has to outlive the connection
+		const char *data;
+		size_t len;
+		/// Bytes already sent
+		size_t sent;
+		struct ev_io w_write;
+		/// Close connection if output is not sent in time
+		struct ev_timer w_timeout;
+	} wbuf;
+};
+
+struct socket_listener_private;
+struct worker_args {
+	struct socket_listener_private *accept_private;
+	size_t idx;
+
+	/// Worker receive counters, to compare listener modes
+	struct {
+		uint64_t bytes;
+		/// Read callbacks (epoll) or completion batches (io_uring)
+		uint64_t wakeups;
+	} stats;
 };
 
+/// Stop pending output watchers. Safe if they were never started
+static void connection_wbuf_stop(struct ev_loop *loop,
+                                        struct connection_private *connection) {
+	ev_io_stop(loop,&connection->wbuf.w_write);
+	ev_timer_stop(loop,&connection->wbuf.w_timeout);
+}
+
 static void close_socket_and_stop_watcher(struct ev_loop *loop,struct ev_io *watcher){
+	struct connection_private *connection = watcher->data;
 	ev_io_stop(loop,watcher);
+	connection_wbuf_stop(loop,connection);
 
 	close(watcher->fd);
+	free(connection->rbuf.buf);
 	free(watcher);
 }
 
+static int connection_rbuf_resize(struct connection_private *connection,
+                                                             size_t size) {
+	char *new_buf = realloc(connection->rbuf.buf,size);
+	if(NULL == new_buf) {
+		rdlog(LOG_ERR,"Can't resize %s receive buffer to %zu bytes "
+			"(out of memory?)",connection->client,size);
+		return -1;
+	}
+
+	connection->rbuf.buf = new_buf;
+	connection->rbuf.size = size;
+	return 0;
+}
+
+/** Adapt receive buffer size to the connection traffic: Shrink it if last
+  wakeups read a lot less than its size */
+static void connection_rbuf_adapt(struct connection_private *connection,
+                                                        size_t last_read) {
+	connection->rbuf.avg_read =
+		(connection->rbuf.avg_read*7 + last_read)/8;
+
+	size_t new_size = connection->rbuf.size;
+	while(new_size > TCP_READ_BUFFER_MIN_SIZE &&
+	                        connection->rbuf.avg_read*4 < new_size &&
+	                        connection->rbuf.used <= new_size/2) {
+		new_size /= 2;
+	}
+
+	if(new_size != connection->rbuf.size) {
+		connection_rbuf_resize(connection,new_size);
+	}
+}
+
+/** Drain socket until EAGAIN, or until receive buffer is full and it can't
+  grow more (libev will call us again in this case)
+  @param fd Socket
+  @param connection Connection
+  @param closed Return if the connection was closed or had an error
+  @return Bytes read in this call. They are appended to connection buffer.
+  */
+static size_t connection_drain_socket(int fd,
+                        struct connection_private *connection,int *closed) {
+	size_t used = connection->rbuf.used;
+
+	*closed = 0;
+	while(1) {
+		if(used == connection->rbuf.size) {
+			const size_t new_size = connection->rbuf.size ?
+				2*connection->rbuf.size : TCP_READ_BUFFER_MIN_SIZE;
+
+			if(new_size > TCP_READ_BUFFER_MAX_SIZE ||
+			        0 != connection_rbuf_resize(connection,new_size)) {
+				break;
+			}
+		}
+
+		const ssize_t recv_result = recv(fd,&connection->rbuf.buf[used],
+			connection->rbuf.size - used,MSG_DONTWAIT);
+		if(recv_result > 0) {
+			used += (size_t)recv_result;
+		} else if(recv_result == 0) {
+			*closed = 1;
+			break;
+		} else if(errno == EINTR) {
+			continue;
+		} else if(errno == EAGAIN) {
+			break;
+		} else {
+			rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+			*closed = 1;
+			break;
+		}
+	}
+
+	const size_t read_bytes = used - connection->rbuf.used;
+	connection->rbuf.used = used;
+	return read_bytes;
+}
+
+/// Send records found in connection buffer to decoder
+static void process_framed_records(struct connection_private *connection,
+                const struct framed_record *records,size_t records_count) {
+	size_t i;
+
+	if(records_count > 1 && connection->callback == dumb_decoder &&
+	                                        likely(!only_stdout_output())) {
+		if(unlikely(global_config.debug))
+			rdlog(LOG_DEBUG,"received %zu records from %s",
+				records_count,connection->client);
+		dumb_decoder_batch(records,records_count,
+			connection->callback_opaque);
+		return;
+	}
+
+	for(i=0;i<records_count;++i) {
+		process_data_received_from_socket(records[i].payload,
+			records[i].len,connection->client,connection->callback,
+			connection->callback_opaque);
+	}
+}
+
+/** Split connection buffer in records and send them to decoder. Incomplete
+  last record is kept at the beginning of connection buffer.
+  @param connection Connection
+  @return 0 if success, !0 if stream is malformed
+  */
+static int process_connection_buffer(struct connection_private *connection) {
+	struct framed_record records[FRAMING_BATCH_MAX_RECORDS];
+	size_t offset = 0;
+	size_t records_count = 0;
+
+	do {
+		records_count = FRAMING_BATCH_MAX_RECORDS;
+		const ssize_t consumed = framing_split(connection->framing,
+			&connection->rbuf.buf[offset],
+			connection->rbuf.used - offset,records,&records_count);
+		if(consumed < 0) {
+			rdlog(LOG_ERR,"Malformed %s stream from %s",
+				framing_mode_name(connection->framing),
+				connection->client);
+			return -1;
+		}
+
+		process_framed_records(connection,records,records_count);
+		offset += (size_t)consumed;
+	} while(records_count == FRAMING_BATCH_MAX_RECORDS);
+
+	if(offset == 0 && connection->rbuf.used == TCP_READ_BUFFER_MAX_SIZE) {
+		if(connection->framing != FRAMING_NEWLINE) {
+			rdlog(LOG_ERR,"Record from %s bigger than %d bytes",
+				connection->client,TCP_READ_BUFFER_MAX_SIZE);
+			return -1;
+		}
+
+		/* Can't wait more for the delimiter */
+		rdlog(LOG_WARNING,"Record from %s bigger than %d bytes, "
+			"sending it split",connection->client,
+			TCP_READ_BUFFER_MAX_SIZE);
+		process_data_received_from_socket(connection->rbuf.buf,
+			connection->rbuf.used,connection->client,
+			connection->callback,connection->callback_opaque);
+		offset = connection->rbuf.used;
+	}
+
+	connection->rbuf.used -= offset;
+	if(connection->rbuf.used > 0 && offset > 0) {
+		memmove(connection->rbuf.buf,&connection->rbuf.buf[offset],
+			connection->rbuf.used);
+	}
+
+	return 0;
+}
+
+/** Send as much pending output as socket accepts without blocking
+  @param fd Socket
+  @param connection Connection
+  @return 0 if all output has been sent, 1 if some is still pending, -1 if
+  error
+  */
+static int connection_wbuf_flush(int fd,
+                                struct connection_private *connection) {
+	while(connection->wbuf.sent < connection->wbuf.len) {
+		const ssize_t send_rc = send(fd,
+			&connection->wbuf.data[connection->wbuf.sent],
+			connection->wbuf.len - connection->wbuf.sent,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(send_rc > 0) {
+			connection->wbuf.sent += (size_t)send_rc;
+		} else if(send_rc < 0 && errno == EINTR) {
+			continue;
+		} else if(send_rc < 0 && errno == EAGAIN) {
+			return 1;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/// Socket is writable again: Continue sending pending output
+static void write_cb(struct ev_loop *loop,struct ev_io *w_write,int revents) {
+	struct ev_io *watcher = w_write->data;
+	struct connection_private *connection = watcher->data;
+
+	if(EV_ERROR & revents) {
+		rdlog(LOG_ERR,"Write callback error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+	}
+
+	const int flush_rc = connection_wbuf_flush(watcher->fd,connection);
+	if(flush_rc < 0) {
+		rdlog(LOG_ERR,"Cannot send to %s socket: %s",connection->client,
+			mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+		close_socket_and_stop_watcher(loop,watcher);
+	} else if(flush_rc == 0) {
+		rdlog(LOG_DEBUG,"Pending output to %s sent",connection->client);
+		connection_wbuf_stop(loop,connection);
+	}
+}
+
+static void write_timeout_cb(struct ev_loop *loop,struct ev_timer *w_timeout,
+                                        int revents __attribute__((unused))) {
+	struct ev_io *watcher = w_timeout->data;
+	struct connection_private *connection = watcher->data;
+
+	rdlog(LOG_ERR,"Socket of %s not ready for writing in %.1fs. Closing.",
+		connection->client,WRITE_TIMEOUT);
+	close_socket_and_stop_watcher(loop,watcher);
+}
+
+/** Send data to a connection without blocking the worker. What socket does
+  not accept now is sent when it is writable again.
+  @param loop Connection event loop
+  @param watcher Connection read watcher
+  @param data Data to send. It is not copied, so it has to outlive the
+  connection
+  @param len Data length
+  @return 0 if data was sent or queued, !0 if connection has to be closed
+  */
+static int connection_send(struct ev_loop *loop,struct ev_io *watcher,
+                                        const char *data,size_t len) {
+	struct connection_private *connection = watcher->data;
+
+	if(connection->wbuf.sent < connection->wbuf.len) {
+		rdlog(LOG_ERR,"Can't send to %s: Previous output still pending",
+			connection->client);
+		return -1;
+	}
+
+	connection->wbuf.data = data;
+	connection->wbuf.len = len;
+	connection->wbuf.sent = 0;
+
+	const int flush_rc = connection_wbuf_flush(watcher->fd,connection);
+	if(flush_rc <= 0) {
+		return flush_rc;
+	}
+
+	/* Socket buffer is full: wait for it in the event loop */
+	ev_io_init(&connection->wbuf.w_write,write_cb,watcher->fd,EV_WRITE);
+	connection->wbuf.w_write.data = watcher;
+	ev_timer_init(&connection->wbuf.w_timeout,write_timeout_cb,
+		WRITE_TIMEOUT,0.);
+	connection->wbuf.w_timeout.data = watcher;
+	ev_io_start(loop,&connection->wbuf.w_write);
+	ev_timer_start(loop,&connection->wbuf.w_timeout);
+	return 0;
+}
+
 static void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 
 	if(EV_ERROR & revents) {
@@ -253,58 +635,72 @@ static void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	}
 
 	struct connection_private *connection = (struct connection_private *) watcher->data;
-	struct sockaddr_in6 saddr;
+	int closed = 0;
 
 #ifdef CONNECTION_PRIVATE_MAGIC
 	assert(connection->magic == CONNECTION_PRIVATE_MAGIC);
 #endif
 
-	char *buffer = calloc(READ_BUFFER_SIZE,sizeof(char));
-	const int recv_result = receive_from_socket(watcher->fd,&saddr,buffer,READ_BUFFER_SIZE);
-	if(recv_result > 0){
-		process_data_received_from_socket(buffer,(size_t)recv_result,connection->client,
-		            connection->callback,connection->callback_opaque);
-	}else if(recv_result < 0){
-		if(errno == EAGAIN){
-			rdbg("Socket not ready. re-trying");
-			free(buffer);
-			return;
-		}else{
-			rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
-			free(buffer);
+	const size_t read_bytes = connection_drain_socket(watcher->fd,
+		connection,&closed);
+	struct worker_args *worker_args = ev_userdata(loop);
+	if(worker_args) {
+		worker_args->stats.bytes += read_bytes;
+		worker_args->stats.wakeups++;
+	}
+	if(read_bytes > 0){
+		if(0 != process_connection_buffer(connection)) {
 			close_socket_and_stop_watcher(loop,watcher);
 			return;
 		}
-	}else{ /* recv_result == 0 */
-		free(buffer);
+		connection_rbuf_adapt(connection,read_bytes);
+	}
+
+	if(closed) {
+		if(connection->rbuf.used > 0) {
+			rdlog(LOG_WARNING,"Discarding %zu bytes of incomplete "
+				"record from %s",connection->rbuf.used,
+				connection->client);
+		}
 		close_socket_and_stop_watcher(loop,watcher);
 		return;
 	}
 
+	if(0 == read_bytes) {
+		rdbg("Socket not ready. re-trying");
+		return;
+	}
+
 	if(NULL!=global_config.response && !connection->first_response_sent){
-		int send_ret = 1;
 		rdlog(LOG_DEBUG,"Sending first response...");
+		connection->first_response_sent = 1;
 
 		if(global_config.response_len == 0){
 			rdlog(LOG_ERR,"Can't send first response to %s: size of response == 0",connection->client);
-			connection->first_response_sent = 1;
-		} else {
-			send_ret = send_to_socket(watcher->fd,global_config.response,(size_t)global_config.response_len-1);
-		}
-
-		if(send_ret <= 0){
+		} else if(0 != connection_send(loop,watcher,global_config.response,
+		                        (size_t)global_config.response_len-1)) {
 			rdlog(LOG_ERR,"Cannot send first response to %s socket: %s",
 				connection->client, mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
 			close_socket_and_stop_watcher(loop,watcher);
+			return;
 		}
-		
-		rdlog(LOG_DEBUG,"first response ok");
-		connection->first_response_sent = 1;
 	}
 }
 
 #define SOCKET_LISTENER_PRIVATE_MAGIC 0xB0C31331AEA1CL
 
+/// Max connections accepted in the same worker wakeup in reuseport mode
+#define TCP_ACCEPT_BATCH_SIZE 64
+
+/// TCP worker own listen socket, in reuseport mode
+struct tcp_worker_accept {
+	/// Accept watcher. Need to be the first member
+	struct ev_io w_accept;
+	int listenfd;
+	/// Accepted connections
+	uint64_t accepted;
+};
+
 struct socket_listener_private {
 #ifdef SOCKET_LISTENER_PRIVATE_MAGIC
 	uint64_t magic;
@@ -318,6 +714,18 @@ struct socket_listener_private {
 		uint16_t listen_port;
 		size_t threads;
 		bool tcp_keepalive;
+		/// Every thread binds its own socket with SO_REUSEPORT
+		int reuseport;
+		/// Max datagrams read per recvmmsg call
+		int udp_batch_size;
+		/// UDP SO_RCVBUF at start, 0 means kernel default
+		int udp_rcvbuf;
+		/// Grow UDP SO_RCVBUF up to this size when kernel drops, 0 never
+		int udp_rcvbuf_max;
+		/// TCP stream framing
+		enum framing_mode framing;
+		/// Worker threads CPU affinity
+		struct cpu_affinity affinity;
 		enum thread_mode thread_mode;
 		decoder_callback callback;
 		void *callback_opaque;
@@ -329,8 +737,115 @@ struct socket_listener_private {
 	rd_fifoq_t watchers_queue[MAX_NUM_THREADS];
 
 	size_t accept_current_worker_idx;
+	/// Reuseport mode per worker accept
+	struct tcp_worker_accept tcp_accepts[MAX_NUM_THREADS];
+
+	struct udp_thread_info udp_threads[MAX_NUM_THREADS];
+	/// One per thread in reuseport mode, or only the first one
+	struct udp_socket_stats udp_sockets[MAX_NUM_THREADS];
 };
 
+/** Check and prepare a just accepted connection socket
+  @param client_sd Client socket
+  @param client_saddr Client address
+  @param accept_private Listener private data
+  @param client_buf Buffer to print client address
+  @param client_buf_size Size of client_buf
+  @return Client address string, or NULL if connection was rejected or any
+  error happened (socket is closed in that case)
+  */
+static const char *accept_connection(int client_sd,
+                        struct sockaddr_in *client_saddr,
+                        const struct socket_listener_private *accept_private,
+                        char *client_buf,size_t client_buf_size) {
+	const char *client_addr = sockaddr2str(client_buf,client_buf_size,
+		(struct sockaddr *)client_saddr);
+	if(NULL == client_addr) {
+		rdlog(LOG_ERR,"couldn't get client address");
+		close(client_sd);
+		return NULL;
+	}
+
+	if(!client_addr_allowed((const struct sockaddr *)client_saddr)) {
+		if(global_config.debug)
+			rdbg("Connection rejected: %s not allowed",client_addr);
+		close(client_sd);
+		return NULL;
+	}else if(global_config.debug){
+		print_accepted_connection_log(client_saddr);
+	}
+
+	if(accept_private->config.tcp_keepalive)
+		set_keepalive_opt(client_sd);
+	set_nonblock_flag(client_sd);
+
+	if(accept_private->config.thread_mode == MODE_THREAD_PER_CONNECTION) {
+		rdlog(LOG_ERR,"Mode " STR_MODE_THREAD_PER_CONNECTION "still not implemented");
+		exit(-1);
+	}
+
+	return client_addr;
+}
+
+/** Initialize connection private data
+  @param conn_priv Connection private data
+  @param accept_private Listener private data
+  @param client Client address string storage, just after connection in the
+  same allocation
+  @param client_addr Client address
+  @param client_addr_len Client address length
+  */
+static void connection_private_init(struct connection_private *conn_priv,
+                        const struct socket_listener_private *accept_private,
+                        char *client,const char *client_addr,
+                        size_t client_addr_len) {
+#if CONNECTION_PRIVATE_MAGIC
+	conn_priv->magic = CONNECTION_PRIVATE_MAGIC;
+#endif
+	conn_priv->callback = accept_private->config.callback;
+	conn_priv->callback_opaque = accept_private->config.callback_opaque;
+	conn_priv->framing = accept_private->config.framing;
+	conn_priv->client = strncat(client,client_addr,client_addr_len+1);
+}
+
+/** Prepare the watcher of a just accepted connection
+  @param client_sd Client socket
+  @param client_saddr Client address
+  @param accept_private Listener private data
+  @return Client watcher, or NULL if connection was rejected or any error
+  happened (socket is closed in that case)
+  */
+static struct ev_io *new_connection_watcher(int client_sd,
+                        struct sockaddr_in *client_saddr,
+                        struct socket_listener_private *accept_private) {
+	char client_buf[BUFSIZ];
+
+	const char *client_addr = accept_connection(client_sd,client_saddr,
+		accept_private,client_buf,sizeof(client_buf));
+	if(NULL == client_addr) {
+		return NULL;
+	}
+	const size_t client_addr_len = strlen(client_addr);
+
+	/* Set watcher. Private data just after watcher */
+	struct ev_io *w_client = calloc(1,
+		sizeof(struct ev_io)+sizeof(struct connection_private)+client_addr_len+1);
+	if(unlikely(NULL == w_client)) {
+		rdlog(LOG_ERR,"Can't allocate client %s private data",client_addr);
+		close(client_sd);
+		return NULL;
+	}
+
+	struct connection_private *conn_priv = NULL;
+	w_client->data = conn_priv = (struct connection_private *)&w_client[1];
+	connection_private_init(conn_priv,accept_private,(char *)&conn_priv[1],
+		client_addr,client_addr_len);
+
+	ev_io_init(w_client, read_cb, client_sd, EV_READ);
+	return w_client;
+}
+
+/// Round robin mode accept: Send accepted connections to worker threads
 static void accept_cb(struct ev_loop *loop __attribute__((unused)), 
                       struct ev_io *watcher,int revents){
 	struct sockaddr_in client_saddr;
@@ -338,12 +853,10 @@ static void accept_cb(struct ev_loop *loop __attribute__((unused)),
 	struct socket_listener_private *accept_private = 
 		(struct socket_listener_private *)watcher->data;
 	int client_sd;
-	char client_buf[BUFSIZ];
 	char buf[512];
 
 	if(EV_ERROR & revents) {
-		strerror_r(errno,buf,sizeof(buf));
-		rdlog(LOG_ERR,"Invalid event: %s",buf);
+		rdlog(LOG_ERR,"Invalid event: %s",mystrerror(errno,buf,sizeof(buf)));
 		return;
 	}
 
@@ -351,71 +864,67 @@ static void accept_cb(struct ev_loop *loop __attribute__((unused)),
 		&client_len);
 
 	if(client_sd < 0) {
-		strerror_r(errno,buf,sizeof(buf));
-		rdlog(LOG_ERR,"accept error: %s",buf);
+		rdlog(LOG_ERR,"accept error: %s",mystrerror(errno,buf,sizeof(buf)));
 		return;
 	}
 
-	const char *client_addr = sockaddr2str(client_buf, sizeof(client_buf), 
-		(struct sockaddr *)&client_saddr);
-	if(NULL == client_addr) {
-		rdlog(LOG_ERR,"couldn't get client address");
+	struct ev_io *w_client = new_connection_watcher(client_sd,&client_saddr,
+		accept_private);
+	if(NULL == w_client) {
 		return;
 	}
-	const size_t client_addr_len = strlen(client_addr);
 
-	if(in_addr_list_contains(global_config.blacklist,&client_saddr.sin_addr)) {
-		if(global_config.debug)
-			rdbg("Connection rejected: %s in blacklist",client_addr);
-		close(client_sd);
-		return;
-	}else if(global_config.debug){
-		print_accepted_connection_log((struct sockaddr_in *)&client_saddr);
-	}
+	const size_t cur_idx = accept_private->accept_current_worker_idx++;
+	if(accept_private->accept_current_worker_idx >= accept_private->config.threads)
+		accept_private->accept_current_worker_idx = 0;
 
-	if(accept_private->config.tcp_keepalive)
-		set_keepalive_opt(client_sd);
-	set_nonblock_flag(client_sd);
+	rdbg("Sent connection of %s to worker thread %zu",
+		((struct connection_private *)w_client->data)->client,cur_idx);
 
-	if(accept_private->config.thread_mode == MODE_THREAD_PER_CONNECTION) {
-		rdlog(LOG_ERR,"Mode " STR_MODE_THREAD_PER_CONNECTION "still not implemented");
-		exit(-1);
-	} else {
-		/* Set watcher. Private data just after watcher */
-		struct ev_io *w_client = calloc(1,
-			sizeof(struct ev_io)+sizeof(struct connection_private)+client_addr_len+1);
-		if(unlikely(NULL == w_client)) {
-			rdlog(LOG_ERR,"Can't allocate client %s private data",client_addr);
-		} else {
-			struct connection_private *conn_priv = NULL;
-			w_client->data = conn_priv = (struct connection_private *)&w_client[1];
-#if CONNECTION_PRIVATE_MAGIC
-			conn_priv->magic = CONNECTION_PRIVATE_MAGIC;
-#endif
-			conn_priv->callback = accept_private->config.callback;
-			conn_priv->callback_opaque = accept_private->config.callback_opaque;
+	rd_fifoq_add(&accept_private->watchers_queue[cur_idx],w_client);
+	ev_async_send(accept_private->event_loops[cur_idx],
+		&accept_private->event_asyncs[cur_idx]);
+}
 
-			const size_t cur_idx = accept_private->accept_current_worker_idx++;
-			if(accept_private->accept_current_worker_idx >= accept_private->config.threads)
-				accept_private->accept_current_worker_idx = 0;
+/** Reuseport mode accept: Every worker accepts connections from its own
+  listen socket, and watch them in its own loop */
+static void worker_accept_cb(struct ev_loop *loop,struct ev_io *watcher,
+                                                                int revents) {
+	struct tcp_worker_accept *worker_accept =
+		(struct tcp_worker_accept *)watcher;
+	struct socket_listener_private *accept_private = watcher->data;
+	char buf[512];
+	size_t i;
 
-			conn_priv->client = strncat((char *)&conn_priv[1],client_addr,client_addr_len+1);
+	if(EV_ERROR & revents) {
+		rdlog(LOG_ERR,"Invalid event: %s",mystrerror(errno,buf,sizeof(buf)));
+		return;
+	}
 
-			rdbg("Sent connection of %s to worker thread %zu",client_addr,cur_idx);
+	/* Listen socket is non-blocking, accept all pending connections */
+	for(i=0;i<TCP_ACCEPT_BATCH_SIZE;++i) {
+		struct sockaddr_in client_saddr;
+		socklen_t client_len = sizeof(client_saddr);
+
+		const int client_sd = accept(watcher->fd,
+			(struct sockaddr *)&client_saddr,&client_len);
+		if(client_sd < 0) {
+			if(errno != EAGAIN && errno != EINTR) {
+				rdlog(LOG_ERR,"accept error: %s",
+					mystrerror(errno,buf,sizeof(buf)));
+			}
+			break;
+		}
 
-			ev_io_init(w_client, read_cb, client_sd, EV_READ);
-			rd_fifoq_add(&accept_private->watchers_queue[cur_idx],w_client);
-			ev_async_send(accept_private->event_loops[cur_idx],
-				&accept_private->event_asyncs[cur_idx]);
+		struct ev_io *w_client = new_connection_watcher(client_sd,
+			&client_saddr,accept_private);
+		if(NULL != w_client) {
+			worker_accept->accepted++;
+			ev_io_start(loop,w_client);
 		}
 	}
 }
 
-struct worker_args {
-	struct socket_listener_private *accept_private;
-	size_t idx;
-};
-
 static void async_cb(struct ev_loop *loop, ev_async *w __attribute__((unused)),
 	int revents) {
 	struct worker_args *args = ev_userdata(loop);
@@ -423,8 +932,7 @@ static void async_cb(struct ev_loop *loop, ev_async *w __attribute__((unused)),
 	char buf[512];
 
 	if(EV_ERROR & revents) {
-		strerror_r(errno,buf,sizeof(buf));
-		rdlog(LOG_ERR,"Invalid event: %s",buf);
+		rdlog(LOG_ERR,"Invalid event: %s",mystrerror(errno,buf,sizeof(buf)));
 		return;
 	}
 
@@ -448,16 +956,113 @@ static void async_cb(struct ev_loop *loop, ev_async *w __attribute__((unused)),
 	}
 }
 
+/** Pin calling listener thread to its CPU
+  @param priv Listener
+  @param thread_kind Thread kind to log
+  @param idx Thread index
+  */
+static void pin_listener_thread(const struct socket_listener_private *priv,
+                                const char *thread_kind,size_t idx) {
+	char thread_name[64];
+
+	snprintf(thread_name,sizeof(thread_name),"Listener %"PRIu16" %s %zu",
+		priv->config.listen_port,thread_kind,idx);
+	cpu_affinity_pin_thread(&priv->config.affinity,idx,thread_name);
+}
+
+/** Log calling listener thread CPU usage, so listener modes can be compared
+  on the same machine
+  @param priv Listener
+  @param thread_kind Thread kind to log
+  @param idx Thread index
+  @param bytes Bytes received by the thread
+  @param wakeups Times the thread woke up to receive data
+  */
+static void log_thread_cpu_usage(const struct socket_listener_private *priv,
+                                const char *thread_kind,size_t idx,
+                                uint64_t bytes,uint64_t wakeups) {
+	struct timespec cpu_time;
+
+	if(0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_time)) {
+		rdlog(LOG_ERR,"Can't get thread CPU time: %s",
+			mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+		return;
+	}
+
+	const double cpu_s = (double)cpu_time.tv_sec +
+		(double)cpu_time.tv_nsec/1e9;
+	const double gbytes = (double)bytes/(1024.0*1024.0*1024.0);
+
+	rdlog(LOG_INFO,"Listener %"PRIu16" (%s) %s %zu: %"PRIu64" bytes in "
+		"%"PRIu64" wakeups, %.3f CPU s (%.3f CPU s/GB)",
+		priv->config.listen_port,
+		thread_mode_name(priv->config.thread_mode),thread_kind,idx,
+		bytes,wakeups,cpu_s,gbytes > 0 ? cpu_s/gbytes : 0.0);
+}
+
 static void *worker(void *_worker_arg) {
 	struct worker_args *worker_args = _worker_arg;
 
+	/* Connection buffers are allocated in worker thread, so they will be
+	   in the same NUMA node */
+	pin_listener_thread(worker_args->accept_private,"TCP worker",
+		worker_args->idx);
+
 	ev_run(worker_args->accept_private->event_loops[worker_args->idx],0);
 
+	log_thread_cpu_usage(worker_args->accept_private,"TCP worker",
+		worker_args->idx,worker_args->stats.bytes,
+		worker_args->stats.wakeups);
 	free(worker_args);
 
 	return NULL;
 }
 
+/** Start reuseport mode worker accept. Worker 0 uses listener socket, and
+  the rest create their own.
+  @param listenfd Listener socket
+  @param priv Listener
+  @param idx Worker index
+  */
+static void start_worker_accept(int listenfd,
+                        struct socket_listener_private *priv,size_t idx) {
+	struct tcp_worker_accept *worker_accept = &priv->tcp_accepts[idx];
+
+	worker_accept->listenfd = idx == 0 ? listenfd :
+		createListenSocket(priv->config.proto,priv->config.listen_port,1);
+	if(worker_accept->listenfd <= 0) {
+		rdlog(LOG_ERR,"Can't create worker %zu listen socket, it will "
+			"not accept connections",idx);
+		worker_accept->listenfd = -1;
+		return;
+	}
+
+	set_nonblock_flag(worker_accept->listenfd);
+	ev_io_init(&worker_accept->w_accept,worker_accept_cb,
+		worker_accept->listenfd,EV_READ);
+	worker_accept->w_accept.data = priv;
+	ev_io_start(priv->event_loops[idx],&worker_accept->w_accept);
+}
+
+/// Stop reuseport mode worker accept. Worker loop must be stopped.
+static void stop_worker_accept(int listenfd,
+                        struct socket_listener_private *priv,size_t idx) {
+	struct tcp_worker_accept *worker_accept = &priv->tcp_accepts[idx];
+
+	if(worker_accept->listenfd < 0) {
+		return;
+	}
+
+	rdlog(LOG_INFO,"Listener %"PRIu16" TCP worker %zu accepted %"PRIu64
+		" connections",priv->config.listen_port,idx,
+		worker_accept->accepted);
+
+	ev_io_stop(priv->event_loops[idx],&worker_accept->w_accept);
+	if(worker_accept->listenfd != listenfd) {
+		close(worker_accept->listenfd);
+	}
+}
+
 static void main_tcp_loop(int listenfd,struct socket_listener_private *priv) {
 	priv->event_loop = ev_loop_new(0);
 	struct ev_io w_accept = {
@@ -471,7 +1076,9 @@ static void main_tcp_loop(int listenfd,struct socket_listener_private *priv) {
 
 	ev_io_init((&w_accept),accept_cb,listenfd,EV_READ);
 	ev_async_init((&priv->w_async),async_cb);
-	ev_io_start(priv->event_loop,&w_accept);
+	if(!priv->config.reuseport) {
+		ev_io_start(priv->event_loop,&w_accept);
+	}
 	ev_async_start(priv->event_loop,&priv->w_async);
 
 	size_t i;
@@ -499,6 +1106,10 @@ static void main_tcp_loop(int listenfd,struct socket_listener_private *priv) {
 		priv->event_asyncs[i].data = priv;
 		ev_async_start(priv->event_loops[i],&priv->event_asyncs[i]);
 
+		if(priv->config.reuseport) {
+			start_worker_accept(listenfd,priv,i);
+		}
+
 		pthread_create(&priv->threads[i],NULL,worker,args);
 	}
 
@@ -513,78 +1124,1166 @@ static void main_tcp_loop(int listenfd,struct socket_listener_private *priv) {
 		ev_async_send(priv->event_loops[i],&priv->event_asyncs[i]);
 		pthread_join(priv->threads[i],NULL);
 
+		if(priv->config.reuseport) {
+			stop_worker_accept(listenfd,priv,i);
+		}
+
 		ev_async_stop(priv->event_loops[i],&priv->event_asyncs[i]);
 		ev_loop_destroy(priv->event_loops[i]);
 	}
 
 	ev_async_stop(priv->event_loop,&priv->w_async);
-	ev_io_stop(priv->event_loop,&w_accept);
+	if(!priv->config.reuseport) {
+		ev_io_stop(priv->event_loop,&w_accept);
+	}
 
 	ev_loop_destroy(priv->event_loop);
 }
 
-/// @TODO join with TCP
-static void *main_consumer_loop_udp(void *_thread_info){
-	struct udp_thread_info *thread_info = _thread_info;
-	while(!do_shutdown){
-		struct sockaddr_in6 addr;
-		char addr_buf[BUFSIZ];
-		int recv_result = 0;
-		struct timeval tv = {.tv_sec = 1,.tv_usec = 0};
-		char *buffer = calloc(READ_BUFFER_SIZE,sizeof(char));
-		pthread_mutex_lock(&thread_info->listenfd_mutex);
-		if(likely(!do_shutdown)){
-			int select_result = select_socket(thread_info->listenfd,&tv);
-			if(select_result==-1 && errno!=EINTR){ /* NOT INTERRUPTED */
-				rdlog(LOG_ERR,"listen select error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
-			}else if(select_result>0){
-				recv_result = receive_from_socket(thread_info->listenfd,&addr,buffer,READ_BUFFER_SIZE);
-			}
-		}
-		pthread_mutex_unlock(&thread_info->listenfd_mutex);
+static int init_udp_recv_batch(struct udp_recv_batch *batch,size_t size) {
+	size_t i;
 
-		if(recv_result < 0){
-			if(errno == EAGAIN) {
-				rdbg("Socket not ready. re-trying");
-				free(buffer);
-			} else {
-				rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
-				free(buffer);
-				break;
-			}
-		} else {
-			const char *client_addr = sockaddr2str(addr_buf, sizeof(addr_buf), 
-				(struct sockaddr *)&addr);
-			process_data_received_from_socket(buffer,(size_t)recv_result,client_addr,
-				thread_info->callback,thread_info->callback_opaque);
-		}
+	memset(batch,0,sizeof(*batch));
+	batch->msgs = calloc(size,sizeof(batch->msgs[0]));
+	batch->iovecs = calloc(size,sizeof(batch->iovecs[0]));
+	batch->addrs = calloc(size,sizeof(batch->addrs[0]));
+	batch->controls = calloc(size,UDP_CONTROL_SIZE);
+	batch->buffers = malloc(size*READ_BUFFER_SIZE);
+
+	if(!batch->msgs || !batch->iovecs || !batch->addrs || !batch->controls
+	                                                || !batch->buffers) {
+		rdlog(LOG_ERR,"Can't allocate UDP receive batch (out of memory?)");
+		free(batch->msgs);
+		free(batch->iovecs);
+		free(batch->addrs);
+		free(batch->controls);
+		free(batch->buffers);
+		return -1;
 	}
 
-	return NULL;
+	batch->size = size;
+	for(i=0;i<size;++i) {
+		batch->iovecs[i].iov_base = &batch->buffers[i*READ_BUFFER_SIZE];
+		batch->iovecs[i].iov_len = READ_BUFFER_SIZE;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_control =
+			&batch->controls[i*UDP_CONTROL_SIZE];
+	}
+
+	return 0;
 }
 
-static void main_udp_loop(int listenfd,size_t udp_threads,
-        decoder_callback callback,void *callback_opaque){
-	/* Lots of threads listening  and processing*/
-	unsigned int i;
-	struct udp_thread_info udp_thread_info;
-	udp_thread_info.listenfd = listenfd;
-	udp_thread_info.callback = callback;
-	udp_thread_info.callback_opaque = callback_opaque;
+static void udp_recv_batch_done(struct udp_recv_batch *batch) {
+	free(batch->msgs);
+	free(batch->iovecs);
+	free(batch->addrs);
+	free(batch->controls);
+	free(batch->buffers);
+}
+
+/// Read as many datagrams as available (up to batch size) without blocking
+static int udp_recv_batch(int fd,struct udp_recv_batch *batch) {
+	size_t i;
+	for(i=0;i<batch->size;++i) {
+		/* Kernel overwrites them in every call */
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+		batch->msgs[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+		batch->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	return recvmmsg(fd,batch->msgs,(unsigned int)batch->size,MSG_DONTWAIT,
+									NULL);
+}
+
+static size_t udp_batch_fill_bucket(size_t n) {
+	size_t bucket = 0;
+	while(n >>= 1) {
+		bucket++;
+	}
+	return bucket < UDP_BATCH_FILL_BUCKETS ? bucket :
+						UDP_BATCH_FILL_BUCKETS - 1;
+}
+
+/** Enable kernel drops reporting in UDP socket, and set its receive buffer
+  @param fd Socket
+  @param sock Socket stats
+  @param rcvbuf Receive buffer size to set, 0 to keep kernel default
+  */
+static void udp_socket_init(int fd,struct udp_socket_stats *sock,int rcvbuf) {
+	const int one = 1;
+	int actual_rcvbuf = 0;
+	socklen_t optlen = sizeof(actual_rcvbuf);
+
+	memset(sock,0,sizeof(*sock));
+	if(0 != setsockopt(fd,SOL_SOCKET,SO_RXQ_OVFL,&one,sizeof(one))) {
+		rdlog(LOG_WARNING,"Can't set SO_RXQ_OVFL, kernel drops will not "
+			"be reported: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+	}
+
+	if(rcvbuf > 0 && 0 != setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,
+	                                                sizeof(rcvbuf))) {
+		rdlog(LOG_WARNING,"Can't set UDP SO_RCVBUF to %d: %s",rcvbuf,
+			mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+	}
+
+	/* Kernel reports twice the requested size (bookkeeping overhead) */
+	if(0 == getsockopt(fd,SOL_SOCKET,SO_RCVBUF,&actual_rcvbuf,&optlen)) {
+		sock->rcvbuf = actual_rcvbuf/2;
+	}
+}
+
+/** Search SO_RXQ_OVFL in datagram ancillary data
+  @param msg Received message header
+  @param ovfl Kernel drops counter found
+  @return 1 if found, 0 in other case
+  */
+static int udp_msg_ovfl(struct msghdr *msg,uint32_t *ovfl) {
+	struct cmsghdr *cmsg;
+
+	for(cmsg = CMSG_FIRSTHDR(msg);cmsg;cmsg = CMSG_NXTHDR(msg,cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET &&
+		                                cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(ovfl,CMSG_DATA(cmsg),sizeof(*ovfl));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Double socket receive buffer, up to configured max
+  @param thread_info Thread that saw the drops
+  @param fd Socket
+  @param now Current time
+  */
+static void udp_socket_grow_rcvbuf(struct udp_thread_info *thread_info,
+                                                        int fd,time_t now) {
+	struct udp_socket_stats *sock = thread_info->socket;
+	const int rcvbuf_max = thread_info->listener->config.udp_rcvbuf_max;
+	time_t last_grow = ATOMIC_OP(fetch,add,&sock->last_grow,0);
+	int rcvbuf = ATOMIC_OP(fetch,add,&sock->rcvbuf,0);
+
+	if(rcvbuf >= rcvbuf_max || now - last_grow < UDP_RCVBUF_GROW_INTERVAL_S
+	                || !__atomic_compare_exchange_n(&sock->last_grow,
+	                        &last_grow,now,0,__ATOMIC_SEQ_CST,
+	                        __ATOMIC_SEQ_CST)) {
+		/* Max reached, or other thread already did it */
+		return;
+	}
+
+	rcvbuf = rcvbuf > rcvbuf_max/2 ? rcvbuf_max : 2*rcvbuf;
+	/* FORCE ignores net.core.rmem_max, but needs CAP_NET_ADMIN */
+	if(0 != setsockopt(fd,SOL_SOCKET,SO_RCVBUFFORCE,&rcvbuf,sizeof(rcvbuf))
+	                && 0 != setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,
+	                                                        sizeof(rcvbuf))) {
+		rdlog(LOG_ERR,"Can't grow UDP port %"PRIu16" SO_RCVBUF to %d: %s",
+			thread_info->listener->config.listen_port,rcvbuf,
+			mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+		return;
+	}
+
+	__atomic_store_n(&sock->rcvbuf,rcvbuf,__ATOMIC_SEQ_CST);
+	rdlog(LOG_INFO,"UDP port %"PRIu16" thread %zu: kernel dropped datagrams,"
+		" receive buffer grown to %d bytes (max %d)",
+		thread_info->listener->config.listen_port,thread_info->idx,
+		rcvbuf,rcvbuf_max);
+}
+
+/// Log kernel drops since last warning, at most once per interval
+static void udp_socket_warn_drops(struct udp_thread_info *thread_info,
+                                                                time_t now) {
+	struct udp_socket_stats *sock = thread_info->socket;
+	time_t last_warn = ATOMIC_OP(fetch,add,&sock->last_warn,0);
+
+	if(now - last_warn < UDP_DROPS_WARN_INTERVAL_S ||
+	                !__atomic_compare_exchange_n(&sock->last_warn,
+	                        &last_warn,now,0,__ATOMIC_SEQ_CST,
+	                        __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	const uint64_t drops = ATOMIC_OP(fetch,add,&sock->drops,0);
+	const uint64_t packets = ATOMIC_OP(fetch,add,&sock->packets,0);
+	const uint64_t interval_drops = drops -
+		__atomic_exchange_n(&sock->last_warn_drops,drops,
+							__ATOMIC_SEQ_CST);
+	const uint64_t interval_packets = packets -
+		__atomic_exchange_n(&sock->last_warn_packets,packets,
+							__ATOMIC_SEQ_CST);
+	const uint64_t interval_total = interval_drops + interval_packets;
+
+	rdlog(LOG_WARNING,"UDP port %"PRIu16" thread %zu: kernel dropped %"
+		PRIu64" datagrams since last warning (%.2f%% drop rate), %"
+		PRIu64" total, receive buffer %d bytes",
+		thread_info->listener->config.listen_port,thread_info->idx,
+		interval_drops,interval_total ?
+			100.0*(double)interval_drops/(double)interval_total : 0.0,
+		drops,ATOMIC_OP(fetch,add,&sock->rcvbuf,0));
+}
+
+/** Account received datagrams and kernel drops of a socket
+  @param thread_info Thread that received datagrams
+  @param fd Socket
+  @param n_msgs Received datagrams
+  @param has_ovfl Some datagram had SO_RXQ_OVFL
+  @param ovfl Newest SO_RXQ_OVFL value found
+  */
+static void udp_socket_stats_add(struct udp_thread_info *thread_info,int fd,
+                                size_t n_msgs,int has_ovfl,uint32_t ovfl) {
+	struct udp_socket_stats *sock = thread_info->socket;
+	uint64_t new_drops = 0;
+
+	ATOMIC_OP(add,fetch,&sock->packets,n_msgs);
+	if(!has_ovfl) {
+		return;
+	}
+
+	/* Other threads can be reading the same socket */
+	uint32_t last_ovfl = ATOMIC_OP(fetch,add,&sock->last_ovfl,0);
+	while((int32_t)(ovfl - last_ovfl) > 0) {
+		if(__atomic_compare_exchange_n(&sock->last_ovfl,&last_ovfl,ovfl,
+		                0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)) {
+			new_drops = ovfl - last_ovfl;
+			break;
+		}
+	}
+
+	if(0 == new_drops) {
+		return;
+	}
+
+	ATOMIC_OP(add,fetch,&sock->drops,new_drops);
+	const time_t now = time(NULL);
+	if(thread_info->listener->config.udp_rcvbuf_max > 0) {
+		udp_socket_grow_rcvbuf(thread_info,fd,now);
+	}
+	udp_socket_warn_drops(thread_info,now);
+}
+
+/// Send a received datagram to decoder, if its sender is allowed
+static void process_udp_datagram(struct udp_thread_info *thread_info,
+                        const struct sockaddr *sa,char *buffer,size_t len) {
+	if(!client_addr_allowed(sa)) {
+		return;
+	}
+
+	/* Same sensors send over and over: avoid printing its addr */
+	const struct rb_addr_str *client_addr = rb_addr_cache_get(sa);
+	if(NULL == client_addr) {
+		return;
+	}
+	process_data_received_from_socket(buffer,len,client_addr->str,
+		thread_info->callback,thread_info->callback_opaque);
+}
+
+/// Account a batch of received datagrams in thread counters
+static void udp_thread_stats_add(struct udp_thread_info *thread_info,
+                                                size_t n_msgs,uint64_t bytes) {
+	ATOMIC_OP(add,fetch,&thread_info->stats.packets,n_msgs);
+	ATOMIC_OP(add,fetch,&thread_info->stats.bytes,bytes);
+	ATOMIC_OP(add,fetch,&thread_info->stats.batches,1);
+	ATOMIC_OP(add,fetch,
+		&thread_info->stats.batch_fill[udp_batch_fill_bucket(n_msgs)],1);
+}
+
+static void process_udp_batch(struct udp_thread_info *thread_info,
+                       struct udp_recv_batch *batch,size_t n_msgs) {
+	size_t i;
+	uint64_t bytes = 0;
+	uint32_t ovfl = 0;
+	int has_ovfl = 0;
+
+	for(i=0;i<n_msgs;++i) {
+		struct mmsghdr *msg = &batch->msgs[i];
+
+		bytes += msg->msg_len;
+		/* Kernel only sends it if socket has dropped something */
+		has_ovfl |= udp_msg_ovfl(&msg->msg_hdr,&ovfl);
+		process_udp_datagram(thread_info,
+			(const struct sockaddr *)&batch->addrs[i],
+			batch->iovecs[i].iov_base,msg->msg_len);
+	}
+
+	udp_thread_stats_add(thread_info,n_msgs,bytes);
+	udp_socket_stats_add(thread_info,thread_info->listenfd,n_msgs,has_ovfl,
+		ovfl);
+}
+
+/// @TODO join with TCP
+static void *main_consumer_loop_udp(void *_thread_info){
+	struct udp_thread_info *thread_info = _thread_info;
+	struct udp_recv_batch batch;
+
+	/* Pin before allocate receive buffers */
+	pin_listener_thread(thread_info->listener,"UDP thread",thread_info->idx);
+
+	if(0 != init_udp_recv_batch(&batch,thread_info->batch_size)) {
+		return NULL;
+	}
+
+	while(!do_shutdown){
+		int recv_result = 0;
+		struct timeval tv = {.tv_sec = 1,.tv_usec = 0};
+		if(thread_info->listenfd_mutex) {
+			pthread_mutex_lock(thread_info->listenfd_mutex);
+		}
+		if(likely(!do_shutdown)){
+			/* Only wait in select if there is nothing to read */
+			recv_result = udp_recv_batch(thread_info->listenfd,&batch);
+			if(recv_result < 0 && errno == EAGAIN) {
+				recv_result = 0;
+				int select_result = select_socket(thread_info->listenfd,&tv);
+				if(select_result==-1 && errno!=EINTR){ /* NOT INTERRUPTED */
+					rdlog(LOG_ERR,"listen select error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+				}else if(select_result>0){
+					recv_result = udp_recv_batch(thread_info->listenfd,&batch);
+				}
+			}
+		}
+		if(thread_info->listenfd_mutex) {
+			pthread_mutex_unlock(thread_info->listenfd_mutex);
+		}
+
+		if(recv_result < 0){
+			if(errno == EAGAIN || errno == EINTR) {
+				rdbg("Socket not ready. re-trying");
+			} else {
+				rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+				break;
+			}
+		} else if(recv_result > 0) {
+			process_udp_batch(thread_info,&batch,(size_t)recv_result);
+		}
+	}
+
+	log_thread_cpu_usage(thread_info->listener,"UDP thread",
+		thread_info->idx,thread_info->stats.bytes,
+		thread_info->stats.batches);
+	udp_recv_batch_done(&batch);
+
+	return NULL;
+}
+
+/// Print how many packets & bytes each UDP thread has received
+static void log_udp_threads_stats(struct socket_listener_private *priv) {
+	size_t i;
+	uint64_t total_packets = 0;
+
+	for(i=0;i<priv->config.threads;++i) {
+		total_packets += ATOMIC_OP(fetch,add,
+			&priv->udp_threads[i].stats.packets,0);
+	}
+
+	for(i=0;i<priv->config.threads;++i) {
+		struct udp_thread_info *thread_info = &priv->udp_threads[i];
+		const uint64_t packets = ATOMIC_OP(fetch,add,
+			&thread_info->stats.packets,0);
+		const uint64_t bytes = ATOMIC_OP(fetch,add,
+			&thread_info->stats.bytes,0);
+
+		const uint64_t batches = ATOMIC_OP(fetch,add,
+			&thread_info->stats.batches,0);
+		char fill_buf[UDP_BATCH_FILL_BUCKETS*24];
+		size_t b,fill_buf_len = 0;
+
+		fill_buf[0] = '\0';
+		for(b=0;b<UDP_BATCH_FILL_BUCKETS;++b) {
+			const uint64_t fill = ATOMIC_OP(fetch,add,
+				&thread_info->stats.batch_fill[b],0);
+			fill_buf_len += (size_t)snprintf(&fill_buf[fill_buf_len],
+				sizeof(fill_buf)-fill_buf_len,"%s%zu:%"PRIu64,
+				b ? " " : "",(size_t)1<<b,fill);
+		}
+
+		rdlog(LOG_INFO,"UDP port %"PRIu16" thread %zu: %"PRIu64" packets "
+			"(%.1f%%), %"PRIu64" bytes, %"PRIu64" batches "
+			"(avg %.1f/%d, fill histogram %s)",
+			priv->config.listen_port,i,
+			packets,total_packets ? 100.0*packets/total_packets : 0.0,
+			bytes,batches,batches ? (double)packets/batches : 0.0,
+			priv->config.udp_batch_size,fill_buf);
+	}
+
+	const size_t udp_sockets = priv->config.reuseport ?
+		priv->config.threads : 1;
+	uint64_t total_drops = 0;
+	for(i=0;i<udp_sockets;++i) {
+		struct udp_socket_stats *sock = &priv->udp_sockets[i];
+		const uint64_t drops = ATOMIC_OP(fetch,add,&sock->drops,0);
+		const uint64_t packets = ATOMIC_OP(fetch,add,&sock->packets,0);
+
+		total_drops += drops;
+		rdlog(LOG_INFO,"UDP port %"PRIu16" socket %zu: %"PRIu64" kernel "
+			"drops (%.2f%%), receive buffer %d bytes",
+			priv->config.listen_port,i,drops,drops + packets ?
+				100.0*(double)drops/(double)(drops+packets) : 0.0,
+			ATOMIC_OP(fetch,add,&sock->rcvbuf,0));
+	}
+
+	rdlog(LOG_INFO,"UDP port %"PRIu16": %"PRIu64" packets received, %"PRIu64
+		" dropped by kernel",priv->config.listen_port,total_packets,
+		total_drops);
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * io_uring mode: Every listener thread owns a ring. Connections are accepted
+ * with multishot accept, and data is received with multishot recv into a
+ * ring of provided buffers, so no syscall is needed per read and there is no
+ * readiness notification before it. All new requests and recycled buffers of
+ * a wakeup are submitted together in the next wait.
+ */
+
+/// Submission queue entries of each thread ring
+#define URING_QUEUE_DEPTH 256
+/// Provided buffers of each ring. Needs to be a power of 2
+#define URING_BUFFERS_COUNT 256
+#define URING_TCP_BUFFER_SIZE (16*1024)
+/// recvmsg result header and client address are placed before datagram
+#define URING_UDP_BUFFER_SIZE (READ_BUFFER_SIZE + 128)
+/// Provided buffers group. Rings are not shared, so only one is needed
+#define URING_BUFFER_GROUP 0
+/// Max time waiting for completions before checking shutdown
+#define URING_WAIT_TIMEOUT_S 1
+
+/// Operation of a request, stored in user data low bits
+enum uring_op {
+	URING_OP_ACCEPT = 1,
+	URING_OP_RECV,
+	URING_OP_SEND,
+};
+
+#define URING_OP_MASK 0x7
+#define uring_udata(ptr,op) ((uint64_t)(uintptr_t)(ptr) | (uint64_t)(op))
+#define uring_udata_op(udata) ((udata) & URING_OP_MASK)
+#define uring_udata_ptr(udata) \
+	((void *)(uintptr_t)((udata) & ~(uint64_t)URING_OP_MASK))
+
+/// Provided buffers ring. Kernel picks a free buffer for each received data
+struct uring_buffers {
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned int entries;
+	size_t buf_size;
+	/// Buffers given back to kernel since last commit
+	int recycled;
+};
+
+static char *uring_buffer(const struct uring_buffers *buffers,
+                                                        unsigned short bid) {
+	return &buffers->bufs[(size_t)bid*buffers->buf_size];
+}
+
+/// Give back a buffer to kernel. It will be visible after commit
+static void uring_buffers_recycle(struct uring_buffers *buffers,
+                                                        unsigned short bid) {
+	io_uring_buf_ring_add(buffers->br,uring_buffer(buffers,bid),
+		(unsigned int)buffers->buf_size,bid,
+		io_uring_buf_ring_mask(buffers->entries),buffers->recycled++);
+}
+
+static void uring_buffers_commit(struct uring_buffers *buffers) {
+	io_uring_buf_ring_advance(buffers->br,buffers->recycled);
+	buffers->recycled = 0;
+}
+
+/// Buffer id of a completion, or -1 if it does not use any buffer
+static int uring_cqe_buffer(const struct io_uring_cqe *cqe) {
+	return (cqe->flags & IORING_CQE_F_BUFFER) ?
+		(int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+}
+
+/** Create calling thread ring and its provided buffers
+  @param ring Ring to initialize
+  @param buffers Buffers to initialize
+  @param buf_size Size of each provided buffer
+  @return 0 if success, !0 in other case
+  */
+static int uring_thread_init(struct io_uring *ring,
+                        struct uring_buffers *buffers,size_t buf_size) {
+	unsigned int i;
+	int rc;
+
+	memset(buffers,0,sizeof(*buffers));
+
+	/* Only this thread submits & reaps, so kernel can defer work to it */
+	rc = io_uring_queue_init(URING_QUEUE_DEPTH,ring,
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+	if(rc == -EINVAL) {
+		/* Old kernel */
+		rc = io_uring_queue_init(URING_QUEUE_DEPTH,ring,0);
+	}
+	if(rc < 0) {
+		rdlog(LOG_ERR,"Can't create io_uring: %s",
+			mystrerror(-rc,errbuf,ERROR_BUFFER_SIZE));
+		return -1;
+	}
+
+	buffers->bufs = malloc(URING_BUFFERS_COUNT*buf_size);
+	if(NULL == buffers->bufs) {
+		rdlog(LOG_ERR,"Can't allocate io_uring buffers (out of memory?)");
+		io_uring_queue_exit(ring);
+		return -1;
+	}
+
+	buffers->br = io_uring_setup_buf_ring(ring,URING_BUFFERS_COUNT,
+		URING_BUFFER_GROUP,0,&rc);
+	if(NULL == buffers->br) {
+		rdlog(LOG_ERR,"Can't register io_uring provided buffers: %s",
+			mystrerror(-rc,errbuf,ERROR_BUFFER_SIZE));
+		free(buffers->bufs);
+		io_uring_queue_exit(ring);
+		return -1;
+	}
+
+	buffers->entries = URING_BUFFERS_COUNT;
+	buffers->buf_size = buf_size;
+	for(i=0;i<URING_BUFFERS_COUNT;++i) {
+		uring_buffers_recycle(buffers,(unsigned short)i);
+	}
+	uring_buffers_commit(buffers);
+
+	return 0;
+}
+
+/// Destroy ring. Kernel will not touch buffers after that
+static void uring_thread_done(struct io_uring *ring,
+                                        struct uring_buffers *buffers) {
+	io_uring_free_buf_ring(ring,buffers->br,buffers->entries,
+		URING_BUFFER_GROUP);
+	io_uring_queue_exit(ring);
+	free(buffers->bufs);
+}
+
+/// Get a submission entry, flushing submission queue if it is full
+static struct io_uring_sqe *uring_get_sqe(struct io_uring *ring) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	if(unlikely(NULL == sqe)) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+
+	if(unlikely(NULL == sqe)) {
+		rdlog(LOG_ERR,"Can't get io_uring submission entry");
+	}
+	return sqe;
+}
+
+/// Submit pending requests and wait for at least one completion
+static void uring_submit_and_wait(struct io_uring *ring) {
+	struct __kernel_timespec ts = {.tv_sec = URING_WAIT_TIMEOUT_S};
+	struct io_uring_cqe *cqe = NULL;
+
+	const int rc = io_uring_submit_and_wait_timeout(ring,&cqe,1,&ts,NULL);
+	if(rc < 0 && rc != -ETIME && rc != -EINTR) {
+		rdlog(LOG_ERR,"io_uring wait error: %s",
+			mystrerror(-rc,errbuf,ERROR_BUFFER_SIZE));
+	}
+}
+
+/// io_uring TCP connection
+struct uring_connection {
+	struct connection_private conn;
+	int fd;
+	/// Multishot recv is armed
+	int recv_armed;
+	/// First response send is in flight
+	int send_inflight;
+	/// First response bytes already sent
+	size_t response_sent;
+	/// Connection has been shut down, waiting for in flight requests
+	int closing;
+	LIST_ENTRY(uring_connection) entry;
+};
+
+/// io_uring TCP worker
+struct uring_tcp_worker {
+	struct worker_args *args;
+	struct tcp_worker_accept *accept;
+	struct io_uring ring;
+	struct uring_buffers buffers;
+	/// Multishot accept is armed
+	int accept_armed;
+	LIST_HEAD(,uring_connection) connections;
+};
+
+static void uring_arm_accept(struct uring_tcp_worker *worker) {
+	if(worker->accept->listenfd < 0) {
+		return;
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+	if(NULL == sqe) {
+		return;
+	}
+
+	/* Every accepted socket overwrites the same address, so ask it later
+	   with getpeername */
+	io_uring_prep_multishot_accept(sqe,worker->accept->listenfd,NULL,NULL,
+		SOCK_CLOEXEC);
+	io_uring_sqe_set_data64(sqe,uring_udata(NULL,URING_OP_ACCEPT));
+	worker->accept_armed = 1;
+}
+
+static int uring_arm_recv(struct uring_tcp_worker *worker,
+                                        struct uring_connection *connection) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+	if(NULL == sqe) {
+		return -1;
+	}
+
+	io_uring_prep_recv_multishot(sqe,connection->fd,NULL,0,0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe,uring_udata(connection,URING_OP_RECV));
+	connection->recv_armed = 1;
+	return 0;
+}
+
+/// Free connection if it is closing and no request references it
+static void uring_connection_release(struct uring_connection *connection) {
+	if(!connection->closing || connection->recv_armed ||
+	                                        connection->send_inflight) {
+		return;
+	}
+
+	close(connection->fd);
+	LIST_REMOVE(connection,entry);
+	free(connection->conn.rbuf.buf);
+	free(connection);
+}
+
+/** Close a connection. Shutdown will make in flight requests to complete,
+  and connection will be freed after that */
+static void uring_connection_close(struct uring_connection *connection) {
+	if(!connection->closing) {
+		connection->closing = 1;
+		shutdown(connection->fd,SHUT_RDWR);
+	}
+
+	uring_connection_release(connection);
+}
+
+static void uring_tcp_send_response(struct uring_tcp_worker *worker,
+                                        struct uring_connection *connection) {
+	const size_t response_len = (size_t)global_config.response_len-1;
+	struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+	if(NULL == sqe) {
+		rdlog(LOG_ERR,"Cannot send first response to %s",
+			connection->conn.client);
+		uring_connection_close(connection);
+		return;
+	}
+
+	io_uring_prep_send(sqe,connection->fd,
+		&global_config.response[connection->response_sent],
+		response_len - connection->response_sent,MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe,uring_udata(connection,URING_OP_SEND));
+	connection->send_inflight = 1;
+}
+
+static void uring_tcp_send_completion(struct uring_tcp_worker *worker,
+                                        struct uring_connection *connection,
+                                        const struct io_uring_cqe *cqe) {
+	connection->send_inflight = 0;
+
+	if(connection->closing) {
+		uring_connection_release(connection);
+		return;
+	}
+
+	if(cqe->res <= 0) {
+		rdlog(LOG_ERR,"Cannot send first response to %s socket: %s",
+			connection->conn.client,
+			mystrerror(-cqe->res,errbuf,ERROR_BUFFER_SIZE));
+		uring_connection_close(connection);
+		return;
+	}
+
+	connection->response_sent += (size_t)cqe->res;
+	if(connection->response_sent < (size_t)global_config.response_len-1) {
+		uring_tcp_send_response(worker,connection);
+	} else {
+		rdlog(LOG_DEBUG,"first response ok");
+	}
+}
+
+/** Make room for new data in connection buffer
+  @param connection Connection
+  @param wanted Wanted buffer size. It will be clamped to max size.
+  @return 0 if success, !0 if buffer can't grow
+  */
+static int connection_rbuf_reserve(struct connection_private *connection,
+                                                        size_t wanted) {
+	size_t new_size = connection->rbuf.size ? connection->rbuf.size :
+		TCP_READ_BUFFER_MIN_SIZE;
+
+	while(new_size < wanted && new_size < TCP_READ_BUFFER_MAX_SIZE) {
+		new_size *= 2;
+	}
+
+	return new_size == connection->rbuf.size ? 0 :
+		connection_rbuf_resize(connection,new_size);
+}
+
+/** Append received data to connection buffer and process it
+  @param worker Worker
+  @param connection Connection
+  @param data Received data (a provided buffer)
+  @param len Data length
+  */
+static void uring_tcp_recv_data(struct uring_tcp_worker *worker,
+                        struct uring_connection *connection,
+                        const char *data,size_t len) {
+	struct connection_private *conn = &connection->conn;
+	const size_t read_bytes = len;
+
+	while(len > 0) {
+		if(0 != connection_rbuf_reserve(conn,conn->rbuf.used + len) ||
+		                        conn->rbuf.used == conn->rbuf.size) {
+			uring_connection_close(connection);
+			return;
+		}
+
+		const size_t room = conn->rbuf.size - conn->rbuf.used;
+		const size_t chunk = len < room ? len : room;
+		memcpy(&conn->rbuf.buf[conn->rbuf.used],data,chunk);
+		conn->rbuf.used += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if(0 != process_connection_buffer(conn)) {
+			uring_connection_close(connection);
+			return;
+		}
+	}
+	connection_rbuf_adapt(conn,read_bytes);
+
+	if(NULL!=global_config.response && !conn->first_response_sent){
+		rdlog(LOG_DEBUG,"Sending first response...");
+		conn->first_response_sent = 1;
+
+		if(global_config.response_len == 0){
+			rdlog(LOG_ERR,"Can't send first response to %s: size of response == 0",conn->client);
+		} else {
+			uring_tcp_send_response(worker,connection);
+		}
+	}
+}
+
+static void uring_tcp_recv_completion(struct uring_tcp_worker *worker,
+                                        struct uring_connection *connection,
+                                        const struct io_uring_cqe *cqe) {
+	const int bid = uring_cqe_buffer(cqe);
+
+	if(bid >= 0) {
+		if(cqe->res > 0 && !connection->closing) {
+			worker->args->stats.bytes += (uint64_t)cqe->res;
+			uring_tcp_recv_data(worker,connection,
+				uring_buffer(&worker->buffers,
+					(unsigned short)bid),(size_t)cqe->res);
+		}
+		uring_buffers_recycle(&worker->buffers,(unsigned short)bid);
+	}
+
+	if(cqe->flags & IORING_CQE_F_MORE) {
+		return;
+	}
+
+	/* Multishot recv finished */
+	connection->recv_armed = 0;
+	if(connection->closing) {
+		uring_connection_release(connection);
+		return;
+	}
+
+	if(cqe->res > 0 || cqe->res == -ENOBUFS) {
+		/* Kernel stopped it, or ran out of buffers. Recycled buffers
+		   will be committed before next submit */
+		if(0 == uring_arm_recv(worker,connection)) {
+			return;
+		}
+	} else if(cqe->res < 0) {
+		rdlog(LOG_ERR,"Recv error: %s",
+			mystrerror(-cqe->res,errbuf,ERROR_BUFFER_SIZE));
+	} else if(connection->conn.rbuf.used > 0) {
+		rdlog(LOG_WARNING,"Discarding %zu bytes of incomplete "
+			"record from %s",connection->conn.rbuf.used,
+			connection->conn.client);
+	}
+
+	uring_connection_close(connection);
+}
+
+static void uring_tcp_new_connection(struct uring_tcp_worker *worker,
+                                                        int client_sd) {
+	struct sockaddr_in client_saddr;
+	socklen_t client_len = sizeof(client_saddr);
+	char client_buf[BUFSIZ];
+
+	if(0 != getpeername(client_sd,(struct sockaddr *)&client_saddr,
+	                                                        &client_len)) {
+		rdlog(LOG_ERR,"Can't get client address: %s",
+			mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+		close(client_sd);
+		return;
+	}
+
+	const char *client_addr = accept_connection(client_sd,&client_saddr,
+		worker->args->accept_private,client_buf,sizeof(client_buf));
+	if(NULL == client_addr) {
+		return;
+	}
+	const size_t client_addr_len = strlen(client_addr);
+
+	struct uring_connection *connection = calloc(1,
+		sizeof(*connection) + client_addr_len + 1);
+	if(unlikely(NULL == connection)) {
+		rdlog(LOG_ERR,"Can't allocate client %s private data",client_addr);
+		close(client_sd);
+		return;
+	}
+
+	connection_private_init(&connection->conn,
+		worker->args->accept_private,(char *)&connection[1],
+		client_addr,client_addr_len);
+	connection->fd = client_sd;
+	LIST_INSERT_HEAD(&worker->connections,connection,entry);
+	worker->accept->accepted++;
+
+	if(0 != uring_arm_recv(worker,connection)) {
+		uring_connection_close(connection);
+	}
+}
+
+static void uring_tcp_accept_completion(struct uring_tcp_worker *worker,
+                                        const struct io_uring_cqe *cqe) {
+	if(cqe->res >= 0) {
+		uring_tcp_new_connection(worker,cqe->res);
+	} else if(cqe->res != -EAGAIN && cqe->res != -EINTR) {
+		rdlog(LOG_ERR,"accept error: %s",
+			mystrerror(-cqe->res,errbuf,ERROR_BUFFER_SIZE));
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE)) {
+		worker->accept_armed = 0;
+	}
+}
+
+static void uring_tcp_completion(struct uring_tcp_worker *worker,
+                                        const struct io_uring_cqe *cqe) {
+	const uint64_t udata = io_uring_cqe_get_data64(cqe);
+	struct uring_connection *connection = uring_udata_ptr(udata);
+
+	switch(uring_udata_op(udata)) {
+	case URING_OP_ACCEPT:
+		uring_tcp_accept_completion(worker,cqe);
+		break;
+	case URING_OP_RECV:
+		uring_tcp_recv_completion(worker,connection,cqe);
+		break;
+	case URING_OP_SEND:
+		uring_tcp_send_completion(worker,connection,cqe);
+		break;
+	default:
+		rdlog(LOG_ERR,"Unknown io_uring completion %"PRIu64,udata);
+		break;
+	};
+}
+
+static void *uring_tcp_worker(void *_worker_arg) {
+	struct uring_tcp_worker worker;
+	struct uring_connection *connection = NULL;
+
+	memset(&worker,0,sizeof(worker));
+	worker.args = _worker_arg;
+	worker.accept = &worker.args->accept_private->tcp_accepts[
+		worker.args->idx];
+	LIST_INIT(&worker.connections);
+
+	/* Pin before allocate receive buffers */
+	pin_listener_thread(worker.args->accept_private,"TCP worker",
+		worker.args->idx);
+
+	if(0 != uring_thread_init(&worker.ring,&worker.buffers,
+	                                        URING_TCP_BUFFER_SIZE)) {
+		free(worker.args);
+		return NULL;
+	}
+
+	while(!do_shutdown) {
+		struct io_uring_cqe *cqe = NULL;
+		unsigned int head,count = 0;
+
+		if(!worker.accept_armed) {
+			uring_arm_accept(&worker);
+		}
+
+		uring_submit_and_wait(&worker.ring);
+
+		io_uring_for_each_cqe(&worker.ring,head,cqe) {
+			uring_tcp_completion(&worker,cqe);
+			count++;
+		}
+		io_uring_cq_advance(&worker.ring,count);
+		uring_buffers_commit(&worker.buffers);
+
+		if(count > 0) {
+			worker.args->stats.wakeups++;
+		}
+	}
+
+	log_thread_cpu_usage(worker.args->accept_private,"TCP worker",
+		worker.args->idx,worker.args->stats.bytes,
+		worker.args->stats.wakeups);
+
+	/* Ring destruction cancels all in flight requests */
+	while((connection = LIST_FIRST(&worker.connections))) {
+		LIST_REMOVE(connection,entry);
+		close(connection->fd);
+		free(connection->conn.rbuf.buf);
+		free(connection);
+	}
+	uring_thread_done(&worker.ring,&worker.buffers);
+	free(worker.args);
+
+	return NULL;
+}
+
+static void main_tcp_loop_uring(int listenfd,
+                                        struct socket_listener_private *priv) {
+	size_t i;
+
+	for(i=0;i<priv->config.threads;++i) {
+		struct tcp_worker_accept *worker_accept = &priv->tcp_accepts[i];
+		struct worker_args *args = calloc(1,sizeof(args[0]));
+		if(!args) {
+			rdlog(LOG_ERR,"Can't allocate worker arg (out of memory?");
+			continue;
+		}
+
+		args->idx = i;
+		args->accept_private = priv;
+
+		/* Without reuseport, all workers accept from the same socket */
+		worker_accept->listenfd = (!priv->config.reuseport || i == 0) ?
+			listenfd : createListenSocket(priv->config.proto,
+				priv->config.listen_port,1);
+		if(worker_accept->listenfd <= 0) {
+			rdlog(LOG_ERR,"Can't create worker %zu listen socket, "
+				"it will not accept connections",i);
+			worker_accept->listenfd = -1;
+		}
+
+		pthread_create(&priv->threads[i],NULL,uring_tcp_worker,args);
+	}
+
+	for(i=0;i<priv->config.threads;++i) {
+		struct tcp_worker_accept *worker_accept = &priv->tcp_accepts[i];
+
+		pthread_join(priv->threads[i],NULL);
+		rdlog(LOG_INFO,"Listener %"PRIu16" TCP worker %zu accepted %"
+			PRIu64" connections",priv->config.listen_port,i,
+			worker_accept->accepted);
+		if(worker_accept->listenfd >= 0 &&
+		                        worker_accept->listenfd != listenfd) {
+			close(worker_accept->listenfd);
+		}
+	}
+}
+
+static int uring_arm_recvmsg(struct io_uring *ring,int fd,
+                                                struct msghdr *msg) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if(NULL == sqe) {
+		return -1;
+	}
+
+	io_uring_prep_recvmsg_multishot(sqe,fd,msg,0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe,uring_udata(NULL,URING_OP_RECV));
+	return 0;
+}
+
+/// Search SO_RXQ_OVFL in a multishot recvmsg result
+static int uring_recvmsg_ovfl(struct io_uring_recvmsg_out *out,
+                                        struct msghdr *msg,uint32_t *ovfl) {
+	struct cmsghdr *cmsg;
+
+	for(cmsg = io_uring_recvmsg_cmsg_firsthdr(out,msg);cmsg;
+	                cmsg = io_uring_recvmsg_cmsg_nexthdr(out,msg,cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET &&
+		                                cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(ovfl,CMSG_DATA(cmsg),sizeof(*ovfl));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *uring_consumer_loop_udp(void *_thread_info) {
+	struct udp_thread_info *thread_info = _thread_info;
+	struct io_uring ring;
+	struct uring_buffers buffers;
+	int recv_armed = 0;
+
+	/* Layout of every received datagram buffer */
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_namelen = sizeof(struct sockaddr_in6);
+	msg.msg_controllen = UDP_CONTROL_SIZE;
+
+	/* Pin before allocate receive buffers */
+	pin_listener_thread(thread_info->listener,"UDP thread",thread_info->idx);
+
+	if(0 != uring_thread_init(&ring,&buffers,URING_UDP_BUFFER_SIZE)) {
+		return NULL;
+	}
+
+	while(!do_shutdown) {
+		struct io_uring_cqe *cqe = NULL;
+		unsigned int head,count = 0;
+		size_t n_msgs = 0;
+		uint64_t bytes = 0;
+		uint32_t ovfl = 0;
+		int has_ovfl = 0;
+
+		if(!recv_armed) {
+			recv_armed = 0 == uring_arm_recvmsg(&ring,
+				thread_info->listenfd,&msg);
+		}
+
+		uring_submit_and_wait(&ring);
+
+		io_uring_for_each_cqe(&ring,head,cqe) {
+			const int bid = uring_cqe_buffer(cqe);
+
+			count++;
+			if(!(cqe->flags & IORING_CQE_F_MORE)) {
+				recv_armed = 0;
+			}
+
+			if(cqe->res < 0 && cqe->res != -ENOBUFS) {
+				rdlog(LOG_ERR,"Recv error: %s",mystrerror(
+					-cqe->res,errbuf,ERROR_BUFFER_SIZE));
+			}
+
+			if(bid < 0) {
+				continue;
+			}
+
+			char *buf = uring_buffer(&buffers,(unsigned short)bid);
+			struct io_uring_recvmsg_out *out =
+				io_uring_recvmsg_validate(buf,cqe->res,&msg);
+			if(NULL != out) {
+				const unsigned int len =
+					io_uring_recvmsg_payload_length(out,
+						cqe->res,&msg);
+				bytes += len;
+				n_msgs++;
+				has_ovfl |= uring_recvmsg_ovfl(out,&msg,&ovfl);
+				process_udp_datagram(thread_info,
+					io_uring_recvmsg_name(out),
+					io_uring_recvmsg_payload(out,&msg),len);
+			}
+			uring_buffers_recycle(&buffers,(unsigned short)bid);
+		}
+		io_uring_cq_advance(&ring,count);
+		uring_buffers_commit(&buffers);
+
+		if(n_msgs > 0) {
+			udp_thread_stats_add(thread_info,n_msgs,bytes);
+			udp_socket_stats_add(thread_info,thread_info->listenfd,
+				n_msgs,has_ovfl,ovfl);
+		}
+	}
+
+	log_thread_cpu_usage(thread_info->listener,"UDP thread",
+		thread_info->idx,thread_info->stats.bytes,
+		thread_info->stats.batches);
+	uring_thread_done(&ring,&buffers);
+
+	return NULL;
+}
+#endif /* HAVE_LIBURING */
+
+static void main_udp_loop(int listenfd,struct socket_listener_private *priv){
+	/* Lots of threads listening  and processing*/
+	size_t i;
+	pthread_mutex_t listenfd_mutex;
+	const size_t udp_threads = priv->config.threads;
 
 	assert(udp_threads>0);
 	pthread_t *threads = malloc(sizeof(threads[0])*udp_threads);
 
-	if(0 != createListenSocketMutex(&udp_thread_info.listenfd_mutex))
+	if(!priv->config.reuseport && 0 != createListenSocketMutex(&listenfd_mutex))
 		exit(-1);
 
+	for(i=0;i<udp_threads;++i) {
+		struct udp_thread_info *thread_info = &priv->udp_threads[i];
+
+		memset(thread_info,0,sizeof(*thread_info));
+		thread_info->listener = priv;
+		thread_info->idx = i;
+		thread_info->callback = priv->config.callback;
+		thread_info->callback_opaque = priv->config.callback_opaque;
+		thread_info->batch_size = (size_t)priv->config.udp_batch_size;
+
+		thread_info->socket = &priv->udp_sockets[
+			priv->config.reuseport ? i : 0];
+
+		if(!priv->config.reuseport) {
+			thread_info->listenfd = listenfd;
+			thread_info->listenfd_mutex = &listenfd_mutex;
+		} else if(0 == i) {
+			thread_info->listenfd = listenfd;
+		} else {
+			/* Kernel will hash flows between all sockets bound to
+			   the same port */
+			thread_info->listenfd = createListenSocket(
+				priv->config.proto,priv->config.listen_port,1);
+			if(thread_info->listenfd <= 0) {
+				rdlog(LOG_ERR,"Can't create UDP socket for thread %zu",
+					i);
+				exit(-1);
+			}
+		}
+
+		if(priv->config.reuseport || 0 == i) {
+			udp_socket_init(thread_info->listenfd,
+				thread_info->socket,priv->config.udp_rcvbuf);
+		}
+	}
+
+	void *(*consumer_loop)(void *) = main_consumer_loop_udp;
+#ifdef HAVE_LIBURING
+	if(priv->config.thread_mode == MODE_IO_URING) {
+		/* Every ring arms its own multishot recvmsg, no lock needed */
+		consumer_loop = uring_consumer_loop_udp;
+	}
+#endif
+
 	for(i=0;i<udp_threads;++i)
-		pthread_create(&threads[i],NULL,main_consumer_loop_udp,&udp_thread_info);
+		pthread_create(&threads[i],NULL,consumer_loop,
+			&priv->udp_threads[i]);
 
 	for(i=0;i<udp_threads;++i)
 		pthread_join(threads[i],NULL);
-	
-	pthread_mutex_destroy(&udp_thread_info.listenfd_mutex);
+
+	log_udp_threads_stats(priv);
+
+	if(priv->config.reuseport) {
+		for(i=1;i<udp_threads;++i) {
+			close(priv->udp_threads[i].listenfd);
+		}
+	} else {
+		pthread_mutex_destroy(&listenfd_mutex);
+	}
 	
 	free(threads);
 }
@@ -597,7 +2296,8 @@ static void *main_socket_loop(void *_params) {
 		return NULL;
 	}
 	
-	int listenfd = createListenSocket(params->config.proto,params->config.listen_port);
+	int listenfd = createListenSocket(params->config.proto,
+		params->config.listen_port,params->config.reuseport);
 	if(listenfd == -1)
 		return NULL;
 
@@ -606,8 +2306,11 @@ static void *main_socket_loop(void *_params) {
 	*/
 
 	if( 0 == strcmp(N2KAFKA_UDP,params->config.proto) ){
-		main_udp_loop(listenfd,params->config.threads,params->config.callback,
-		    params->config.callback_opaque);
+		main_udp_loop(listenfd,params);
+#ifdef HAVE_LIBURING
+	}else if(params->config.thread_mode == MODE_IO_URING){
+		main_tcp_loop_uring(listenfd,params);
+#endif
 	}else{
 		main_tcp_loop(listenfd,params);
 	}
@@ -622,14 +2325,24 @@ static void join_listener_socket(void *_private){
 	struct socket_listener_private *private = _private;
 
 	do_shutdown = 1;
-	ev_async_send (private->event_loop,&private->w_async);
+	if(private->event_loop) {
+		/* UDP and io_uring listeners check do_shutdown periodically */
+		ev_async_send (private->event_loop,&private->w_async);
+	}
 	pthread_join(private->main_loop,NULL);
+	cpu_affinity_done(&private->config.affinity);
 	free(private);
 }
 
 static void reload_listener_socket(json_t *new_config __attribute__((unused)),
                                 decoder_listener_opaque_reload opaque_reload,
-                      void *cb_opaque,void *_private __attribute__((unused))) {
+                      void *cb_opaque,void *_private) {
+	struct socket_listener_private *priv = _private;
+
+	if(0 == strcmp(N2KAFKA_UDP,priv->config.proto)) {
+		log_udp_threads_stats(priv);
+	}
+
 	if(opaque_reload){
 		rdlog(LOG_INFO,"Reloading opaque");
 		opaque_reload(new_config,cb_opaque);
@@ -654,13 +2367,19 @@ struct listener *create_socket_listener(struct json_t *config,
 	priv->config.threads = 1; 
 	priv->config.tcp_keepalive = 0;
 	priv->config.thread_mode = MODE_EPOLL;
-	const char *mode=NULL;
+	priv->config.udp_batch_size = DEFAULT_UDP_BATCH_SIZE;
+	const char *mode=NULL,*framing=NULL,*cpu_list=NULL;
+	int numa_node = CPU_AFFINITY_NO_NUMA_NODE;
 
 	const int unpack_rc = json_unpack_ex(config,&error,0,
-		"{s:s,s:i,s?i,s?b,s?s}",
+		"{s:s,s:i,s?i,s?b,s?s,s?b,s?i,s?s,s?s,s?i,s?i,s?i}",
 		"proto",&proto,"port",&priv->config.listen_port,
 		"num_threads",&priv->config.threads,"tcp_keepalive",&priv->config.tcp_keepalive,
-		"mode",&mode);
+		"mode",&mode,"reuseport",&priv->config.reuseport,
+		"udp_batch_size",&priv->config.udp_batch_size,
+		"framing",&framing,"cpu_affinity",&cpu_list,
+		"numa_node",&numa_node,"udp_rcvbuf",&priv->config.udp_rcvbuf,
+		"udp_rcvbuf_max",&priv->config.udp_rcvbuf_max);
 
 	if( unpack_rc != 0 /* Failure */ ) {
 		rdlog(LOG_ERR,"Can't decode listener: %s",error.text);
@@ -679,13 +2398,62 @@ struct listener *create_socket_listener(struct json_t *config,
 		priv->config.threads = MAX_NUM_THREADS;
 	}
 
+	if( priv->config.udp_batch_size <= 0 ||
+	            priv->config.udp_batch_size > MAX_UDP_BATCH_SIZE ) {
+		rdlog(LOG_ERR,"UDP batch size has to be between 1 and %d. "
+			"Setting to %d",MAX_UDP_BATCH_SIZE,DEFAULT_UDP_BATCH_SIZE);
+		priv->config.udp_batch_size = DEFAULT_UDP_BATCH_SIZE;
+	}
+
+	if( priv->config.udp_rcvbuf < 0 || priv->config.udp_rcvbuf_max < 0 ) {
+		rdlog(LOG_ERR,"UDP receive buffer sizes can't be negative. "
+			"Using kernel default");
+		priv->config.udp_rcvbuf = priv->config.udp_rcvbuf_max = 0;
+	}
+
+	if( priv->config.udp_rcvbuf_max > 0 &&
+	                priv->config.udp_rcvbuf_max < priv->config.udp_rcvbuf ) {
+		rdlog(LOG_WARNING,"udp_rcvbuf_max (%d) < udp_rcvbuf (%d), "
+			"receive buffer will not grow",
+			priv->config.udp_rcvbuf_max,priv->config.udp_rcvbuf);
+		priv->config.udp_rcvbuf_max = 0;
+	}
+
 	if(mode != NULL) {
 		priv->config.thread_mode = thread_mode_str(mode);
 	}
 
+#ifndef HAVE_LIBURING
+	if( priv->config.thread_mode == MODE_IO_URING ) {
+		rdlog(LOG_ERR,"n2kafka was built without io_uring support. "
+			"Using " STR_MODE_EPOLL " mode");
+		priv->config.thread_mode = MODE_EPOLL;
+	}
+#endif
+
+	priv->config.framing = framing_mode_str(framing);
+	if( priv->config.framing == FRAMING_INVALID ) {
+		rdlog(LOG_ERR,"Unknown framing %s",framing);
+		free(priv);
+		return NULL;
+	}
+
+	if( priv->config.framing != FRAMING_NONE &&
+	                                0 == strcmp(N2KAFKA_UDP,proto) ) {
+		rdlog(LOG_WARNING,"UDP listener does not use framing: Every "
+			"datagram is a message");
+	}
+
+	if( 0 != cpu_affinity_init(&priv->config.affinity,cpu_list,
+	                                                        numa_node) ) {
+		free(priv);
+		return NULL;
+	}
+
 	priv->config.proto = strdup(proto);
 	if( NULL == priv->config.proto) {
 		rdlog(LOG_ERR,"Error: Can't strdup protocol (out of memory?)");
+		cpu_affinity_done(&priv->config.affinity);
 		free(priv);
 		return NULL;
 	}
@@ -693,6 +2461,7 @@ struct listener *create_socket_listener(struct json_t *config,
 	struct listener *l = calloc(1,sizeof(*l));
 	if( NULL == l ) {
 		rdlog(LOG_ERR,"Can't allocate listener (out of memory?)");
+		cpu_affinity_done(&priv->config.affinity);
 		free(priv);
 		return NULL;
 	}
@@ -710,7 +2479,9 @@ struct listener *create_socket_listener(struct json_t *config,
 		main_socket_loop,priv);
 	if (pcreate_rc != 0) {
 		char err[BUFSIZ];
-		strerror_r(pcreate_rc,err,sizeof(err));
+		rdlog(LOG_ERR,"Can't create listener thread: %s",
+			mystrerror(pcreate_rc,err,sizeof(err)));
+		cpu_affinity_done(&priv->config.affinity);
 		free(priv);
 		free(l);
 		return NULL;
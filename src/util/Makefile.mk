@@ -1,5 +1,7 @@
 THIS_SRCS := \
-	in_addr_list.c \
+	addr_filter.c \
+	cpu_affinity.c \
+	framing.c \
 	kafka.c \
 	kafka_message_list.c \
 	pair.c \
@@ -7,6 +9,7 @@ THIS_SRCS := \
 	rb_mac.c \
 	topic_database.c \
 	rb_timer.c \
+	spill_journal.c \
 
 SRCS += $(addprefix $(CURRENT_N2KAFKA_DIR), $(THIS_SRCS))
 
@@ -0,0 +1,332 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "addr_filter.h"
+
+#include "config.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Bits consumed in each trie level
+#define TRIE_STRIDE 4
+#define TRIE_FANOUT (1 << TRIE_STRIDE)
+
+/// Trie root nodes
+enum {
+	TRIE_ROOT_IPV4,
+	TRIE_ROOT_IPV6,
+	TRIE_ROOTS,
+};
+
+#define NO_RULE -1
+
+/** Multibit trie node. Prefixes whose length is not a multiple of stride are
+  expanded in all slots they cover. */
+struct addr_filter_node {
+	/// Child nodes. 0 means no child (roots can't be children)
+	uint32_t child[TRIE_FANOUT];
+	/// Longest rule that ends in each slot
+	int32_t rule[TRIE_FANOUT];
+	/// Prefix length of rule[i]
+	uint8_t rule_len[TRIE_FANOUT];
+};
+
+struct addr_filter_rule {
+	char *cidr;
+	enum addr_filter_action action;
+	uint64_t hits;
+};
+
+struct addr_filter_s {
+	struct addr_filter_node *nodes;
+	size_t nodes_count,nodes_size;
+
+	struct addr_filter_rule *rules;
+	size_t rules_count,rules_size;
+
+	/// Action of addresses that does not match any rule
+	enum addr_filter_action default_action;
+	/// Addresses that did not match any rule
+	uint64_t default_hits;
+};
+
+/// Get nibble idx of key
+static unsigned int key_nibble(const uint8_t *key,size_t idx) {
+	const uint8_t byte = key[idx/2];
+	return idx % 2 ? byte & 0x0f : byte >> 4;
+}
+
+/** Allocate a new trie node
+  @return node index, or 0 if error */
+static uint32_t new_node(addr_filter_t *filter) {
+	size_t i;
+
+	if (filter->nodes_count == filter->nodes_size) {
+		const size_t new_size = 2*filter->nodes_size;
+		struct addr_filter_node *new_nodes = realloc(filter->nodes,
+			new_size*sizeof(new_nodes[0]));
+		if (NULL == new_nodes) {
+			rdlog(LOG_ERR,"Can't allocate address filter node "
+				"(out of memory?)");
+			return 0;
+		}
+		filter->nodes = new_nodes;
+		filter->nodes_size = new_size;
+	}
+
+	struct addr_filter_node *node = &filter->nodes[filter->nodes_count];
+	memset(node->child,0,sizeof(node->child));
+	memset(node->rule_len,0,sizeof(node->rule_len));
+	for (i=0; i<TRIE_FANOUT; ++i) {
+		node->rule[i] = NO_RULE;
+	}
+
+	return (uint32_t)filter->nodes_count++;
+}
+
+addr_filter_t *addr_filter_new() {
+	size_t i;
+	addr_filter_t *filter = calloc(1,sizeof(*filter));
+	if (NULL == filter) {
+		rdlog(LOG_ERR,"Can't allocate address filter (out of memory?)");
+		return NULL;
+	}
+
+	filter->nodes_size = TRIE_ROOTS;
+	filter->nodes = calloc(filter->nodes_size,sizeof(filter->nodes[0]));
+	if (NULL == filter->nodes) {
+		rdlog(LOG_ERR,"Can't allocate address filter (out of memory?)");
+		free(filter);
+		return NULL;
+	}
+
+	for (i=0; i<TRIE_ROOTS; ++i) {
+		new_node(filter);
+	}
+
+	filter->default_action = ADDR_FILTER_ALLOW;
+	return filter;
+}
+
+/// Insert a prefix in trie
+static int trie_insert(addr_filter_t *filter,uint32_t root,
+		const uint8_t *key,unsigned int prefix_len,int32_t rule) {
+	uint32_t node = root;
+	size_t i;
+
+	/* Level where prefix ends */
+	const size_t level = prefix_len ? (prefix_len - 1) / TRIE_STRIDE : 0;
+	for (i=0; i<level; ++i) {
+		const unsigned int nibble = key_nibble(key,i);
+		if (0 == filter->nodes[node].child[nibble]) {
+			const uint32_t child = new_node(filter);
+			if (0 == child) {
+				return -1;
+			}
+			filter->nodes[node].child[nibble] = child;
+		}
+		node = filter->nodes[node].child[nibble];
+	}
+
+	/* Expand prefix to all covered slots of the last level */
+	const unsigned int used_bits = prefix_len - level*TRIE_STRIDE;
+	const unsigned int slots = 1u << (TRIE_STRIDE - used_bits);
+	const unsigned int first_slot = used_bits ?
+		key_nibble(key,level) & ~(slots - 1) & (TRIE_FANOUT - 1) : 0;
+	struct addr_filter_node *n = &filter->nodes[node];
+	for (i=first_slot; i<first_slot + slots; ++i) {
+		if (n->rule[i] == NO_RULE || n->rule_len[i] <= prefix_len) {
+			n->rule[i] = rule;
+			n->rule_len[i] = (uint8_t)prefix_len;
+		}
+	}
+
+	return 0;
+}
+
+/// Longest prefix match of key
+static int32_t trie_lookup(const addr_filter_t *filter,uint32_t root,
+					const uint8_t *key,size_t key_bits) {
+	int32_t ret = NO_RULE;
+	uint32_t node = root;
+	size_t i;
+
+	for (i=0; i<key_bits/TRIE_STRIDE; ++i) {
+		const struct addr_filter_node *n = &filter->nodes[node];
+		const unsigned int nibble = key_nibble(key,i);
+
+		if (n->rule[nibble] != NO_RULE) {
+			ret = n->rule[nibble];
+		}
+
+		node = n->child[nibble];
+		if (0 == node) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+int addr_filter_add(addr_filter_t *filter,const char *cidr,
+					enum addr_filter_action action) {
+	uint8_t key[sizeof(struct in6_addr)];
+	char addr[INET6_ADDRSTRLEN];
+	unsigned int prefix_len;
+
+	const char *slash = strchr(cidr,'/');
+	const size_t addr_len = slash ? (size_t)(slash - cidr) : strlen(cidr);
+	if (addr_len >= sizeof(addr)) {
+		rdlog(LOG_ERR,"Invalid address %s",cidr);
+		return -1;
+	}
+	memcpy(addr,cidr,addr_len);
+	addr[addr_len] = '\0';
+
+	const int ipv6 = NULL != strchr(addr,':');
+	const unsigned int max_prefix_len = ipv6 ? 128 : 32;
+	if (1 != inet_pton(ipv6 ? AF_INET6 : AF_INET,addr,key)) {
+		rdlog(LOG_ERR,"Invalid address %s",cidr);
+		return -1;
+	}
+
+	if (slash) {
+		char *endptr = NULL;
+		const unsigned long l = strtoul(slash+1,&endptr,10);
+		if (endptr == slash+1 || *endptr != '\0' ||
+							l > max_prefix_len) {
+			rdlog(LOG_ERR,"Invalid prefix length in %s",cidr);
+			return -1;
+		}
+		prefix_len = (unsigned int)l;
+	} else {
+		prefix_len = max_prefix_len;
+	}
+
+	if (filter->rules_count == filter->rules_size) {
+		const size_t new_size = filter->rules_size ?
+			2*filter->rules_size : 16;
+		struct addr_filter_rule *new_rules = realloc(filter->rules,
+			new_size*sizeof(new_rules[0]));
+		if (NULL == new_rules) {
+			rdlog(LOG_ERR,"Can't allocate address filter rule "
+				"(out of memory?)");
+			return -1;
+		}
+		filter->rules = new_rules;
+		filter->rules_size = new_size;
+	}
+
+	struct addr_filter_rule *rule = &filter->rules[filter->rules_count];
+	rule->cidr = strdup(cidr);
+	rule->action = action;
+	rule->hits = 0;
+	if (NULL == rule->cidr) {
+		rdlog(LOG_ERR,"Can't allocate address filter rule "
+			"(out of memory?)");
+		return -1;
+	}
+
+	const int rc = trie_insert(filter,
+		ipv6 ? TRIE_ROOT_IPV6 : TRIE_ROOT_IPV4,key,prefix_len,
+		(int32_t)filter->rules_count);
+	if (rc != 0) {
+		free(rule->cidr);
+		return rc;
+	}
+
+	filter->rules_count++;
+	if (action == ADDR_FILTER_ALLOW) {
+		filter->default_action = ADDR_FILTER_DENY;
+	}
+
+	return 0;
+}
+
+enum addr_filter_action addr_filter_check(addr_filter_t *filter,
+					const struct sockaddr *sa) {
+	int32_t rule = NO_RULE;
+
+	if (0 == filter->rules_count) {
+		return ADDR_FILTER_ALLOW;
+	}
+
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+		rule = trie_lookup(filter,TRIE_ROOT_IPV4,
+			(const uint8_t *)&sin->sin_addr,32);
+	} else if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)sa;
+		const uint8_t *key = sin6->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			/* Dual stack socket: Use IPv4 rules */
+			rule = trie_lookup(filter,TRIE_ROOT_IPV4,&key[12],32);
+		} else {
+			rule = trie_lookup(filter,TRIE_ROOT_IPV6,key,128);
+		}
+	}
+
+	if (rule == NO_RULE) {
+		ATOMIC_OP(add,fetch,&filter->default_hits,1);
+		return filter->default_action;
+	}
+
+	ATOMIC_OP(add,fetch,&filter->rules[rule].hits,1);
+	return filter->rules[rule].action;
+}
+
+void addr_filter_log_stats(addr_filter_t *filter) {
+	size_t i;
+
+	for (i=0; i<filter->rules_count; ++i) {
+		const uint64_t hits = ATOMIC_OP(fetch,add,
+			&filter->rules[i].hits,0);
+		rdlog(LOG_INFO,"Address filter rule %s %s: %"PRIu64" hits",
+			filter->rules[i].action == ADDR_FILTER_ALLOW ?
+				"allow" : "deny",
+			filter->rules[i].cidr,hits);
+	}
+
+	if (filter->rules_count > 0) {
+		rdlog(LOG_INFO,"Address filter default %s: %"PRIu64" hits",
+			filter->default_action == ADDR_FILTER_ALLOW ?
+				"allow" : "deny",
+			ATOMIC_OP(fetch,add,&filter->default_hits,0));
+	}
+}
+
+void addr_filter_done(addr_filter_t *filter) {
+	size_t i;
+
+	for (i=0; i<filter->rules_count; ++i) {
+		free(filter->rules[i].cidr);
+	}
+	free(filter->rules);
+	free(filter->nodes);
+	free(filter);
+}
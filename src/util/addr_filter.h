@@ -0,0 +1,61 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <sys/socket.h>
+
+/** Client address filter. It holds IPv4 & IPv6 CIDR rules in a longest
+  prefix match trie, so the most specific rule decides. Filter can't be
+  modified after it's shared between threads: build a new one instead. */
+typedef struct addr_filter_s addr_filter_t; /* FW DECLARATION */
+
+enum addr_filter_action {
+	ADDR_FILTER_ALLOW,
+	ADDR_FILTER_DENY,
+};
+
+/// Create a new, empty filter. Empty filter allows every address.
+addr_filter_t *addr_filter_new();
+
+/** Add a rule to filter.
+  @param filter Filter
+  @param cidr IPv4 or IPv6 address, with optional prefix length
+  ("10.0.0.0/8", "2001:db8::/32", "192.168.101.3")
+  @param action Action of addresses that match
+  @return 0 if success, !0 in other case
+  @note If filter has any allow rule, addresses that do not match any rule
+  are denied.
+  */
+int addr_filter_add(addr_filter_t *filter,const char *cidr,
+                                        enum addr_filter_action action);
+
+/** Check an address against filter, and count the hit of matched rule.
+  @param filter Filter
+  @param sa Address to check (AF_INET or AF_INET6)
+  @return Action of the longest matching rule, or default action if none
+  */
+enum addr_filter_action addr_filter_check(addr_filter_t *filter,
+                                                const struct sockaddr *sa);
+
+/// Log rules hits
+void addr_filter_log_stats(addr_filter_t *filter);
+
+/// Deallocate a filter.
+void addr_filter_done(addr_filter_t *filter);
@@ -0,0 +1,242 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* pthread_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "cpu_affinity.h"
+
+#include "util.h"
+
+#include <librd/rdlog.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUMA_NODE_CPULIST_PATH "/sys/devices/system/node/node%d/cpulist"
+/// Max CPU index accepted
+#define MAX_CPU_IDX (CPU_SETSIZE-1)
+
+static int add_cpu(int **cpus,size_t *cpus_count,size_t *cpus_size,
+								long cpu) {
+	if (*cpus_count == *cpus_size) {
+		const size_t new_size = *cpus_size ? 2 * *cpus_size : 16;
+		int *new_cpus = realloc(*cpus,new_size*sizeof(new_cpus[0]));
+		if (NULL == new_cpus) {
+			rdlog(LOG_ERR,"Can't allocate CPU list (out of memory?)");
+			return -1;
+		}
+		*cpus = new_cpus;
+		*cpus_size = new_size;
+	}
+
+	(*cpus)[(*cpus_count)++] = (int)cpu;
+	return 0;
+}
+
+int parse_cpu_list(const char *str,int **cpus,size_t *cpus_count) {
+	size_t cpus_size = 0;
+	const char *cursor = str;
+
+	*cpus = NULL;
+	*cpus_count = 0;
+
+	while (*cursor != '\0' && *cursor != '\n') {
+		char *endptr = NULL;
+		long first,last,cpu;
+
+		first = last = strtol(cursor,&endptr,10);
+		if (endptr == cursor) {
+			goto err;
+		}
+
+		cursor = endptr;
+		if (*cursor == '-') {
+			const char *last_str = cursor + 1;
+			last = strtol(last_str,&endptr,10);
+			if (endptr == last_str) {
+				goto err;
+			}
+			cursor = endptr;
+		}
+
+		if (first < 0 || last < first || last > MAX_CPU_IDX) {
+			goto err;
+		}
+
+		for (cpu=first; cpu<=last; ++cpu) {
+			if (0 != add_cpu(cpus,cpus_count,&cpus_size,cpu)) {
+				goto err;
+			}
+		}
+
+		if (*cursor == ',') {
+			cursor++;
+		} else if (*cursor != '\0' && *cursor != '\n') {
+			goto err;
+		}
+	}
+
+	if (0 == *cpus_count) {
+		goto err;
+	}
+
+	return 0;
+
+err:
+	rdlog(LOG_ERR,"Invalid CPU list \"%s\"",str);
+	free(*cpus);
+	*cpus = NULL;
+	*cpus_count = 0;
+	return -1;
+}
+
+/// Read NUMA node CPUs from sysfs
+static int numa_node_cpus(int numa_node,int **cpus,size_t *cpus_count) {
+	char path[sizeof(NUMA_NODE_CPULIST_PATH) + 16];
+	char cpulist[BUFSIZ];
+	char errbuf[BUFSIZ];
+
+	snprintf(path,sizeof(path),NUMA_NODE_CPULIST_PATH,numa_node);
+	FILE *f = fopen(path,"r");
+	if (NULL == f) {
+		rdlog(LOG_ERR,"Can't open NUMA node %d cpulist %s: %s",
+			numa_node,path,mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	const char *line = fgets(cpulist,sizeof(cpulist),f);
+	fclose(f);
+	if (NULL == line) {
+		rdlog(LOG_ERR,"Can't read NUMA node %d cpulist",numa_node);
+		return -1;
+	}
+
+	return parse_cpu_list(cpulist,cpus,cpus_count);
+}
+
+/// Keep only CPUs of a that are in b
+static void cpus_intersect(int *a,size_t *a_count,const int *b,
+							size_t b_count) {
+	size_t i,j,new_count = 0;
+
+	for (i=0; i<*a_count; ++i) {
+		for (j=0; j<b_count; ++j) {
+			if (a[i] == b[j]) {
+				a[new_count++] = a[i];
+				break;
+			}
+		}
+	}
+
+	*a_count = new_count;
+}
+
+int cpu_affinity_init(struct cpu_affinity *affinity,const char *cpu_list,
+								int numa_node) {
+	int *node_cpus = NULL;
+	size_t node_cpus_count = 0;
+
+	memset(affinity,0,sizeof(*affinity));
+	affinity->numa_node = numa_node;
+
+	if (numa_node != CPU_AFFINITY_NO_NUMA_NODE &&
+		0 != numa_node_cpus(numa_node,&node_cpus,&node_cpus_count)) {
+		return -1;
+	}
+
+	if (NULL == cpu_list) {
+		/* Only NUMA node (or nothing) */
+		affinity->cpus = node_cpus;
+		affinity->cpus_count = node_cpus_count;
+		affinity->whole_set = 1;
+		return 0;
+	}
+
+	if (0 != parse_cpu_list(cpu_list,&affinity->cpus,
+						&affinity->cpus_count)) {
+		free(node_cpus);
+		return -1;
+	}
+
+	if (node_cpus) {
+		cpus_intersect(affinity->cpus,&affinity->cpus_count,node_cpus,
+			node_cpus_count);
+		free(node_cpus);
+		if (0 == affinity->cpus_count) {
+			rdlog(LOG_ERR,"No CPU of \"%s\" belongs to NUMA node %d",
+				cpu_list,numa_node);
+			cpu_affinity_done(affinity);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cpu_affinity_pin_thread(const struct cpu_affinity *affinity,
+				size_t thread_idx,const char *thread_name) {
+	cpu_set_t cpuset;
+	size_t i;
+	char errbuf[BUFSIZ];
+
+	if (0 == affinity->cpus_count) {
+		return 0;
+	}
+
+	CPU_ZERO(&cpuset);
+	if (affinity->whole_set) {
+		for (i=0; i<affinity->cpus_count; ++i) {
+			CPU_SET((size_t)affinity->cpus[i],&cpuset);
+		}
+	} else {
+		CPU_SET((size_t)affinity->cpus[thread_idx %
+					affinity->cpus_count],&cpuset);
+	}
+
+	const int rc = pthread_setaffinity_np(pthread_self(),sizeof(cpuset),
+		&cpuset);
+	if (rc != 0) {
+		rdlog(LOG_ERR,"Can't set %s CPU affinity: %s",thread_name,
+			mystrerror(rc,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	if (affinity->whole_set) {
+		rdlog(LOG_INFO,"%s pinned to NUMA node %d CPUs",thread_name,
+			affinity->numa_node);
+	} else {
+		rdlog(LOG_INFO,"%s pinned to CPU %d",thread_name,
+			affinity->cpus[thread_idx % affinity->cpus_count]);
+	}
+
+	return 0;
+}
+
+void cpu_affinity_done(struct cpu_affinity *affinity) {
+	free(affinity->cpus);
+	affinity->cpus = NULL;
+	affinity->cpus_count = 0;
+}
@@ -0,0 +1,75 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+
+/// No NUMA node configured
+#define CPU_AFFINITY_NO_NUMA_NODE -1
+
+/// Threads CPU affinity
+struct cpu_affinity {
+	/// CPUs to pin threads. No pinning if empty.
+	int *cpus;
+	/// Number of CPUs
+	size_t cpus_count;
+	/** Pin every thread to all cpus (NUMA node), instead of one cpu per
+	    thread */
+	int whole_set;
+	/// NUMA node
+	int numa_node;
+};
+
+/** Initialize CPU affinity
+  @param affinity Affinity to initialize
+  @param cpu_list Linux cpulist format list of CPUs ("0-3,8"). Threads are
+  pinned to them in round robin, one CPU per thread. Can be NULL.
+  @param numa_node NUMA node. If cpu_list is NULL, threads are pinned to all
+  node CPUs. If it's not, only CPUs that belongs to the node are used. Can be
+  CPU_AFFINITY_NO_NUMA_NODE.
+  @return 0 if success, !0 in other case
+  */
+int cpu_affinity_init(struct cpu_affinity *affinity,const char *cpu_list,
+								int numa_node);
+
+/** Pin calling thread.
+  @param affinity Affinity configuration
+  @param thread_idx Thread index. It selects the CPU in one CPU per thread
+  mode.
+  @param thread_name Thread name to log the pinning
+  @return 0 if success (or no pinning configured), !0 in other case
+  @note Allocate thread buffers after calling this function, so kernel
+  first-touch policy allocates them in thread NUMA node.
+  */
+int cpu_affinity_pin_thread(const struct cpu_affinity *affinity,
+				size_t thread_idx,const char *thread_name);
+
+/** Release affinity resources
+  @param affinity Affinity
+  */
+void cpu_affinity_done(struct cpu_affinity *affinity);
+
+/** Parse a Linux cpulist formatted string (as "0-3,8,10-11")
+  @param str String to parse
+  @param cpus Returned CPUs. Need to be freed with free()
+  @param cpus_count Returned number of CPUs
+  @return 0 if success, !0 in other case
+  */
+int parse_cpu_list(const char *str,int **cpus,size_t *cpus_count);
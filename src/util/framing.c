@@ -0,0 +1,178 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "framing.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/// Max number of digits of octet counting length (RFC 6587 MSG-LEN)
+#define OCTET_COUNTING_MAX_DIGITS 9
+/// Length prefix size
+#define LENGTH_PREFIX_SIZE sizeof(uint32_t)
+
+enum framing_mode framing_mode_str(const char *str) {
+	if (NULL == str || 0 == strcmp(STR_FRAMING_NONE, str))
+		return FRAMING_NONE;
+	if (0 == strcmp(STR_FRAMING_NEWLINE, str))
+		return FRAMING_NEWLINE;
+	if (0 == strcmp(STR_FRAMING_OCTET_COUNTING, str))
+		return FRAMING_OCTET_COUNTING;
+	if (0 == strcmp(STR_FRAMING_LENGTH_PREFIX, str))
+		return FRAMING_LENGTH_PREFIX;
+	return FRAMING_INVALID;
+}
+
+const char *framing_mode_name(enum framing_mode mode) {
+	switch (mode) {
+	case FRAMING_NONE:
+		return STR_FRAMING_NONE;
+	case FRAMING_NEWLINE:
+		return STR_FRAMING_NEWLINE;
+	case FRAMING_OCTET_COUNTING:
+		return STR_FRAMING_OCTET_COUNTING;
+	case FRAMING_LENGTH_PREFIX:
+		return STR_FRAMING_LENGTH_PREFIX;
+	case FRAMING_INVALID:
+	default:
+		return "invalid";
+	};
+}
+
+/** Search next record delimited by newline.
+  @note memchr is vectorized in glibc, so delimiter scan uses SIMD
+  */
+static ssize_t next_newline_record(char *buf, size_t len,
+					struct framed_record *record) {
+	char *nl = memchr(buf, '\n', len);
+	if (NULL == nl) {
+		return 0;
+	}
+
+	record->payload = buf;
+	record->len = (size_t)(nl - buf);
+	if (record->len > 0 && record->payload[record->len - 1] == '\r') {
+		/* CRLF */
+		record->len--;
+	}
+
+	return nl - buf + 1;
+}
+
+/// Search next RFC 6587 octet counting record
+static ssize_t next_octet_counting_record(char *buf, size_t len,
+					struct framed_record *record) {
+	size_t i, record_len = 0;
+
+	for (i = 0; i < len && i <= OCTET_COUNTING_MAX_DIGITS; ++i) {
+		if (buf[i] == ' ') {
+			break;
+		}
+
+		if (buf[i] < '0' || buf[i] > '9' || (i == 0 && buf[i] == '0')) {
+			/* Not a NONZERO-DIGIT *DIGIT length */
+			return -1;
+		}
+
+		record_len = record_len * 10 + (size_t)(buf[i] - '0');
+	}
+
+	if (i > OCTET_COUNTING_MAX_DIGITS || (i < len && i == 0)) {
+		return -1;
+	}
+
+	if (i == len || len - i - 1 < record_len) {
+		/* Incomplete */
+		return 0;
+	}
+
+	record->payload = &buf[i + 1];
+	record->len = record_len;
+	return (ssize_t)(i + 1 + record_len);
+}
+
+/// Search next 4 bytes big endian length prefixed record
+static ssize_t next_length_prefix_record(char *buf, size_t len,
+					struct framed_record *record) {
+	const unsigned char *ubuf = (const unsigned char *)buf;
+
+	if (len < LENGTH_PREFIX_SIZE) {
+		return 0;
+	}
+
+	const size_t record_len = (size_t)ubuf[0] << 24 |
+		(size_t)ubuf[1] << 16 | (size_t)ubuf[2] << 8 | (size_t)ubuf[3];
+	if (len - LENGTH_PREFIX_SIZE < record_len) {
+		return 0;
+	}
+
+	record->payload = &buf[LENGTH_PREFIX_SIZE];
+	record->len = record_len;
+	return (ssize_t)(LENGTH_PREFIX_SIZE + record_len);
+}
+
+ssize_t framing_split(enum framing_mode mode, char *buf, size_t len,
+		struct framed_record *records, size_t *records_count) {
+	size_t consumed = 0, count = 0;
+	ssize_t (*next_record)(char *, size_t, struct framed_record *) = NULL;
+
+	switch (mode) {
+	case FRAMING_NEWLINE:
+		next_record = next_newline_record;
+		break;
+	case FRAMING_OCTET_COUNTING:
+		next_record = next_octet_counting_record;
+		break;
+	case FRAMING_LENGTH_PREFIX:
+		next_record = next_length_prefix_record;
+		break;
+	case FRAMING_NONE:
+		if (*records_count == 0 || len == 0) {
+			*records_count = 0;
+			return 0;
+		}
+		records[0].payload = buf;
+		records[0].len = len;
+		*records_count = 1;
+		return (ssize_t)len;
+	case FRAMING_INVALID:
+	default:
+		*records_count = 0;
+		return -1;
+	};
+
+	while (count < *records_count && consumed < len) {
+		const ssize_t rc = next_record(&buf[consumed], len - consumed,
+			&records[count]);
+		if (rc < 0) {
+			*records_count = 0;
+			return -1;
+		} else if (rc == 0) {
+			break;
+		}
+
+		consumed += (size_t)rc;
+		if (records[count].len > 0) {
+			count++;
+		}
+	}
+
+	*records_count = count;
+	return (ssize_t)consumed;
+}
@@ -0,0 +1,73 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/// Stream record framing
+enum framing_mode {
+	/// Every read is a message
+	#define STR_FRAMING_NONE "none"
+	FRAMING_NONE,
+	/// Records delimited by '\n'
+	#define STR_FRAMING_NEWLINE "newline"
+	FRAMING_NEWLINE,
+	/// RFC 6587 octet counting: "<length> <record>"
+	#define STR_FRAMING_OCTET_COUNTING "octet_counting"
+	FRAMING_OCTET_COUNTING,
+	/// 4 bytes big endian length, followed by record
+	#define STR_FRAMING_LENGTH_PREFIX "length_prefix"
+	FRAMING_LENGTH_PREFIX,
+	FRAMING_INVALID
+};
+
+/// Record found in a stream buffer. It points to the buffer memory
+struct framed_record {
+	char *payload;
+	size_t len;
+};
+
+/** Get framing mode from its name
+  @param str Framing name. NULL means none
+  @return Framing mode, or FRAMING_INVALID if unknown
+  */
+enum framing_mode framing_mode_str(const char *str);
+
+/** Get framing mode name
+  @param mode Framing mode
+  @return Framing mode name
+  */
+const char *framing_mode_name(enum framing_mode mode);
+
+/** Search complete records in a stream buffer.
+  @param mode Framing mode
+  @param buf Stream buffer
+  @param len Buffer length
+  @param records Records found
+  @param records_count Size of records array as input, number of records
+  found as output
+  @return Bytes of buffer consumed (they can be discarded), or -1 if stream
+  is malformed (no records are returned in that case). Incomplete records
+  are never consumed.
+  @note Empty records are consumed but not returned
+  */
+ssize_t framing_split(enum framing_mode mode, char *buf, size_t len,
+		struct framed_record *records, size_t *records_count);
@@ -17,7 +17,9 @@
 ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "config.h"
 #include "util.h"
+#include "spill_journal.h"
 /// @TODO this should not have engine/ dependences
 #include "engine/parse.h"
 #include "engine/global_config.h"
@@ -25,20 +27,371 @@
 #include <pthread.h>
 
 #include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <jansson.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ERROR_BUFFER_SIZE   256
 #define RDKAFKA_ERRSTR_SIZE ERROR_BUFFER_SIZE
 
+/// Delivery reports extracted from an event at once
+#define KAFKA_DR_BATCH_SIZE 256
+/// Seconds between per topic delivery counters logs
+#define KAFKA_DR_LOG_INTERVAL_S 60
+
+/// Producer queue counters. Updated atomically
+static struct {
+	/// Payload bytes produced and waiting for delivery report
+	uint64_t inflight_bytes;
+	/// Messages with delivery report
+	uint64_t delivered_msgs;
+	/// Payload bytes with delivery report
+	uint64_t delivered_bytes;
+} kafka_queue_counters;
+
+/// Atomically set a value. Only one thread can set it
+static void atomic_set_single_writer(int *value,int new_value) {
+	const int old_value = ATOMIC_OP(fetch,add,value,0);
+	ATOMIC_OP(add,fetch,value,new_value - old_value);
+}
+
+/** Absolute CLOCK_MONOTONIC time to wait until
+  @param deadline Returned time
+  @param timeout_ms Milliseconds from now
+  */
+static void monotonic_deadline(struct timespec *deadline,int timeout_ms) {
+	clock_gettime(CLOCK_MONOTONIC,deadline);
+	deadline->tv_sec += timeout_ms/1000;
+	deadline->tv_nsec += (timeout_ms%1000)*1000*1000;
+	if (deadline->tv_nsec >= 1000*1000*1000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000*1000*1000;
+	}
+}
+
+/*
+ *  DELIVERY ACKNOWLEDGEMENT
+ */
+
+struct kafka_delivery_ack {
+	pthread_mutex_t lock;
+	/// Tracked messages not reported yet, plus owner reference
+	size_t refcnt;
+	/// Tracked, reported and failed messages
+	size_t msgs,reported,failed;
+	/// No more messages will be tracked
+	int sealed;
+	/// Callback, NULL if already called or cancelled
+	kafka_delivery_ack_cb cb;
+	void *cb_opaque;
+};
+
+/// Tracked message rdkafka opaque
+struct kafka_msg_ack {
+	/// Original message opaque
+	void *opaque;
+	struct kafka_delivery_ack *ack;
+};
+
+/* Tracked messages opaque have the low bit set. Allocated pointers are
+   aligned, and values (like client MAC) are encoded with
+   kafka_msg_opaque_from_value, so they never use it */
+#define KAFKA_MSG_ACK_TAG ((uintptr_t)1)
+
+/// Delivery acknowledgement of messages produced by this thread
+static __thread struct kafka_delivery_ack *current_delivery_ack;
+
+static struct kafka_msg_ack *kafka_msg_ack(void *msg_opaque) {
+	const uintptr_t u = (uintptr_t)msg_opaque;
+	return (u & KAFKA_MSG_ACK_TAG) ?
+		(struct kafka_msg_ack *)(u & ~KAFKA_MSG_ACK_TAG) : NULL;
+}
+
+struct kafka_delivery_ack *kafka_delivery_ack_new(kafka_delivery_ack_cb cb,
+								void *opaque) {
+	struct kafka_delivery_ack *ack = calloc(1,sizeof(*ack));
+	if (NULL == ack) {
+		rdlog(LOG_ERR,"Can't allocate delivery ack (out of memory?)");
+		return NULL;
+	}
+
+	pthread_mutex_init(&ack->lock,NULL);
+	ack->refcnt = 1;
+	ack->cb = cb;
+	ack->cb_opaque = opaque;
+	return ack;
+}
+
+/// Call callback if all messages reported. Need to hold ack lock
+static void delivery_ack_maybe_call(struct kafka_delivery_ack *ack) {
+	if (ack->cb && ack->sealed && ack->reported == ack->msgs) {
+		ack->cb(ack->msgs,ack->failed,ack->cb_opaque);
+		ack->cb = NULL;
+	}
+}
+
+/// Drop a reference. Need to hold ack lock, that is released
+static void delivery_ack_decref_unlock(struct kafka_delivery_ack *ack) {
+	const size_t refcnt = --ack->refcnt;
+	pthread_mutex_unlock(&ack->lock);
+
+	if (0 == refcnt) {
+		pthread_mutex_destroy(&ack->lock);
+		free(ack);
+	}
+}
+
+void kafka_delivery_ack_track(struct kafka_delivery_ack *ack) {
+	current_delivery_ack = ack;
+}
+
+void kafka_delivery_ack_seal(struct kafka_delivery_ack *ack) {
+	pthread_mutex_lock(&ack->lock);
+	ack->sealed = 1;
+	delivery_ack_maybe_call(ack);
+	pthread_mutex_unlock(&ack->lock);
+}
+
+void kafka_delivery_ack_done(struct kafka_delivery_ack *ack) {
+	pthread_mutex_lock(&ack->lock);
+	ack->cb = NULL;
+	delivery_ack_decref_unlock(ack);
+}
+
+void *kafka_msg_opaque(void *msg_opaque) {
+	const struct kafka_msg_ack *msg_ack = kafka_msg_ack(msg_opaque);
+	return msg_ack ? msg_ack->opaque : msg_opaque;
+}
+
+/** Get a tracking opaque for a message about to be produced, if this thread
+  is tracking messages
+  @param opaque Message opaque
+  @return Opaque to pass to rdkafka
+  */
+static void *msg_ack_wrap(void *opaque) {
+	struct kafka_delivery_ack *ack = current_delivery_ack;
+	if (NULL == ack) {
+		return opaque;
+	}
+
+	struct kafka_msg_ack *msg_ack = malloc(sizeof(*msg_ack));
+	pthread_mutex_lock(&ack->lock);
+	ack->msgs++;
+	if (NULL == msg_ack) {
+		/* Can't know if it will be delivered */
+		rdlog(LOG_ERR,"Can't allocate message delivery ack "
+			"(out of memory?)");
+		ack->reported++;
+		ack->failed++;
+		pthread_mutex_unlock(&ack->lock);
+		return opaque;
+	}
+	ack->refcnt++;
+	pthread_mutex_unlock(&ack->lock);
+
+	msg_ack->opaque = opaque;
+	msg_ack->ack = ack;
+	return (void *)((uintptr_t)msg_ack | KAFKA_MSG_ACK_TAG);
+}
+
+/** Report a message delivery or produce error
+  @param msg_opaque rdkafka message opaque
+  @param err Message could not be produced or delivered
+  @return Original message opaque
+  */
+static void *msg_ack_report(void *msg_opaque,int err) {
+	struct kafka_msg_ack *msg_ack = kafka_msg_ack(msg_opaque);
+	if (NULL == msg_ack) {
+		return msg_opaque;
+	}
+
+	void *opaque = msg_ack->opaque;
+	struct kafka_delivery_ack *ack = msg_ack->ack;
+	free(msg_ack);
+
+	pthread_mutex_lock(&ack->lock);
+	ack->reported++;
+	if (err) {
+		ack->failed++;
+	}
+	delivery_ack_maybe_call(ack);
+	delivery_ack_decref_unlock(ack);
+
+	return opaque;
+}
+
+/// Report messages that have not been produced, if this thread is tracking
+static void msg_ack_fail_untracked(size_t count) {
+	struct kafka_delivery_ack *ack = current_delivery_ack;
+	if (NULL == ack || 0 == count) {
+		return;
+	}
+
+	pthread_mutex_lock(&ack->lock);
+	ack->msgs += count;
+	ack->reported += count;
+	ack->failed += count;
+	pthread_mutex_unlock(&ack->lock);
+}
+
+void kafka_track_batch(rd_kafka_message_t *msgs,size_t count) {
+	size_t i;
+
+	if (NULL == current_delivery_ack) {
+		return;
+	}
+
+	for (i=0; i<count; ++i) {
+		msgs[i]._private = msg_ack_wrap(msgs[i]._private);
+	}
+}
+
+/*
+ *  PRODUCER INSTANCES
+ */
+
+/// Last statistics reported by a producer instance
+struct kafka_producer_stats {
+	/// Messages and bytes in producer queues
+	json_int_t msg_cnt,msg_size;
+	/// Requests and bytes sent to brokers
+	json_int_t tx,tx_bytes;
+	/// Messages and bytes sent to brokers
+	json_int_t txmsgs,txmsg_bytes;
+};
+
+static struct {
+	/// Producer handlers. The first one is global_config.rk
+	rd_kafka_t **rk;
+	size_t count;
+	/// Next instance to assign to a producing thread
+	size_t next_thread_instance;
+
+	/// Protects stats
+	pthread_mutex_t stats_lock;
+	struct kafka_producer_stats *stats;
+} kafka_producers = {
+	.stats_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Producer instance used by this thread, plus one. 0 if not assigned yet
+static __thread size_t thread_producer_instance;
+
+/** Producer instance of current thread. Threads are assigned to instances
+  in round robin the first time they produce, and they always use the same
+  one after that, so messages of the same thread keep their order.
+  @return Producer instance index
+  */
+static size_t kafka_thread_producer_instance() {
+	if (0 == thread_producer_instance) {
+		const size_t next = ATOMIC_OP(fetch,add,
+			&kafka_producers.next_thread_instance,1);
+		thread_producer_instance = next % kafka_producers.count + 1;
+	}
+
+	return thread_producer_instance - 1;
+}
+
+/// Number of producer handlers topics need to be created in
+static size_t kafka_producers_count() {
+	return kafka_producers.count > 0 ? kafka_producers.count : 1;
+}
+
+/// Producer handler of an instance
+static rd_kafka_t *kafka_producer(size_t instance) {
+	return kafka_producers.count > 0 ? kafka_producers.rk[instance] :
+		global_config.rk;
+}
+
+/// Messages and requests waiting in all producers queues
+static size_t kafka_producers_outq_len() {
+	size_t i,ret = 0;
+	for (i=0; i<kafka_producers.count; ++i) {
+		ret += (size_t)rd_kafka_outq_len(kafka_producers.rk[i]);
+	}
+	return ret;
+}
+
+/** Process a statistics event. Keep instance statistics, and log the
+  aggregation of all instances when the first one reports.
+  @param stats Statistics of the instance that emitted the event
+  @param json Statistics json
+  */
+static void producer_stats(struct kafka_producer_stats *stats,
+							const char *json) {
+	struct kafka_producer_stats instance_stats,total;
+	json_error_t jerr;
+	size_t i;
+
+	memset(&instance_stats,0,sizeof(instance_stats));
+	json_t *root = json_loads(json,0,&jerr);
+	if (NULL == root) {
+		rdlog(LOG_ERR,"Can't parse rdkafka stats: %s",jerr.text);
+		return;
+	}
+
+	const int unpack_rc = json_unpack_ex(root,&jerr,0,
+		"{s?I,s?I,s?I,s?I,s?I,s?I}",
+		"msg_cnt",&instance_stats.msg_cnt,
+		"msg_size",&instance_stats.msg_size,
+		"tx",&instance_stats.tx,
+		"tx_bytes",&instance_stats.tx_bytes,
+		"txmsgs",&instance_stats.txmsgs,
+		"txmsg_bytes",&instance_stats.txmsg_bytes);
+	json_decref(root);
+	if (0 != unpack_rc) {
+		rdlog(LOG_ERR,"Can't parse rdkafka stats: %s",jerr.text);
+		return;
+	}
+
+	memset(&total,0,sizeof(total));
+	pthread_mutex_lock(&kafka_producers.stats_lock);
+	*stats = instance_stats;
+	if (stats == &kafka_producers.stats[0]) {
+		for (i=0; i<kafka_producers.count; ++i) {
+			const struct kafka_producer_stats *s =
+				&kafka_producers.stats[i];
+			total.msg_cnt += s->msg_cnt;
+			total.msg_size += s->msg_size;
+			total.tx += s->tx;
+			total.tx_bytes += s->tx_bytes;
+			total.txmsgs += s->txmsgs;
+			total.txmsg_bytes += s->txmsg_bytes;
+		}
+	}
+	pthread_mutex_unlock(&kafka_producers.stats_lock);
+
+	if (stats == &kafka_producers.stats[0]) {
+		rdlog(LOG_INFO,"Kafka producers stats (%zu instances): "
+			"queued %"JSON_INTEGER_FORMAT" messages "
+			"(%"JSON_INTEGER_FORMAT" bytes), "
+			"sent %"JSON_INTEGER_FORMAT" requests "
+			"(%"JSON_INTEGER_FORMAT" bytes), "
+			"%"JSON_INTEGER_FORMAT" messages "
+			"(%"JSON_INTEGER_FORMAT" bytes)",
+			kafka_producers.count,total.msg_cnt,total.msg_size,
+			total.tx,total.tx_bytes,total.txmsgs,
+			total.txmsg_bytes);
+	}
+}
+
 /** Creates a new topic handler using global configuration
+    @param rk Producer handler
     @param topic_name Topic name
     @param partitioner Partitioner function
+    @param opaque Topic opaque
     @return New topic handler */
-rd_kafka_topic_t *new_rkt_global_config(const char *topic_name,
-	rb_rd_kafka_partitioner_t partitioner,char *err,size_t errsize) {
+static rd_kafka_topic_t *new_rkt_global_config(rd_kafka_t *rk,
+	const char *topic_name,rb_rd_kafka_partitioner_t partitioner,
+	void *opaque,char *err,size_t errsize) {
 	rd_kafka_topic_conf_t *template_config = global_config.kafka_topic_conf;
 	rd_kafka_topic_conf_t *my_rkt_conf
 		= rd_kafka_topic_conf_dup(template_config);
@@ -49,8 +402,9 @@ rd_kafka_topic_t *new_rkt_global_config(const char *topic_name,
 	}
 
 	rd_kafka_topic_conf_set_partitioner_cb(my_rkt_conf, partitioner);
+	rd_kafka_topic_conf_set_opaque(my_rkt_conf, opaque);
 
-	rd_kafka_topic_t *ret = rd_kafka_topic_new(global_config.rk, topic_name,
+	rd_kafka_topic_t *ret = rd_kafka_topic_new(rk, topic_name,
 		my_rkt_conf);
 	if (NULL == ret) {
 		strerror_r(errno, err, errsize);
@@ -60,25 +414,882 @@ rd_kafka_topic_t *new_rkt_global_config(const char *topic_name,
 	return ret;
 }
 
+/*
+ *  TOPICS REGISTRY
+ */
+
+/// Shared topic handler
+struct kafka_topic_entry {
+	char *name;
+	rb_rd_kafka_partitioner_t partitioner;
+	/// Topic handler in every producer instance. The first one is the
+	/// one returned to users
+	rd_kafka_topic_t **rkt;
+	size_t rkt_count;
+	size_t refcnt;
+	LIST_ENTRY(kafka_topic_entry) entry;
+};
+
+static struct {
+	/// Only taken on configuration and reload, not per message
+	pthread_mutex_t lock;
+	LIST_HEAD(,kafka_topic_entry) topics;
+} kafka_topics = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.topics = LIST_HEAD_INITIALIZER(kafka_topics.topics),
+};
+
+static void kafka_topic_entry_done(struct kafka_topic_entry *entry) {
+	size_t i;
+	for (i=0; i<entry->rkt_count; ++i) {
+		rd_kafka_topic_destroy(entry->rkt[i]);
+	}
+	free(entry->rkt);
+	free(entry->name);
+	free(entry);
+}
+
+/** Create a registry entry, with a topic handler in each producer instance
+  @param topic_name Topic name
+  @param partitioner Partitioner
+  @param err Error buffer
+  @param errsize Error buffer size
+  @return New entry, or NULL if error
+  */
+static struct kafka_topic_entry *kafka_topic_entry_new(const char *topic_name,
+		rb_rd_kafka_partitioner_t partitioner,char *err,size_t errsize) {
+	const size_t instances = kafka_producers_count();
+	struct kafka_topic_entry *entry = calloc(1,sizeof(*entry));
+	if (NULL == entry || NULL == (entry->name = strdup(topic_name)) ||
+			NULL == (entry->rkt = calloc(instances,
+						sizeof(entry->rkt[0])))) {
+		snprintf(err,errsize,"Can't allocate topic entry "
+			"(out of memory?)");
+		if (entry) {
+			free(entry->name);
+		}
+		free(entry);
+		return NULL;
+	}
+
+	entry->partitioner = partitioner;
+	entry->refcnt = 1;
+	for (entry->rkt_count = 0; entry->rkt_count < instances;
+							entry->rkt_count++) {
+		rd_kafka_topic_t *rkt = new_rkt_global_config(
+			kafka_producer(entry->rkt_count),topic_name,
+			partitioner,entry,err,errsize);
+		if (NULL == rkt) {
+			kafka_topic_entry_done(entry);
+			return NULL;
+		}
+		entry->rkt[entry->rkt_count] = rkt;
+	}
+
+	return entry;
+}
+
+/** Get a topic handler from registry, creating it if needed. There is only
+  one entry per topic name, since rdkafka shares the topic (and so its
+  partitioner) inside a producer instance anyway.
+  @param topic_name Topic name
+  @param partitioner Partitioner of the handler
+  @param any_partitioner Any existing handler of the topic is valid, no
+  matter its partitioner
+  @param err Error buffer
+  @param errsize Error buffer size
+  @return Topic handler, or NULL if error
+  */
+static rd_kafka_topic_t *kafka_topic_get0(const char *topic_name,
+		rb_rd_kafka_partitioner_t partitioner,int any_partitioner,
+		char *err,size_t errsize) {
+	struct kafka_topic_entry *entry = NULL;
+	rd_kafka_topic_t *ret = NULL;
+
+	pthread_mutex_lock(&kafka_topics.lock);
+	LIST_FOREACH(entry,&kafka_topics.topics,entry) {
+		if (0 == strcmp(entry->name,topic_name)) {
+			break;
+		}
+	}
+
+	if (entry) {
+		if (!any_partitioner && entry->partitioner != partitioner) {
+			rdlog(LOG_WARNING,"Topic %s used with different "
+				"partitioners, only the first one will be used",
+				topic_name);
+		}
+		entry->refcnt++;
+		ret = entry->rkt[0];
+		goto done;
+	}
+
+	entry = kafka_topic_entry_new(topic_name,partitioner,err,errsize);
+	if (entry) {
+		LIST_INSERT_HEAD(&kafka_topics.topics,entry,entry);
+		ret = entry->rkt[0];
+	}
+
+done:
+	pthread_mutex_unlock(&kafka_topics.lock);
+	return ret;
+}
+
+rd_kafka_topic_t *kafka_topic_get(const char *topic_name,
+		rb_rd_kafka_partitioner_t partitioner,char *err,size_t errsize) {
+	return kafka_topic_get0(topic_name,partitioner,0,err,errsize);
+}
+
+void kafka_topic_release(rd_kafka_topic_t *rkt) {
+	struct kafka_topic_entry *entry = NULL;
+
+	pthread_mutex_lock(&kafka_topics.lock);
+	LIST_FOREACH(entry,&kafka_topics.topics,entry) {
+		if (entry->rkt[0] == rkt) {
+			break;
+		}
+	}
+
+	if (NULL == entry) {
+		/* Not created by registry */
+		rd_kafka_topic_destroy(rkt);
+	} else if (0 == --entry->refcnt) {
+		LIST_REMOVE(entry,entry);
+		kafka_topic_entry_done(entry);
+	}
+	pthread_mutex_unlock(&kafka_topics.lock);
+}
+
+rd_kafka_topic_t *kafka_thread_topic(rd_kafka_topic_t *rkt) {
+	if (NULL == rkt || kafka_producers.count < 2) {
+		return rkt;
+	}
+
+	/* Caller holds a reference of rkt, so entry is alive */
+	const struct kafka_topic_entry *entry = rd_kafka_topic_opaque(rkt);
+	return entry ? entry->rkt[kafka_thread_producer_instance()] : rkt;
+}
+
 const char *default_topic_name() {
 	return global_config.topic;
 }
 
-/**
-* Message delivery report callback.
-* Called once for each message.
-* See rdkafka.h for more information.
-*/
-static void msg_delivered (rd_kafka_t *_rk RB_UNUSED,
-void *payload, size_t len,
-int error_code,
-void *opaque RB_UNUSED, void *msg_opaque RB_UNUSED) {
+/*
+ *  SPILL JOURNAL
+ */
+
+/// Spill journal config defaults
+#define KAFKA_SPILL_SEGMENT_SIZE_DEFAULT ((json_int_t)64*1024*1024)
+#define KAFKA_SPILL_MAX_SIZE_DEFAULT ((json_int_t)1024*1024*1024)
+#define KAFKA_SPILL_REPLAY_RATE_DEFAULT 1000
+#define KAFKA_SPILL_REPLAY_MAX_QUEUE_DEFAULT 10000
+#define KAFKA_SPILL_PROBE_INTERVAL_MS_DEFAULT 5000
+/// Replayer thread wake up interval
+#define KAFKA_SPILL_REPLAY_TICK_MS 100
+/// Seconds between replay progress logs
+#define KAFKA_SPILL_LOG_INTERVAL_S 60
+
+static struct {
+	/// NULL if not configured. Opened before producers and delivery
+	/// reports thread start, and closed after it stops, so it is not
+	/// modified while other threads read it
+	struct spill_journal *journal;
+	/// Max records replayed per second
+	int replay_rate;
+	/// Do not replay while producers queues have more messages than this
+	int replay_max_queue;
+	/// Time between replayed records while deliveries are failing
+	int probe_interval_ms;
+
+	/// Last delivery report says kafka is delivering. Updated atomically
+	int delivery_ok;
+	/// Replayed records that could not be produced again. Updated
+	/// atomically
+	uint64_t dropped_msgs;
+
+	pthread_t thread;
+	/// Replayer thread has been started
+	int running;
+	/// Protects stop
+	pthread_mutex_t lock;
+	/// Signaled when replayer thread must stop
+	pthread_cond_t cond;
+	int stop;
+} kafka_spill = {
+	.delivery_ok = 1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Append a message that could not be produced or delivered to the spill
+  journal, so it can be replayed later
+  @param rkt Message topic
+  @param partition Message partition, or RD_KAFKA_PARTITION_UA
+  @param key Message key
+  @param key_len Message key length
+  @param payload Message payload
+  @param len Message payload length
+  @return 0 if spilled, -1 if no journal or it is full
+  */
+static int kafka_spill_msg(const rd_kafka_topic_t *rkt,int32_t partition,
+		const void *key,size_t key_len,const void *payload,size_t len) {
+	if (NULL == kafka_spill.journal) {
+		return -1;
+	}
+
+	const char *topic_name = rd_kafka_topic_name(rkt);
+	const struct spill_record record = {
+		.topic = topic_name,
+		.topic_len = strlen(topic_name),
+		.partition = partition,
+		.key = key,
+		.key_len = key_len,
+		.payload = payload,
+		.payload_len = len,
+	};
+
+	return spill_journal_append(kafka_spill.journal,&record);
+}
+
+/// Delivery errors that would happen again if the message is replayed
+static int kafka_delivery_err_permanent(rd_kafka_resp_err_t err) {
+	switch (err) {
+	case RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE:
+	case RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART:
+	case RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC:
+		return 1;
+	default:
+		return 0;
+	};
+}
+
+static void kafka_spill_log_stats0(const struct spill_journal_stats *stats) {
+	rdlog(LOG_INFO,"Spill journal: %"PRIu64" messages (%"PRIu64" bytes) "
+		"pending in %zu segments. Since start, %"PRIu64" messages "
+		"spilled (%"PRIu64" bytes), %"PRIu64" replayed (%"PRIu64" "
+		"bytes), %"PRIu64" rejected because journal was full, "
+		"%"PRIu64" corrupted and %"PRIu64" dropped on replay",
+		stats->pending_msgs,stats->pending_bytes,stats->segments,
+		stats->appended_msgs,stats->appended_bytes,
+		stats->replayed_msgs,stats->replayed_bytes,
+		stats->rejected_msgs,stats->corrupted_msgs,
+		ATOMIC_OP(fetch,add,&kafka_spill.dropped_msgs,0));
+}
+
+void kafka_log_spill_stats() {
+	struct spill_journal_stats stats;
+
+	if (NULL == kafka_spill.journal) {
+		return;
+	}
+
+	spill_journal_stats(kafka_spill.journal,&stats);
+	kafka_spill_log_stats0(&stats);
+}
+
+/// Replayer thread state
+struct kafka_spill_replayer {
+	/// Topic of last replayed record, from registry
+	rd_kafka_topic_t *rkt;
+	char topic_name[256];
+	/// Records that can be replayed, following replay rate
+	double credit;
+	/// Last replay while deliveries are failing
+	struct timespec last_probe;
+	/// Last progress log
+	time_t last_log;
+};
+
+/** Produce a spilled record again
+  @param record Spilled record
+  @param opaque Replayer state
+  @return 0 if produced (or dropped), -1 if producer queue is full
+  */
+static int kafka_spill_replay_record(const struct spill_record *record,
+							void *opaque) {
+	struct kafka_spill_replayer *replayer = opaque;
+	char err[BUFSIZ];
+
+	if (record->topic_len >= sizeof(replayer->topic_name)) {
+		rdlog(LOG_ERR,"Can't replay spilled message: topic name too "
+			"long");
+		ATOMIC_OP(add,fetch,&kafka_spill.dropped_msgs,1);
+		return 0;
+	}
+
+	if (NULL == replayer->rkt ||
+			strlen(replayer->topic_name) != record->topic_len ||
+			0 != memcmp(replayer->topic_name,record->topic,
+							record->topic_len)) {
+		if (replayer->rkt) {
+			kafka_topic_release(replayer->rkt);
+		}
+		memcpy(replayer->topic_name,record->topic,record->topic_len);
+		replayer->topic_name[record->topic_len] = '\0';
+		/* Partitioner is not needed if record knows its partition,
+		   and client MAC is lost anyway */
+		replayer->rkt = kafka_topic_get0(replayer->topic_name,NULL,1,
+							err,sizeof(err));
+		if (NULL == replayer->rkt) {
+			rdlog(LOG_ERR,"Can't replay spilled message: can't "
+				"create topic %s: %s",replayer->topic_name,err);
+			ATOMIC_OP(add,fetch,&kafka_spill.dropped_msgs,1);
+			return 0;
+		}
+	}
+
+	rd_kafka_topic_t *rkt = kafka_thread_topic(replayer->rkt);
+	/* Copied payload is not modified */
+	void *payload = (void *)(uintptr_t)record->payload;
+	int produce_rc = rd_kafka_produce(rkt,record->partition,
+		RD_KAFKA_MSG_F_COPY,payload,record->payload_len,record->key,
+		record->key_len,NULL);
+	if (0 != produce_rc && ENOBUFS != errno &&
+				RD_KAFKA_PARTITION_UA != record->partition) {
+		/* Partition may not exist anymore */
+		produce_rc = rd_kafka_produce(rkt,RD_KAFKA_PARTITION_UA,
+			RD_KAFKA_MSG_F_COPY,payload,record->payload_len,
+			record->key,record->key_len,NULL);
+	}
+	const int produce_errno = errno;
+
+	if (0 == produce_rc) {
+		ATOMIC_OP(add,fetch,&kafka_queue_counters.inflight_bytes,
+			record->payload_len);
+		return 0;
+	}
+
+	if (ENOBUFS == produce_errno) {
+		/* Retry in next tick */
+		return -1;
+	}
+
+	rdlog(LOG_ERR,"Can't replay spilled message: %s",
+		mystrerror(produce_errno,err,sizeof(err)));
+	ATOMIC_OP(add,fetch,&kafka_spill.dropped_msgs,1);
+	return 0;
+}
+
+/// Milliseconds from a to b
+static int64_t timespec_diff_ms(const struct timespec *a,
+						const struct timespec *b) {
+	return ((int64_t)b->tv_sec - a->tv_sec)*1000 +
+		((int64_t)b->tv_nsec - a->tv_nsec)/(1000*1000);
+}
+
+/** Replay spilled records allowed by replay rate. While deliveries are
+  failing, only one record is replayed every probe interval, to know when
+  kafka is back.
+  @param replayer Replayer state
+  */
+static void kafka_spill_replay_tick(struct kafka_spill_replayer *replayer) {
+	struct timespec now;
+
+	replayer->credit += (double)kafka_spill.replay_rate*
+					KAFKA_SPILL_REPLAY_TICK_MS/1000;
+	if (replayer->credit > kafka_spill.replay_rate) {
+		/* No bursts after a pause */
+		replayer->credit = kafka_spill.replay_rate;
+	}
+
+	size_t max_records = (size_t)replayer->credit;
+	if (0 == max_records) {
+		return;
+	}
+
+	if (!ATOMIC_OP(fetch,add,&kafka_spill.delivery_ok,0)) {
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		if (timespec_diff_ms(&replayer->last_probe,&now) <
+						kafka_spill.probe_interval_ms) {
+			return;
+		}
+		replayer->last_probe = now;
+		max_records = 1;
+	}
+
+	if (kafka_producers_outq_len() > (size_t)kafka_spill.replay_max_queue) {
+		/* Live traffic first */
+		return;
+	}
+
+	replayer->credit -= (double)spill_journal_replay(kafka_spill.journal,
+			max_records,kafka_spill_replay_record,replayer);
+}
+
+static void *kafka_spill_replayer_main(void *unused RB_UNUSED) {
+	struct kafka_spill_replayer replayer;
+	struct spill_journal_stats stats;
+	struct timespec deadline;
+
+	memset(&replayer,0,sizeof(replayer));
+	replayer.last_log = time(NULL);
+
+	pthread_mutex_lock(&kafka_spill.lock);
+	while (!kafka_spill.stop) {
+		monotonic_deadline(&deadline,KAFKA_SPILL_REPLAY_TICK_MS);
+		pthread_cond_timedwait(&kafka_spill.cond,&kafka_spill.lock,
+								&deadline);
+		if (kafka_spill.stop) {
+			break;
+		}
+		pthread_mutex_unlock(&kafka_spill.lock);
+
+		kafka_spill_replay_tick(&replayer);
+
+		const time_t now = time(NULL);
+		if (difftime(now,replayer.last_log) >=
+						KAFKA_SPILL_LOG_INTERVAL_S) {
+			spill_journal_stats(kafka_spill.journal,&stats);
+			if (stats.pending_msgs > 0) {
+				kafka_spill_log_stats0(&stats);
+			}
+			replayer.last_log = now;
+		}
+
+		pthread_mutex_lock(&kafka_spill.lock);
+	}
+	pthread_mutex_unlock(&kafka_spill.lock);
+
+	if (replayer.rkt) {
+		kafka_topic_release(replayer.rkt);
+	}
+	return NULL;
+}
+
+static void kafka_spill_replayer_start() {
+	pthread_condattr_t cond_attr;
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&kafka_spill.cond,&cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	kafka_spill.stop = 0;
+	const int create_rc = pthread_create(&kafka_spill.thread,NULL,
+						kafka_spill_replayer_main,NULL);
+	if (0 != create_rc) {
+		fatal("%% Can't create spill journal replayer thread: %s",
+			strerror(create_rc));
+	}
+	kafka_spill.running = 1;
+}
+
+/// Stop replaying spill journal. Records not replayed are kept in it
+static void kafka_spill_replayer_stop() {
+	if (!kafka_spill.running) {
+		return;
+	}
+
+	pthread_mutex_lock(&kafka_spill.lock);
+	kafka_spill.stop = 1;
+	pthread_cond_signal(&kafka_spill.cond);
+	pthread_mutex_unlock(&kafka_spill.lock);
+
+	pthread_join(kafka_spill.thread,NULL);
+	kafka_spill.running = 0;
+	pthread_cond_destroy(&kafka_spill.cond);
+}
+
+/// Close spill journal. Nothing can spill messages after this
+static void kafka_spill_close() {
+	if (NULL == kafka_spill.journal) {
+		return;
+	}
+
+	kafka_log_spill_stats();
+	spill_journal_close(kafka_spill.journal);
+	kafka_spill.journal = NULL;
+}
+
+int kafka_spill_init(json_t *config) {
+	json_error_t jerr;
+	char err[BUFSIZ];
+	const char *path = NULL;
+	json_int_t segment_size = KAFKA_SPILL_SEGMENT_SIZE_DEFAULT;
+	json_int_t max_size = KAFKA_SPILL_MAX_SIZE_DEFAULT;
+	int replay_rate = KAFKA_SPILL_REPLAY_RATE_DEFAULT;
+	int replay_max_queue = KAFKA_SPILL_REPLAY_MAX_QUEUE_DEFAULT;
+	int probe_interval_ms = KAFKA_SPILL_PROBE_INTERVAL_MS_DEFAULT;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,
+		"{s:s,s?I,s?I,s?i,s?i,s?i}",
+		"path",&path,
+		"segment_size",&segment_size,
+		"max_size",&max_size,
+		"replay_rate",&replay_rate,
+		"replay_max_queue",&replay_max_queue,
+		"replay_probe_interval_ms",&probe_interval_ms);
+	if (0 != unpack_rc) {
+		rdlog(LOG_ERR,"Can't parse spill journal config: %s",jerr.text);
+		return -1;
+	}
+
+	if (segment_size <= 0 || max_size <= 0 || replay_rate <= 0 ||
+				replay_max_queue < 0 || probe_interval_ms < 0) {
+		rdlog(LOG_ERR,"Invalid spill journal config: sizes and replay "
+			"rate must be greater than 0, and replay queue and "
+			"probe interval can't be negative");
+		return -1;
+	}
+
+	const struct spill_journal_config journal_config = {
+		.path = path,
+		.segment_size = (size_t)segment_size,
+		.max_size = (uint64_t)max_size,
+	};
+
+	kafka_spill.journal = spill_journal_open(&journal_config,err,
+								sizeof(err));
+	if (NULL == kafka_spill.journal) {
+		rdlog(LOG_ERR,"Can't open spill journal %s: %s",path,err);
+		return -1;
+	}
+
+	kafka_spill.replay_rate = replay_rate;
+	kafka_spill.replay_max_queue = replay_max_queue;
+	kafka_spill.probe_interval_ms = probe_interval_ms;
+	kafka_log_spill_stats();
+	return 0;
+}
+
+/*
+ *  DELIVERY REPORTS
+ */
+
+/// Per topic delivery counters. Only used by delivery reports thread
+struct kafka_topic_delivery {
+	char *name;
+	/// Since last log
+	uint64_t delivered_msgs,delivered_bytes,failed_msgs;
+	/// Last delivery error
+	rd_kafka_resp_err_t last_err;
+	LIST_ENTRY(kafka_topic_delivery) entry;
+};
+
+/// Delivery reports being processed
+struct kafka_dr_batch {
+	uint64_t msgs,bytes;
+	/// Topic counters of the last message
+	struct kafka_topic_delivery *topic;
+	/// Last message says kafka is delivering (1) or not (0). -1 if no
+	/// message says anything
+	int delivery_ok;
+};
+
+static struct {
+	pthread_t thread;
+	/// Thread has been started
+	int running;
+	/// Thread must stop. Updated atomically
+	int stop;
+	/// rdkafka writes in it when producers main queues get events
+	int pipe[2];
+	/// Producers main queues
+	rd_kafka_queue_t **queues;
+
+	/// Protects batches
+	pthread_mutex_t lock;
+	/// Signaled when delivery reports are processed
+	pthread_cond_t cond;
+	/// Times delivery reports have been processed
+	uint64_t batches;
+
+	/// Per topic counters
+	LIST_HEAD(,kafka_topic_delivery) topics;
+	/// Last time per topic counters were logged
+	time_t last_log;
+} kafka_dr_thread = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.pipe = {-1, -1},
+	.topics = LIST_HEAD_INITIALIZER(kafka_dr_thread.topics),
+};
+
+/** Get topic delivery counters
+  @param prev Counters of previous message, checked first
+  @param rkt Message topic
+  @return Topic counters, NULL if no memory
+  */
+static struct kafka_topic_delivery *kafka_topic_delivery(
+		struct kafka_topic_delivery *prev,const rd_kafka_topic_t *rkt) {
+	const char *topic_name = rd_kafka_topic_name(rkt);
+	struct kafka_topic_delivery *topic = NULL;
+
+	if (prev && 0 == strcmp(prev->name,topic_name)) {
+		return prev;
+	}
+
+	LIST_FOREACH(topic,&kafka_dr_thread.topics,entry) {
+		if (0 == strcmp(topic->name,topic_name)) {
+			return topic;
+		}
+	}
+
+	topic = calloc(1,sizeof(*topic));
+	if (NULL == topic || NULL == (topic->name = strdup(topic_name))) {
+		rdlog(LOG_ERR,"Can't allocate topic %s delivery counters "
+			"(out of memory?)",topic_name);
+		free(topic);
+		return NULL;
+	}
+
+	LIST_INSERT_HEAD(&kafka_dr_thread.topics,topic,entry);
+	return topic;
+}
 
-	if (error_code){
-		rblog(LOG_ERR,   "Message delivery failed: %s",rd_kafka_err2str(error_code));
-	}else{
-		rblog(LOG_DEBUG, "Message delivered (%zd bytes): %*.*s", len, (int)len,(int)len, (char *)payload);
+/** Process a message delivery report
+  @param batch Delivery reports being processed
+  @param msg Delivered message
+  */
+static void msg_delivered(struct kafka_dr_batch *batch,
+					const rd_kafka_message_t *msg) {
+	/* Spilled messages are still failed: journal is not synced, and
+	   replay can lose them, so clients must not take them as delivered */
+	msg_ack_report(msg->_private,msg->err);
+	batch->msgs++;
+	batch->bytes += msg->len;
+
+	if (msg->rkt && !msg->err) {
+		batch->delivery_ok = 1;
+	} else if (msg->rkt && !kafka_delivery_err_permanent(msg->err)) {
+		batch->delivery_ok = 0;
+		/* Message was assigned to a partition that does not exist */
+		const int32_t partition =
+			RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION == msg->err ?
+			RD_KAFKA_PARTITION_UA : msg->partition;
+		kafka_spill_msg(msg->rkt,partition,msg->key,msg->key_len,
+			msg->payload,msg->len);
+	}
+
+	if (NULL == msg->rkt) {
+		return;
+	}
+
+	batch->topic = kafka_topic_delivery(batch->topic,msg->rkt);
+	if (NULL == batch->topic) {
+		return;
+	}
+
+	if (msg->err) {
+		batch->topic->failed_msgs++;
+		batch->topic->last_err = msg->err;
+	} else {
+		batch->topic->delivered_msgs++;
+		batch->topic->delivered_bytes += msg->len;
+	}
+}
+
+/// Update global counters with processed delivery reports
+static void kafka_dr_batch_done(const struct kafka_dr_batch *batch) {
+	ATOMIC_OP(sub,fetch,&kafka_queue_counters.inflight_bytes,batch->bytes);
+	ATOMIC_OP(add,fetch,&kafka_queue_counters.delivered_msgs,batch->msgs);
+	ATOMIC_OP(add,fetch,&kafka_queue_counters.delivered_bytes,
+		batch->bytes);
+	if (batch->delivery_ok >= 0) {
+		atomic_set_single_writer(&kafka_spill.delivery_ok,
+							batch->delivery_ok);
+	}
+}
+
+/// Process a delivery reports event
+static void kafka_dr_event(rd_kafka_event_t *event) {
+	const rd_kafka_message_t *msgs[KAFKA_DR_BATCH_SIZE];
+	struct kafka_dr_batch batch;
+	size_t i,count;
+
+	memset(&batch,0,sizeof(batch));
+	batch.delivery_ok = -1;
+	while (0 != (count = rd_kafka_event_message_array(event,msgs,
+							RD_ARRAYSIZE(msgs)))) {
+		for (i=0; i<count; ++i) {
+			msg_delivered(&batch,msgs[i]);
+		}
+	}
+
+	kafka_dr_batch_done(&batch);
+}
+
+/** Serve producers main queues events
+  @return Number of events served
+  */
+static size_t kafka_dr_serve_queues() {
+	size_t i,events = 0;
+	rd_kafka_event_t *event = NULL;
+
+	for (i=0; i<kafka_producers.count; ++i) {
+		/* Only events enabled in rd_kafka_conf_set_events reach the
+		   queue */
+		while ((event = rd_kafka_queue_poll(kafka_dr_thread.queues[i],
+								0))) {
+			switch (rd_kafka_event_type(event)) {
+			case RD_KAFKA_EVENT_DR:
+				kafka_dr_event(event);
+				break;
+			case RD_KAFKA_EVENT_STATS:
+				producer_stats(&kafka_producers.stats[i],
+						rd_kafka_event_stats(event));
+				break;
+			case RD_KAFKA_EVENT_ERROR:
+				rdlog(LOG_ERR,"Kafka producer error: %s: %s",
+					rd_kafka_err2str(
+						rd_kafka_event_error(event)),
+					rd_kafka_event_error_string(event));
+				break;
+			default:
+				break;
+			}
+			rd_kafka_event_destroy(event);
+			events++;
+		}
+	}
+
+	if (events > 0) {
+		pthread_mutex_lock(&kafka_dr_thread.lock);
+		kafka_dr_thread.batches++;
+		pthread_cond_broadcast(&kafka_dr_thread.cond);
+		pthread_mutex_unlock(&kafka_dr_thread.lock);
+	}
+
+	return events;
+}
+
+/** Log per topic delivery counters, and reset them
+  @param now Current time
+  @param force Log even if the interval has not passed yet
+  */
+static void kafka_dr_log_topics(time_t now,int force) {
+	struct kafka_topic_delivery *topic = NULL;
+	const double elapsed = difftime(now,kafka_dr_thread.last_log);
+
+	if (!force && elapsed < KAFKA_DR_LOG_INTERVAL_S) {
+		return;
+	}
+
+	LIST_FOREACH(topic,&kafka_dr_thread.topics,entry) {
+		if (topic->failed_msgs) {
+			rdlog(LOG_ERR,"Topic %s: %"PRIu64" messages delivered "
+				"(%"PRIu64" bytes) and %"PRIu64" failed in "
+				"last %.0f seconds, last error: %s",
+				topic->name,topic->delivered_msgs,
+				topic->delivered_bytes,topic->failed_msgs,
+				elapsed,rd_kafka_err2str(topic->last_err));
+		} else if (topic->delivered_msgs) {
+			rdlog(LOG_DEBUG,"Topic %s: %"PRIu64" messages "
+				"delivered (%"PRIu64" bytes) in last %.0f "
+				"seconds",topic->name,topic->delivered_msgs,
+				topic->delivered_bytes,elapsed);
+		}
+
+		topic->delivered_msgs = topic->delivered_bytes = 0;
+		topic->failed_msgs = 0;
+	}
+
+	kafka_dr_thread.last_log = now;
+}
+
+static void *kafka_dr_thread_main(void *unused RB_UNUSED) {
+	struct pollfd pfd = {
+		.fd = kafka_dr_thread.pipe[0],
+		.events = POLLIN,
+	};
+	char buf[BUFSIZ];
+
+	while (!ATOMIC_OP(fetch,add,&kafka_dr_thread.stop,0)) {
+		/* Timeout serves queues even if some wake up is lost */
+		if (poll(&pfd,1,1000) > 0) {
+			while (read(pfd.fd,buf,sizeof(buf)) > 0);
+		}
+
+		kafka_dr_serve_queues();
+		kafka_dr_log_topics(time(NULL),0);
+	}
+
+	kafka_dr_serve_queues();
+	kafka_dr_log_topics(time(NULL),1);
+	return NULL;
+}
+
+/** Start delivery reports thread. Producers must be created with
+  RD_KAFKA_EVENT_DR, RD_KAFKA_EVENT_STATS and RD_KAFKA_EVENT_ERROR events
+  enabled.
+  */
+static void kafka_dr_thread_start() {
+	pthread_condattr_t cond_attr;
+	size_t i;
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&kafka_dr_thread.cond,&cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	if (0 != pipe(kafka_dr_thread.pipe)) {
+		fatal("%% Can't create delivery reports pipe: %s",
+			strerror(errno));
+	}
+
+	for (i=0; i<RD_ARRAYSIZE(kafka_dr_thread.pipe); ++i) {
+		const int flags = fcntl(kafka_dr_thread.pipe[i],F_GETFL);
+		fcntl(kafka_dr_thread.pipe[i],F_SETFL,flags | O_NONBLOCK);
+	}
+
+	kafka_dr_thread.queues = calloc(kafka_producers.count,
+				sizeof(kafka_dr_thread.queues[0]));
+	if (NULL == kafka_dr_thread.queues) {
+		fatal("%% Can't allocate producers queues (out of memory?)");
+	}
+
+	for (i=0; i<kafka_producers.count; ++i) {
+		static const char wake_up = 1;
+		kafka_dr_thread.queues[i] = rd_kafka_queue_get_main(
+							kafka_producers.rk[i]);
+		rd_kafka_queue_io_event_enable(kafka_dr_thread.queues[i],
+			kafka_dr_thread.pipe[1],&wake_up,sizeof(wake_up));
+	}
+
+	kafka_dr_thread.last_log = time(NULL);
+	const int create_rc = pthread_create(&kafka_dr_thread.thread,NULL,
+						kafka_dr_thread_main,NULL);
+	if (0 != create_rc) {
+		fatal("%% Can't create delivery reports thread: %s",
+			strerror(create_rc));
+	}
+	kafka_dr_thread.running = 1;
+}
+
+/// Stop delivery reports thread, after serve pending events
+static void kafka_dr_thread_stop() {
+	static const char wake_up = 1;
+	struct kafka_topic_delivery *topic = NULL;
+	size_t i;
+
+	if (!kafka_dr_thread.running) {
+		return;
+	}
+
+	ATOMIC_OP(add,fetch,&kafka_dr_thread.stop,1);
+	if (write(kafka_dr_thread.pipe[1],&wake_up,sizeof(wake_up)) < 0) {
+		/* Thread will see stop flag in poll timeout */
+	}
+	pthread_join(kafka_dr_thread.thread,NULL);
+	kafka_dr_thread.running = 0;
+
+	for (i=0; i<kafka_producers.count; ++i) {
+		rd_kafka_queue_destroy(kafka_dr_thread.queues[i]);
+	}
+	free(kafka_dr_thread.queues);
+	kafka_dr_thread.queues = NULL;
+
+	for (i=0; i<RD_ARRAYSIZE(kafka_dr_thread.pipe); ++i) {
+		close(kafka_dr_thread.pipe[i]);
+		kafka_dr_thread.pipe[i] = -1;
+	}
+
+	while (!LIST_EMPTY(&kafka_dr_thread.topics)) {
+		topic = LIST_FIRST(&kafka_dr_thread.topics);
+		LIST_REMOVE(topic,entry);
+		free(topic->name);
+		free(topic);
 	}
+
+	pthread_cond_destroy(&kafka_dr_thread.cond);
 }
 
 int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *_rkt,
@@ -87,16 +1298,46 @@ int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *_rkt,
 					int32_t partition_cnt,
 					void *rkt_opaque,
 					void *msg_opaque){
-	const uint64_t client_mac = (uint64_t)(intptr_t)msg_opaque;
+	const uint64_t client_mac = kafka_msg_opaque_value(
+						kafka_msg_opaque(msg_opaque));
 	if(client_mac == 0)
 		return rd_kafka_msg_partitioner_random(_rkt,NULL,0,partition_cnt,rkt_opaque,msg_opaque);
 	else
 		return client_mac % (unsigned)partition_cnt;
 }
 
-void init_rdkafka(){
+/** Create a producer handler
+  @return New producer handler
+  */
+static rd_kafka_t *new_producer() {
 	char errstr[RDKAFKA_ERRSTR_SIZE];
 
+	rd_kafka_conf_t *my_kafka_conf = rd_kafka_conf_dup(
+						global_config.kafka_conf);
+	if (NULL == my_kafka_conf) {
+		fatal("%% Failed to duplicate kafka conf (out of memory?)");
+	}
+	/* Delivery reports, statistics and errors are served by delivery
+	   reports thread */
+	rd_kafka_conf_set_events(my_kafka_conf, RD_KAFKA_EVENT_DR |
+				RD_KAFKA_EVENT_STATS | RD_KAFKA_EVENT_ERROR);
+	rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER,my_kafka_conf,
+						errstr,RDKAFKA_ERRSTR_SIZE);
+
+	if(!rk){
+		fatal("%% Failed to create new producer: %s",errstr);
+	}
+
+	if(global_config.debug){
+		rd_kafka_set_log_level (rk, LOG_DEBUG);
+	}
+
+	return rk;
+}
+
+void init_rdkafka(){
+	size_t i;
+
 	assert(global_config.kafka_conf);
 	assert(global_config.kafka_topic_conf);
 
@@ -105,21 +1346,28 @@ void init_rdkafka(){
 		return;
 	}
 
-	rd_kafka_conf_t *my_kafka_conf = rd_kafka_conf_dup(
-						global_config.kafka_conf);
-	rd_kafka_conf_set_dr_cb(my_kafka_conf, msg_delivered);
-	if (NULL == my_kafka_conf) {
-		fatal("%% Failed to duplicate kafka conf (out of memory?)");
+	kafka_producers.count = global_config.producer_instances ?
+		global_config.producer_instances : 1;
+	kafka_producers.rk = calloc(kafka_producers.count,
+					sizeof(kafka_producers.rk[0]));
+	kafka_producers.stats = calloc(kafka_producers.count,
+					sizeof(kafka_producers.stats[0]));
+	if (NULL == kafka_producers.rk || NULL == kafka_producers.stats) {
+		fatal("%% Failed to allocate producers (out of memory?)");
 	}
-	global_config.rk = rd_kafka_new(RD_KAFKA_PRODUCER,my_kafka_conf,
-						errstr,RDKAFKA_ERRSTR_SIZE);
 
-	if(!global_config.rk){
-		fatal("%% Failed to create new producer: %s",errstr);
+	for (i=0; i<kafka_producers.count; ++i) {
+		kafka_producers.rk[i] = new_producer();
+	}
+	global_config.rk = kafka_producers.rk[0];
+	kafka_dr_thread_start();
+	if (kafka_spill.journal) {
+		kafka_spill_replayer_start();
 	}
 
-	if(global_config.debug){
-		rd_kafka_set_log_level (global_config.rk, LOG_DEBUG);
+	if (kafka_producers.count > 1) {
+		rdlog(LOG_INFO,"Using %zu kafka producer instances",
+			kafka_producers.count);
 	}
 
 	if(global_config.brokers == NULL){
@@ -128,38 +1376,321 @@ void init_rdkafka(){
 }
 
 static void flush_kafka0(int timeout_ms){
-	rd_kafka_poll(global_config.rk,timeout_ms);
+	kafka_poll(timeout_ms);
+}
+
+/*
+ *  PRODUCE POLICY
+ */
+
+/// Upper limit of wait time histogram buckets, in milliseconds
+static const unsigned produce_wait_buckets_ms[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000,
+};
+
+static const char *produce_policy_names[] = {
+	[KAFKA_PRODUCE_DROP] = "drop",
+	[KAFKA_PRODUCE_BLOCK] = "block",
+	[KAFKA_PRODUCE_BLOCK_FOREVER] = "block_forever",
+};
+
+/// Default max wait of KAFKA_PRODUCE_BLOCK policy
+#define KAFKA_PRODUCE_BLOCK_TIMEOUT_MS_DEFAULT 1000
+/// Max kafka_poll wait between produce retries, in milliseconds
+#define KAFKA_PRODUCE_RETRY_MS 10
+
+/// Produce policy, and wait stats. Updated atomically
+static struct {
+	int policy;
+	int block_timeout_ms;
+	/// Stop waiting with any policy
+	int stop_blocking;
+
+	struct {
+		/// Produce calls that had to wait, by wait time. Last bucket
+		/// is for waits longer than all produce_wait_buckets_ms
+		uint64_t buckets[RD_ARRAYSIZE(produce_wait_buckets_ms) + 1];
+		/// Waits that ended with the message not produced
+		uint64_t gave_up;
+	} wait_stats[KAFKA_PRODUCE_POLICY__END];
+} kafka_produce = {
+	.policy = KAFKA_PRODUCE_DROP,
+	.block_timeout_ms = KAFKA_PRODUCE_BLOCK_TIMEOUT_MS_DEFAULT,
+};
+
+int kafka_produce_policy_parse(const char *name,
+					enum kafka_produce_policy *policy) {
+	size_t i;
+	for (i=0; i<RD_ARRAYSIZE(produce_policy_names); ++i) {
+		if (0 == strcmp(name,produce_policy_names[i])) {
+			*policy = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void kafka_set_produce_policy(enum kafka_produce_policy policy,
+						int block_timeout_ms) {
+	/* Only called from main thread */
+	atomic_set_single_writer(&kafka_produce.block_timeout_ms,
+							block_timeout_ms);
+	atomic_set_single_writer(&kafka_produce.policy,(int)policy);
+}
+
+void kafka_produce_stop_blocking() {
+	ATOMIC_OP(add,fetch,&kafka_produce.stop_blocking,1);
+}
+
+/// Produce call waiting for room in producer queue
+struct produce_wait {
+	/// Policy in use, read in the first wait
+	enum kafka_produce_policy policy;
+	int block_timeout_ms;
+	/// Number of waits
+	unsigned waits;
+	struct timespec start;
+};
+
+#define PRODUCE_WAIT_INITIALIZER {.waits = 0}
+
+static uint64_t produce_wait_elapsed_ms(const struct produce_wait *wait) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (uint64_t)(now.tv_sec - wait->start.tv_sec)*1000 +
+		(uint64_t)(now.tv_nsec/(1000*1000)) -
+		(uint64_t)(wait->start.tv_nsec/(1000*1000));
+}
+
+/** Wait for room in producer queue, following produce policy
+  @param wait Wait state
+  @return 0 if produce must be retried, -1 if caller should give up
+  */
+static int produce_wait(struct produce_wait *wait) {
+	int wait_ms = KAFKA_PRODUCE_RETRY_MS;
+
+	if (0 == wait->waits) {
+		wait->policy = ATOMIC_OP(fetch,add,&kafka_produce.policy,0);
+		wait->block_timeout_ms = ATOMIC_OP(fetch,add,
+					&kafka_produce.block_timeout_ms,0);
+		clock_gettime(CLOCK_MONOTONIC,&wait->start);
+	}
+
+	if (ATOMIC_OP(fetch,add,&kafka_produce.stop_blocking,0)) {
+		return -1;
+	}
+
+	switch (wait->policy) {
+	case KAFKA_PRODUCE_DROP:
+		if (wait->waits > 0) {
+			return -1;
+		}
+		wait_ms = 5;
+		break;
+
+	case KAFKA_PRODUCE_BLOCK:
+	{
+		const uint64_t elapsed_ms = produce_wait_elapsed_ms(wait);
+		if (elapsed_ms >= (uint64_t)wait->block_timeout_ms) {
+			return -1;
+		}
+		if ((uint64_t)wait->block_timeout_ms - elapsed_ms <
+							(uint64_t)wait_ms) {
+			wait_ms = wait->block_timeout_ms - (int)elapsed_ms;
+		}
+		break;
+	}
+
+	case KAFKA_PRODUCE_BLOCK_FOREVER:
+	default:
+		break;
+	};
+
+	wait->waits++;
+	/* Wait for delivery reports to free some room */
+	kafka_poll(wait_ms);
+	return 0;
+}
+
+/** Account wait time, if any
+  @param wait Wait state
+  @param produced Message (or the last message that needed to wait) has
+  been produced
+  */
+static void produce_wait_done(const struct produce_wait *wait,int produced) {
+	size_t i;
+
+	if (0 == wait->waits) {
+		return;
+	}
+
+	const uint64_t elapsed_ms = produce_wait_elapsed_ms(wait);
+	for (i=0; i<RD_ARRAYSIZE(produce_wait_buckets_ms); ++i) {
+		if (elapsed_ms < produce_wait_buckets_ms[i]) {
+			break;
+		}
+	}
+
+	ATOMIC_OP(add,fetch,&kafka_produce.wait_stats[wait->policy].buckets[i],
+		1);
+	if (!produced) {
+		ATOMIC_OP(add,fetch,&kafka_produce.wait_stats[wait->policy].gave_up,
+			1);
+	}
+}
+
+void kafka_log_produce_wait_stats() {
+	size_t policy,i;
+
+	for (policy=0; policy<KAFKA_PRODUCE_POLICY__END; ++policy) {
+		char histogram[BUFSIZ];
+		size_t histogram_len = 0;
+		uint64_t waits = 0;
+
+		for (i=0; i<RD_ARRAYSIZE(kafka_produce.wait_stats[0].buckets);
+									++i) {
+			const uint64_t bucket = ATOMIC_OP(fetch,add,
+				&kafka_produce.wait_stats[policy].buckets[i],0);
+			waits += bucket;
+			if (0 == bucket) {
+				continue;
+			}
+
+			const int print_rc = i < RD_ARRAYSIZE(
+						produce_wait_buckets_ms) ?
+				snprintf(histogram + histogram_len,
+					sizeof(histogram) - histogram_len,
+					" <%ums:%"PRIu64,
+					produce_wait_buckets_ms[i],bucket) :
+				snprintf(histogram + histogram_len,
+					sizeof(histogram) - histogram_len,
+					" >=%ums:%"PRIu64,
+					produce_wait_buckets_ms[i-1],bucket);
+			if (print_rc > 0) {
+				histogram_len += (size_t)print_rc;
+			}
+			if (histogram_len >= sizeof(histogram)) {
+				break;
+			}
+		}
+
+		if (0 == waits) {
+			continue;
+		}
+
+		rdlog(LOG_INFO,"Produce policy %s: %"PRIu64" produce calls "
+			"waited for room in queue, %"PRIu64" gave up. "
+			"Wait times:%s",produce_policy_names[policy],waits,
+			ATOMIC_OP(fetch,add,
+				&kafka_produce.wait_stats[policy].gave_up,0),
+			histogram);
+	}
 }
 
 void send_to_kafka(rd_kafka_topic_t *rkt,char *buf,const size_t bufsize,
 						int flags,void *opaque) {
-	int retried = 0;
+	struct produce_wait wait = PRODUCE_WAIT_INITIALIZER;
+	int produced = 0;
 	char errbuf[ERROR_BUFFER_SIZE];
 
+	opaque = msg_ack_wrap(opaque);
+	rkt = kafka_thread_topic(rkt);
+
 	do{
 		if(NULL == rkt) {
 			rdlog(LOG_ERR,"Can't produce message, no topic specified");
+			msg_ack_report(opaque,1);
 			if(flags & RD_KAFKA_MSG_F_FREE) {
 				free(buf);
 			}
+			break;
 		}
 
 		const int produce_ret = rd_kafka_produce(rkt,RD_KAFKA_PARTITION_UA,flags,
 			buf,bufsize,NULL,0,opaque);
+		const int produce_errno = errno;
 
-		if(produce_ret == 0)
+		if(produce_ret == 0) {
+			ATOMIC_OP(add,fetch,&kafka_queue_counters.inflight_bytes,
+				bufsize);
+			produced = 1;
 			break;
+		}
 
-		if(ENOBUFS==errno && !(retried++)){
-			rd_kafka_poll(global_config.rk,5); // backpressure
+		if(ENOBUFS==produce_errno && 0 == produce_wait(&wait)){
+			continue; // backpressure
 		}else{
-			//rdbg(LOG_ERR, "Failed to produce message: %s",rd_kafka_errno2err(errno));
-			rblog(LOG_ERR, "Failed to produce message: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+			/* Overflow messages are replayed from spill journal */
+			const int spilled = ENOBUFS == produce_errno &&
+				0 == kafka_spill_msg(rkt,RD_KAFKA_PARTITION_UA,
+							NULL,0,buf,bufsize);
+			if(!spilled) {
+				//rdbg(LOG_ERR, "Failed to produce message: %s",rd_kafka_errno2err(errno));
+				rblog(LOG_ERR, "Failed to produce message: %s",mystrerror(produce_errno,errbuf,ERROR_BUFFER_SIZE));
+			}
+			msg_ack_report(opaque,1);
 			if(flags & RD_KAFKA_MSG_F_FREE)
 				free(buf);
 			break;
 		}
 	}while(1);
+
+	produce_wait_done(&wait,produced);
+}
+
+/// Produce a message of a batch, and return its error
+static rd_kafka_resp_err_t kafka_produce_batch_msg(rd_kafka_topic_t *rkt,
+		int32_t partition,int flags,const rd_kafka_message_t *msg) {
+	if (0 == rd_kafka_produce(rkt,partition,flags,msg->payload,msg->len,
+				msg->key,msg->key_len,msg->_private)) {
+		return RD_KAFKA_RESP_ERR_NO_ERROR;
+	}
+
+	return rd_kafka_errno2err(errno);
+}
+
+int kafka_produce_batch(rd_kafka_topic_t *rkt,int32_t partition,int flags,
+				rd_kafka_message_t *msgs,size_t count) {
+	struct produce_wait wait = PRODUCE_WAIT_INITIALIZER;
+	int produce_rc = 0;
+	size_t i;
+
+	rkt = kafka_thread_topic(rkt);
+	kafka_track_batch(msgs,count);
+
+	/* rd_kafka_produce_batch keeps enqueuing messages after one does not
+	   fit, so messages are produced one by one: the rest of the batch
+	   waits until the one that did not fit is enqueued, and messages with
+	   the same key keep their order */
+	for (i=0; i<count; ++i) {
+		msgs[i].err = kafka_produce_batch_msg(rkt,partition,flags,
+								&msgs[i]);
+		while (RD_KAFKA_RESP_ERR__QUEUE_FULL == msgs[i].err &&
+						0 == produce_wait(&wait)) {
+			msgs[i].err = kafka_produce_batch_msg(rkt,partition,
+							flags,&msgs[i]);
+		}
+
+		if (RD_KAFKA_RESP_ERR__QUEUE_FULL == msgs[i].err) {
+			break;
+		} else if (RD_KAFKA_RESP_ERR_NO_ERROR == msgs[i].err) {
+			produce_rc++;
+		}
+	}
+
+	const int gave_up = i < count;
+
+	/* Produce policy gave up: spill the rest of the batch, in order */
+	for (; i<count; ++i) {
+		msgs[i].err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+		kafka_spill_msg(rkt,partition,msgs[i].key,msgs[i].key_len,
+						msgs[i].payload,msgs[i].len);
+	}
+
+	produce_wait_done(&wait,!gave_up);
+	kafka_account_produced_batch(msgs,count);
+	return produce_rc;
 }
 
 struct kafka_message_array *new_kafka_message_array(size_t size){
@@ -203,8 +1734,11 @@ static int send_array_to_rkt(rd_kafka_topic_t *rkt, int flags,
 	int i;
 
 	if (rkt) {
-		produce_rc = rd_kafka_produce_batch(rkt,RD_KAFKA_PARTITION_UA,
+		produce_rc = kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA,
 			flags, msgs->msgs, msgs->count);
+	} else {
+		rdlog(LOG_ERR,"Can't produce messages, no topic specified");
+		msg_ack_fail_untracked(msgs->count);
 	}
 
 	for (i=0; produce_rc != (int)msgs->count && i<(int)msgs->count; ++i) {
@@ -219,8 +1753,8 @@ static int send_array_to_rkt(rd_kafka_topic_t *rkt, int flags,
 		}
 
 		// Free the message if needed/requested
-		if (!rkt ||
-			((flags & RD_KAFKA_MSG_F_FREE) && msgs->msgs[i].err)) {
+		if ((flags & RD_KAFKA_MSG_F_FREE) &&
+					(!rkt || msgs->msgs[i].err)) {
 			free(msgs->msgs[i].payload);
 		}
 	}
@@ -249,16 +1783,153 @@ int send_array_to_kafka_topics(struct rkt_array *rkt_array,
 }
 
 
+/// Dumb decoder listener opaque
+struct dumb_opaque {
+	/// Protects rkt on reload
+	pthread_rwlock_t rwlock;
+	/// Listener topic, from registry. NULL if no topic
+	rd_kafka_topic_t *rkt;
+};
+
+/** Get listener topic from registry
+  @param config Listener config
+  @param rkt Returned topic, NULL if no topic configured
+  @return 0 if success, -1 if error
+  */
+static int dumb_opaque_topic(json_t *config,rd_kafka_topic_t **rkt) {
+	const char *topic_name = NULL;
+	json_error_t jerr;
+	char err[BUFSIZ];
+
+	*rkt = NULL;
+	if (config && 0 != json_unpack_ex(config,&jerr,0,"{s?s}","topic",
+	                                                        &topic_name)) {
+		rdlog(LOG_ERR,"Can't parse listener topic: %s",jerr.text);
+		return -1;
+	}
+
+	if (NULL == topic_name) {
+		topic_name = default_topic_name();
+	}
+
+	if (NULL == topic_name || only_stdout_output()) {
+		return 0;
+	}
+
+	*rkt = kafka_topic_get(topic_name,NULL,err,sizeof(err));
+	if (NULL == *rkt) {
+		rdlog(LOG_ERR,"Can't create topic %s: %s",topic_name,err);
+		return -1;
+	}
+
+	return 0;
+}
+
+int dumb_opaque_creator(json_t *config,void **_opaque) {
+	struct dumb_opaque *opaque = calloc(1,sizeof(*opaque));
+	if (NULL == opaque) {
+		rdlog(LOG_ERR,"Can't allocate dumb decoder opaque "
+			"(out of memory?)");
+		return -1;
+	}
+
+	if (0 != dumb_opaque_topic(config,&opaque->rkt)) {
+		free(opaque);
+		return -1;
+	}
+
+	pthread_rwlock_init(&opaque->rwlock,NULL);
+	*_opaque = opaque;
+	return 0;
+}
+
+int dumb_opaque_reload(json_t *config,void *_opaque) {
+	struct dumb_opaque *opaque = _opaque;
+	rd_kafka_topic_t *rkt = NULL;
+
+	if (0 != dumb_opaque_topic(config,&rkt)) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&opaque->rwlock);
+	swap_ptrs(rkt,opaque->rkt);
+	pthread_rwlock_unlock(&opaque->rwlock);
+
+	if (rkt) {
+		kafka_topic_release(rkt);
+	}
+	return 0;
+}
+
+void dumb_opaque_done(void *_opaque) {
+	struct dumb_opaque *opaque = _opaque;
+
+	if (opaque->rkt) {
+		kafka_topic_release(opaque->rkt);
+	}
+	pthread_rwlock_destroy(&opaque->rwlock);
+	free(opaque);
+}
+
 void dumb_decoder(char *buffer, size_t buf_size,
                   const keyval_list_t *keyval __attribute__((unused)),
                   void *listener_callback_opaque,
                   void **sessionp __attribute__((unused))) {
+	struct dumb_opaque *opaque = listener_callback_opaque;
+
+	pthread_rwlock_rdlock(&opaque->rwlock);
+	send_to_kafka(opaque->rkt, buffer, buf_size, RD_KAFKA_MSG_F_COPY,
+		NULL);
+	pthread_rwlock_unlock(&opaque->rwlock);
+}
+
+void dumb_decoder_batch(const struct framed_record *records,
+		size_t records_count,void *listener_callback_opaque) {
+	size_t i;
+	struct dumb_opaque *opaque = listener_callback_opaque;
+	struct kafka_message_array *msgs = new_kafka_message_array(
+		records_count);
+	if (NULL == msgs) {
+		return;
+	}
+
+	for (i=0; i<records_count; ++i) {
+		save_kafka_msg_in_array(msgs, records[i].payload,
+			records[i].len, NULL);
+	}
 
-  rd_kafka_topic_t *rkt =
-      new_rkt_global_config(default_topic_name(), NULL, NULL, 0);
-  send_to_kafka(rkt, buffer, buf_size, RD_KAFKA_MSG_F_FREE,
-                listener_callback_opaque);
-  rd_kafka_topic_destroy(rkt);
+	pthread_rwlock_rdlock(&opaque->rwlock);
+	send_array_to_rkt(opaque->rkt, RD_KAFKA_MSG_F_COPY, msgs);
+	pthread_rwlock_unlock(&opaque->rwlock);
+	free(msgs);
+}
+
+void kafka_account_produced_batch(rd_kafka_message_t *msgs,size_t count) {
+	uint64_t bytes = 0;
+	size_t i;
+
+	for (i=0; i<count; ++i) {
+		const int err = RD_KAFKA_RESP_ERR_NO_ERROR != msgs[i].err;
+		if (!err) {
+			bytes += msgs[i].len;
+			/* rdkafka keeps its own copy of tracking opaque */
+			msgs[i]._private = kafka_msg_opaque(msgs[i]._private);
+		} else {
+			msgs[i]._private = msg_ack_report(msgs[i]._private,1);
+		}
+	}
+
+	ATOMIC_OP(add,fetch,&kafka_queue_counters.inflight_bytes,bytes);
+}
+
+void kafka_queue_status(struct kafka_queue_status *status) {
+	status->outq_len = kafka_producers_outq_len();
+	status->inflight_bytes = ATOMIC_OP(fetch,add,
+		&kafka_queue_counters.inflight_bytes,0);
+	status->delivered_msgs = ATOMIC_OP(fetch,add,
+		&kafka_queue_counters.delivered_msgs,0);
+	status->delivered_bytes = ATOMIC_OP(fetch,add,
+		&kafka_queue_counters.delivered_bytes,0);
 }
 
 void flush_kafka(){
@@ -266,21 +1937,50 @@ void flush_kafka(){
 }
 
 void kafka_poll(int timeout_ms){
-	rd_kafka_poll(global_config.rk,timeout_ms);
+	struct timespec deadline;
+
+	if (!kafka_dr_thread.running) {
+		poll(NULL,0,timeout_ms);
+		return;
+	}
+
+	monotonic_deadline(&deadline,timeout_ms);
+
+	/* Wait until delivery reports thread process some events */
+	pthread_mutex_lock(&kafka_dr_thread.lock);
+	const uint64_t batches = kafka_dr_thread.batches;
+	while (batches == kafka_dr_thread.batches) {
+		if (ETIMEDOUT == pthread_cond_timedwait(&kafka_dr_thread.cond,
+					&kafka_dr_thread.lock,&deadline)) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&kafka_dr_thread.lock);
 }
 
 void stop_rdkafka(){
+	size_t i;
+
 	rdlog(LOG_INFO,"Waiting kafka handler to stop properly");
+	kafka_log_produce_wait_stats();
+	kafka_spill_replayer_stop();
 
 	/* Make sure all outstanding requests are transmitted and handled. */
-	while (rd_kafka_outq_len(global_config.rk) > 0) {
-		rd_kafka_poll(global_config.rk, 50);
+	while (kafka_producers_outq_len() > 0) {
+		kafka_poll(50);
 	}
+	kafka_dr_thread_stop();
+	/* Failed deliveries have been spilled */
+	kafka_spill_close();
 
 	rd_kafka_topic_conf_destroy(global_config.kafka_topic_conf);
 	rd_kafka_conf_destroy(global_config.kafka_conf);
 
-	rd_kafka_destroy(global_config.rk);
+	for (i=0; i<kafka_producers.count; ++i) {
+		rd_kafka_destroy(kafka_producers.rk[i]);
+	}
+	free(kafka_producers.rk);
+	free(kafka_producers.stats);
 	while(0 != rd_kafka_wait_destroyed(5000));
 }
 
@@ -295,7 +1995,7 @@ void rkt_array_swap(struct rkt_array *a, struct rkt_array *b) {
 void rkt_array_done(struct rkt_array *rkt_array) {
 	size_t i;
 	for (i=0; i<rkt_array->count; ++i) {
-		rd_kafka_topic_destroy(rkt_array->rkt[i]);
+		kafka_topic_release(rkt_array->rkt[i]);
 	}
 	free(rkt_array->rkt);
 	memset(rkt_array, 0, sizeof(*rkt_array));
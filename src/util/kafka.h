@@ -19,11 +19,14 @@
 #pragma once
 #include "engine/parse.h"
 #include "util/pair.h"
+#include "util/framing.h"
 #include <librdkafka/rdkafka.h>
 
+#include <stdint.h>
 #include <string.h>
 
 /* Private data */
+struct json_t;
 struct rd_kafka_message_s;
 
 struct kafka_message_array{
@@ -48,9 +51,100 @@ void rkt_array_done(struct rkt_array *rkt_array);
 void init_rdkafka();
 void send_to_kafka(rd_kafka_topic_t *rkt,char *buffer,const size_t bufsize,
 	int flags,void *opaque);
+
+/// What to do when producer queue is full
+enum kafka_produce_policy {
+	/// Wait for one delivery reports round, and drop the message
+	KAFKA_PRODUCE_DROP,
+	/// Wait until there is room or block timeout expires
+	KAFKA_PRODUCE_BLOCK,
+	/// Wait until there is room
+	KAFKA_PRODUCE_BLOCK_FOREVER,
+	KAFKA_PRODUCE_POLICY__END,
+};
+
+/** Get produce policy from its name
+  @param name Policy name: "drop", "block" or "block_forever"
+  @param policy Returned policy
+  @return 0 if success, -1 if unknown policy
+  */
+int kafka_produce_policy_parse(const char *name,
+					enum kafka_produce_policy *policy);
+
+/** Set produce policy. Threads that are already waiting keep the previous
+  one.
+  @param policy Produce policy
+  @param block_timeout_ms Max wait of KAFKA_PRODUCE_BLOCK policy
+  */
+void kafka_set_produce_policy(enum kafka_produce_policy policy,
+							int block_timeout_ms);
+
+/** Stop waiting for room in producer queue, even with
+  KAFKA_PRODUCE_BLOCK_FOREVER policy, so listeners can be stopped.
+  */
+void kafka_produce_stop_blocking();
+
+/// Log produce policy wait time histograms
+void kafka_log_produce_wait_stats();
+
+/** Open spill journal, where messages that can't be produced or delivered
+  are saved. init_rdkafka starts replaying it when kafka delivers again, so
+  this must be called before it.
+  @param config Spill journal config object
+  @return 0 if success, -1 if error
+  */
+int kafka_spill_init(struct json_t *config);
+
+/// Log spill journal counters, if configured
+void kafka_log_spill_stats();
+
+/** Produce a batch of messages, waiting for room in producer queue following
+  produce policy. Messages are tracked and accounted, like
+  kafka_track_batch and kafka_account_produced_batch do.
+  @note When a message does not fit in producer queue, the rest of the
+  batch waits for it, so messages are enqueued in order. If produce policy
+  gives up, that message and the rest of the batch are spilled, in order.
+  @param rkt Topic handler returned by kafka_topic_get
+  @param partition Partition
+  @param flags rd_kafka_produce flags
+  @param msgs Messages. Messages that could not be produced have err set
+  @param count Number of messages
+  @return Number of produced messages
+  */
+int kafka_produce_batch(rd_kafka_topic_t *rkt,int32_t partition,int flags,
+				rd_kafka_message_t *msgs,size_t count);
 void dumb_decoder(char *buffer,size_t buf_size,const keyval_list_t *keyval,
     void *listener_callback_opaque,void **sessionp);
 
+/** Create dumb decoder listener opaque. Listener "topic" overrides global
+  topic.
+  @param config Listener config
+  @param opaque Created opaque
+  @return 0 if success, !0 if error
+  */
+int dumb_opaque_creator(struct json_t *config,void **opaque);
+
+/** Reload dumb decoder listener opaque
+  @param config New listener config
+  @param opaque Opaque to reload
+  @return 0 if success, !0 if error
+  */
+int dumb_opaque_reload(struct json_t *config,void *opaque);
+
+/** Destroy dumb decoder listener opaque
+  @param opaque Opaque
+  */
+void dumb_opaque_done(void *opaque);
+
+/** Send many records of the same client with dumb decoder, using only one
+  produce batch call
+  @param records Records to send. They will be copied.
+  @param records_count Number of records
+  @param listener_callback_opaque Dumb decoder listener opaque
+  */
+void dumb_decoder_batch(const struct framed_record *records,
+	size_t records_count,void *listener_callback_opaque);
+
 /// @TODO join with rb_http2k_decoder mac partitioner
 int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *_rkt,
 					const void *key,size_t keylen,int32_t partition_cnt,
@@ -90,6 +184,105 @@ int send_array_to_kafka_topics(struct rkt_array *rkt_array,
 
 void kafka_poll();
 
+/// Producer queue status
+struct kafka_queue_status {
+	/// Messages and requests waiting in rdkafka queues
+	size_t outq_len;
+	/// Payload bytes produced and waiting for delivery report
+	uint64_t inflight_bytes;
+	/// Messages with delivery report since start
+	uint64_t delivered_msgs;
+	/// Payload bytes with delivery report since start
+	uint64_t delivered_bytes;
+};
+
+/** Get producer queue status, so listeners can shed load when kafka can't
+  keep up
+  @param status Status
+  */
+void kafka_queue_status(struct kafka_queue_status *status);
+
+/** Account messages enqueued with rd_kafka_produce_batch out of this module,
+  so they are counted in kafka_queue_status inflight bytes. Messages tracked
+  with kafka_track_batch get their original opaque back, and the ones that
+  were not enqueued are reported as failed.
+  @param msgs Messages passed to rd_kafka_produce_batch. Messages with error
+  were not enqueued
+  @param count Number of messages
+  */
+void kafka_account_produced_batch(rd_kafka_message_t *msgs,size_t count);
+
+/// Delivery acknowledgement of a group of messages
+struct kafka_delivery_ack;
+
+/** Delivery acknowledgement callback. Called from the thread that delivers
+  the last report, or from kafka_delivery_ack_seal if all messages have been
+  already reported.
+  @param msgs Tracked messages
+  @param failed Messages that could not be produced or delivered
+  @param opaque Callback opaque
+  */
+typedef void (*kafka_delivery_ack_cb)(size_t msgs,size_t failed,void *opaque);
+
+/** Create a delivery acknowledgement
+  @param cb Callback to call when all messages have been delivered
+  @param opaque Callback opaque
+  @return New delivery acknowledgement, or NULL if no memory
+  */
+struct kafka_delivery_ack *kafka_delivery_ack_new(kafka_delivery_ack_cb cb,
+								void *opaque);
+
+/** Track messages produced by this thread with a delivery acknowledgement.
+  Their rdkafka opaque is replaced by a tracking one, so partitioners must
+  get the original one with kafka_msg_opaque.
+  @param ack Delivery acknowledgement, or NULL to stop tracking
+  */
+void kafka_delivery_ack_track(struct kafka_delivery_ack *ack);
+
+/** No more messages will be tracked, so callback can be called when all
+  tracked messages are reported
+  @param ack Delivery acknowledgement
+  */
+void kafka_delivery_ack_seal(struct kafka_delivery_ack *ack);
+
+/** Release delivery acknowledgement. Callback will not be called after this
+  function returns, even if it has not been called yet.
+  @param ack Delivery acknowledgement
+  */
+void kafka_delivery_ack_done(struct kafka_delivery_ack *ack);
+
+/** Original opaque of a message, as passed to produce functions
+  @param msg_opaque rdkafka message opaque
+  @return Original opaque
+  */
+void *kafka_msg_opaque(void *msg_opaque);
+
+/** Encode a value as message opaque. Low bit of message opaques is reserved
+  for delivery acknowledgement tracking, so use this instead of casting values
+  to pointers.
+  @param value Value to encode
+  @return Message opaque
+  */
+static inline void *kafka_msg_opaque_from_value(uint64_t value) {
+	return (void *)(uintptr_t)(value << 1);
+}
+
+/** Decode a value encoded with kafka_msg_opaque_from_value
+  @param opaque Original message opaque (see kafka_msg_opaque)
+  @return Encoded value
+  */
+static inline uint64_t kafka_msg_opaque_value(const void *opaque) {
+	return (uint64_t)((uintptr_t)opaque >> 1);
+}
+
+/** Replace messages opaques by tracking ones, if this thread is tracking
+  messages. Call before rd_kafka_produce_batch, and then
+  kafka_account_produced_batch.
+  @param msgs Messages to produce
+  @param count Number of messages
+  */
+void kafka_track_batch(rd_kafka_message_t *msgs,size_t count);
+
 typedef int32_t (*rb_rd_kafka_partitioner_t) (
 						const rd_kafka_topic_t *rkt,
 						const void *keydata,
@@ -98,13 +291,31 @@ typedef int32_t (*rb_rd_kafka_partitioner_t) (
 						void *rkt_opaque,
 						void *msg_opaque);
 
-/** Creates a new topic handler using global configuration
+/** Get a topic handler from process topics registry, creating it with global
+    configuration if needed. Handlers are refcounted and shared by all users
+    of the same topic name, so listeners and reloads don't create new ones.
+    If the topic already exists with another partitioner, a warning is
+    logged and the existing one is used.
     @param topic_name Topic name
-    @param partitioner Partitioner function
-    @return New topic handler */
-rd_kafka_topic_t *new_rkt_global_config(const char *topic_name,
+    @param partitioner Partitioner function, NULL for rdkafka default
+    @param err Error buffer
+    @param errsiz Error buffer size
+    @return Topic handler, that must be released with kafka_topic_release */
+rd_kafka_topic_t *kafka_topic_get(const char *topic_name,
     rb_rd_kafka_partitioner_t partitioner,char *err,size_t errsiz);
 
+/** Release a topic handler got from kafka_topic_get
+    @param rkt Topic handler */
+void kafka_topic_release(rd_kafka_topic_t *rkt);
+
+/** Topic handler to produce from current thread. Every producer thread is
+    assigned to one of the producer_instances, so messages it sends keep
+    their order. All instances use the same partitioner, so messages with
+    the same key go to the same partition regardless of the instance.
+    @param rkt Topic handler returned by kafka_topic_get
+    @return Topic handler in current thread producer instance */
+rd_kafka_topic_t *kafka_thread_topic(rd_kafka_topic_t *rkt);
+
 /** Default kafka topic name (if any)
 	@return Default kafka topic name (if any)
 	*/
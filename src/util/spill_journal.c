@@ -0,0 +1,638 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "spill_journal.h"
+
+#include <librd/rdlog.h>
+#include <librd/rdsysqueue.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define SPILL_SEGMENT_MAGIC "N2KSPILL"
+#define SPILL_SEGMENT_VERSION 1
+#define SPILL_SEGMENT_SUFFIX ".spill"
+/// Segment file name: 16 hex digits sequence plus suffix
+#define SPILL_SEGMENT_NAME_LEN (16 + sizeof(SPILL_SEGMENT_SUFFIX) - 1)
+
+/// Segment file header. Records start at SPILL_SEGMENT_HEADER_SIZE
+struct spill_segment_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	/// Offset of the first record not replayed yet
+	uint64_t read_offset;
+};
+
+#define SPILL_SEGMENT_HEADER_SIZE 64
+
+/** Record header. Followed by topic, key and payload, and padded to 8 bytes.
+  A record with size 0 marks the end of segment records.
+  */
+struct spill_record_header {
+	/// CRC32 of the rest of the record, from size to the end of payload
+	uint32_t crc;
+	/// Record size, including header and padding
+	uint32_t size;
+	int32_t partition;
+	uint32_t topic_len;
+	/// UINT32_MAX if no key
+	uint32_t key_len;
+	uint32_t payload_len;
+};
+
+#define SPILL_NO_KEY UINT32_MAX
+#define SPILL_RECORD_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+struct spill_segment {
+	uint64_t seq;
+	int fd;
+	/// Segment file, mmap'ed
+	char *map;
+	size_t size;
+	/// End of segment records
+	size_t end;
+	/// Records not replayed yet
+	uint64_t pending_msgs;
+	TAILQ_ENTRY(spill_segment) entry;
+};
+
+struct spill_journal {
+	/// Protects segments list, tail end and stats
+	pthread_mutex_t lock;
+	char *path;
+	size_t segment_size;
+	uint64_t max_size;
+	/// Sequence of next segment file
+	uint64_t next_seq;
+	/// Oldest first. Records are appended to the last one
+	TAILQ_HEAD(spill_segment_tailq,spill_segment) segments;
+	struct spill_journal_stats stats;
+};
+
+static struct spill_segment_header *segment_header(
+				const struct spill_segment *segment) {
+	return (struct spill_segment_header *)segment->map;
+}
+
+static uint32_t record_crc(const struct spill_record_header *header) {
+	const size_t crc_offset = offsetof(struct spill_record_header,size);
+	const size_t len = sizeof(*header) - crc_offset + header->topic_len +
+		(header->key_len == SPILL_NO_KEY ? 0 : header->key_len) +
+		header->payload_len;
+	return (uint32_t)crc32(crc32(0L,Z_NULL,0),
+		(const Bytef *)header + crc_offset,(uInt)len);
+}
+
+/** Parse record at segment offset, checking it
+  @param segment Segment
+  @param offset Record offset
+  @param record Returned record
+  @return Record size, 0 if end of records, -1 if corrupted record
+  */
+static ssize_t segment_record(const struct spill_segment *segment,
+			size_t offset,struct spill_record *record) {
+	const struct spill_record_header *header =
+		(const struct spill_record_header *)(segment->map + offset);
+
+	if (offset + sizeof(*header) > segment->size || 0 == header->size) {
+		return 0;
+	}
+
+	const size_t key_len = header->key_len == SPILL_NO_KEY ? 0 :
+							header->key_len;
+	const uint64_t data_len = (uint64_t)header->topic_len + key_len +
+							header->payload_len;
+	if (header->size % 8 || header->size > segment->size - offset ||
+			sizeof(*header) + data_len > header->size ||
+			0 == header->topic_len ||
+			record_crc(header) != header->crc) {
+		return -1;
+	}
+
+	const char *data = (const char *)&header[1];
+	record->topic = data;
+	record->topic_len = header->topic_len;
+	record->partition = header->partition;
+	record->key = header->key_len == SPILL_NO_KEY ? NULL :
+						data + header->topic_len;
+	record->key_len = key_len;
+	record->payload = data + header->topic_len + key_len;
+	record->payload_len = header->payload_len;
+	return header->size;
+}
+
+static void segment_path(const struct spill_journal *journal,uint64_t seq,
+						char *buf,size_t bufsize) {
+	snprintf(buf,bufsize,"%s/%016"PRIx64 SPILL_SEGMENT_SUFFIX,
+		journal->path,seq);
+}
+
+static void segment_close(struct spill_segment *segment) {
+	msync(segment->map,segment->size,MS_ASYNC);
+	munmap(segment->map,segment->size);
+	close(segment->fd);
+	free(segment);
+}
+
+/** Map a segment file
+  @param journal Spill journal
+  @param seq Segment sequence
+  @param create Create a new segment file
+  @param err Error buffer
+  @param errsize Error buffer size
+  @return Segment, or NULL if error
+  */
+static struct spill_segment *segment_map(const struct spill_journal *journal,
+		uint64_t seq,int create,char *err,size_t errsize) {
+	char path[PATH_MAX];
+	struct stat st;
+	struct spill_segment *segment = calloc(1,sizeof(*segment));
+	if (NULL == segment) {
+		snprintf(err,errsize,"Can't allocate segment (out of memory?)");
+		return NULL;
+	}
+
+	segment_path(journal,seq,path,sizeof(path));
+	segment->seq = seq;
+	segment->fd = open(path,O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+									0640);
+	if (segment->fd < 0) {
+		snprintf(err,errsize,"Can't open %s: %s",path,strerror(errno));
+		goto open_err;
+	}
+
+	if (create && 0 != ftruncate(segment->fd,
+					(off_t)journal->segment_size)) {
+		snprintf(err,errsize,"Can't allocate %s: %s",path,
+			strerror(errno));
+		goto map_err;
+	}
+
+	if (0 != fstat(segment->fd,&st)) {
+		snprintf(err,errsize,"Can't stat %s: %s",path,strerror(errno));
+		goto map_err;
+	}
+
+	segment->size = (size_t)st.st_size;
+	if (segment->size < SPILL_SEGMENT_HEADER_SIZE) {
+		snprintf(err,errsize,"Segment %s is too small",path);
+		goto map_err;
+	}
+
+	segment->map = mmap(NULL,segment->size,PROT_READ | PROT_WRITE,
+						MAP_SHARED,segment->fd,0);
+	if (MAP_FAILED == segment->map) {
+		snprintf(err,errsize,"Can't map %s: %s",path,strerror(errno));
+		goto map_err;
+	}
+
+	struct spill_segment_header *header = segment_header(segment);
+	if (create) {
+		memcpy(header->magic,SPILL_SEGMENT_MAGIC,sizeof(header->magic));
+		header->version = SPILL_SEGMENT_VERSION;
+		header->header_size = SPILL_SEGMENT_HEADER_SIZE;
+		header->read_offset = SPILL_SEGMENT_HEADER_SIZE;
+	} else if (0 != memcmp(header->magic,SPILL_SEGMENT_MAGIC,
+						sizeof(header->magic)) ||
+			header->version != SPILL_SEGMENT_VERSION ||
+			header->header_size != SPILL_SEGMENT_HEADER_SIZE) {
+		snprintf(err,errsize,"%s is not a spill segment",path);
+		munmap(segment->map,segment->size);
+		goto map_err;
+	}
+
+	segment->end = SPILL_SEGMENT_HEADER_SIZE;
+	return segment;
+
+map_err:
+	close(segment->fd);
+	if (create) {
+		unlink(path);
+	}
+open_err:
+	free(segment);
+	return NULL;
+}
+
+/// Remove a segment file. Need to hold journal lock
+static void segment_remove(struct spill_journal *journal,
+					struct spill_segment *segment) {
+	char path[PATH_MAX];
+
+	TAILQ_REMOVE(&journal->segments,segment,entry);
+	journal->stats.segments--;
+	segment_path(journal,segment->seq,path,sizeof(path));
+	munmap(segment->map,segment->size);
+	close(segment->fd);
+	free(segment);
+	if (0 != unlink(path)) {
+		rdlog(LOG_ERR,"Can't remove spill segment %s: %s",path,
+			strerror(errno));
+	}
+}
+
+/** Find segment records not replayed yet
+  @param journal Spill journal
+  @param segment Segment
+  */
+static void segment_recover(struct spill_journal *journal,
+					struct spill_segment *segment) {
+	struct spill_segment_header *header = segment_header(segment);
+	struct spill_record record;
+	ssize_t record_size;
+
+	if (header->read_offset < SPILL_SEGMENT_HEADER_SIZE ||
+				header->read_offset > segment->size ||
+				header->read_offset % 8) {
+		rdlog(LOG_ERR,"Spill segment %016"PRIx64" has invalid read "
+			"offset, replaying it from start",segment->seq);
+		header->read_offset = SPILL_SEGMENT_HEADER_SIZE;
+	}
+
+	for (segment->end = header->read_offset;
+		(record_size = segment_record(segment,segment->end,&record)) > 0;
+					segment->end += (size_t)record_size) {
+		segment->pending_msgs++;
+	}
+
+	if (record_size < 0) {
+		/* Torn or corrupted write. Following records can't be
+		   found */
+		rdlog(LOG_ERR,"Spill segment %016"PRIx64" has a corrupted "
+			"record at offset %zu, ignoring the rest of it",
+			segment->seq,segment->end);
+		journal->stats.corrupted_msgs++;
+		/* New records could be appended here */
+		memset(segment->map + segment->end,0,
+			segment->size - segment->end);
+	}
+
+	journal->stats.pending_msgs += segment->pending_msgs;
+	journal->stats.pending_bytes += segment->end - header->read_offset;
+}
+
+static int segment_seq_cmp(const void *a,const void *b) {
+	const uint64_t seq_a = *(const uint64_t *)a;
+	const uint64_t seq_b = *(const uint64_t *)b;
+	return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+
+/** Get segment files sequences in journal directory
+  @param journal Spill journal
+  @param seqs Returned sequences, sorted. Need to be freed
+  @param count Number of sequences
+  @return 0 if success, -1 if error
+  */
+static int journal_list_segments(const struct spill_journal *journal,
+		uint64_t **seqs,size_t *count,char *err,size_t errsize) {
+	size_t size = 0;
+	struct dirent *entry = NULL;
+	DIR *dir = opendir(journal->path);
+	if (NULL == dir) {
+		snprintf(err,errsize,"Can't open %s: %s",journal->path,
+			strerror(errno));
+		return -1;
+	}
+
+	*seqs = NULL;
+	*count = 0;
+	while ((entry = readdir(dir))) {
+		uint64_t seq;
+		int seq_len = 0;
+		if (strlen(entry->d_name) != SPILL_SEGMENT_NAME_LEN ||
+				1 != sscanf(entry->d_name,"%16"SCNx64"%n",
+							&seq,&seq_len) ||
+				16 != seq_len ||
+				0 != strcmp(entry->d_name + seq_len,
+						SPILL_SEGMENT_SUFFIX)) {
+			continue;
+		}
+
+		if (*count == size) {
+			size = size ? 2*size : 16;
+			uint64_t *new_seqs = realloc(*seqs,size*sizeof(seq));
+			if (NULL == new_seqs) {
+				snprintf(err,errsize,"Can't allocate segments "
+					"list (out of memory?)");
+				free(*seqs);
+				closedir(dir);
+				return -1;
+			}
+			*seqs = new_seqs;
+		}
+		(*seqs)[(*count)++] = seq;
+	}
+
+	closedir(dir);
+	if (*count > 0) {
+		qsort(*seqs,*count,sizeof((*seqs)[0]),segment_seq_cmp);
+	}
+	return 0;
+}
+
+/// Map segments of previous runs
+static int journal_recover(struct spill_journal *journal,char *err,
+							size_t errsize) {
+	uint64_t *seqs = NULL;
+	size_t i,count = 0;
+
+	if (0 != journal_list_segments(journal,&seqs,&count,err,errsize)) {
+		return -1;
+	}
+
+	for (i=0; i<count; ++i) {
+		char segment_err[BUFSIZ];
+		struct spill_segment *segment = segment_map(journal,seqs[i],0,
+					segment_err,sizeof(segment_err));
+		if (NULL == segment) {
+			rdlog(LOG_ERR,"Ignoring spill segment: %s",segment_err);
+			continue;
+		}
+
+		segment_recover(journal,segment);
+		if (i < count - 1 && segment->end ==
+				segment_header(segment)->read_offset) {
+			/* Completely replayed */
+			TAILQ_INSERT_TAIL(&journal->segments,segment,entry);
+			journal->stats.segments++;
+			segment_remove(journal,segment);
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&journal->segments,segment,entry);
+		journal->stats.segments++;
+	}
+
+	if (count > 0) {
+		journal->next_seq = seqs[count - 1] + 1;
+	}
+	free(seqs);
+	return 0;
+}
+
+struct spill_journal *spill_journal_open(
+		const struct spill_journal_config *config,char *err,
+		size_t errsize) {
+	if (config->segment_size < SPILL_SEGMENT_HEADER_SIZE +
+				sizeof(struct spill_record_header) ||
+			config->segment_size > UINT32_MAX) {
+		snprintf(err,errsize,"Invalid spill segment size %zu",
+			config->segment_size);
+		return NULL;
+	}
+
+	if (config->max_size < config->segment_size) {
+		snprintf(err,errsize,"Spill journal max size is lower than "
+			"segment size");
+		return NULL;
+	}
+
+	struct spill_journal *journal = calloc(1,sizeof(*journal));
+	if (NULL == journal || NULL == (journal->path = strdup(
+							config->path))) {
+		snprintf(err,errsize,"Can't allocate spill journal "
+			"(out of memory?)");
+		free(journal);
+		return NULL;
+	}
+
+	pthread_mutex_init(&journal->lock,NULL);
+	TAILQ_INIT(&journal->segments);
+	journal->segment_size = config->segment_size;
+	journal->max_size = config->max_size;
+
+	if (0 != mkdir(journal->path,0750) && EEXIST != errno) {
+		snprintf(err,errsize,"Can't create %s: %s",journal->path,
+			strerror(errno));
+		goto err;
+	}
+
+	if (0 != journal_recover(journal,err,errsize)) {
+		goto err;
+	}
+
+	return journal;
+
+err:
+	spill_journal_close(journal);
+	return NULL;
+}
+
+/// Journal disk size. Need to hold journal lock
+static uint64_t journal_disk_size(const struct spill_journal *journal) {
+	const struct spill_segment *segment = NULL;
+	uint64_t ret = 0;
+	TAILQ_FOREACH(segment,&journal->segments,entry) {
+		ret += segment->size;
+	}
+	return ret;
+}
+
+/** Get the segment to append a record. Need to hold journal lock
+  @param journal Spill journal
+  @param record_size Record size
+  @return Segment, or NULL if journal is full or error
+  */
+static struct spill_segment *journal_append_segment(
+			struct spill_journal *journal,size_t record_size) {
+	char err[BUFSIZ];
+	struct spill_segment *last = TAILQ_LAST(&journal->segments,
+							spill_segment_tailq);
+	if (last && record_size <= last->size - last->end) {
+		return last;
+	}
+
+	if (journal_disk_size(journal) + journal->segment_size >
+							journal->max_size) {
+		return NULL;
+	}
+
+	if (last) {
+		msync(last->map,last->size,MS_ASYNC);
+	}
+
+	struct spill_segment *segment = segment_map(journal,
+		journal->next_seq++,1,err,sizeof(err));
+	if (NULL == segment) {
+		rdlog(LOG_ERR,"Can't create spill segment: %s",err);
+		return NULL;
+	}
+
+	TAILQ_INSERT_TAIL(&journal->segments,segment,entry);
+	journal->stats.segments++;
+	return segment;
+}
+
+int spill_journal_append(struct spill_journal *journal,
+					const struct spill_record *record) {
+	struct spill_record_header header;
+	const size_t data_len = record->topic_len + record->key_len +
+							record->payload_len;
+	const size_t record_size = SPILL_RECORD_ALIGN(sizeof(header) +
+								data_len);
+	int rc = -1;
+
+	pthread_mutex_lock(&journal->lock);
+	struct spill_segment *segment = record->topic_len > 0 &&
+		record_size <= journal->segment_size -
+						SPILL_SEGMENT_HEADER_SIZE ?
+		journal_append_segment(journal,record_size) : NULL;
+	if (NULL == segment) {
+		journal->stats.rejected_msgs++;
+		goto done;
+	}
+
+	char *cursor = segment->map + segment->end + sizeof(header);
+	memcpy(cursor,record->topic,record->topic_len);
+	cursor += record->topic_len;
+	if (record->key) {
+		memcpy(cursor,record->key,record->key_len);
+		cursor += record->key_len;
+	}
+	memcpy(cursor,record->payload,record->payload_len);
+
+	header.size = (uint32_t)record_size;
+	header.partition = record->partition;
+	header.topic_len = (uint32_t)record->topic_len;
+	header.key_len = record->key ? (uint32_t)record->key_len :
+								SPILL_NO_KEY;
+	header.payload_len = (uint32_t)record->payload_len;
+	memcpy(segment->map + segment->end,&header,sizeof(header));
+	struct spill_record_header *mapped_header =
+		(struct spill_record_header *)(segment->map + segment->end);
+	mapped_header->crc = record_crc(mapped_header);
+
+	segment->end += record_size;
+	segment->pending_msgs++;
+	journal->stats.pending_msgs++;
+	journal->stats.pending_bytes += record_size;
+	journal->stats.appended_msgs++;
+	journal->stats.appended_bytes += record->payload_len;
+	rc = 0;
+
+done:
+	pthread_mutex_unlock(&journal->lock);
+	return rc;
+}
+
+size_t spill_journal_replay(struct spill_journal *journal,size_t max_records,
+				spill_journal_replay_cb cb,void *opaque) {
+	struct spill_record record;
+	uint64_t payload_bytes = 0;
+	size_t replayed = 0;
+	int corrupted = 0;
+
+	pthread_mutex_lock(&journal->lock);
+	struct spill_segment *segment = TAILQ_FIRST(&journal->segments);
+	/* Records before end are not modified by appenders */
+	const size_t end = segment ? segment->end : 0;
+	pthread_mutex_unlock(&journal->lock);
+
+	if (NULL == segment) {
+		return 0;
+	}
+
+	struct spill_segment_header *header = segment_header(segment);
+	size_t offset = header->read_offset;
+	while (replayed < max_records && offset < end) {
+		const ssize_t record_size = segment_record(segment,offset,
+								&record);
+		if (record_size <= 0) {
+			rdlog(LOG_ERR,"Spill segment %016"PRIx64" has a "
+				"corrupted record at offset %zu, ignoring the "
+				"rest of it",segment->seq,offset);
+			corrupted = 1;
+			offset = end;
+			break;
+		}
+
+		if (0 != cb(&record,opaque)) {
+			break;
+		}
+
+		offset += (size_t)record_size;
+		payload_bytes += record.payload_len;
+		replayed++;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+	journal->stats.pending_bytes -= offset - header->read_offset;
+	journal->stats.replayed_msgs += replayed;
+	journal->stats.replayed_bytes += payload_bytes;
+	if (corrupted) {
+		/* Records appended after end are still pending */
+		uint64_t pending_msgs = 0;
+		size_t pending_offset = end;
+		ssize_t record_size;
+		while ((record_size = segment_record(segment,pending_offset,
+							&record)) > 0) {
+			pending_offset += (size_t)record_size;
+			pending_msgs++;
+		}
+		journal->stats.corrupted_msgs++;
+		journal->stats.pending_msgs -= segment->pending_msgs -
+								pending_msgs;
+		segment->pending_msgs = pending_msgs;
+	} else {
+		journal->stats.pending_msgs -= replayed;
+		segment->pending_msgs -= replayed;
+	}
+	header->read_offset = offset;
+
+	if (offset == segment->end && segment != TAILQ_LAST(
+				&journal->segments,spill_segment_tailq)) {
+		/* No more records will be appended to this segment */
+		segment_remove(journal,segment);
+	}
+	pthread_mutex_unlock(&journal->lock);
+
+	return replayed;
+}
+
+void spill_journal_stats(struct spill_journal *journal,
+					struct spill_journal_stats *stats) {
+	pthread_mutex_lock(&journal->lock);
+	*stats = journal->stats;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+void spill_journal_close(struct spill_journal *journal) {
+	struct spill_segment *segment = NULL;
+
+	while ((segment = TAILQ_FIRST(&journal->segments))) {
+		TAILQ_REMOVE(&journal->segments,segment,entry);
+		segment_close(segment);
+	}
+
+	pthread_mutex_destroy(&journal->lock);
+	free(journal->path);
+	free(journal);
+}
@@ -0,0 +1,119 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Spill journal: messages that could not be produced are appended to
+  mmap'ed segment files in a directory, with their topic, key and
+  partition, so they can be replayed later. Every record is CRC-checked,
+  and replay progress is kept in the segments, so it survives restarts.
+  */
+struct spill_journal;
+
+/// Journal record
+struct spill_record {
+	/// Topic name, not NULL terminated
+	const char *topic;
+	size_t topic_len;
+	/// Partition, or RD_KAFKA_PARTITION_UA (-1)
+	int32_t partition;
+	/// Message key. NULL if no key
+	const void *key;
+	size_t key_len;
+	const void *payload;
+	size_t payload_len;
+};
+
+struct spill_journal_config {
+	/// Directory of segment files. Created if it does not exist
+	const char *path;
+	/// Size of new segment files
+	size_t segment_size;
+	/// Max size of all segment files
+	uint64_t max_size;
+};
+
+/// Journal counters. Appended, replayed and rejected are since open
+struct spill_journal_stats {
+	/// Segment files
+	size_t segments;
+	/// Records and bytes in journal, not replayed yet
+	uint64_t pending_msgs,pending_bytes;
+	/// Records appended, and their payload bytes
+	uint64_t appended_msgs,appended_bytes;
+	/// Records replayed, and their payload bytes
+	uint64_t replayed_msgs,replayed_bytes;
+	/// Records not appended because journal is full or they are too big
+	uint64_t rejected_msgs;
+	/// Records with bad CRC, skipped
+	uint64_t corrupted_msgs;
+};
+
+/** Open a spill journal, recovering segments from previous runs
+  @param config Journal config
+  @param err Error buffer
+  @param errsize Error buffer size
+  @return New journal, or NULL if error
+  */
+struct spill_journal *spill_journal_open(
+		const struct spill_journal_config *config,char *err,
+		size_t errsize);
+
+/** Append a record to journal. Thread safe.
+  @param journal Spill journal
+  @param record Record to append
+  @return 0 if success, -1 if journal is full or error
+  */
+int spill_journal_append(struct spill_journal *journal,
+					const struct spill_record *record);
+
+/** Replay callback
+  @param record Journal record. Data is only valid inside callback
+  @param opaque Callback opaque
+  @return 0 if record has been replayed, !0 to stop replay (record will
+  be replayed in next call)
+  */
+typedef int (*spill_journal_replay_cb)(const struct spill_record *record,
+								void *opaque);
+
+/** Replay oldest records of journal, and remove them. Only one thread can
+  replay at a time, but it can be done while other threads append.
+  @param journal Spill journal
+  @param max_records Max records to replay
+  @param cb Callback called for every record, in append order
+  @param opaque Callback opaque
+  @return Number of records replayed
+  */
+size_t spill_journal_replay(struct spill_journal *journal,size_t max_records,
+				spill_journal_replay_cb cb,void *opaque);
+
+/** Get journal counters
+  @param journal Spill journal
+  @param stats Returned counters
+  */
+void spill_journal_stats(struct spill_journal *journal,
+					struct spill_journal_stats *stats);
+
+/** Close journal. Records not replayed are kept for the next open
+  @param journal Spill journal
+  */
+void spill_journal_close(struct spill_journal *journal);
@@ -1,6 +1,7 @@
 
 #include "config.h"
 #include "topic_database.h"
+#include "kafka.h"
 
 #include <librd/rdavl.h>
 #include <librd/rdmem.h>
@@ -34,7 +35,7 @@ rd_kafka_topic_t *topics_db_get_rdkafka_topic(struct topic_s *topic) {
 
 void topic_decref(struct topic_s *topic) {
 	if(0==ATOMIC_OP(sub,fetch,&topic->refcnt,1)) {
-		rd_kafka_topic_destroy(topic->rkt);
+		kafka_topic_release(topic->rkt);
 		free(topic);
 	}
 }
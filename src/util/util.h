@@ -41,7 +41,12 @@
 #define swap_ptrs(p1,p2) do{void *aux = p1;p1 = p2;p2 = aux;}while(0)
 
 static inline char *mystrerror(int _errno,char *buffer,size_t buffer_size){
+#ifdef _GNU_SOURCE
+	/* GNU version does not need to use buffer */
+	return strerror_r(_errno,buffer,buffer_size);
+#else
 	strerror_r(_errno,buffer,buffer_size);
 	return buffer;
+#endif
 }
 
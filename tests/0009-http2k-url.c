@@ -120,6 +120,72 @@ static void validate_uuid_test() {
 	validate_test(validate_uuid_test0);
 }
 
+static void get_topic_client_test0(struct rb_config *rb) {
+	size_t i;
+	struct {
+		const char *uuid;
+		const char *topic;
+		int expected_sensor;
+		int expected_topic;
+	} validations[] = {
+		{.uuid = "abc", .topic = "rb_flow",
+			.expected_sensor = 1, .expected_topic = 1},
+		{.uuid = "abc", .topic = "rb_unknown",
+			.expected_sensor = 1, .expected_topic = 0},
+		/* Topic is not searched if sensor is not valid */
+		{.uuid = "mno", .topic = "rb_flow",
+			.expected_sensor = 0, .expected_topic = 0},
+	};
+
+	for (i=0; i<sizeof(validations)/sizeof(validations[0]); ++i) {
+		struct rb_http2k_handlers handlers;
+		const int result = rb_http2k_database_get_topic_client(
+			&rb->database,validations[i].topic,
+			validations[i].uuid,&handlers.topic,&handlers.sensor);
+		assert(validations[i].expected_sensor == (NULL != handlers.sensor));
+		assert(validations[i].expected_topic == (NULL != handlers.topic));
+		assert((validations[i].expected_sensor &&
+			validations[i].expected_topic) == result);
+		rb_http2k_handlers_done(&handlers);
+		assert(NULL == handlers.topic && NULL == handlers.sensor);
+	}
+}
+
+static void get_topic_client_test() {
+	validate_test(get_topic_client_test0);
+}
+
+/// Decoder session can take the handlers listener looked up
+static void handlers_take_test0(struct rb_config *rb) {
+	struct rb_http2k_handlers handlers;
+	struct topic_s *topic = NULL;
+	sensor_db_entry_t *sensor = NULL;
+	struct pair handlers_opt = {
+		.key = RB_HTTP2K_HANDLERS_KEY,
+		.value = (const char *)(const void *)&handlers,
+	};
+	keyval_list_t msg_vars = keyval_list_initializer(msg_vars);
+
+	assert(0 == rb_http2k_handlers_take(&msg_vars,&topic,&sensor));
+
+	rb_http2k_database_get_topic_client(&rb->database,"rb_flow","abc",
+		&handlers.topic,&handlers.sensor);
+	add_key_value_pair(&msg_vars,&handlers_opt);
+	assert(1 == rb_http2k_handlers_take(&msg_vars,&topic,&sensor));
+	assert(NULL != topic && NULL != sensor);
+	assert(NULL == handlers.topic && NULL == handlers.sensor);
+
+	/* Already taken */
+	assert(0 == rb_http2k_handlers_take(&msg_vars,&topic,&sensor));
+
+	topic_decref(topic);
+	sensor_db_entry_decref(sensor);
+}
+
+static void handlers_take_test() {
+	validate_test(handlers_take_test0);
+}
+
 #if 0
 int rb_http2k_validate_topic(struct rb_database *db, const char *topic) {
 	pthread_rwlock_rdlock(&db->rwlock);
@@ -133,6 +199,8 @@ int main() {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(validate_uuid_test),
 		cmocka_unit_test(validate_topic_test),
+		cmocka_unit_test(get_topic_client_test),
+		cmocka_unit_test(handlers_take_test),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
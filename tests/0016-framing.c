@@ -0,0 +1,138 @@
+#include "../src/util/framing.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <string.h>
+
+#define MAX_RECORDS 16
+
+struct framing_test {
+	enum framing_mode mode;
+	const char *buf;
+	size_t buf_len;
+	/// Expected consumed bytes
+	ssize_t consumed;
+	/// Expected records
+	const char *records[MAX_RECORDS];
+};
+
+static void check_framing_test(const struct framing_test *test,
+						size_t max_records) {
+	size_t i;
+	struct framed_record records[MAX_RECORDS];
+	size_t records_count = max_records;
+	char *buf = malloc(test->buf_len);
+
+	memcpy(buf, test->buf, test->buf_len);
+	const ssize_t consumed = framing_split(test->mode, buf,
+		test->buf_len, records, &records_count);
+
+	assert_int_equal(test->consumed, consumed);
+	for (i = 0; i < records_count; ++i) {
+		assert_non_null(test->records[i]);
+		assert_int_equal(strlen(test->records[i]), records[i].len);
+		assert_memory_equal(test->records[i], records[i].payload,
+			records[i].len);
+	}
+
+	if (records_count < MAX_RECORDS && consumed >= 0) {
+		assert_null(test->records[records_count]);
+	}
+
+	free(buf);
+}
+
+#define FRAMING_TEST(t_mode, t_buf, t_consumed, ...) { \
+	.mode = t_mode, .buf = t_buf, .buf_len = sizeof(t_buf) - 1, \
+	.consumed = t_consumed, .records = {__VA_ARGS__} }
+
+static void test_framing_mode_str() {
+	assert_int_equal(FRAMING_NONE, framing_mode_str(NULL));
+	assert_int_equal(FRAMING_NONE, framing_mode_str("none"));
+	assert_int_equal(FRAMING_NEWLINE, framing_mode_str("newline"));
+	assert_int_equal(FRAMING_OCTET_COUNTING,
+		framing_mode_str("octet_counting"));
+	assert_int_equal(FRAMING_LENGTH_PREFIX,
+		framing_mode_str("length_prefix"));
+	assert_int_equal(FRAMING_INVALID, framing_mode_str("other"));
+}
+
+static void test_newline() {
+	static const struct framing_test tests[] = {
+		FRAMING_TEST(FRAMING_NEWLINE, "", 0, NULL),
+		FRAMING_TEST(FRAMING_NEWLINE, "abc", 0, NULL),
+		FRAMING_TEST(FRAMING_NEWLINE, "abc\n", 4, "abc", NULL),
+		FRAMING_TEST(FRAMING_NEWLINE, "abc\r\ndef\n", 9, "abc", "def",
+									NULL),
+		/* Empty lines are skipped */
+		FRAMING_TEST(FRAMING_NEWLINE, "\n\nabc\n\nde", 7, "abc", NULL),
+	};
+
+	size_t i;
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		check_framing_test(&tests[i], MAX_RECORDS);
+	}
+}
+
+static void test_octet_counting() {
+	static const struct framing_test tests[] = {
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "3 abc", 5, "abc", NULL),
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "3 abc11 hello world2",
+						19, "abc", "hello world", NULL),
+		/* Incomplete length and record */
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "12", 0, NULL),
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "3 ab", 0, NULL),
+		/* Malformed */
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "a abc", -1, NULL),
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "03 abc", -1, NULL),
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, " abc", -1, NULL),
+		FRAMING_TEST(FRAMING_OCTET_COUNTING, "1234567890 a", -1, NULL),
+	};
+
+	size_t i;
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		check_framing_test(&tests[i], MAX_RECORDS);
+	}
+}
+
+static void test_length_prefix() {
+	static const struct framing_test tests[] = {
+		FRAMING_TEST(FRAMING_LENGTH_PREFIX, "\0\0\0\3abc", 7, "abc",
+									NULL),
+		FRAMING_TEST(FRAMING_LENGTH_PREFIX, "\0\0\0\3abc\0\0\0\2de\0",
+							13, "abc", "de", NULL),
+		/* Empty record is skipped */
+		FRAMING_TEST(FRAMING_LENGTH_PREFIX, "\0\0\0\0\0\0\0\1a", 9, "a",
+									NULL),
+		/* Incomplete */
+		FRAMING_TEST(FRAMING_LENGTH_PREFIX, "\0\0\1\0abc", 0, NULL),
+	};
+
+	size_t i;
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		check_framing_test(&tests[i], MAX_RECORDS);
+	}
+}
+
+/// Records are not consumed if there is no space to return them
+static void test_records_limit() {
+	static const struct framing_test test = FRAMING_TEST(FRAMING_NEWLINE,
+					"a\nb\nc\n", 4, "a", "b", NULL);
+
+	check_framing_test(&test, 2);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_framing_mode_str),
+		cmocka_unit_test(test_newline),
+		cmocka_unit_test(test_octet_counting),
+		cmocka_unit_test(test_length_prefix),
+		cmocka_unit_test(test_records_limit),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
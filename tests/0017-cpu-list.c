@@ -0,0 +1,82 @@
+#include "../src/util/cpu_affinity.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+struct cpu_list_test {
+	const char *str;
+	/// Expected CPUs. -1 terminated
+	int cpus[16];
+};
+
+static void check_cpu_list(const struct cpu_list_test *test) {
+	int *cpus = NULL;
+	size_t i,cpus_count = 0;
+
+	const int rc = parse_cpu_list(test->str,&cpus,&cpus_count);
+	assert_int_equal(0,rc);
+
+	for (i=0; i<cpus_count; ++i) {
+		assert_int_equal(test->cpus[i],cpus[i]);
+	}
+	assert_int_equal(-1,test->cpus[cpus_count]);
+
+	free(cpus);
+}
+
+static void test_valid_cpu_lists() {
+	static const struct cpu_list_test tests[] = {
+		{.str = "0", .cpus = {0,-1}},
+		{.str = "0-3", .cpus = {0,1,2,3,-1}},
+		{.str = "0-1,8,10-11", .cpus = {0,1,8,10,11,-1}},
+		/* sysfs cpulist format */
+		{.str = "0-2,4\n", .cpus = {0,1,2,4,-1}},
+	};
+
+	size_t i;
+	for (i=0; i<sizeof(tests)/sizeof(tests[0]); ++i) {
+		check_cpu_list(&tests[i]);
+	}
+}
+
+static void test_invalid_cpu_lists() {
+	static const char *tests[] = {
+		"", "a", "1-", "-1", "3-1", "1,,2", "1;2", "0-100000",
+	};
+
+	size_t i;
+	for (i=0; i<sizeof(tests)/sizeof(tests[0]); ++i) {
+		int *cpus = NULL;
+		size_t cpus_count = 0;
+
+		const int rc = parse_cpu_list(tests[i],&cpus,&cpus_count);
+		assert_int_not_equal(0,rc);
+		assert_null(cpus);
+		assert_int_equal(0,cpus_count);
+	}
+}
+
+static void test_cpus_intersect() {
+	int a[] = {0,1,2,3,8,9};
+	static const int b[] = {2,3,4,5,6,7,8};
+	size_t a_count = sizeof(a)/sizeof(a[0]);
+
+	cpus_intersect(a,&a_count,b,sizeof(b)/sizeof(b[0]));
+
+	assert_int_equal(3,a_count);
+	assert_int_equal(2,a[0]);
+	assert_int_equal(3,a[1]);
+	assert_int_equal(8,a[2]);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_valid_cpu_lists),
+		cmocka_unit_test(test_invalid_cpu_lists),
+		cmocka_unit_test(test_cpus_intersect),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,177 @@
+#include "../src/util/addr_filter.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+struct addr_filter_test_rule {
+	const char *cidr;
+	enum addr_filter_action action;
+};
+
+struct addr_filter_test_addr {
+	const char *addr;
+	enum addr_filter_action expected;
+};
+
+static addr_filter_t *test_filter(const struct addr_filter_test_rule *rules,
+							size_t rules_count) {
+	size_t i;
+	addr_filter_t *filter = addr_filter_new();
+	assert_non_null(filter);
+
+	for (i=0; i<rules_count; ++i) {
+		const int rc = addr_filter_add(filter,rules[i].cidr,
+			rules[i].action);
+		assert_int_equal(0,rc);
+	}
+
+	return filter;
+}
+
+static enum addr_filter_action check_str_addr(addr_filter_t *filter,
+							const char *str) {
+	if (strchr(str,':')) {
+		struct sockaddr_in6 sin6;
+		memset(&sin6,0,sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		assert_int_equal(1,inet_pton(AF_INET6,str,&sin6.sin6_addr));
+		return addr_filter_check(filter,(struct sockaddr *)&sin6);
+	} else {
+		struct sockaddr_in sin;
+		memset(&sin,0,sizeof(sin));
+		sin.sin_family = AF_INET;
+		assert_int_equal(1,inet_pton(AF_INET,str,&sin.sin_addr));
+		return addr_filter_check(filter,(struct sockaddr *)&sin);
+	}
+}
+
+static void check_addrs(addr_filter_t *filter,
+		const struct addr_filter_test_addr *addrs,size_t addrs_count) {
+	size_t i;
+	for (i=0; i<addrs_count; ++i) {
+		assert_int_equal(addrs[i].expected,
+			check_str_addr(filter,addrs[i].addr));
+	}
+}
+
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
+
+/// Empty filter allows everything
+static void test_empty_filter() {
+	static const struct addr_filter_test_addr addrs[] = {
+		{"192.168.101.3", ADDR_FILTER_ALLOW},
+		{"2001:db8::1", ADDR_FILTER_ALLOW},
+	};
+
+	addr_filter_t *filter = test_filter(NULL,0);
+	check_addrs(filter,addrs,ARRAY_SIZE(addrs));
+	addr_filter_done(filter);
+}
+
+static void test_blacklist() {
+	static const struct addr_filter_test_rule rules[] = {
+		{"192.168.101.3", ADDR_FILTER_DENY},
+		{"10.0.0.0/8", ADDR_FILTER_DENY},
+		{"172.16.0.0/13", ADDR_FILTER_DENY},
+		{"2001:db8::/33", ADDR_FILTER_DENY},
+	};
+	static const struct addr_filter_test_addr addrs[] = {
+		{"192.168.101.3", ADDR_FILTER_DENY},
+		{"192.168.101.4", ADDR_FILTER_ALLOW},
+		{"10.20.30.40", ADDR_FILTER_DENY},
+		{"11.0.0.1", ADDR_FILTER_ALLOW},
+		{"172.23.255.255", ADDR_FILTER_DENY},
+		{"172.24.0.0", ADDR_FILTER_ALLOW},
+		{"172.15.255.255", ADDR_FILTER_ALLOW},
+		{"2001:db8:7fff::1", ADDR_FILTER_DENY},
+		{"2001:db8:8000::1", ADDR_FILTER_ALLOW},
+		/* IPv4 mapped address use IPv4 rules */
+		{"::ffff:10.1.1.1", ADDR_FILTER_DENY},
+	};
+
+	addr_filter_t *filter = test_filter(rules,ARRAY_SIZE(rules));
+	check_addrs(filter,addrs,ARRAY_SIZE(addrs));
+
+	assert_int_equal(1,filter->rules[0].hits);
+	assert_int_equal(2,filter->rules[1].hits);
+	assert_int_equal(5,filter->default_hits);
+	addr_filter_done(filter);
+}
+
+/// Longest prefix decides, and allow rules deny unmatched addresses
+static void test_allowlist() {
+	static const struct addr_filter_test_rule rules[] = {
+		{"10.0.0.0/8", ADDR_FILTER_ALLOW},
+		{"10.1.0.0/16", ADDR_FILTER_DENY},
+		{"10.1.2.0/23", ADDR_FILTER_ALLOW},
+		{"0.0.0.0/0", ADDR_FILTER_DENY},
+		{"::/0", ADDR_FILTER_ALLOW},
+	};
+	static const struct addr_filter_test_addr addrs[] = {
+		{"10.0.0.1", ADDR_FILTER_ALLOW},
+		{"10.1.1.1", ADDR_FILTER_DENY},
+		{"10.1.2.1", ADDR_FILTER_ALLOW},
+		{"10.1.3.1", ADDR_FILTER_ALLOW},
+		{"10.1.4.1", ADDR_FILTER_DENY},
+		{"11.0.0.1", ADDR_FILTER_DENY},
+		{"2001:db8::1", ADDR_FILTER_ALLOW},
+	};
+
+	addr_filter_t *filter = test_filter(rules,ARRAY_SIZE(rules));
+	check_addrs(filter,addrs,ARRAY_SIZE(addrs));
+	addr_filter_done(filter);
+}
+
+static void test_invalid_rules() {
+	static const char *invalid[] = {
+		"", "a.b.c.d", "10.0.0.0/", "10.0.0.0/33", "10.0.0.0/8x",
+		"2001:db8::/129", "300.0.0.1",
+	};
+	size_t i;
+
+	addr_filter_t *filter = addr_filter_new();
+	for (i=0; i<ARRAY_SIZE(invalid); ++i) {
+		assert_int_not_equal(0,addr_filter_add(filter,invalid[i],
+			ADDR_FILTER_DENY));
+	}
+	assert_int_equal(0,filter->rules_count);
+	addr_filter_done(filter);
+}
+
+/// Many rules, to force trie reallocations
+static void test_many_rules() {
+	char cidr[sizeof("255.255.255.255/32")];
+	size_t i;
+
+	addr_filter_t *filter = addr_filter_new();
+	for (i=0; i<4096; ++i) {
+		snprintf(cidr,sizeof(cidr),"%zu.%zu.0.0/%zu",i%256,i/256,
+			16 + i%17);
+		assert_int_equal(0,addr_filter_add(filter,cidr,
+			ADDR_FILTER_DENY));
+	}
+
+	for (i=0; i<4096; ++i) {
+		snprintf(cidr,sizeof(cidr),"%zu.%zu.0.0",i%256,i/256);
+		assert_int_equal(ADDR_FILTER_DENY,
+			check_str_addr(filter,cidr));
+	}
+	assert_int_equal(ADDR_FILTER_ALLOW,
+		check_str_addr(filter,"1.16.0.1"));
+
+	addr_filter_done(filter);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_empty_filter),
+		cmocka_unit_test(test_blacklist),
+		cmocka_unit_test(test_allowlist),
+		cmocka_unit_test(test_invalid_rules),
+		cmocka_unit_test(test_many_rules),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
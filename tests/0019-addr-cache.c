@@ -0,0 +1,67 @@
+#include "../src/engine/rb_addr.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+static struct rb_addr_str *cache_get_ipv4(uint32_t addr) {
+	struct sockaddr_in sin;
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(addr);
+
+	return rb_addr_cache_get((const struct sockaddr *)&sin);
+}
+
+static void test_addr_cache_hit() {
+	struct rb_addr_str *str1 = cache_get_ipv4(0xc0a86503);
+	assert_non_null(str1);
+	assert_string_equal("192.168.101.3",str1->str);
+
+	const uint64_t hits = thread_cache->stats.hits;
+	struct rb_addr_str *str2 = cache_get_ipv4(0xc0a86503);
+	assert_true(str1 == str2);
+	assert_int_equal(hits + 1,thread_cache->stats.hits);
+}
+
+static void test_addr_cache_ipv6() {
+	struct sockaddr_in6 sin6;
+	memset(&sin6,0,sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	inet_pton(AF_INET6,"2001:db8::1",&sin6.sin6_addr);
+
+	struct rb_addr_str *str = rb_addr_cache_get(
+		(const struct sockaddr *)&sin6);
+	assert_non_null(str);
+	assert_string_equal("2001:db8::1",str->str);
+}
+
+/// Referenced strings survive cache eviction
+static void test_addr_cache_eviction() {
+	uint32_t i;
+
+	struct rb_addr_str *str = rb_addr_str_incref(
+		cache_get_ipv4(0x0a000001));
+
+	for (i=0; i<4*RB_ADDR_CACHE_SETS*RB_ADDR_CACHE_WAYS; ++i) {
+		char expected[INET_ADDRSTRLEN];
+		const struct in_addr addr = {.s_addr = htonl(0x0b000000 + i)};
+		inet_ntop(AF_INET,&addr,expected,sizeof(expected));
+
+		assert_string_equal(expected,cache_get_ipv4(0x0b000000 + i)->str);
+	}
+
+	assert_string_equal("10.0.0.1",str->str);
+	rb_addr_str_decref(str);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_addr_cache_hit),
+		cmocka_unit_test(test_addr_cache_ipv6),
+		cmocka_unit_test(test_addr_cache_eviction),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
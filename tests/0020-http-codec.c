@@ -0,0 +1,203 @@
+#include "../src/listener/http_codec.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+/// Decompressed output accumulator
+struct output {
+	char *buf;
+	size_t len;
+};
+
+static void output_cb(char *buf,size_t len,void *opaque) {
+	struct output *out = opaque;
+	out->buf = realloc(out->buf,out->len + len);
+	assert_non_null(out->buf);
+	memcpy(&out->buf[out->len],buf,len);
+	out->len += len;
+}
+
+/// Compress in zlib (window_bits=MAX_WBITS) or gzip (16+MAX_WBITS) format
+static size_t zlib_compress(int window_bits,const char *in,size_t in_len,
+                                                char *out,size_t out_size) {
+	z_stream strm;
+	memset(&strm,0,sizeof(strm));
+
+	assert_int_equal(Z_OK,deflateInit2(&strm,Z_DEFAULT_COMPRESSION,
+		Z_DEFLATED,window_bits,8,Z_DEFAULT_STRATEGY));
+	strm.next_in = (Bytef *)(intptr_t)in;
+	strm.avail_in = (uInt)in_len;
+	strm.next_out = (Bytef *)out;
+	strm.avail_out = (uInt)out_size;
+	assert_int_equal(Z_STREAM_END,deflate(&strm,Z_FINISH));
+	deflateEnd(&strm);
+
+	return out_size - strm.avail_out;
+}
+
+/// Input bigger than decompression output slice
+static char *test_input(size_t len) {
+	size_t i;
+	char *ret = malloc(len);
+	assert_non_null(ret);
+
+	for (i=0; i<len; ++i) {
+		ret[i] = (char)('a' + (i*7 + i/13)%26);
+	}
+
+	return ret;
+}
+
+/// Decompress in chunks of chunk_size, as received from HTTP
+static void check_decompress(enum http_codec_type codec,const char *compressed,
+		size_t compressed_len,size_t chunk_size,const char *expected,
+		size_t expected_len) {
+	struct output out = {NULL,0};
+	struct http_codec_stats stats;
+	size_t pos = 0;
+	memset(&stats,0,sizeof(stats));
+
+	struct http_codec_stream *stream = http_codec_stream_acquire(codec);
+	assert_non_null(stream);
+
+	while (pos < compressed_len) {
+		const size_t len = compressed_len - pos < chunk_size ?
+			compressed_len - pos : chunk_size;
+		const ssize_t rc = http_codec_decompress(stream,
+			&compressed[pos],len,output_cb,&out,&stats);
+		assert_int_equal(len,rc);
+		pos += len;
+	}
+
+	assert_int_equal(expected_len,out.len);
+	assert_memory_equal(expected,out.buf,expected_len);
+	assert_int_equal(compressed_len,stats.bytes_in);
+	assert_int_equal(expected_len,stats.bytes_out);
+	assert_int_equal(0,stats.errors);
+
+	http_codec_stream_release(stream);
+	free(out.buf);
+}
+
+static void test_zlib_codec(enum http_codec_type codec,int window_bits) {
+	static const size_t in_len = 3*HTTP_CODEC_OUT_SIZE + 17;
+	static const size_t chunk_sizes[] = {1,1000,1024*1024};
+	size_t i;
+
+	char *in = test_input(in_len);
+	char *compressed = malloc(in_len);
+	assert_non_null(compressed);
+	const size_t compressed_len = zlib_compress(window_bits,in,in_len,
+		compressed,in_len);
+
+	for (i=0; i<sizeof(chunk_sizes)/sizeof(chunk_sizes[0]); ++i) {
+		check_decompress(codec,compressed,compressed_len,
+			chunk_sizes[i],in,in_len);
+	}
+
+	free(compressed);
+	free(in);
+}
+
+static void test_deflate() {
+	test_zlib_codec(HTTP_CODEC_DEFLATE,MAX_WBITS);
+}
+
+static void test_gzip() {
+	test_zlib_codec(HTTP_CODEC_GZIP,16 + MAX_WBITS);
+}
+
+/// gzip allows concatenated members
+static void test_gzip_members() {
+	static const char msg1[] = "{\"a\":1}\n";
+	static const char msg2[] = "{\"b\":2}\n";
+	char compressed[256],expected[sizeof(msg1) + sizeof(msg2)];
+
+	const size_t len1 = zlib_compress(16 + MAX_WBITS,msg1,strlen(msg1),
+		compressed,sizeof(compressed));
+	const size_t len2 = zlib_compress(16 + MAX_WBITS,msg2,strlen(msg2),
+		&compressed[len1],sizeof(compressed) - len1);
+	snprintf(expected,sizeof(expected),"%s%s",msg1,msg2);
+
+	check_decompress(HTTP_CODEC_GZIP,compressed,len1 + len2,len1 + len2,
+		expected,strlen(expected));
+}
+
+static void test_corrupted_stream() {
+	static const char garbage[] = "this is not a deflate stream";
+	struct output out = {NULL,0};
+	struct http_codec_stats stats;
+	memset(&stats,0,sizeof(stats));
+
+	struct http_codec_stream *stream = http_codec_stream_acquire(
+		HTTP_CODEC_DEFLATE);
+	assert_non_null(stream);
+
+	const ssize_t rc = http_codec_decompress(stream,garbage,
+		strlen(garbage),output_cb,&out,&stats);
+	assert_true(rc < 0);
+	assert_int_equal(1,stats.errors);
+	assert_string_not_equal("no error",http_codec_stream_error(stream));
+
+	/* Failed streams are not reused */
+	http_codec_stream_release(stream);
+	assert_int_equal(0,thread_ctx->pool_count[HTTP_CODEC_DEFLATE]);
+	free(out.buf);
+}
+
+/// Released streams are reused by the same thread
+static void test_stream_pool() {
+	struct http_codec_stream *stream = http_codec_stream_acquire(
+		HTTP_CODEC_GZIP);
+	assert_non_null(stream);
+	http_codec_stream_release(stream);
+
+	assert_true(stream == http_codec_stream_acquire(HTTP_CODEC_GZIP));
+	http_codec_stream_release(stream);
+}
+
+static void test_codec_find() {
+	enum http_codec_type codec = HTTP_CODEC_MAX;
+
+	assert_int_equal(1,http_codec_find(NULL,&codec));
+	assert_int_equal(1,http_codec_find("",&codec));
+	assert_int_equal(1,http_codec_find("identity",&codec));
+	assert_int_equal(-1,http_codec_find("br",&codec));
+	assert_int_equal(-1,http_codec_find("gzip, deflate",&codec));
+
+	assert_int_equal(0,http_codec_find("deflate",&codec));
+	assert_int_equal(HTTP_CODEC_DEFLATE,codec);
+	assert_int_equal(0,http_codec_find("GZIP",&codec));
+	assert_int_equal(HTTP_CODEC_GZIP,codec);
+	assert_int_equal(0,http_codec_find("x-gzip",&codec));
+	assert_int_equal(HTTP_CODEC_GZIP,codec);
+
+#ifdef HAVE_LIBZSTD
+	assert_int_equal(0,http_codec_find("zstd",&codec));
+	assert_int_equal(HTTP_CODEC_ZSTD,codec);
+#else
+	assert_int_equal(-1,http_codec_find("zstd",&codec));
+#endif
+
+#ifdef HAVE_LIBLZ4
+	assert_int_equal(0,http_codec_find("lz4",&codec));
+	assert_int_equal(HTTP_CODEC_LZ4,codec);
+#else
+	assert_int_equal(-1,http_codec_find("lz4",&codec));
+#endif
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_deflate),
+		cmocka_unit_test(test_gzip),
+		cmocka_unit_test(test_gzip_members),
+		cmocka_unit_test(test_corrupted_stream),
+		cmocka_unit_test(test_stream_pool),
+		cmocka_unit_test(test_codec_find),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
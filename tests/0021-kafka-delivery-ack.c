@@ -0,0 +1,133 @@
+#include "../src/util/kafka.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+/// Delivery ack callback calls
+struct ack_result {
+	int calls;
+	size_t msgs,failed;
+};
+
+static void ack_cb(size_t msgs,size_t failed,void *opaque) {
+	struct ack_result *result = opaque;
+	result->calls++;
+	result->msgs = msgs;
+	result->failed = failed;
+}
+
+/// Callback is called when sealed and all messages are reported
+static void delivery_ack_test() {
+	struct ack_result result = {0,0,0};
+	struct kafka_delivery_ack *ack = kafka_delivery_ack_new(ack_cb,&result);
+	void *opaques[3];
+	size_t i;
+	assert_non_null(ack);
+
+	kafka_delivery_ack_track(ack);
+	for (i=0; i<RD_ARRAYSIZE(opaques); ++i) {
+		opaques[i] = msg_ack_wrap(kafka_msg_opaque_from_value(i+1));
+		/* Partitioners still see original opaque */
+		assert_true(kafka_msg_opaque(opaques[i]) ==
+					kafka_msg_opaque_from_value(i+1));
+	}
+	kafka_delivery_ack_track(NULL);
+
+	/* Not tracking anymore */
+	void *untracked = kafka_msg_opaque_from_value(5);
+	assert_true(msg_ack_wrap(untracked) == untracked);
+
+	assert_true(msg_ack_report(opaques[0],0) == kafka_msg_opaque_from_value(1));
+	assert_true(msg_ack_report(opaques[1],1) == kafka_msg_opaque_from_value(2));
+	kafka_delivery_ack_seal(ack);
+	assert_int_equal(result.calls,0);
+
+	msg_ack_report(opaques[2],0);
+	assert_int_equal(result.calls,1);
+	assert_int_equal(result.msgs,3);
+	assert_int_equal(result.failed,1);
+
+	kafka_delivery_ack_done(ack);
+	assert_int_equal(result.calls,1);
+}
+
+/// Callback is called in seal if messages are already reported, and not
+/// called after done
+static void delivery_ack_seal_done_test() {
+	struct ack_result result = {0,0,0};
+	struct kafka_delivery_ack *ack = kafka_delivery_ack_new(ack_cb,&result);
+	assert_non_null(ack);
+
+	kafka_delivery_ack_seal(ack);
+	assert_int_equal(result.calls,1);
+	assert_int_equal(result.msgs,0);
+	kafka_delivery_ack_done(ack);
+
+	memset(&result,0,sizeof(result));
+	ack = kafka_delivery_ack_new(ack_cb,&result);
+	assert_non_null(ack);
+	kafka_delivery_ack_track(ack);
+	void *opaque = msg_ack_wrap(NULL);
+	kafka_delivery_ack_track(NULL);
+	kafka_delivery_ack_seal(ack);
+	kafka_delivery_ack_done(ack);
+
+	/* Late delivery report: ack is still alive, but callback is not
+	   called */
+	msg_ack_report(opaque,0);
+	assert_int_equal(result.calls,0);
+}
+
+/// Batch produce errors are reported, and produced messages get their
+/// opaque back
+static void delivery_ack_batch_test() {
+	struct ack_result result = {0,0,0};
+	struct kafka_delivery_ack *ack = kafka_delivery_ack_new(ack_cb,&result);
+	rd_kafka_message_t msgs[2];
+	assert_non_null(ack);
+
+	memset(msgs,0,sizeof(msgs));
+	msgs[0]._private = kafka_msg_opaque_from_value(1);
+	msgs[1]._private = kafka_msg_opaque_from_value(2);
+
+	kafka_delivery_ack_track(ack);
+	kafka_track_batch(msgs,RD_ARRAYSIZE(msgs));
+	kafka_delivery_ack_track(NULL);
+	void *produced_opaque = msgs[0]._private;
+
+	/* Simulate rd_kafka_produce_batch result */
+	msgs[1].err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+	kafka_account_produced_batch(msgs,RD_ARRAYSIZE(msgs));
+	assert_true(msgs[0]._private == kafka_msg_opaque_from_value(1));
+	assert_true(msgs[1]._private == kafka_msg_opaque_from_value(2));
+
+	kafka_delivery_ack_seal(ack);
+	assert_int_equal(result.calls,0);
+
+	/* Delivery report of produced message */
+	struct kafka_dr_batch batch;
+	rd_kafka_message_t delivered;
+	memset(&batch,0,sizeof(batch));
+	memset(&delivered,0,sizeof(delivered));
+	delivered._private = produced_opaque;
+	delivered.len = 10;
+	msg_delivered(&batch,&delivered);
+	assert_int_equal(batch.msgs,1);
+	assert_int_equal(batch.bytes,10);
+	assert_int_equal(result.calls,1);
+	assert_int_equal(result.msgs,2);
+	assert_int_equal(result.failed,1);
+	kafka_delivery_ack_done(ack);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(delivery_ack_test),
+		cmocka_unit_test(delivery_ack_seal_done_test),
+		cmocka_unit_test(delivery_ack_batch_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
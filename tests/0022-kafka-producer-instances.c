@@ -0,0 +1,118 @@
+#include "../src/util/kafka.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define PRODUCER_INSTANCES 3
+#define TEST_THREADS (2*PRODUCER_INSTANCES)
+
+/// Topic handlers a thread produces through
+struct thread_topics {
+	rd_kafka_topic_t *rkt;
+	rd_kafka_topic_t *first,*second;
+	size_t instance;
+};
+
+static void *thread_topic_main(void *_topics) {
+	struct thread_topics *topics = _topics;
+	topics->first = kafka_thread_topic(topics->rkt);
+	topics->second = kafka_thread_topic(topics->rkt);
+	topics->instance = kafka_thread_producer_instance();
+	return NULL;
+}
+
+static void init_producers() {
+	char errstr[BUFSIZ];
+
+	memset(&global_config,0,sizeof(global_config));
+	global_config.kafka_conf = rd_kafka_conf_new();
+	global_config.kafka_topic_conf = rd_kafka_topic_conf_new();
+	global_config.brokers = "localhost:9092";
+	global_config.topic = "n2kafka_test";
+	global_config.producer_instances = PRODUCER_INSTANCES;
+
+	rd_kafka_conf_set(global_config.kafka_conf,"metadata.broker.list",
+		global_config.brokers,errstr,sizeof(errstr));
+	init_rdkafka();
+}
+
+/// Threads are spread among instances, and always use the same one
+static void producer_instances_test() {
+	pthread_t threads[TEST_THREADS];
+	struct thread_topics topics[TEST_THREADS];
+	size_t instance_threads[PRODUCER_INSTANCES] = {0};
+	char err[BUFSIZ];
+	size_t i;
+
+	init_producers();
+	assert_int_equal(kafka_producers.count,PRODUCER_INSTANCES);
+	assert_true(global_config.rk == kafka_producers.rk[0]);
+
+	rd_kafka_topic_t *rkt = kafka_topic_get(global_config.topic,NULL,
+							err,sizeof(err));
+	assert_non_null(rkt);
+	/* Same handler is shared */
+	assert_true(rkt == kafka_topic_get(global_config.topic,NULL,err,
+								sizeof(err)));
+	kafka_topic_release(rkt);
+
+	for (i=0; i<TEST_THREADS; ++i) {
+		topics[i].rkt = rkt;
+		pthread_create(&threads[i],NULL,thread_topic_main,&topics[i]);
+	}
+
+	for (i=0; i<TEST_THREADS; ++i) {
+		pthread_join(threads[i],NULL);
+		assert_true(topics[i].instance < PRODUCER_INSTANCES);
+		assert_true(topics[i].first == topics[i].second);
+		assert_true(rd_kafka_topic_opaque(topics[i].first) ==
+					rd_kafka_topic_opaque(rkt));
+		instance_threads[topics[i].instance]++;
+	}
+
+	for (i=0; i<PRODUCER_INSTANCES; ++i) {
+		assert_int_equal(instance_threads[i],
+					TEST_THREADS/PRODUCER_INSTANCES);
+	}
+
+	kafka_topic_release(rkt);
+	assert_true(LIST_EMPTY(&kafka_topics.topics));
+	stop_rdkafka();
+}
+
+/// Same topic with different partitioners shares one registry entry
+static void topic_registry_partitioners_test() {
+	char err[BUFSIZ];
+
+	init_producers();
+	rd_kafka_topic_t *rkt = kafka_topic_get(global_config.topic,NULL,
+							err,sizeof(err));
+	assert_non_null(rkt);
+	rd_kafka_topic_t *mac_rkt = kafka_topic_get(global_config.topic,
+				rb_client_mac_partitioner,err,sizeof(err));
+	assert_true(rkt == mac_rkt);
+
+	const struct kafka_topic_entry *entry = LIST_FIRST(
+							&kafka_topics.topics);
+	assert_non_null(entry);
+	assert_null(LIST_NEXT(entry,entry));
+	assert_true(entry->partitioner == NULL);
+	assert_int_equal(entry->refcnt,2);
+
+	kafka_topic_release(mac_rkt);
+	assert_false(LIST_EMPTY(&kafka_topics.topics));
+	kafka_topic_release(rkt);
+	assert_true(LIST_EMPTY(&kafka_topics.topics));
+	stop_rdkafka();
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(producer_instances_test),
+		cmocka_unit_test(topic_registry_partitioners_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,87 @@
+#include "../src/util/kafka.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+/// Number of waits until produce_wait gives up
+static unsigned produce_waits(struct produce_wait *wait) {
+	while (0 == produce_wait(wait));
+	return wait->waits;
+}
+
+static uint64_t policy_waits(enum kafka_produce_policy policy) {
+	uint64_t ret = 0;
+	size_t i;
+	for (i=0; i<RD_ARRAYSIZE(kafka_produce.wait_stats[0].buckets); ++i) {
+		ret += kafka_produce.wait_stats[policy].buckets[i];
+	}
+	return ret;
+}
+
+static void produce_policy_parse_test() {
+	enum kafka_produce_policy policy = KAFKA_PRODUCE_POLICY__END;
+
+	assert_int_equal(0,kafka_produce_policy_parse("drop",&policy));
+	assert_int_equal(policy,KAFKA_PRODUCE_DROP);
+	assert_int_equal(0,kafka_produce_policy_parse("block",&policy));
+	assert_int_equal(policy,KAFKA_PRODUCE_BLOCK);
+	assert_int_equal(0,kafka_produce_policy_parse("block_forever",
+								&policy));
+	assert_int_equal(policy,KAFKA_PRODUCE_BLOCK_FOREVER);
+	assert_int_equal(-1,kafka_produce_policy_parse("wait",&policy));
+}
+
+/// Drop policy only waits once
+static void produce_policy_drop_test() {
+	struct produce_wait wait = PRODUCE_WAIT_INITIALIZER;
+
+	kafka_set_produce_policy(KAFKA_PRODUCE_DROP,1000);
+	assert_int_equal(produce_waits(&wait),1);
+	produce_wait_done(&wait,0);
+	assert_int_equal(policy_waits(KAFKA_PRODUCE_DROP),1);
+	assert_int_equal(kafka_produce.wait_stats[KAFKA_PRODUCE_DROP].gave_up,
+									1);
+}
+
+/// Block policy waits until timeout
+static void produce_policy_block_test() {
+	struct produce_wait wait = PRODUCE_WAIT_INITIALIZER;
+
+	kafka_set_produce_policy(KAFKA_PRODUCE_BLOCK,50);
+	assert_true(produce_waits(&wait) > 1);
+	assert_true(produce_wait_elapsed_ms(&wait) >= 50);
+	produce_wait_done(&wait,1);
+	assert_int_equal(policy_waits(KAFKA_PRODUCE_BLOCK),1);
+	assert_int_equal(kafka_produce.wait_stats[KAFKA_PRODUCE_BLOCK].gave_up,
+									0);
+
+	/* Waits that did not need to wait are not accounted */
+	memset(&wait,0,sizeof(wait));
+	produce_wait_done(&wait,1);
+	assert_int_equal(policy_waits(KAFKA_PRODUCE_BLOCK),1);
+}
+
+/// Block forever policy waits until stop blocking
+static void produce_policy_block_forever_test() {
+	struct produce_wait wait = PRODUCE_WAIT_INITIALIZER;
+
+	kafka_set_produce_policy(KAFKA_PRODUCE_BLOCK_FOREVER,0);
+	assert_int_equal(0,produce_wait(&wait));
+	assert_int_equal(0,produce_wait(&wait));
+	kafka_produce_stop_blocking();
+	assert_int_equal(-1,produce_wait(&wait));
+	assert_int_equal(wait.policy,KAFKA_PRODUCE_BLOCK_FOREVER);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(produce_policy_parse_test),
+		cmocka_unit_test(produce_policy_drop_test),
+		cmocka_unit_test(produce_policy_block_test),
+		cmocka_unit_test(produce_policy_block_forever_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,245 @@
+#include "../src/util/spill_journal.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define TEST_SEGMENT_SIZE 4096
+#define TEST_TOPIC "rb_flow"
+
+/// Records replayed by replay_cb
+struct replayed {
+	size_t count;
+	/// Stop after this number of records
+	size_t max;
+	char payloads[128][64];
+	int32_t partitions[128];
+	int has_key[128];
+};
+
+static int replay_cb(const struct spill_record *record,void *opaque) {
+	struct replayed *replayed = opaque;
+	if (replayed->count == replayed->max) {
+		return -1;
+	}
+
+	assert_int_equal(record->topic_len,strlen(TEST_TOPIC));
+	assert_memory_equal(record->topic,TEST_TOPIC,record->topic_len);
+	assert_true(record->payload_len < sizeof(replayed->payloads[0]));
+	memcpy(replayed->payloads[replayed->count],record->payload,
+		record->payload_len);
+	replayed->payloads[replayed->count][record->payload_len] = '\0';
+	replayed->partitions[replayed->count] = record->partition;
+	replayed->has_key[replayed->count] = NULL != record->key;
+	replayed->count++;
+	return 0;
+}
+
+static void test_dir(char *dir) {
+	strcpy(dir,"/tmp/n2kafka_spill_XXXXXX");
+	assert_non_null(mkdtemp(dir));
+}
+
+static void rm_dir(const char *dir) {
+	char cmd[BUFSIZ];
+	snprintf(cmd,sizeof(cmd),"rm -rf %s",dir);
+	assert_int_equal(0,system(cmd));
+}
+
+static struct spill_journal *open_journal(const char *dir,uint64_t max_size) {
+	char err[BUFSIZ];
+	const struct spill_journal_config config = {
+		.path = dir,
+		.segment_size = TEST_SEGMENT_SIZE,
+		.max_size = max_size,
+	};
+	struct spill_journal *journal = spill_journal_open(&config,err,
+								sizeof(err));
+	assert_non_null(journal);
+	return journal;
+}
+
+static int append_msg(struct spill_journal *journal,size_t i) {
+	char payload[64],key[64];
+	const int payload_len = snprintf(payload,sizeof(payload),
+						"{\"message\":%zu}",i);
+	const int key_len = snprintf(key,sizeof(key),"key%zu",i);
+	const struct spill_record record = {
+		.topic = TEST_TOPIC,
+		.topic_len = strlen(TEST_TOPIC),
+		.partition = (int32_t)(i % 4) - 1,
+		.key = i % 2 ? key : NULL,
+		.key_len = i % 2 ? (size_t)key_len : 0,
+		.payload = payload,
+		.payload_len = (size_t)payload_len,
+	};
+	return spill_journal_append(journal,&record);
+}
+
+static void check_replayed(const struct replayed *replayed,size_t first) {
+	size_t i;
+	for (i=0; i<replayed->count; ++i) {
+		char expected[64];
+		snprintf(expected,sizeof(expected),"{\"message\":%zu}",
+								first + i);
+		assert_string_equal(replayed->payloads[i],expected);
+		assert_int_equal(replayed->partitions[i],
+					(int32_t)((first + i) % 4) - 1);
+		assert_int_equal(replayed->has_key[i],(first + i) % 2);
+	}
+}
+
+/// Records are replayed in order, and progress survives reopen
+static void spill_journal_replay_test() {
+	char dir[64];
+	struct replayed replayed;
+	struct spill_journal_stats stats;
+	size_t i;
+
+	test_dir(dir);
+	struct spill_journal *journal = open_journal(dir,16*TEST_SEGMENT_SIZE);
+	for (i=0; i<100; ++i) {
+		assert_int_equal(0,append_msg(journal,i));
+	}
+
+	spill_journal_stats(journal,&stats);
+	assert_int_equal(stats.appended_msgs,100);
+	assert_int_equal(stats.pending_msgs,100);
+	assert_true(stats.segments > 1);
+
+	memset(&replayed,0,sizeof(replayed));
+	replayed.max = 128;
+	assert_int_equal(10,spill_journal_replay(journal,10,replay_cb,
+								&replayed));
+	check_replayed(&replayed,0);
+
+	/* Callback can stop replay */
+	memset(&replayed,0,sizeof(replayed));
+	replayed.max = 5;
+	spill_journal_replay(journal,10,replay_cb,&replayed);
+	assert_int_equal(replayed.count,5);
+	check_replayed(&replayed,10);
+	spill_journal_close(journal);
+
+	journal = open_journal(dir,16*TEST_SEGMENT_SIZE);
+	spill_journal_stats(journal,&stats);
+	assert_int_equal(stats.pending_msgs,85);
+
+	memset(&replayed,0,sizeof(replayed));
+	replayed.max = 128;
+	while (spill_journal_replay(journal,64,replay_cb,&replayed) > 0);
+	assert_int_equal(replayed.count,85);
+	check_replayed(&replayed,15);
+
+	spill_journal_stats(journal,&stats);
+	assert_int_equal(stats.pending_msgs,0);
+	assert_int_equal(stats.pending_bytes,0);
+	assert_int_equal(stats.replayed_msgs,85);
+	/* Only the last segment is kept */
+	assert_int_equal(stats.segments,1);
+
+	spill_journal_close(journal);
+	rm_dir(dir);
+}
+
+/// Journal does not grow over its max size
+static void spill_journal_full_test() {
+	char dir[64];
+	struct spill_journal_stats stats;
+	struct replayed replayed;
+	size_t i,appended = 0;
+
+	test_dir(dir);
+	struct spill_journal *journal = open_journal(dir,2*TEST_SEGMENT_SIZE);
+	for (i=0; i<1000; ++i) {
+		if (0 == append_msg(journal,i)) {
+			appended++;
+		}
+	}
+
+	spill_journal_stats(journal,&stats);
+	assert_int_equal(stats.segments,2);
+	assert_int_equal(stats.appended_msgs,appended);
+	assert_int_equal(stats.rejected_msgs,1000 - appended);
+
+	/* Too big records are rejected */
+	char big_payload[TEST_SEGMENT_SIZE];
+	memset(big_payload,'a',sizeof(big_payload));
+	const struct spill_record big = {
+		.topic = TEST_TOPIC,
+		.topic_len = strlen(TEST_TOPIC),
+		.payload = big_payload,
+		.payload_len = sizeof(big_payload),
+	};
+	assert_int_equal(-1,spill_journal_append(journal,&big));
+
+	/* Room is released after replay */
+	do {
+		memset(&replayed,0,sizeof(replayed));
+		replayed.max = 128;
+	} while (spill_journal_replay(journal,128,replay_cb,&replayed) > 0);
+	assert_int_equal(0,append_msg(journal,0));
+
+	spill_journal_close(journal);
+	rm_dir(dir);
+}
+
+/// Corrupted records are detected, and the rest of the segment is skipped
+static void spill_journal_corrupted_test() {
+	char dir[64],path[PATH_MAX];
+	struct spill_journal_stats stats;
+	struct replayed replayed;
+	struct stat st;
+	size_t i;
+
+	test_dir(dir);
+	struct spill_journal *journal = open_journal(dir,16*TEST_SEGMENT_SIZE);
+	for (i=0; i<10; ++i) {
+		assert_int_equal(0,append_msg(journal,i));
+	}
+	spill_journal_close(journal);
+
+	/* Corrupt 4th record payload */
+	snprintf(path,sizeof(path),"%s/%016x.spill",dir,0);
+	const int fd = open(path,O_RDWR);
+	assert_true(fd >= 0);
+	assert_int_equal(0,fstat(fd,&st));
+	char *map = mmap(NULL,(size_t)st.st_size,PROT_READ | PROT_WRITE,
+							MAP_SHARED,fd,0);
+	assert_true(MAP_FAILED != map);
+	size_t offset = SPILL_SEGMENT_HEADER_SIZE;
+	for (i=0; i<3; ++i) {
+		offset += ((struct spill_record_header *)(map + offset))->size;
+	}
+	map[offset + sizeof(struct spill_record_header) + 1] ^= 0xff;
+	munmap(map,(size_t)st.st_size);
+	close(fd);
+
+	journal = open_journal(dir,16*TEST_SEGMENT_SIZE);
+	spill_journal_stats(journal,&stats);
+	assert_int_equal(stats.pending_msgs,3);
+	assert_int_equal(stats.corrupted_msgs,1);
+
+	/* New records are appended after the valid ones */
+	assert_int_equal(0,append_msg(journal,3));
+
+	memset(&replayed,0,sizeof(replayed));
+	replayed.max = 128;
+	while (spill_journal_replay(journal,64,replay_cb,&replayed) > 0);
+	assert_int_equal(replayed.count,4);
+	check_replayed(&replayed,0);
+
+	spill_journal_close(journal);
+	rm_dir(dir);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(spill_journal_replay_test),
+		cmocka_unit_test(spill_journal_full_test),
+		cmocka_unit_test(spill_journal_corrupted_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,348 @@
+#include "../src/util/kafka.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+/* Mock cluster can set brokers down and up since librdkafka 1.5 */
+#if RD_KAFKA_VERSION >= 0x010500ff
+#include <librdkafka/rdkafka_mock.h>
+
+#define TEST_TOPIC "n2kafka_spill_test"
+#define TEST_MSGS 20
+/// Producer queue size and batch size of queue full test
+#define TEST_QUEUE_MSGS 2
+#define TEST_BATCH_MSGS 5
+/// Single partition topic and keyed batch size of order test
+#define TEST_ORDER_TOPIC "n2kafka_order_test"
+#define TEST_ORDER_MSGS 50
+/// Max wait for spill or replay, in seconds
+#define TEST_TIMEOUT_S 30
+
+/** Init producers with mock cluster
+  @param queue_max_messages queue.buffering.max.messages, or NULL for
+  default
+  */
+static void init_producers(const char *queue_max_messages) {
+	char errstr[BUFSIZ];
+
+	memset(&global_config,0,sizeof(global_config));
+	global_config.kafka_conf = rd_kafka_conf_new();
+	global_config.kafka_topic_conf = rd_kafka_topic_conf_new();
+	/* Mock cluster overrides it */
+	global_config.brokers = "localhost:9092";
+	global_config.topic = TEST_TOPIC;
+
+	assert_int_equal(RD_KAFKA_CONF_OK,rd_kafka_conf_set(
+		global_config.kafka_conf,"test.mock.num.brokers","1",errstr,
+		sizeof(errstr)));
+	if (queue_max_messages) {
+		assert_int_equal(RD_KAFKA_CONF_OK,rd_kafka_conf_set(
+			global_config.kafka_conf,
+			"queue.buffering.max.messages",queue_max_messages,
+			errstr,sizeof(errstr)));
+	}
+	assert_int_equal(RD_KAFKA_CONF_OK,rd_kafka_topic_conf_set(
+		global_config.kafka_topic_conf,"message.timeout.ms","1000",
+		errstr,sizeof(errstr)));
+	init_rdkafka();
+}
+
+/// Wait until condition is true, or test timeout
+#define wait_until(cond) do {                                            \
+	const time_t wait_start = time(NULL);                            \
+	while (!(cond) && difftime(time(NULL),wait_start) < TEST_TIMEOUT_S) \
+		kafka_poll(100);                                         \
+	assert_true(cond);                                               \
+} while (0)
+
+static struct spill_journal_stats spill_stats() {
+	struct spill_journal_stats stats;
+	spill_journal_stats(kafka_spill.journal,&stats);
+	return stats;
+}
+
+/// Messages are spilled while broker is down, and replayed when it is up
+static void spill_journal_mock_cluster_test() {
+	char dir[] = "/tmp/n2kafka_spill_XXXXXX";
+	char err[BUFSIZ],msg[64],cmd[BUFSIZ];
+	size_t i;
+
+	assert_non_null(mkdtemp(dir));
+	json_t *config = json_pack("{s:s,s:i,s:i,s:i}",
+		"path",dir,
+		"segment_size",64*1024,
+		"max_size",1024*1024,
+		"replay_probe_interval_ms",100);
+	assert_non_null(config);
+	assert_int_equal(0,kafka_spill_init(config));
+	json_decref(config);
+
+	init_producers(NULL);
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+							global_config.rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster,TEST_TOPIC,2,1));
+
+	rd_kafka_topic_t *rkt = kafka_topic_get(TEST_TOPIC,NULL,err,
+								sizeof(err));
+	assert_non_null(rkt);
+
+	rd_kafka_mock_broker_set_down(mcluster,1);
+	for (i=0; i<TEST_MSGS; ++i) {
+		const int len = snprintf(msg,sizeof(msg),"{\"message\":%zu}",i);
+		send_to_kafka(rkt,msg,(size_t)len,RD_KAFKA_MSG_F_COPY,NULL);
+	}
+
+	/* Deliveries time out, and messages are spilled */
+	wait_until(spill_stats().appended_msgs >= TEST_MSGS);
+	assert_int_equal(0,ATOMIC_OP(fetch,add,&kafka_spill.delivery_ok,0));
+
+	/* Replayed when broker is back */
+	rd_kafka_mock_broker_set_up(mcluster,1);
+	wait_until(0 == spill_stats().pending_msgs &&
+		0 == kafka_producers_outq_len() &&
+		ATOMIC_OP(fetch,add,&kafka_spill.delivery_ok,0));
+
+	const struct spill_journal_stats stats = spill_stats();
+	assert_true(stats.replayed_msgs >= TEST_MSGS);
+	assert_int_equal(stats.rejected_msgs,0);
+	assert_int_equal(stats.corrupted_msgs,0);
+	assert_int_equal(ATOMIC_OP(fetch,add,&kafka_spill.dropped_msgs,0),0);
+
+	kafka_topic_release(rkt);
+	stop_rdkafka();
+	assert_null(kafka_spill.journal);
+
+	snprintf(cmd,sizeof(cmd),"rm -rf %s",dir);
+	assert_int_equal(0,system(cmd));
+}
+
+/// Delivery ack callback calls
+struct ack_result {
+	int calls;
+	size_t msgs,failed;
+};
+
+static void ack_cb(size_t msgs,size_t failed,void *opaque) {
+	struct ack_result *result = opaque;
+	result->calls++;
+	result->msgs = msgs;
+	result->failed = failed;
+}
+
+/// Batch messages that don't fit in producer queue are retried following
+/// produce policy, and spilled when it gives up. Spilled messages are still
+/// reported as failed to delivery acknowledgement
+static void spill_journal_queue_full_batch_test() {
+	struct ack_result result = {0,0,0};
+	char dir[] = "/tmp/n2kafka_spill_XXXXXX";
+	char err[BUFSIZ],payloads[TEST_BATCH_MSGS][64],cmd[BUFSIZ];
+	rd_kafka_message_t msgs[TEST_BATCH_MSGS];
+	char queue_max_messages[16];
+	size_t i;
+
+	assert_non_null(mkdtemp(dir));
+	snprintf(queue_max_messages,sizeof(queue_max_messages),"%d",
+							TEST_QUEUE_MSGS);
+	/* Do not replay while queued messages are waiting */
+	json_t *config = json_pack("{s:s,s:i,s:i}",
+		"path",dir,
+		"replay_max_queue",0,
+		"replay_probe_interval_ms",100);
+	assert_non_null(config);
+	assert_int_equal(0,kafka_spill_init(config));
+	json_decref(config);
+
+	init_producers(queue_max_messages);
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+							global_config.rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster,TEST_TOPIC,2,1));
+
+	rd_kafka_topic_t *rkt = kafka_topic_get(TEST_TOPIC,NULL,err,
+								sizeof(err));
+	assert_non_null(rkt);
+	kafka_set_produce_policy(KAFKA_PRODUCE_DROP,0);
+
+	rd_kafka_mock_broker_set_down(mcluster,1);
+	memset(msgs,0,sizeof(msgs));
+	for (i=0; i<TEST_BATCH_MSGS; ++i) {
+		const int len = snprintf(payloads[i],sizeof(payloads[i]),
+						"{\"message\":%zu}",i);
+		msgs[i].payload = payloads[i];
+		msgs[i].len = (size_t)len;
+	}
+
+	struct kafka_delivery_ack *ack = kafka_delivery_ack_new(ack_cb,&result);
+	assert_non_null(ack);
+	kafka_delivery_ack_track(ack);
+	assert_int_equal(TEST_QUEUE_MSGS,kafka_produce_batch(rkt,
+		RD_KAFKA_PARTITION_UA,RD_KAFKA_MSG_F_COPY,msgs,
+		TEST_BATCH_MSGS));
+	kafka_delivery_ack_track(NULL);
+	kafka_delivery_ack_seal(ack);
+	for (i=0; i<TEST_BATCH_MSGS; ++i) {
+		assert_int_equal(msgs[i].err,i < TEST_QUEUE_MSGS ?
+			RD_KAFKA_RESP_ERR_NO_ERROR :
+			RD_KAFKA_RESP_ERR__QUEUE_FULL);
+	}
+
+	/* Waited once for room, and gave up */
+	assert_int_equal(kafka_produce.wait_stats[KAFKA_PRODUCE_DROP].gave_up,
+									1);
+	assert_int_equal(spill_stats().appended_msgs,
+					TEST_BATCH_MSGS - TEST_QUEUE_MSGS);
+
+	/* Everything is delivered when broker is back */
+	rd_kafka_mock_broker_set_up(mcluster,1);
+	wait_until(0 == spill_stats().pending_msgs &&
+		0 == kafka_producers_outq_len() &&
+		ATOMIC_OP(fetch,add,&kafka_spill.delivery_ok,0));
+	assert_true(spill_stats().replayed_msgs >=
+					TEST_BATCH_MSGS - TEST_QUEUE_MSGS);
+
+	kafka_topic_release(rkt);
+	/* Delivery reports thread is stopped, so result is not modified */
+	stop_rdkafka();
+	assert_int_equal(result.calls,1);
+	assert_int_equal(result.msgs,TEST_BATCH_MSGS);
+	/* Queued messages may be delivered before they time out */
+	assert_true(result.failed >= TEST_BATCH_MSGS - TEST_QUEUE_MSGS);
+	kafka_delivery_ack_done(ack);
+
+	snprintf(cmd,sizeof(cmd),"rm -rf %s",dir);
+	assert_int_equal(0,system(cmd));
+}
+
+/** Consume a mock cluster partition from the beginning
+  @param mcluster Mock cluster
+  @param topic Topic
+  @param partition Partition
+  @param payloads Buffer to save consumed payloads
+  @param count Number of messages to consume
+  @return Number of consumed messages
+  */
+static size_t consume_partition(rd_kafka_mock_cluster_t *mcluster,
+		const char *topic,int32_t partition,char (*payloads)[64],
+		size_t count) {
+	char errstr[BUFSIZ];
+	size_t consumed = 0;
+	const time_t start = time(NULL);
+
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+	assert_int_equal(RD_KAFKA_CONF_OK,rd_kafka_conf_set(conf,
+		"bootstrap.servers",rd_kafka_mock_cluster_bootstraps(mcluster),
+		errstr,sizeof(errstr)));
+	assert_int_equal(RD_KAFKA_CONF_OK,rd_kafka_conf_set(conf,"group.id",
+		"n2kafka_test",errstr,sizeof(errstr)));
+	rd_kafka_t *consumer = rd_kafka_new(RD_KAFKA_CONSUMER,conf,errstr,
+							sizeof(errstr));
+	assert_non_null(consumer);
+
+	rd_kafka_topic_partition_list_t *partitions =
+					rd_kafka_topic_partition_list_new(1);
+	rd_kafka_topic_partition_list_add(partitions,topic,partition)->offset =
+						RD_KAFKA_OFFSET_BEGINNING;
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+					rd_kafka_assign(consumer,partitions));
+	rd_kafka_topic_partition_list_destroy(partitions);
+
+	while (consumed < count &&
+			difftime(time(NULL),start) < TEST_TIMEOUT_S) {
+		rd_kafka_message_t *msg = rd_kafka_consumer_poll(consumer,100);
+		if (NULL == msg) {
+			continue;
+		}
+
+		if (RD_KAFKA_RESP_ERR_NO_ERROR == msg->err &&
+						msg->len < sizeof(payloads[0])) {
+			memcpy(payloads[consumed],msg->payload,msg->len);
+			payloads[consumed][msg->len] = '\0';
+			consumed++;
+		}
+		rd_kafka_message_destroy(msg);
+	}
+
+	rd_kafka_consumer_close(consumer);
+	rd_kafka_destroy(consumer);
+	return consumed;
+}
+
+/// Messages of a keyed batch that don't all fit in producer queue are
+/// delivered in batch order
+static void produce_batch_order_test() {
+	char err[BUFSIZ],queue_max_messages[16];
+	char payloads[TEST_ORDER_MSGS][64],consumed[TEST_ORDER_MSGS][64];
+	static char key[] = "client";
+	rd_kafka_message_t msgs[TEST_ORDER_MSGS];
+	size_t i;
+
+	snprintf(queue_max_messages,sizeof(queue_max_messages),"%d",
+							TEST_QUEUE_MSGS);
+	init_producers(queue_max_messages);
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+							global_config.rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster,TEST_ORDER_TOPIC,1,1));
+
+	rd_kafka_topic_t *rkt = kafka_topic_get(TEST_ORDER_TOPIC,NULL,err,
+								sizeof(err));
+	assert_non_null(rkt);
+	kafka_set_produce_policy(KAFKA_PRODUCE_BLOCK,TEST_TIMEOUT_S*1000);
+
+	memset(msgs,0,sizeof(msgs));
+	for (i=0; i<TEST_ORDER_MSGS; ++i) {
+		const int len = snprintf(payloads[i],sizeof(payloads[i]),
+						"{\"message\":%zu}",i);
+		msgs[i].payload = payloads[i];
+		msgs[i].len = (size_t)len;
+		msgs[i].key = key;
+		msgs[i].key_len = sizeof(key) - 1;
+	}
+
+	/* Queue only has room for a few messages, so most of them wait */
+	assert_int_equal(TEST_ORDER_MSGS,kafka_produce_batch(rkt,
+		RD_KAFKA_PARTITION_UA,RD_KAFKA_MSG_F_COPY,msgs,
+		TEST_ORDER_MSGS));
+	wait_until(0 == kafka_producers_outq_len());
+
+	assert_int_equal(TEST_ORDER_MSGS,consume_partition(mcluster,
+		TEST_ORDER_TOPIC,0,consumed,TEST_ORDER_MSGS));
+	for (i=0; i<TEST_ORDER_MSGS; ++i) {
+		assert_string_equal(consumed[i],payloads[i]);
+	}
+
+	kafka_topic_release(rkt);
+	stop_rdkafka();
+}
+
+#else
+
+static void spill_journal_mock_cluster_test() {
+	skip();
+}
+
+static void produce_batch_order_test() {
+	skip();
+}
+
+static void spill_journal_queue_full_batch_test() {
+	skip();
+}
+
+#endif
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(spill_journal_mock_cluster_test),
+		cmocka_unit_test(spill_journal_queue_full_batch_test),
+		cmocka_unit_test(produce_batch_order_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
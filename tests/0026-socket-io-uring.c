@@ -0,0 +1,169 @@
+#include "../src/listener/socket.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <netinet/in.h>
+
+#define TEST_TCP_PORT 2057
+#define TEST_UDP_PORT 2058
+/// Max wait for listener to receive data, in milliseconds
+#define TEST_TIMEOUT_MS 5000
+
+/// Data received by the listener decoder
+static struct {
+	pthread_mutex_t lock;
+	char buf[BUFSIZ];
+	size_t len;
+	size_t calls;
+} received = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void test_decoder(char *buffer,size_t buf_size,
+		const keyval_list_t *keyval __attribute__((unused)),
+		void *listener_callback_opaque __attribute__((unused)),
+		void **sessionp __attribute__((unused))) {
+	pthread_mutex_lock(&received.lock);
+	if (received.len + buf_size <= sizeof(received.buf)) {
+		memcpy(&received.buf[received.len],buffer,buf_size);
+		received.len += buf_size;
+	}
+	received.calls++;
+	pthread_mutex_unlock(&received.lock);
+}
+
+static size_t received_len() {
+	pthread_mutex_lock(&received.lock);
+	const size_t ret = received.len;
+	pthread_mutex_unlock(&received.lock);
+	return ret;
+}
+
+static void received_reset() {
+	pthread_mutex_lock(&received.lock);
+	received.len = received.calls = 0;
+	pthread_mutex_unlock(&received.lock);
+}
+
+#ifdef HAVE_LIBURING
+/// Skip test if kernel does not support rings with provided buffers
+static void skip_if_no_io_uring() {
+	struct io_uring ring;
+	struct uring_buffers buffers;
+
+	if (0 != uring_thread_init(&ring,&buffers,URING_TCP_BUFFER_SIZE)) {
+		skip();
+	}
+	uring_thread_done(&ring,&buffers);
+}
+#else
+static void skip_if_no_io_uring() {
+	skip();
+}
+#endif
+
+static struct listener *start_listener(const char *proto,uint16_t port) {
+	received_reset();
+	do_shutdown = 0;
+	json_t *config = json_pack("{s:s,s:i,s:s,s:i}","proto",proto,
+		"port",port,"mode",STR_MODE_IO_URING,"num_threads",2);
+	assert_non_null(config);
+	struct listener *listener = create_socket_listener(config,
+						test_decoder,0,NULL);
+	json_decref(config);
+	assert_non_null(listener);
+	return listener;
+}
+
+static void stop_listener(struct listener *listener) {
+	listener->join(listener->private);
+	free(listener);
+}
+
+static struct sockaddr_in loopback_addr(uint16_t port) {
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	return addr;
+}
+
+/// TCP data sent to an io_uring listener reaches the decoder
+static void io_uring_tcp_test() {
+	static const char msg[] = "{\"message\":\"io_uring tcp\"}";
+	const struct sockaddr_in addr = loopback_addr(TEST_TCP_PORT);
+	int waited_ms = 0,fd = -1;
+
+	skip_if_no_io_uring();
+	struct listener *listener = start_listener(N2KAFKA_TCP,TEST_TCP_PORT);
+
+	/* Listener thread could still be binding */
+	for (; waited_ms < TEST_TIMEOUT_MS; waited_ms += 10) {
+		fd = socket(AF_INET,SOCK_STREAM,0);
+		assert_true(fd >= 0);
+		if (0 == connect(fd,(const struct sockaddr *)&addr,
+							sizeof(addr))) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+		usleep(10*1000);
+	}
+	assert_true(fd >= 0);
+
+	assert_int_equal(sizeof(msg) - 1,send(fd,msg,sizeof(msg) - 1,0));
+	for (; received_len() < sizeof(msg) - 1 &&
+				waited_ms < TEST_TIMEOUT_MS; waited_ms += 10) {
+		usleep(10*1000);
+	}
+	close(fd);
+
+	assert_int_equal(received_len(),sizeof(msg) - 1);
+	assert_memory_equal(received.buf,msg,sizeof(msg) - 1);
+	stop_listener(listener);
+}
+
+/// UDP datagrams sent to an io_uring listener reach the decoder, one call
+/// per datagram
+static void io_uring_udp_test() {
+	static const char msg[] = "{\"message\":\"io_uring udp\"}";
+	const struct sockaddr_in addr = loopback_addr(TEST_UDP_PORT);
+	int waited_ms;
+
+	skip_if_no_io_uring();
+	struct listener *listener = start_listener(N2KAFKA_UDP,TEST_UDP_PORT);
+	const int fd = socket(AF_INET,SOCK_DGRAM,0);
+	assert_true(fd >= 0);
+
+	/* Datagrams sent before the listener binds are lost */
+	for (waited_ms = 0; 0 == received_len() &&
+				waited_ms < TEST_TIMEOUT_MS; waited_ms += 10) {
+		sendto(fd,msg,sizeof(msg) - 1,0,
+			(const struct sockaddr *)&addr,sizeof(addr));
+		usleep(10*1000);
+	}
+	close(fd);
+	/* Let in flight datagrams arrive */
+	usleep(50*1000);
+
+	pthread_mutex_lock(&received.lock);
+	assert_true(received.calls > 0);
+	assert_int_equal(received.len,received.calls*(sizeof(msg) - 1));
+	assert_memory_equal(received.buf,msg,sizeof(msg) - 1);
+	pthread_mutex_unlock(&received.lock);
+	stop_listener(listener);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(io_uring_tcp_test),
+		cmocka_unit_test(io_uring_udp_test),
+	};
+
+	init_global_config();
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
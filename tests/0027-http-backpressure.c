@@ -0,0 +1,92 @@
+#include "../src/listener/http.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <curl/curl.h>
+#include <strings.h>
+
+#define TEST_PORT 2059
+#define TEST_URL "http://localhost:2059/rbdata"
+
+/// Only 429 and 503 are valid rejection codes
+static void backpressure_status_code_test() {
+	json_t *config = json_pack("{s:i,s:i,s:i}","port",TEST_PORT,
+		"backpressure_max_messages",1,"backpressure_status_code",404);
+	assert_non_null(config);
+	assert_null(create_http_listener(config,NULL,0,NULL));
+	json_decref(config);
+}
+
+static void test_decoder(char *buffer __attribute__((unused)),
+		size_t buf_size __attribute__((unused)),
+		const keyval_list_t *keyval __attribute__((unused)),
+		void *listener_callback_opaque __attribute__((unused)),
+		void **sessionp __attribute__((unused))) {
+	fail_msg("Rejected request reached the decoder");
+}
+
+/// Retry-After header value, or -1
+static size_t retry_after_header(char *buffer,size_t size,size_t nitems,
+							void *opaque) {
+	static const char header[] = "Retry-After:";
+	long *retry_after = opaque;
+	const size_t len = size*nitems;
+
+	if (len > sizeof(header) - 1 &&
+			0 == strncasecmp(buffer,header,sizeof(header) - 1)) {
+		*retry_after = strtol(&buffer[sizeof(header) - 1],NULL,10);
+	}
+	return len;
+}
+
+/// Listener answers with configured code and Retry-After over watermark
+static void backpressure_http_test() {
+	static char payload[] = "{\"message\":\"backpressure\"}";
+	rd_kafka_message_t msg;
+	long http_code = 0,retry_after = -1;
+
+	json_t *config = json_pack("{s:i,s:I,s:i}","port",TEST_PORT,
+		"backpressure_max_bytes",(json_int_t)1,
+		"backpressure_status_code",MHD_HTTP_TOO_MANY_REQUESTS);
+	assert_non_null(config);
+	struct listener *listener = create_http_listener(config,test_decoder,
+								0,NULL);
+	json_decref(config);
+	assert_non_null(listener);
+
+	/* Pretend some bytes are waiting for delivery */
+	memset(&msg,0,sizeof(msg));
+	msg.payload = payload;
+	msg.len = sizeof(payload) - 1;
+	kafka_account_produced_batch(&msg,1);
+
+	CURL *curl = curl_easy_init();
+	assert_non_null(curl);
+	curl_easy_setopt(curl,CURLOPT_URL,TEST_URL);
+	curl_easy_setopt(curl,CURLOPT_POSTFIELDS,payload);
+	curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION,retry_after_header);
+	curl_easy_setopt(curl,CURLOPT_HEADERDATA,&retry_after);
+	assert_int_equal(CURLE_OK,curl_easy_perform(curl));
+	curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&http_code);
+	curl_easy_cleanup(curl);
+
+	assert_int_equal(http_code,MHD_HTTP_TOO_MANY_REQUESTS);
+	assert_true(retry_after >= BACKPRESSURE_RETRY_AFTER_MIN);
+	assert_true(retry_after <= BACKPRESSURE_RETRY_AFTER_MAX);
+
+	listener->join(listener->private);
+	free(listener);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(backpressure_status_code_test),
+		cmocka_unit_test(backpressure_http_test),
+	};
+
+	init_global_config();
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,113 @@
+#include "../src/listener/backpressure.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+static void test_backpressure_init(struct backpressure *bp,
+			size_t max_messages,uint64_t max_bytes) {
+	const struct backpressure_config config = {
+		.max_messages = max_messages,
+		.max_bytes = max_bytes,
+		.status_code = HTTP_SERVICE_UNAVAILABLE,
+	};
+	backpressure_init(bp,0,&config);
+}
+
+/// Requests are only rejected over some watermark
+static void backpressure_watermark_test() {
+	struct backpressure bp;
+	struct kafka_queue_status status;
+
+	memset(&status,0,sizeof(status));
+	test_backpressure_init(&bp,100,1000);
+
+	status.outq_len = 100;
+	status.inflight_bytes = 1000;
+	assert_int_equal(0,backpressure_check0(&bp,&status,1.));
+
+	status.outq_len = 101;
+	assert_true(backpressure_check0(&bp,&status,1.) > 0);
+
+	status.outq_len = 0;
+	status.inflight_bytes = 1001;
+	assert_true(backpressure_check0(&bp,&status,1.) > 0);
+	assert_int_equal(bp.rejected,2);
+
+	/* Disabled watermark */
+	bp.config.max_bytes = 0;
+	assert_int_equal(0,backpressure_check0(&bp,&status,1.));
+	assert_int_equal(bp.rejected,2);
+
+	backpressure_done(&bp);
+}
+
+/// Retry-After is the time to drain the excess, between 1 and 60 seconds
+static void backpressure_retry_after_test() {
+	struct backpressure bp;
+	struct kafka_queue_status status;
+
+	memset(&status,0,sizeof(status));
+	test_backpressure_init(&bp,100,0);
+
+	/* Unknown drain rate */
+	status.outq_len = 200;
+	assert_int_equal(BACKPRESSURE_RETRY_AFTER_MAX,
+				backpressure_check0(&bp,&status,10.));
+
+	/* 1000 messages delivered per second */
+	status.delivered_msgs = 1000;
+	status.outq_len = 5100;
+	assert_int_equal(5,backpressure_check0(&bp,&status,11.));
+
+	/* Clamped */
+	status.outq_len = 101;
+	assert_int_equal(BACKPRESSURE_RETRY_AFTER_MIN,
+				backpressure_check0(&bp,&status,11.));
+	status.outq_len = 1000*1000;
+	assert_int_equal(BACKPRESSURE_RETRY_AFTER_MAX,
+				backpressure_check0(&bp,&status,11.));
+
+	/* Not draining */
+	status.outq_len = 200;
+	assert_int_equal(BACKPRESSURE_RETRY_AFTER_MAX,
+				backpressure_check0(&bp,&status,12.));
+
+	backpressure_done(&bp);
+}
+
+/// Watermarks can't be negative, and only 429 and 503 are valid rejection
+/// codes
+static void backpressure_config_test() {
+	struct backpressure_config config;
+
+	json_t *json = json_pack("{s:i,s:I}","backpressure_max_messages",10,
+		"backpressure_max_bytes",(json_int_t)1000);
+	assert_non_null(json);
+	assert_int_equal(0,backpressure_config_parse(&config,json));
+	assert_int_equal(config.max_messages,10);
+	assert_int_equal(config.max_bytes,1000);
+	assert_int_equal(config.status_code,HTTP_SERVICE_UNAVAILABLE);
+	json_decref(json);
+
+	json = json_pack("{s:i}","backpressure_max_messages",-1);
+	assert_non_null(json);
+	assert_int_equal(-1,backpressure_config_parse(&config,json));
+	json_decref(json);
+
+	json = json_pack("{s:i}","backpressure_status_code",404);
+	assert_non_null(json);
+	assert_int_equal(-1,backpressure_config_parse(&config,json));
+	json_decref(json);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(backpressure_watermark_test),
+		cmocka_unit_test(backpressure_retry_after_test),
+		cmocka_unit_test(backpressure_config_test),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,598 @@
+#include "../src/listener/http2.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <poll.h>
+#include <zlib.h>
+
+#define TEST_PORT 2060
+/// Max wait for a response, in milliseconds
+#define TEST_TIMEOUT_MS 5000
+#define TEST_WINDOW_SIZE 1024
+#define TEST_MAX_DECOMPRESSED_BODY 1024
+
+/// Data received by the listener decoder
+static struct {
+	pthread_mutex_t lock;
+	char buf[64*1024];
+	size_t len;
+	/// Streaming decoder sessions ended
+	size_t sessions_end;
+	/// Messages tracked by decoder, and not reported yet
+	rd_kafka_message_t tracked;
+	int has_tracked;
+} received = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// What decoder does with tracked messages
+static enum {
+	/// Does not produce anything
+	DECODER_NO_MESSAGES,
+	/// Produce a message that fails
+	DECODER_FAILED_MESSAGE,
+	/// Produce a message that is never reported
+	DECODER_PENDING_MESSAGE,
+} decoder_mode;
+
+static void test_decoder(char *buffer,size_t buf_size,
+		const keyval_list_t *keyval __attribute__((unused)),
+		void *listener_callback_opaque __attribute__((unused)),
+		void **sessionp) {
+	rd_kafka_message_t msg;
+
+	pthread_mutex_lock(&received.lock);
+	if (sessionp && NULL == buffer) {
+		received.sessions_end++;
+	} else if (received.len + buf_size <= sizeof(received.buf)) {
+		memcpy(&received.buf[received.len],buffer,buf_size);
+		received.len += buf_size;
+	}
+
+	memset(&msg,0,sizeof(msg));
+	switch (decoder_mode) {
+	case DECODER_FAILED_MESSAGE:
+		kafka_track_batch(&msg,1);
+		msg.err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+		kafka_account_produced_batch(&msg,1);
+		break;
+	case DECODER_PENDING_MESSAGE:
+		if (!received.has_tracked) {
+			kafka_track_batch(&msg,1);
+			received.tracked = msg;
+			received.has_tracked = 1;
+		}
+		break;
+	case DECODER_NO_MESSAGES:
+	default:
+		break;
+	};
+	pthread_mutex_unlock(&received.lock);
+}
+
+static void received_reset() {
+	pthread_mutex_lock(&received.lock);
+	received.len = received.sessions_end = 0;
+	pthread_mutex_unlock(&received.lock);
+}
+
+/// Stream response
+struct test_response {
+	int status;
+	long retry_after;
+	char allow[16];
+	/// Stream has been closed, and reset error code
+	int closed;
+	uint32_t error_code;
+};
+
+/// Request body
+struct test_body {
+	const char *buf;
+	size_t len,sent;
+	/// Do not end stream after sending body
+	int keep_open;
+};
+
+struct test_client {
+	int fd;
+	nghttp2_session *session;
+};
+
+static ssize_t test_body_read(nghttp2_session *session,int32_t stream_id,
+		uint8_t *buf,size_t length,uint32_t *data_flags,
+		nghttp2_data_source *source,void *user_data) {
+	struct test_body *body = source->ptr;
+	const size_t pending = body->len - body->sent;
+	const size_t n = pending < length ? pending : length;
+	(void)session;
+	(void)stream_id;
+	(void)user_data;
+
+	if (0 == pending && body->keep_open) {
+		return NGHTTP2_ERR_DEFERRED;
+	}
+
+	memcpy(buf,&body->buf[body->sent],n);
+	body->sent += n;
+	if (body->sent == body->len && !body->keep_open) {
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+	}
+	return (ssize_t)n;
+}
+
+static int test_on_header(nghttp2_session *session,
+		const nghttp2_frame *frame,const uint8_t *name,size_t namelen,
+		const uint8_t *value,size_t valuelen,uint8_t flags,
+		void *user_data) {
+	struct test_response *response = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	(void)flags;
+	(void)user_data;
+
+	if (NULL == response || frame->hd.type != NGHTTP2_HEADERS) {
+		return 0;
+	}
+
+	if (header_is(name,namelen,":status")) {
+		response->status = atoi((const char *)value);
+	} else if (header_is(name,namelen,"retry-after")) {
+		response->retry_after = strtol((const char *)value,NULL,10);
+	} else if (header_is(name,namelen,"allow") &&
+					valuelen < sizeof(response->allow)) {
+		memcpy(response->allow,value,valuelen);
+	}
+	return 0;
+}
+
+static int test_on_stream_close(nghttp2_session *session,int32_t stream_id,
+		uint32_t error_code,void *user_data) {
+	struct test_response *response = nghttp2_session_get_stream_user_data(
+		session,stream_id);
+	(void)user_data;
+
+	if (response) {
+		response->closed = 1;
+		response->error_code = error_code;
+	}
+	return 0;
+}
+
+/// Connect an HTTP/2 client to listener
+static void test_client_connect(struct test_client *client,int family) {
+	nghttp2_session_callbacks *callbacks = NULL;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	memset(&addr,0,sizeof(addr));
+	if (AF_INET6 == family) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_loopback;
+		sin6->sin6_port = htons(TEST_PORT);
+		addrlen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin->sin_port = htons(TEST_PORT);
+		addrlen = sizeof(*sin);
+	}
+
+	client->fd = socket(family,SOCK_STREAM,0);
+	assert_true(client->fd >= 0);
+	assert_int_equal(0,connect(client->fd,(const struct sockaddr *)&addr,
+								addrlen));
+
+	assert_int_equal(0,nghttp2_session_callbacks_new(&callbacks));
+	nghttp2_session_callbacks_set_on_header_callback(callbacks,
+		test_on_header);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+		test_on_stream_close);
+	assert_int_equal(0,nghttp2_session_client_new(&client->session,
+		callbacks,client));
+	nghttp2_session_callbacks_del(callbacks);
+	assert_int_equal(0,nghttp2_submit_settings(client->session,
+		NGHTTP2_FLAG_NONE,NULL,0));
+}
+
+static void test_client_close(struct test_client *client) {
+	nghttp2_session_del(client->session);
+	close(client->fd);
+}
+
+static int32_t test_client_request(struct test_client *client,
+		const char *method,const char *path,const char *encoding,
+		struct test_body *body,struct test_response *response) {
+	nghttp2_nv nva[5];
+	size_t nvlen = 0;
+	nghttp2_data_provider data_prd;
+
+#define TEST_NV(name,value) (nghttp2_nv){(uint8_t *)(uintptr_t)name,      \
+	(uint8_t *)(uintptr_t)value,strlen(name),strlen(value),              \
+	NGHTTP2_NV_FLAG_NONE}
+	nva[nvlen++] = TEST_NV(":method",method);
+	nva[nvlen++] = TEST_NV(":scheme","http");
+	nva[nvlen++] = TEST_NV(":authority","localhost");
+	nva[nvlen++] = TEST_NV(":path",path);
+	if (encoding) {
+		nva[nvlen++] = TEST_NV("content-encoding",encoding);
+	}
+#undef TEST_NV
+
+	memset(response,0,sizeof(*response));
+	data_prd.source.ptr = body;
+	data_prd.read_callback = test_body_read;
+	const int32_t stream_id = nghttp2_submit_request(client->session,NULL,
+		nva,nvlen,body ? &data_prd : NULL,response);
+	assert_true(stream_id > 0);
+	return stream_id;
+}
+
+/// Exchange data with listener until condition is true, or test timeout
+#define test_client_run_until(client,cond) do {                          \
+	int waited_ms = 0;                                               \
+	while (!(cond) && waited_ms < TEST_TIMEOUT_MS) {                 \
+		test_client_io(client);                                  \
+		waited_ms += 10;                                         \
+	}                                                                \
+	assert_true(cond);                                               \
+} while (0)
+
+static void test_client_io(struct test_client *client) {
+	const uint8_t *data = NULL;
+	uint8_t buf[16*1024];
+	ssize_t n;
+
+	while ((n = nghttp2_session_mem_send(client->session,&data)) > 0) {
+		assert_int_equal(n,send(client->fd,data,(size_t)n,0));
+	}
+	assert_true(n >= 0);
+
+	struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+	if (poll(&pfd,1,10) > 0) {
+		n = recv(client->fd,buf,sizeof(buf),0);
+		assert_true(n > 0);
+		assert_int_equal(n,nghttp2_session_mem_recv(client->session,buf,
+								(size_t)n));
+	}
+}
+
+/// Send a request and wait for its response
+static void test_client_post(struct test_client *client,const char *path,
+		const char *encoding,const char *data,size_t len,
+		struct test_response *response) {
+	struct test_body body = {.buf = data, .len = len};
+
+	test_client_request(client,"POST",path,encoding,&body,response);
+	test_client_run_until(client,response->closed);
+}
+
+static struct listener *test_listener_start(json_t *config,int cb_flags) {
+	received_reset();
+	decoder_mode = DECODER_NO_MESSAGES;
+	assert_non_null(config);
+	assert_int_equal(0,json_object_set_new(config,"port",
+						json_integer(TEST_PORT)));
+	struct listener *listener = create_http2_listener(config,test_decoder,
+							cb_flags,NULL);
+	json_decref(config);
+	assert_non_null(listener);
+	return listener;
+}
+
+static void test_listener_stop(struct listener *listener) {
+	listener->join(listener->private);
+	free(listener);
+}
+
+/// Invalid listener options are rejected
+static void http2_config_test() {
+	static const char *invalid_configs[] = {
+		"{\"port\":0}",
+		"{\"port\":2060,\"num_threads\":0}",
+		"{\"port\":2060,\"initial_window_size\":0}",
+		"{\"port\":2060,\"delivery_ack_timeout_ms\":0}",
+		"{\"port\":2060,\"backpressure_status_code\":404}",
+		"{\"port\":2060,\"max_decompressed_body\":-1}",
+	};
+	size_t i;
+
+	for (i=0; i<sizeof(invalid_configs)/sizeof(invalid_configs[0]); ++i) {
+		json_t *config = json_loads(invalid_configs[i],0,NULL);
+		assert_non_null(config);
+		assert_null(create_http2_listener(config,test_decoder,0,NULL));
+		json_decref(config);
+	}
+}
+
+/// Only valid requests reach the decoder
+static void http2_request_validation_test() {
+	static const char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response;
+
+	struct listener *listener = test_listener_start(json_object(),0);
+	test_client_connect(&client,AF_INET);
+
+	test_client_request(&client,"GET","/",NULL,NULL,&response);
+	test_client_run_until(&client,response.closed);
+	assert_int_equal(response.status,405);
+	assert_string_equal(response.allow,"POST");
+
+	test_client_post(&client,"/","br",payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,415);
+	assert_int_equal(received.len,0);
+
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,200);
+	assert_int_equal(received.len,sizeof(payload) - 1);
+	assert_memory_equal(received.buf,payload,sizeof(payload) - 1);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// rb_http2k URI is validated
+static void http2_redborder_uri_test() {
+	static const char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response;
+
+	struct listener *listener = test_listener_start(
+		json_pack("{s:b}","redborder_uri",1),0);
+	test_client_connect(&client,AF_INET);
+
+	test_client_post(&client,"/v1/data",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,400);
+	/* Query string is not part of the topic */
+	test_client_post(&client,"/rbdata/abc/?topic/x",NULL,payload,
+					sizeof(payload) - 1,&response);
+	assert_int_equal(response.status,400);
+	assert_int_equal(received.len,0);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Bodies bigger than flow control windows are received
+static void http2_flow_control_test() {
+	static char payload[16*TEST_WINDOW_SIZE];
+	struct test_client client;
+	struct test_response response;
+
+	memset(payload,'a',sizeof(payload));
+	struct listener *listener = test_listener_start(json_pack("{s:i,s:i}",
+		"initial_window_size",TEST_WINDOW_SIZE,
+		"connection_window_size",TEST_WINDOW_SIZE),
+		DECODER_F_SUPPORT_STREAMING);
+	test_client_connect(&client,AF_INET);
+
+	test_client_post(&client,"/",NULL,payload,sizeof(payload),&response);
+	assert_int_equal(nghttp2_session_get_remote_settings(client.session,
+		NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE),TEST_WINDOW_SIZE);
+	assert_int_equal(response.status,200);
+	assert_int_equal(received.len,sizeof(payload));
+	assert_int_equal(received.sessions_end,1);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Stream errors end decoder session, and do not affect other streams
+static void http2_stream_error_test() {
+	static const char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response,reset_response;
+	struct test_body body = {
+		.buf = payload,
+		.len = sizeof(payload) - 1,
+		.keep_open = 1,
+	};
+
+	struct listener *listener = test_listener_start(json_object(),
+		DECODER_F_SUPPORT_STREAMING);
+	test_client_connect(&client,AF_INET);
+
+	/* Client cancels request after sending some data */
+	const int32_t stream_id = test_client_request(&client,"POST","/",NULL,
+		&body,&reset_response);
+	test_client_run_until(&client,body.sent == body.len);
+	assert_int_equal(0,nghttp2_submit_rst_stream(client.session,
+		NGHTTP2_FLAG_NONE,stream_id,NGHTTP2_CANCEL));
+
+	/* Corrupted compressed body */
+	test_client_post(&client,"/","gzip",payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,400);
+	assert_true(reset_response.closed);
+	assert_int_equal(reset_response.status,0);
+
+	/* Connection is still usable */
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,200);
+
+	pthread_mutex_lock(&received.lock);
+	assert_int_equal(received.sessions_end,3);
+	assert_int_equal(received.len,2*(sizeof(payload) - 1));
+	pthread_mutex_unlock(&received.lock);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Compress in gzip format
+static size_t gzip_compress(const char *in,size_t in_len,char *out,
+							size_t out_size) {
+	z_stream strm;
+	memset(&strm,0,sizeof(strm));
+
+	assert_int_equal(Z_OK,deflateInit2(&strm,Z_DEFAULT_COMPRESSION,
+		Z_DEFLATED,16+MAX_WBITS,8,Z_DEFAULT_STRATEGY));
+	strm.next_in = (Bytef *)(intptr_t)in;
+	strm.avail_in = (uInt)in_len;
+	strm.next_out = (Bytef *)out;
+	strm.avail_out = (uInt)out_size;
+	assert_int_equal(Z_STREAM_END,deflate(&strm,Z_FINISH));
+	deflateEnd(&strm);
+
+	return out_size - strm.avail_out;
+}
+
+/// Decompressed bodies over limit are rejected
+static void http2_max_decompressed_body_test() {
+	static char payload[4*TEST_MAX_DECOMPRESSED_BODY];
+	char compressed[1024];
+	struct test_client client;
+	struct test_response response;
+
+	memset(payload,'a',sizeof(payload));
+	struct listener *listener = test_listener_start(json_pack("{s:I}",
+		"max_decompressed_body",
+		(json_int_t)TEST_MAX_DECOMPRESSED_BODY),0);
+	struct http2_listener *l = listener->private;
+	test_client_connect(&client,AF_INET);
+
+	size_t compressed_len = gzip_compress(payload,sizeof(payload),
+					compressed,sizeof(compressed));
+	test_client_post(&client,"/","gzip",compressed,compressed_len,
+								&response);
+	assert_int_equal(response.status,413);
+	assert_int_equal(received.len,0);
+
+	compressed_len = gzip_compress(payload,TEST_MAX_DECOMPRESSED_BODY,
+					compressed,sizeof(compressed));
+	test_client_post(&client,"/","gzip",compressed,compressed_len,
+								&response);
+	assert_int_equal(response.status,200);
+
+	pthread_mutex_lock(&received.lock);
+	assert_int_equal(received.len,TEST_MAX_DECOMPRESSED_BODY);
+	pthread_mutex_unlock(&received.lock);
+	assert_int_equal(1,ATOMIC_OP(fetch,add,
+				&l->codec_stats[HTTP_CODEC_GZIP].errors,0));
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Listener accepts IPv6 clients
+static void http2_ipv6_test() {
+	static const char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response;
+
+	/* Kernel or loopback interface without IPv6 */
+	struct sockaddr_in6 loopback = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	const int fd = socket(AF_INET6,SOCK_STREAM,0);
+	const int bind_rc = fd < 0 ? -1 : bind(fd,
+		(const struct sockaddr *)&loopback,sizeof(loopback));
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (0 != bind_rc) {
+		skip();
+	}
+
+	struct listener *listener = test_listener_start(json_object(),0);
+	test_client_connect(&client,AF_INET6);
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,200);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Streams are rejected over kafka backpressure watermark
+static void http2_backpressure_test() {
+	static char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response;
+	rd_kafka_message_t msg;
+
+	struct listener *listener = test_listener_start(json_pack("{s:I,s:i}",
+		"backpressure_max_bytes",(json_int_t)1,
+		"backpressure_status_code",429),0);
+	test_client_connect(&client,AF_INET);
+
+	/* Pretend some bytes are waiting for delivery */
+	memset(&msg,0,sizeof(msg));
+	msg.payload = payload;
+	msg.len = sizeof(payload) - 1;
+	kafka_account_produced_batch(&msg,1);
+
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,429);
+	assert_true(response.retry_after >= BACKPRESSURE_RETRY_AFTER_MIN);
+	assert_true(response.retry_after <= BACKPRESSURE_RETRY_AFTER_MAX);
+	assert_int_equal(received.len,0);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+/// Streams are answered when kafka reports all their messages
+static void http2_delivery_ack_test() {
+	static const char payload[] = "{\"message\":\"http2\"}";
+	struct test_client client;
+	struct test_response response;
+
+	struct listener *listener = test_listener_start(json_pack("{s:b,s:i}",
+		"delivery_ack",1,"delivery_ack_timeout_ms",100),0);
+	test_client_connect(&client,AF_INET);
+
+	/* Nothing to wait */
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,200);
+
+	decoder_mode = DECODER_FAILED_MESSAGE;
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,503);
+
+	decoder_mode = DECODER_PENDING_MESSAGE;
+	test_client_post(&client,"/",NULL,payload,sizeof(payload) - 1,
+								&response);
+	assert_int_equal(response.status,504);
+
+	/* Late report of released ack */
+	pthread_mutex_lock(&received.lock);
+	assert_true(received.has_tracked);
+	received.tracked.err = RD_KAFKA_RESP_ERR__MSG_TIMED_OUT;
+	kafka_account_produced_batch(&received.tracked,1);
+	received.has_tracked = 0;
+	pthread_mutex_unlock(&received.lock);
+
+	test_client_close(&client);
+	test_listener_stop(listener);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(http2_config_test),
+		cmocka_unit_test(http2_request_validation_test),
+		cmocka_unit_test(http2_redborder_uri_test),
+		cmocka_unit_test(http2_flow_control_test),
+		cmocka_unit_test(http2_stream_error_test),
+		cmocka_unit_test(http2_max_decompressed_body_test),
+		cmocka_unit_test(http2_ipv6_test),
+		cmocka_unit_test(http2_backpressure_test),
+		cmocka_unit_test(http2_delivery_ack_test),
+	};
+
+	init_global_config();
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,132 @@
+#include "../src/listener/http.c"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <curl/curl.h>
+#include <zlib.h>
+
+#define TEST_PORT 2061
+#define TEST_URL "http://localhost:2061/rbdata"
+#define TEST_MAX_DECOMPRESSED_BODY 1024
+
+/// Data received by the listener decoder
+static struct {
+	pthread_mutex_t lock;
+	size_t len;
+	size_t calls;
+} received = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void test_decoder(char *buffer __attribute__((unused)),
+		size_t buf_size,
+		const keyval_list_t *keyval __attribute__((unused)),
+		void *listener_callback_opaque __attribute__((unused)),
+		void **sessionp __attribute__((unused))) {
+	pthread_mutex_lock(&received.lock);
+	received.len += buf_size;
+	received.calls++;
+	pthread_mutex_unlock(&received.lock);
+}
+
+/// Compress in gzip format
+static size_t gzip_compress(const char *in,size_t in_len,char *out,
+							size_t out_size) {
+	z_stream strm;
+	memset(&strm,0,sizeof(strm));
+
+	assert_int_equal(Z_OK,deflateInit2(&strm,Z_DEFAULT_COMPRESSION,
+		Z_DEFLATED,16+MAX_WBITS,8,Z_DEFAULT_STRATEGY));
+	strm.next_in = (Bytef *)(intptr_t)in;
+	strm.avail_in = (uInt)in_len;
+	strm.next_out = (Bytef *)out;
+	strm.avail_out = (uInt)out_size;
+	assert_int_equal(Z_STREAM_END,deflate(&strm,Z_FINISH));
+	deflateEnd(&strm);
+
+	return out_size - strm.avail_out;
+}
+
+/// POST a gzip encoded body, and return answer status
+static long post_gzip(const char *body,size_t len) {
+	long http_code = 0;
+	struct curl_slist *headers = curl_slist_append(NULL,
+						"Content-Encoding: gzip");
+	CURL *curl = curl_easy_init();
+	assert_non_null(curl);
+
+	curl_easy_setopt(curl,CURLOPT_URL,TEST_URL);
+	curl_easy_setopt(curl,CURLOPT_HTTPHEADER,headers);
+	curl_easy_setopt(curl,CURLOPT_POSTFIELDS,body);
+	curl_easy_setopt(curl,CURLOPT_POSTFIELDSIZE,(long)len);
+	assert_int_equal(CURLE_OK,curl_easy_perform(curl));
+	curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&http_code);
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(headers);
+	return http_code;
+}
+
+/// Corrupted and too large compressed bodies are answered with an error,
+/// and they don't reach the decoder
+static void codec_errors_test() {
+	static const char corrupted[] = "{\"message\":\"not gzip\"}";
+	char big[4*TEST_MAX_DECOMPRESSED_BODY],compressed[1024];
+
+	json_t *config = json_pack("{s:i,s:I}","port",TEST_PORT,
+		"max_decompressed_body",(json_int_t)TEST_MAX_DECOMPRESSED_BODY);
+	assert_non_null(config);
+	struct listener *listener = create_http_listener(config,test_decoder,
+									0,NULL);
+	json_decref(config);
+	assert_non_null(listener);
+	struct http_private *h = listener->private;
+
+	assert_int_equal(post_gzip(corrupted,sizeof(corrupted) - 1),
+						MHD_HTTP_BAD_REQUEST);
+
+	memset(big,'a',sizeof(big));
+	size_t compressed_len = gzip_compress(big,sizeof(big),compressed,
+							sizeof(compressed));
+	assert_int_equal(post_gzip(compressed,compressed_len),
+					MHD_HTTP_REQUEST_ENTITY_TOO_LARGE);
+
+	pthread_mutex_lock(&received.lock);
+	assert_int_equal(received.calls,0);
+	pthread_mutex_unlock(&received.lock);
+
+	/* Bodies under the limit are still decoded */
+	compressed_len = gzip_compress(big,TEST_MAX_DECOMPRESSED_BODY,
+					compressed,sizeof(compressed));
+	assert_int_equal(post_gzip(compressed,compressed_len),MHD_HTTP_OK);
+
+	pthread_mutex_lock(&received.lock);
+	assert_int_equal(received.len,TEST_MAX_DECOMPRESSED_BODY);
+	pthread_mutex_unlock(&received.lock);
+	assert_int_equal(2,ATOMIC_OP(fetch,add,
+				&h->codec_stats[HTTP_CODEC_GZIP].errors,0));
+
+	listener->join(listener->private);
+	free(listener);
+}
+
+/// Negative limit is rejected
+static void max_decompressed_body_config_test() {
+	json_t *config = json_pack("{s:i,s:i}","port",TEST_PORT,
+		"max_decompressed_body",-1);
+	assert_non_null(config);
+	assert_null(create_http_listener(config,test_decoder,0,NULL));
+	json_decref(config);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(max_decompressed_body_config_test),
+		cmocka_unit_test(codec_errors_test),
+	};
+
+	init_global_config();
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}